@@ -0,0 +1,449 @@
+#include "StdAfx.h"
+
+#include "bitstream_filter.h"
+
+#include "ffmpeg_error.h"
+#include "util/util.h"
+
+#include <common/log.h>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const uint8_t START_CODE[] = { 0, 0, 0, 1 };
+
+		static const int AAC_SAMPLE_RATES[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+
+		class stream_filter
+		{
+		public:
+			enum class kind
+			{
+				none,
+				h264_annexb,
+				hevc_annexb,
+				aac_raw
+			};
+
+			struct statistics
+			{
+				tbb::atomic<uint64_t>	in_place;
+				tbb::atomic<uint64_t>	copied;
+				tbb::atomic<uint64_t>	parameter_sets_inserted;
+				tbb::atomic<uint64_t>	headers_stripped;
+				tbb::atomic<uint64_t>	passed_invalid;
+			};
+		private:
+			const kind				kind_;
+			const int				index_;
+			statistics&				stats_;
+			int						length_size_		= 4;
+			std::vector<uint8_t>	parameter_sets_;	// Annex B.
+			std::vector<uint8_t>	in_band_;
+			bool					warned_				= false;
+		public:
+			stream_filter(kind k, AVStream& stream, statistics& stats)
+				: kind_(k)
+				, index_(stream.index)
+				, stats_(stats)
+			{
+				auto codec = stream.codec;
+
+				if (kind_ == kind::aac_raw)
+					ensure_audio_specific_config(*codec);
+				else
+					parse_config(codec->extradata, codec->extradata_size);
+			}
+
+			static kind select(const AVStream& stream, bitstream_target target)
+			{
+				auto codec		= stream.codec;
+				auto extradata	= codec->extradata;
+				auto size		= codec->extradata_size;
+
+				if (target == bitstream_target::mpegts)
+				{
+					// avcC/hvcC extradata (version 1) means length prefixed NAL units.
+					if (codec->codec_id == AV_CODEC_ID_H264 && extradata && size >= 7 && extradata[0] == 1)
+						return kind::h264_annexb;
+
+					if (codec->codec_id == AV_CODEC_ID_HEVC && extradata && size >= 23 && extradata[0] == 1)
+						return kind::hevc_annexb;
+				}
+				else if (codec->codec_id == AV_CODEC_ID_AAC)
+					return kind::aac_raw;
+
+				return kind::none;
+			}
+
+			std::shared_ptr<AVPacket> filter(const std::shared_ptr<AVPacket>& packet)
+			{
+				if (!packet || !packet->data)
+					return packet;
+
+				return kind_ == kind::aac_raw ? strip_adts(packet) : to_annexb(packet);
+			}
+		private:
+			// The flv muxer writes the extradata as the AAC sequence header, a TS
+			// source has none, derive it from the codec parameters instead.
+			static void ensure_audio_specific_config(AVCodecContext& codec)
+			{
+				if (codec.extradata && codec.extradata_size >= 2)
+					return;
+
+				auto rate = std::find(std::begin(AAC_SAMPLE_RATES), std::end(AAC_SAMPLE_RATES), codec.sample_rate);
+
+				if (rate == std::end(AAC_SAMPLE_RATES) || codec.channels < 1 || codec.channels > 7)
+					return;
+
+				auto object_type	= codec.profile >= FF_PROFILE_AAC_MAIN && codec.profile < FF_PROFILE_AAC_HE ? codec.profile + 1 : 2;
+				auto frequency		= static_cast<int>(rate - std::begin(AAC_SAMPLE_RATES));
+				auto extradata		= static_cast<uint8_t*>(av_mallocz(2 + AV_INPUT_BUFFER_PADDING_SIZE));
+
+				if (!extradata)
+					throw std::bad_alloc();
+
+				extradata[0] = static_cast<uint8_t>((object_type << 3) | (frequency >> 1));
+				extradata[1] = static_cast<uint8_t>(((frequency & 0x01) << 7) | (codec.channels << 3));
+
+				av_free(codec.extradata);
+				codec.extradata			= extradata;
+				codec.extradata_size	= 2;
+			}
+
+			// Collects the parameter sets of an avcC or hvcC record in Annex B form.
+			void parse_config(const uint8_t* data, int size)
+			{
+				if (!data || size < 7 || data[0] != 1)
+					return;
+
+				std::vector<uint8_t> sets;
+				auto end = data + size;
+
+				auto append = [&](const uint8_t*& p) -> bool
+				{
+					if (end - p < 2)
+						return false;
+
+					auto length = (p[0] << 8) | p[1];
+					p += 2;
+
+					if (end - p < length)
+						return false;
+
+					sets.insert(sets.end(), std::begin(START_CODE), std::end(START_CODE));
+					sets.insert(sets.end(), p, p + length);
+					p += length;
+
+					return true;
+				};
+
+				if (kind_ == kind::h264_annexb)
+				{
+					length_size_ = (data[4] & 0x03) + 1;
+
+					auto p		= data + 5;
+					auto count	= *p++ & 0x1F;
+
+					for (int i = 0; i < count; ++i)
+					{
+						if (!append(p))
+							return;
+					}
+
+					if (p >= end)
+						return;
+
+					count = *p++;
+
+					for (int i = 0; i < count; ++i)
+					{
+						if (!append(p))
+							return;
+					}
+				}
+				else
+				{
+					if (size < 23)
+						return;
+
+					length_size_ = (data[21] & 0x03) + 1;
+
+					auto p		= data + 23;
+					auto arrays	= data[22];
+
+					for (int a = 0; a < arrays; ++a)
+					{
+						if (end - p < 3)
+							return;
+
+						auto count = (p[1] << 8) | p[2];
+						p += 3;
+
+						for (int i = 0; i < count; ++i)
+						{
+							if (!append(p))
+								return;
+						}
+					}
+				}
+
+				parameter_sets_.swap(sets);
+			}
+
+			bool is_parameter_set(uint8_t header) const
+			{
+				if (kind_ == kind::h264_annexb)
+					return (header & 0x1F) == 7 || (header & 0x1F) == 8;
+
+				auto type = (header >> 1) & 0x3F;
+				return type >= 32 && type <= 34;
+			}
+
+			bool is_key_frame(uint8_t header) const
+			{
+				if (kind_ == kind::h264_annexb)
+					return (header & 0x1F) == 5;
+
+				auto type = (header >> 1) & 0x3F;
+				return type >= 16 && type <= 23;
+			}
+
+			std::shared_ptr<AVPacket> to_annexb(const std::shared_ptr<AVPacket>& packet)
+			{
+				int side_size = 0;
+				auto side = av_packet_get_side_data(packet.get(), AV_PKT_DATA_NEW_EXTRADATA, &side_size);
+
+				if (side && side_size > 0)
+					parse_config(side, side_size);
+
+				auto data			= packet->data;
+				auto end			= data + packet->size;
+				size_t out_size		= 0;
+				auto key_frame		= false;
+				auto has_sets		= false;
+
+				in_band_.clear();
+
+				for (auto p = data; p < end;)
+				{
+					if (end - p < length_size_)
+						return pass_invalid(packet);
+
+					size_t length = 0;
+
+					for (int i = 0; i < length_size_; ++i)
+						length = (length << 8) | p[i];
+
+					p += length_size_;
+
+					if (length == 0 || length > static_cast<size_t>(end - p))
+						return pass_invalid(packet);
+
+					if (is_parameter_set(p[0]))
+					{
+						has_sets = true;
+						in_band_.insert(in_band_.end(), std::begin(START_CODE), std::end(START_CODE));
+						in_band_.insert(in_band_.end(), p, p + length);
+					}
+
+					key_frame	= key_frame || is_key_frame(p[0]);
+					out_size	+= sizeof(START_CODE) + length;
+					p			+= length;
+				}
+
+				// The latest in band parameter sets win over the extradata.
+				if (has_sets)
+					parameter_sets_ = in_band_;
+
+				auto insert = key_frame && !has_sets && !parameter_sets_.empty();
+
+				if (!insert && length_size_ == 4 && packet.use_count() == 1 && packet->buf && av_buffer_is_writable(packet->buf))
+				{
+					for (auto p = data; p < end;)
+					{
+						size_t length = (static_cast<size_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+						std::memcpy(p, START_CODE, sizeof(START_CODE));
+						p += 4 + length;
+					}
+
+					++stats_.in_place;
+					return packet;
+				}
+
+				if (insert)
+					out_size += parameter_sets_.size();
+
+				std::shared_ptr<AVPacket> out = create_packet();
+				THROW_ON_ERROR2(av_new_packet(out.get(), static_cast<int>(out_size)), L"bitstream_filter");
+				THROW_ON_ERROR2(av_packet_copy_props(out.get(), packet.get()), L"bitstream_filter");
+
+				auto q = out->data;
+
+				if (insert)
+				{
+					std::memcpy(q, parameter_sets_.data(), parameter_sets_.size());
+					q += parameter_sets_.size();
+					++stats_.parameter_sets_inserted;
+				}
+
+				for (auto p = data; p < end;)
+				{
+					size_t length = 0;
+
+					for (int i = 0; i < length_size_; ++i)
+						length = (length << 8) | p[i];
+
+					p += length_size_;
+					std::memcpy(q, START_CODE, sizeof(START_CODE));
+					std::memcpy(q + sizeof(START_CODE), p, length);
+					q += sizeof(START_CODE) + length;
+					p += length;
+				}
+
+				++stats_.copied;
+				return out;
+			}
+
+			std::shared_ptr<AVPacket> strip_adts(const std::shared_ptr<AVPacket>& packet)
+			{
+				auto data = packet->data;
+
+				if (packet->size < 7 || data[0] != 0xFF || (data[1] & 0xF6) != 0xF0)
+					return packet; // Already raw.
+
+				auto header_size	= data[1] & 0x01 ? 7 : 9;
+				auto frame_length	= ((data[3] & 0x03) << 11) | (data[4] << 3) | (data[5] >> 5);
+
+				if ((data[6] & 0x03) != 0 || frame_length != packet->size || packet->size <= header_size)
+					return pass_invalid(packet); // Several raw data blocks or frames per packet.
+
+				// Shares the buffer, only the data pointer moves past the header.
+				std::shared_ptr<AVPacket> out = create_packet();
+				THROW_ON_ERROR2(av_packet_ref(out.get(), packet.get()), L"bitstream_filter");
+				out->data += header_size;
+				out->size -= header_size;
+
+				++stats_.headers_stripped;
+				return out;
+			}
+
+			std::shared_ptr<AVPacket> pass_invalid(const std::shared_ptr<AVPacket>& packet)
+			{
+				if (!warned_)
+					CASPAR_LOG(warning) << L"[bitstream_filter] Stream " << index_ << L" has packets that can not be converted, passing them through.";
+
+				warned_ = true;
+				++stats_.passed_invalid;
+
+				return packet;
+			}
+		};
+
+		struct bitstream_filter_producer::impl : boost::noncopyable
+		{
+			const std::shared_ptr<packetProducer>		source_;
+			const bitstream_target						target_;
+			stream_filter::statistics					stats_;
+			std::vector<std::unique_ptr<stream_filter>>	filters_;	// By stream index, null for pass through.
+
+			impl(const std::shared_ptr<packetProducer>& source, bitstream_target target)
+				: source_(source)
+				, target_(target)
+			{
+				stats_.in_place					= 0;
+				stats_.copied					= 0;
+				stats_.parameter_sets_inserted	= 0;
+				stats_.headers_stripped			= 0;
+				stats_.passed_invalid			= 0;
+
+				auto context = source_->context();
+
+				for (unsigned int i = 0; i < context->nb_streams; ++i)
+				{
+					auto& stream	= *context->streams[i];
+					auto kind		= stream_filter::select(stream, target_);
+
+					if (kind == stream_filter::kind::none)
+						filters_.push_back(nullptr);
+					else
+						filters_.push_back(std::unique_ptr<stream_filter>(new stream_filter(kind, stream, stats_)));
+				}
+			}
+
+			void filter(std::shared_ptr<AVPacket>& packet)
+			{
+				if (!packet)
+					return;
+
+				auto index = packet->stream_index;
+
+				if (index >= 0 && index < static_cast<int>(filters_.size()) && filters_[index])
+					packet = filters_[index]->filter(std::move(packet));
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"target", target_ == bitstream_target::mpegts ? L"mpegts" : L"flv");
+				info.add(L"converted-in-place", stats_.in_place);
+				info.add(L"converted-by-copy", stats_.copied);
+				info.add(L"parameter-sets-inserted", stats_.parameter_sets_inserted);
+				info.add(L"adts-headers-stripped", stats_.headers_stripped);
+				info.add(L"passed-unconverted", stats_.passed_invalid);
+
+				return info;
+			}
+		};
+
+		bitstream_filter_producer::bitstream_filter_producer(const std::shared_ptr<packetProducer>& source, bitstream_target target)
+			: impl_(new impl(source, target))
+		{
+		}
+
+		bool bitstream_filter_producer::receive_v(std::shared_ptr<AVPacket>& packet)
+		{
+			if (!impl_->source_->receive_v(packet))
+				return false;
+
+			impl_->filter(packet);
+			return true;
+		}
+
+		bool bitstream_filter_producer::receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			if (!impl_->source_->receive_a(packet, stream_index))
+				return false;
+
+			impl_->filter(packet);
+			return true;
+		}
+
+		bool bitstream_filter_producer::receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			if (!impl_->source_->receive_s(packet, stream_index))
+				return false;
+
+			impl_->filter(packet);
+			return true;
+		}
+
+		std::shared_ptr<AVFormatContext> bitstream_filter_producer::context()
+		{
+			return impl_->source_->context();
+		}
+
+		boost::property_tree::wptree bitstream_filter_producer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
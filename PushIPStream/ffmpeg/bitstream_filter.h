@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../packetProducer.h"
+
+#include <common/memory.h>
+
+#include <memory>
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		enum class bitstream_target
+		{
+			mpegts,		// Annex B H.264/HEVC, as h264_mp4toannexb and hevc_mp4toannexb.
+			flv			// Raw AAC, as aac_adtstoasc.
+		};
+
+		// Rewrites the elementary streams of a producer into the form an output
+		// format carries, so MP4/MOV sources can go to TS and TS sources to FLV.
+		// One filter per stream is set up on construction and kept across loops
+		// and seeks; streams already in the right form pass through untouched.
+		//
+		// H.264/HEVC parameter sets from the extradata, or the latest ones seen
+		// in band, are put in front of every key frame that lacks them. Length
+		// prefixes are overwritten with start codes in place when the packet is
+		// not shared and uses 4 byte lengths, ADTS headers are skipped within the
+		// same buffer, so only key frames are copied. Raw AAC needs nothing for TS,
+		// both TS muxers write ADTS headers themselves.
+		//
+		// Wrap the source before a packet_hub, packets shared between outputs are
+		// never modified in place.
+		class bitstream_filter_producer : public packetProducer
+		{
+		public:
+			bitstream_filter_producer(const std::shared_ptr<packetProducer>& source, bitstream_target target);
+
+			bool								receive_v(std::shared_ptr<AVPacket>& packet) override;
+			bool								receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index) override;
+			bool								receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index) override;
+			std::shared_ptr<AVFormatContext>	context() override;
+
+			boost::property_tree::wptree		info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
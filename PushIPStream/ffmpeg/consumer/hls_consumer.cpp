@@ -0,0 +1,1032 @@
+#include "../StdAfx.h"
+
+#include "hls_consumer.h"
+#include "http_server.h"
+#include "muxer.h"
+
+#include "../bitstream_filter.h"
+#include "../ffmpeg_error.h"
+#include "../packet_source.h"
+#include "../timestamp_normalizer.h"
+
+#include <common/except.h>
+#include <common/executor.h>
+#include <common/log.h>
+#include <common/os/general_protection_fault.h>
+#include <common/param.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int MUXER_IO_BUFFER_SIZE = 64 * 1024;
+
+		struct hls_url
+		{
+			std::string		address;
+			int				port			= 0;
+			std::string		name			= "stream";
+			bool			fmp4			= true;
+			int64_t			segment			= 4 * AV_TIME_BASE;
+			int64_t			part			= AV_TIME_BASE / 2;
+			size_t			window			= 6;
+			std::wstring	directory;
+			ffmpeg_options	muxer_options;
+		};
+
+		static hls_url parse_hls_url(const std::wstring& url)
+		{
+			auto parts = protocol_split(url);
+
+			if (!boost::iequals(parts.at(0), L"hls"))
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Not a hls url: " + url));
+
+			auto rest	= u8(parts.at(1));
+			auto query	= std::string();
+			auto q		= rest.find('?');
+
+			if (q != std::string::npos)
+			{
+				query	= rest.substr(q + 1);
+				rest	= rest.substr(0, q);
+			}
+
+			hls_url result;
+
+			auto slash = rest.find('/');
+
+			if (slash != std::string::npos)
+			{
+				if (slash + 1 < rest.size())
+					result.name = rest.substr(slash + 1);
+
+				rest = rest.substr(0, slash);
+			}
+
+			auto colon = rest.rfind(':');
+
+			if (colon == std::string::npos || colon + 1 == rest.size())
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Missing port in " + url));
+
+			result.address = rest.substr(0, colon);
+
+			if (result.address.size() > 2 && result.address.front() == '[' && result.address.back() == ']')
+				result.address = result.address.substr(1, result.address.size() - 2);
+
+			std::vector<std::string> pairs;
+			boost::split(pairs, query, boost::is_any_of("&"), boost::token_compress_on);
+
+			try
+			{
+				result.port = boost::lexical_cast<int>(rest.substr(colon + 1));
+
+				for (auto& pair : pairs)
+				{
+					if (pair.empty())
+						continue;
+
+					auto eq		= pair.find('=');
+					auto key	= pair.substr(0, eq);
+					auto value	= eq == std::string::npos ? std::string() : pair.substr(eq + 1);
+
+					if (key == "segment")
+						result.segment = static_cast<int64_t>(boost::lexical_cast<double>(value) * AV_TIME_BASE);
+					else if (key == "part")
+						result.part = static_cast<int64_t>(boost::lexical_cast<double>(value) * AV_TIME_BASE);
+					else if (key == "format")
+					{
+						if (value != "fmp4" && value != "ts")
+							CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"format must be fmp4 or ts in " + url));
+
+						result.fmp4 = value == "fmp4";
+					}
+					else if (key == "window")
+						result.window = boost::lexical_cast<size_t>(value);
+					else if (key == "directory")
+						result.directory = u16(value);
+					else
+						result.muxer_options.push_back(std::make_pair(key, value));
+				}
+			}
+			catch (const boost::bad_lexical_cast&)
+			{
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Invalid value in " + url));
+			}
+
+			if (result.segment <= 0 || result.part < 0 || result.part >= result.segment)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"part must be shorter than segment in " + url));
+
+			if (result.window < 3)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"window must be at least 3 in " + url));
+
+			if (result.port <= 0 && result.directory.empty())
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Neither a port nor a directory in " + url));
+
+			if (result.name.empty() || result.name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != std::string::npos)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Invalid name in " + url));
+
+			// Partial segments are the fragments ended by muxer::fragment().
+			if (result.fmp4)
+			{
+				auto flags = std::string("frag_custom+empty_moov+default_base_moof");
+				auto it = std::find_if(result.muxer_options.begin(), result.muxer_options.end(), [](const std::pair<std::string, std::string>& option) { return option.first == "movflags"; });
+
+				if (it != result.muxer_options.end())
+					it->second += "+" + flags;
+				else
+					result.muxer_options.push_back(std::make_pair("movflags", flags));
+			}
+
+			return result;
+		}
+
+		typedef std::shared_ptr<const std::vector<uint8_t>> shared_bytes;
+
+		struct hls_part
+		{
+			shared_bytes	data;
+			double			duration;
+			bool			independent;
+		};
+
+		struct hls_segment
+		{
+			int64_t					msn;
+			int						init;
+			bool					discontinuity;
+			std::string				program_date_time;
+			std::vector<hls_part>	parts;
+			double					duration	= 0.0;
+			bool					complete	= false;
+		};
+
+		struct hls_consumer::impl : boost::noncopyable
+		{
+			const std::wstring							url_;
+			const hls_url								config_;
+			const std::string							extension_;
+
+			// Packaging thread only.
+			packet_source								source_;
+			int											cut_stream_				= -1;
+			std::unique_ptr<muxer>						muxer_;
+			std::vector<uint8_t>						pending_;		// Bytes of the part being muxed.
+			std::shared_ptr<hls_segment>				current_;
+			int64_t										segment_start_			= AV_NOPTS_VALUE;
+			int64_t										part_start_				= AV_NOPTS_VALUE;
+			int64_t										last_time_				= AV_NOPTS_VALUE;
+			int64_t										last_cut_time_			= AV_NOPTS_VALUE;
+			int64_t										frame_interval_			= 0;
+			bool										part_open_				= false;
+			bool										part_independent_		= false;
+			bool										cut_pending_			= false;
+			bool										discontinuity_pending_	= false;
+
+			// Shared with the connections, under mutex_ and only changed by the
+			// packaging thread.
+			int64_t										next_msn_					= 0;
+			int											next_init_					= 0;
+			mutable boost::mutex						mutex_;
+			boost::condition_variable					changed_;
+			std::deque<std::shared_ptr<hls_segment>>	segments_;
+			std::map<int, shared_bytes>					inits_;
+			std::shared_ptr<const std::string>			playlist_;
+			int64_t										dropped_discontinuities_	= 0;
+			bool										ended_						= false;
+			bool										stopping_					= false;
+
+			tbb::atomic<bool>							is_running_;
+			tbb::atomic<uint64_t>						bytes_muxed_;
+			tbb::atomic<uint64_t>						segments_packaged_;
+			tbb::atomic<uint64_t>						parts_packaged_;
+			tbb::atomic<uint64_t>						blocking_requests_;
+			tbb::atomic<uint64_t>						blocking_timeouts_;
+
+			boost::thread								thread_;
+			std::unique_ptr<http_server>				server_;
+			std::unique_ptr<executor>					writer_;	// Last, drains its writes before the members above go.
+
+			impl(const std::shared_ptr<packetProducer>& producer, const std::wstring& url)
+				: url_(url)
+				, config_(parse_hls_url(url))
+				, extension_(config_.fmp4 ? ".m4s" : ".ts")
+				, source_(config_.fmp4 ? producer : std::shared_ptr<packetProducer>(std::make_shared<bitstream_filter_producer>(producer, bitstream_target::mpegts)))
+			{
+				is_running_			= true;
+				bytes_muxed_		= 0;
+				segments_packaged_	= 0;
+				parts_packaged_		= 0;
+				blocking_requests_	= 0;
+				blocking_timeouts_	= 0;
+
+				auto context = source_.context();
+
+				for (unsigned int i = 0; i < context->nb_streams; ++i)
+				{
+					if (context->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+					{
+						cut_stream_ = static_cast<int>(i);
+						break;
+					}
+				}
+
+				if (cut_stream_ < 0 && context->nb_streams > 0)
+					cut_stream_ = 0;
+
+				if (!config_.directory.empty())
+				{
+					boost::filesystem::create_directories(config_.directory);
+					writer_.reset(new executor(L"hls-writer"));
+				}
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					render();
+				}
+
+				if (config_.port > 0)
+				{
+					server_.reset(new http_server(config_.address, config_.port, [this](const http_server::request& request, http_server::response& response)
+					{
+						serve(request, response);
+					}));
+				}
+
+				thread_ = boost::thread([this] { package(); });
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+				thread_.join();
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					stopping_ = true;
+				}
+
+				changed_.notify_all();
+				server_.reset();
+			}
+
+			// Packaging
+
+			void package()
+			{
+				ensure_gpf_handler_installed_for_thread("hls-consumer");
+
+				try
+				{
+					while (is_running_)
+					{
+						std::shared_ptr<AVPacket> packet;
+
+						if (!source_.try_pop(packet))
+						{
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+							continue;
+						}
+
+						if (!packet->data)
+						{
+							if (packet->pos == -1) // End of input.
+								break;
+
+							cut_pending_ = discontinuity_pending_ = true;
+							continue;
+						}
+
+						if (packet->flags & PKT_FLAG_DISCONTINUITY)
+							cut_pending_ = discontinuity_pending_ = true;
+
+						auto time	= packet_time(*packet);
+						auto key	= is_key(*packet);
+
+						if (packet->stream_index == cut_stream_ && time != AV_NOPTS_VALUE)
+						{
+							if (last_cut_time_ != AV_NOPTS_VALUE && time > last_cut_time_)
+								frame_interval_ = time - last_cut_time_;
+
+							last_cut_time_ = time;
+						}
+
+						if (current_ && key && (cut_pending_ || (time != AV_NOPTS_VALUE && time - segment_start_ >= config_.segment)))
+							finish_segment(time);
+						else if (current_ && part_open_ && is_part_cut(*packet, time))
+							finish_part(time);
+
+						// Nothing is packaged before the first key frame.
+						if (!current_)
+						{
+							if (!key)
+								continue;
+
+							start_segment(time);
+						}
+
+						if (!part_open_)
+						{
+							part_open_			= true;
+							part_start_			= time;
+							part_independent_	= key;
+						}
+
+						muxer_->write(packet);
+
+						if (time != AV_NOPTS_VALUE)
+							last_time_ = last_time_ == AV_NOPTS_VALUE ? time : std::max(last_time_, time);
+					}
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				try
+				{
+					if (current_)
+						finish_segment(AV_NOPTS_VALUE);
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					ended_ = true;
+					render();
+				}
+
+				changed_.notify_all();
+
+				CASPAR_LOG(info) << print() << L" Packaging stopped.";
+			}
+
+			int64_t packet_time(const AVPacket& packet) const
+			{
+				auto ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+				if (ts == AV_NOPTS_VALUE)
+					return AV_NOPTS_VALUE;
+
+				return av_rescale_q(ts, source_.context()->streams[packet.stream_index]->time_base, AV_TIME_BASE_Q);
+			}
+
+			bool is_key(const AVPacket& packet) const
+			{
+				return packet.stream_index == cut_stream_ && (packet.flags & AV_PKT_FLAG_KEY);
+			}
+
+			// Parts end before the frame that would take them past the part target,
+			// which no part may exceed.
+			bool is_part_cut(const AVPacket& packet, int64_t time) const
+			{
+				if (config_.part == 0 || packet.stream_index != cut_stream_ || time == AV_NOPTS_VALUE || part_start_ == AV_NOPTS_VALUE)
+					return false;
+
+				return time - part_start_ + frame_interval_ > config_.part;
+			}
+
+			void start_segment(int64_t time)
+			{
+				// TS segments start with their own PAT and PMT, fMP4 segments share
+				// the init section until the codec parameters may have changed.
+				if (!muxer_ || !config_.fmp4 || discontinuity_pending_)
+					open_muxer();
+
+				auto segment = std::make_shared<hls_segment>();
+				segment->init				= next_init_ - 1;
+				segment->program_date_time	= boost::posix_time::to_iso_extended_string(boost::posix_time::microsec_clock::universal_time()) + "Z";
+
+				publish([&]
+				{
+					segment->msn			= next_msn_++;
+					segment->discontinuity	= discontinuity_pending_ && segment->msn > 0;
+					segments_.push_back(segment);
+				});
+
+				current_				= segment;
+				segment_start_			= time;
+				cut_pending_			= false;
+				discontinuity_pending_	= false;
+			}
+
+			void open_muxer()
+			{
+				muxer_.reset();
+				pending_.clear();
+
+				muxer_.reset(new muxer(config_.fmp4 ? "mp4" : "mpegts", source_.context(), config_.muxer_options, [this](const uint8_t* data, int size)
+				{
+					pending_.insert(pending_.end(), data, data + size);
+					bytes_muxed_ += size;
+				}, MUXER_IO_BUFFER_SIZE));
+
+				muxer_->flush();
+
+				if (!config_.fmp4)
+					return;
+
+				auto init	= std::make_shared<const std::vector<uint8_t>>(std::move(pending_));
+				auto index	= next_init_;
+				pending_.clear();
+
+				publish([&]
+				{
+					inits_[index] = init;
+					++next_init_;
+				});
+
+				write_file(config_.name + "-init" + boost::lexical_cast<std::string>(index) + ".mp4", { init });
+			}
+
+			void finish_part(int64_t end_time)
+			{
+				muxer_->fragment();
+
+				hls_part part;
+				part.data			= std::make_shared<const std::vector<uint8_t>>(std::move(pending_));
+				part.duration		= duration(part_start_, end_time);
+				part.independent	= part_independent_;
+				pending_.clear();
+				part_open_ = false;
+
+				auto segment = current_;
+				auto index = segment->parts.size();
+
+				publish([&]
+				{
+					segment->parts.push_back(part);
+				});
+
+				++parts_packaged_;
+
+				if (config_.part > 0)
+					write_file(part_name(segment->msn, index), { part.data });
+			}
+
+			void finish_segment(int64_t end_time)
+			{
+				if (part_open_ || !pending_.empty())
+					finish_part(end_time);
+
+				auto segment	= std::move(current_);
+				auto length		= duration(segment_start_, end_time);
+
+				// The trailer of a fragmented mp4 is only an index of the fragments.
+				if (!config_.fmp4)
+				{
+					muxer_->close();
+					muxer_.reset();
+					pending_.clear();
+				}
+
+				publish([&]
+				{
+					segment->duration = length;
+					segment->complete = true;
+				});
+
+				++segments_packaged_;
+
+				std::vector<shared_bytes> data;
+
+				for (auto& part : segment->parts)
+					data.push_back(part.data);
+
+				write_file(segment_name(segment->msn), data);
+			}
+
+			double duration(int64_t start, int64_t end) const
+			{
+				if (end == AV_NOPTS_VALUE)
+					end = last_time_ != AV_NOPTS_VALUE ? last_time_ + frame_interval_ : start;
+
+				if (start == AV_NOPTS_VALUE || end == AV_NOPTS_VALUE || end < start)
+					return 0.0;
+
+				return static_cast<double>(end - start) / AV_TIME_BASE;
+			}
+
+			// Changes the shared state and renders the playlist under the lock,
+			// then wakes the connections waiting for it.
+			template<typename Func>
+			void publish(const Func& change)
+			{
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					change();
+					trim();
+					render();
+				}
+
+				changed_.notify_all();
+			}
+
+			// Keeps two segments more than the window for clients that are still
+			// fetching them.
+			void trim()
+			{
+				while (segments_.size() > config_.window + 3)
+				{
+					auto& front = *segments_.front();
+
+					if (front.discontinuity)
+						++dropped_discontinuities_;
+
+					remove_files(front);
+					segments_.pop_front();
+				}
+
+				auto first_init = segments_.empty() ? next_init_ - 1 : segments_.front()->init;
+
+				while (!inits_.empty() && inits_.begin()->first < first_init)
+				{
+					remove_file(config_.name + "-init" + boost::lexical_cast<std::string>(inits_.begin()->first) + ".mp4");
+					inits_.erase(inits_.begin());
+				}
+			}
+
+			std::string segment_name(int64_t msn) const
+			{
+				return config_.name + "-" + boost::lexical_cast<std::string>(msn) + extension_;
+			}
+
+			std::string part_name(int64_t msn, size_t index) const
+			{
+				return config_.name + "-" + boost::lexical_cast<std::string>(msn) + "." + boost::lexical_cast<std::string>(index) + extension_;
+			}
+
+			std::string playlist_name() const
+			{
+				return config_.name + ".m3u8";
+			}
+
+			int64_t target_duration() const
+			{
+				auto target = static_cast<int64_t>(std::ceil(static_cast<double>(config_.segment) / AV_TIME_BASE));
+
+				for (auto& segment : segments_)
+				{
+					if (segment->complete)
+						target = std::max(target, static_cast<int64_t>(std::lround(segment->duration)));
+				}
+
+				return target;
+			}
+
+			static std::string format_duration(double seconds)
+			{
+				char buffer[32];
+				std::snprintf(buffer, sizeof(buffer), "%.5f", seconds);
+				return buffer;
+			}
+
+			// Under mutex_.
+			void render()
+			{
+				auto target			= target_duration();
+				auto parts			= config_.part > 0;
+				auto part_target	= static_cast<double>(config_.part) / AV_TIME_BASE;
+
+				size_t complete = 0;
+
+				for (auto& segment : segments_)
+					complete += segment->complete ? 1 : 0;
+
+				auto first = complete > config_.window ? complete - config_.window : 0;
+
+				auto discontinuity_sequence = dropped_discontinuities_;
+
+				for (size_t i = 0; i < first; ++i)
+					discontinuity_sequence += segments_[i]->discontinuity ? 1 : 0;
+
+				std::string playlist;
+				playlist += "#EXTM3U\n";
+				playlist += "#EXT-X-VERSION:" + std::string(parts ? "9" : config_.fmp4 ? "7" : "3") + "\n";
+				playlist += "#EXT-X-TARGETDURATION:" + boost::lexical_cast<std::string>(target) + "\n";
+
+				if (parts)
+				{
+					playlist += "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=" + format_duration(part_target * 3) + "\n";
+					playlist += "#EXT-X-PART-INF:PART-TARGET=" + format_duration(part_target) + "\n";
+				}
+				else
+					playlist += "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES\n";
+
+				playlist += "#EXT-X-MEDIA-SEQUENCE:" + boost::lexical_cast<std::string>(first < segments_.size() ? segments_[first]->msn : next_msn_) + "\n";
+				playlist += "#EXT-X-DISCONTINUITY-SEQUENCE:" + boost::lexical_cast<std::string>(discontinuity_sequence) + "\n";
+
+				// Parts are only listed for segments close to the live edge.
+				auto parts_from = segments_.empty() ? 0 : segments_.back()->msn - 3;
+				auto init = -1;
+
+				for (size_t i = first; i < segments_.size(); ++i)
+				{
+					auto& segment = *segments_[i];
+
+					// Without parts a segment is only listed once it is complete.
+					if (!segment.complete && !parts)
+						continue;
+
+					if (segment.discontinuity)
+						playlist += "#EXT-X-DISCONTINUITY\n";
+
+					if (config_.fmp4 && segment.init != init)
+					{
+						init = segment.init;
+						playlist += "#EXT-X-MAP:URI=\"" + config_.name + "-init" + boost::lexical_cast<std::string>(init) + ".mp4\"\n";
+					}
+
+					playlist += "#EXT-X-PROGRAM-DATE-TIME:" + segment.program_date_time + "\n";
+
+					if (parts && segment.msn >= parts_from)
+					{
+						for (size_t p = 0; p < segment.parts.size(); ++p)
+						{
+							playlist += "#EXT-X-PART:DURATION=" + format_duration(segment.parts[p].duration) + ",URI=\"" + part_name(segment.msn, p) + "\"";
+							playlist += segment.parts[p].independent ? ",INDEPENDENT=YES\n" : "\n";
+						}
+					}
+
+					if (segment.complete)
+					{
+						playlist += "#EXTINF:" + format_duration(segment.duration) + ",\n";
+						playlist += segment_name(segment.msn) + "\n";
+					}
+					else if (parts)
+						playlist += "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" + part_name(segment.msn, segment.parts.size()) + "\"\n";
+				}
+
+				if (ended_)
+					playlist += "#EXT-X-ENDLIST\n";
+
+				playlist_ = std::make_shared<const std::string>(std::move(playlist));
+
+				if (writer_)
+				{
+					auto content = playlist_;
+					write_file(playlist_name(), { std::make_shared<const std::vector<uint8_t>>(content->begin(), content->end()) });
+				}
+			}
+
+			// Directory output, on the writer thread. Files are written under a
+			// temporary name and renamed so a reader never sees a partial one.
+			void write_file(const std::string& name, const std::vector<shared_bytes>& data)
+			{
+				if (!writer_)
+					return;
+
+				auto path = boost::filesystem::path(config_.directory) / name;
+
+				writer_->begin_invoke([=]
+				{
+					auto temporary = path;
+					temporary += ".tmp";
+
+					{
+						boost::filesystem::ofstream file(temporary, std::ios::out | std::ios::binary | std::ios::trunc);
+
+						for (auto& bytes : data)
+							file.write(reinterpret_cast<const char*>(bytes->data()), bytes->size());
+
+						if (!file.flush())
+							CASPAR_THROW_EXCEPTION(file_write_error() << msg_info("Failed to write " + name));
+					}
+
+					boost::filesystem::rename(temporary, path);
+				});
+			}
+
+			void remove_file(const std::string& name)
+			{
+				if (!writer_)
+					return;
+
+				auto path = boost::filesystem::path(config_.directory) / name;
+
+				writer_->begin_invoke([=]
+				{
+					boost::system::error_code ec;
+					boost::filesystem::remove(path, ec);
+				});
+			}
+
+			void remove_files(const hls_segment& segment)
+			{
+				remove_file(segment_name(segment.msn));
+
+				if (config_.part > 0)
+				{
+					for (size_t p = 0; p < segment.parts.size(); ++p)
+						remove_file(part_name(segment.msn, p));
+				}
+			}
+
+			// Serving, on the connection threads.
+
+			void serve(const http_server::request& request, http_server::response& response)
+			{
+				auto path = boost::trim_left_copy_if(request.path, boost::is_any_of("/"));
+
+				if (path == playlist_name())
+					return serve_playlist(request, response);
+
+				auto prefix = config_.name + "-";
+
+				if (!boost::starts_with(path, prefix))
+					return;
+
+				auto rest = path.substr(prefix.size());
+
+				if (boost::starts_with(rest, "init") && boost::ends_with(rest, ".mp4"))
+				{
+					int index;
+
+					if (boost::conversion::try_lexical_convert(rest.substr(4, rest.size() - 8), index))
+						serve_init(index, response);
+
+					return;
+				}
+
+				if (!boost::ends_with(rest, extension_))
+					return;
+
+				rest = rest.substr(0, rest.size() - extension_.size());
+
+				auto dot = rest.find('.');
+				int64_t msn;
+				size_t part;
+
+				if (!boost::conversion::try_lexical_convert(rest.substr(0, dot), msn))
+					return;
+
+				if (dot == std::string::npos)
+					serve_segment(msn, response);
+				else if (config_.part > 0 && boost::conversion::try_lexical_convert(rest.substr(dot + 1), part))
+					serve_part(msn, part, response);
+			}
+
+			std::string content_type() const
+			{
+				return config_.fmp4 ? "video/mp4" : "video/mp2t";
+			}
+
+			// Under mutex_.
+			std::shared_ptr<hls_segment> find(int64_t msn) const
+			{
+				if (segments_.empty() || msn < segments_.front()->msn || msn > segments_.back()->msn)
+					return nullptr;
+
+				return segments_[static_cast<size_t>(msn - segments_.front()->msn)];
+			}
+
+			// Under mutex_. Whether a playlist asked for with _HLS_msn and
+			// _HLS_part (-1 if not given) can be answered.
+			bool is_available(int64_t msn, int64_t part) const
+			{
+				if (segments_.empty())
+					return false;
+
+				if (segments_.back()->msn > msn)
+					return true;
+
+				auto segment = find(msn);
+
+				return segment && (segment->complete || (part >= 0 && static_cast<int64_t>(segment->parts.size()) > part));
+			}
+
+			boost::chrono::milliseconds blocking_timeout() const
+			{
+				return boost::chrono::milliseconds(3 * target_duration() * 1000);
+			}
+
+			void serve_playlist(const http_server::request& request, http_server::response& response)
+			{
+				auto msn_param	= request.query.find("_HLS_msn");
+				auto part_param	= request.query.find("_HLS_part");
+				int64_t msn		= -1;
+				int64_t part	= -1;
+
+				if (msn_param == request.query.end() && part_param != request.query.end())
+				{
+					response.send(400, "text/plain", std::string("_HLS_part without _HLS_msn\n"));
+					return;
+				}
+
+				if ((msn_param != request.query.end() && !boost::conversion::try_lexical_convert(msn_param->second, msn))
+					|| (part_param != request.query.end() && !boost::conversion::try_lexical_convert(part_param->second, part)))
+				{
+					response.send(400, "text/plain", std::string("Invalid _HLS_msn or _HLS_part\n"));
+					return;
+				}
+
+				boost::unique_lock<boost::mutex> lock(mutex_);
+
+				if (msn >= 0)
+				{
+					++blocking_requests_;
+
+					// More than two segments ahead of the live edge is a client error.
+					if (msn > next_msn_ + 1)
+					{
+						lock.unlock();
+						response.send(400, "text/plain", std::string("_HLS_msn too far in the future\n"));
+						return;
+					}
+
+					auto available = changed_.wait_for(lock, blocking_timeout(), [&]
+					{
+						return stopping_ || ended_ || is_available(msn, part);
+					});
+
+					if (!available || stopping_)
+					{
+						++blocking_timeouts_;
+						lock.unlock();
+						response.send(503, "text/plain", std::string("Timed out\n"));
+						return;
+					}
+				}
+
+				auto playlist	= playlist_;
+				auto cache		= msn >= 0 ? "Cache-Control: max-age=" + boost::lexical_cast<std::string>(6 * target_duration()) + "\r\n" : std::string("Cache-Control: no-cache\r\n");
+				lock.unlock();
+
+				response.send(200, "application/vnd.apple.mpegurl", *playlist, cache);
+			}
+
+			void serve_init(int index, http_server::response& response)
+			{
+				shared_bytes init;
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					auto it = inits_.find(index);
+
+					if (it == inits_.end())
+						return;
+
+					init = it->second;
+				}
+
+				response.send(200, "video/mp4", std::vector<boost::asio::const_buffer>{ boost::asio::buffer(*init) }, "Cache-Control: max-age=3600\r\n");
+			}
+
+			// A part that is hinted but not yet packaged is waited for.
+			void serve_part(int64_t msn, size_t index, http_server::response& response)
+			{
+				shared_bytes data;
+
+				{
+					boost::unique_lock<boost::mutex> lock(mutex_);
+
+					if (msn > next_msn_)
+						return;
+
+					changed_.wait_for(lock, blocking_timeout(), [&]
+					{
+						auto segment = find(msn);
+						return stopping_ || ended_ || (segments_.empty() || msn < segments_.front()->msn) || (segment && (segment->complete || segment->parts.size() > index));
+					});
+
+					auto segment = find(msn);
+
+					if (!segment || segment->parts.size() <= index)
+						return;
+
+					data = segment->parts[index].data;
+				}
+
+				response.send(200, content_type(), std::vector<boost::asio::const_buffer>{ boost::asio::buffer(*data) }, "Cache-Control: max-age=3600\r\n");
+			}
+
+			// A segment that is still being packaged is sent chunked, a part at a
+			// time as they complete.
+			void serve_segment(int64_t msn, http_server::response& response)
+			{
+				boost::unique_lock<boost::mutex> lock(mutex_);
+
+				auto segment = find(msn);
+
+				if (!segment)
+					return;
+
+				size_t sent = 0;
+				auto chunked = !segment->complete;
+
+				if (chunked)
+				{
+					lock.unlock();
+
+					if (!response.begin_chunked(200, content_type()))
+						return;
+
+					lock.lock();
+				}
+
+				while (true)
+				{
+					std::vector<shared_bytes> data;
+
+					for (; sent < segment->parts.size(); ++sent)
+						data.push_back(segment->parts[sent].data);
+
+					auto complete = segment->complete;
+					lock.unlock();
+
+					std::vector<boost::asio::const_buffer> buffers;
+
+					for (auto& bytes : data)
+						buffers.push_back(boost::asio::buffer(*bytes));
+
+					if (!chunked)
+					{
+						response.send(200, content_type(), buffers, "Cache-Control: max-age=3600\r\n");
+						return;
+					}
+
+					if (!response.chunk(buffers))
+						return;
+
+					if (complete)
+					{
+						response.end_chunked();
+						return;
+					}
+
+					lock.lock();
+
+					// A segment that stops growing is abandoned, the client retries.
+					if (!changed_.wait_for(lock, blocking_timeout(), [&] { return stopping_ || segment->complete || segment->parts.size() > sent; }) || stopping_)
+						return;
+				}
+			}
+
+			std::wstring print() const
+			{
+				return L"hls_consumer[" + url_ + L"]";
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"type", L"hls");
+				info.add(L"url", url_);
+				info.add(L"format", config_.fmp4 ? L"fmp4" : L"ts");
+				info.add(L"bytes-muxed", bytes_muxed_);
+				info.add(L"segments", segments_packaged_);
+				info.add(L"parts", parts_packaged_);
+				info.add(L"blocking-requests", blocking_requests_);
+				info.add(L"blocking-timeouts", blocking_timeouts_);
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					info.add(L"media-sequence", segments_.empty() ? next_msn_ : segments_.back()->msn);
+					info.add(L"target-duration", target_duration());
+				}
+
+				if (server_)
+					info.add_child(L"server", server_->info());
+
+				return info;
+			}
+		};
+
+		hls_consumer::hls_consumer(const std::shared_ptr<packetProducer>& producer, const std::wstring& url)
+			: impl_(new impl(producer, url))
+		{
+		}
+
+		hls_consumer::~hls_consumer()
+		{
+		}
+
+		std::wstring hls_consumer::print() const
+		{
+			return impl_->print();
+		}
+
+		boost::property_tree::wptree hls_consumer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
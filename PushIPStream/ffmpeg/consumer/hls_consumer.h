@@ -0,0 +1,47 @@
+#pragma once
+
+#include "../../packetConsumer.h"
+#include "../../packetProducer.h"
+
+#include <common/memory.h>
+
+#include <memory>
+#include <string>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Packages a packetProducer as low latency HLS, fMP4 (CMAF style, one init
+		// section and moof/mdat fragments) or TS segments that start on a video
+		// key frame and are made of partial segments, for a url of the form
+		// hls://[address]:port/name?segment=4&part=0.5.
+		//
+		// Muxed bytes are written once, into an immutable buffer per partial
+		// segment that the built-in http_server sends from directly. A segment is
+		// the gathering write of its parts and one that is still being packaged
+		// is sent chunked as its parts complete. Playlists are served at
+		// /<name>.m3u8 and support blocking reload (_HLS_msn, _HLS_part) and a
+		// preload hint for the next part.
+		//
+		// Query parameters of the url: segment (target duration in seconds,
+		// default 4, segments are cut at the first key frame after it and after
+		// a timeline discontinuity), part (target duration of partial segments,
+		// default 0.5, 0 for plain HLS), format (fmp4 or ts), window (segments in
+		// the playlist, default 6) and directory (also writes every file there,
+		// each replaced atomically by a rename, for another web server). Port 0
+		// with a directory packages without serving. Any other parameter is
+		// passed to the muxer.
+		class hls_consumer : public packetConsumer
+		{
+		public:
+			hls_consumer(const std::shared_ptr<packetProducer>& producer, const std::wstring& url);
+			virtual ~hls_consumer();
+
+			std::wstring						print() const override;
+			boost::property_tree::wptree		info() const override;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
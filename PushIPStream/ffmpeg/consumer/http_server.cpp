@@ -0,0 +1,488 @@
+#include "../StdAfx.h"
+
+#include "http_server.h"
+
+#include <common/except.h>
+#include <common/log.h>
+#include <common/os/general_protection_fault.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <tbb/atomic.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <list>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const size_t MAX_REQUEST_HEADER = 16 * 1024;
+
+		static std::string status_text(int status)
+		{
+			switch (status)
+			{
+			case 200:	return "OK";
+			case 400:	return "Bad Request";
+			case 404:	return "Not Found";
+			case 405:	return "Method Not Allowed";
+			case 500:	return "Internal Server Error";
+			case 503:	return "Service Unavailable";
+			default:	return "Unknown";
+			}
+		}
+
+		static std::string percent_decode(const std::string& str, bool plus_is_space)
+		{
+			std::string result;
+			result.reserve(str.size());
+
+			for (size_t i = 0; i < str.size(); ++i)
+			{
+				if (str[i] == '%' && i + 2 < str.size() && std::isxdigit(static_cast<unsigned char>(str[i + 1])) && std::isxdigit(static_cast<unsigned char>(str[i + 2])))
+				{
+					result += static_cast<char>(std::stoi(str.substr(i + 1, 2), nullptr, 16));
+					i += 2;
+				}
+				else if (str[i] == '+' && plus_is_space)
+					result += ' ';
+				else
+					result += str[i];
+			}
+
+			return result;
+		}
+
+		static bool parse_request(const std::string& head, http_server::request& request, bool& keep_alive)
+		{
+			std::vector<std::string> lines;
+			boost::split(lines, head, boost::is_any_of("\n"));
+
+			auto first_line = boost::trim_copy(lines.at(0));
+			std::vector<std::string> request_line;
+			boost::split(request_line, first_line, boost::is_any_of(" "), boost::token_compress_on);
+
+			if (request_line.size() != 3 || !boost::starts_with(request_line[2], "HTTP/1."))
+				return false;
+
+			request.method	= request_line[0];
+			keep_alive		= request_line[2] != "HTTP/1.0";
+
+			auto target	= request_line[1];
+			auto q		= target.find('?');
+
+			request.path = percent_decode(target.substr(0, q), false);
+
+			if (q != std::string::npos)
+			{
+				auto query = target.substr(q + 1);
+				std::vector<std::string> pairs;
+				boost::split(pairs, query, boost::is_any_of("&"), boost::token_compress_on);
+
+				for (auto& pair : pairs)
+				{
+					if (pair.empty())
+						continue;
+
+					auto eq = pair.find('=');
+					request.query[percent_decode(pair.substr(0, eq), true)] = eq == std::string::npos ? std::string() : percent_decode(pair.substr(eq + 1), true);
+				}
+			}
+
+			for (size_t i = 1; i < lines.size(); ++i)
+			{
+				auto colon = lines[i].find(':');
+
+				if (colon == std::string::npos || !boost::iequals(boost::trim_copy(lines[i].substr(0, colon)), "connection"))
+					continue;
+
+				auto value = boost::to_lower_copy(lines[i].substr(colon + 1));
+
+				if (value.find("close") != std::string::npos)
+					keep_alive = false;
+				else if (value.find("keep-alive") != std::string::npos)
+					keep_alive = true;
+			}
+
+			return true;
+		}
+
+		class connection_response : public http_server::response
+		{
+			enum class state
+			{
+				idle,
+				chunked,
+				done,
+				failed
+			};
+
+			boost::asio::ip::tcp::socket&	socket_;
+			const bool						head_;
+			const bool						keep_alive_;
+			tbb::atomic<uint64_t>&			bytes_sent_;
+			state							state_		= state::idle;
+		public:
+			using http_server::response::send;
+
+			connection_response(boost::asio::ip::tcp::socket& socket, bool head, bool keep_alive, tbb::atomic<uint64_t>& bytes_sent)
+				: socket_(socket)
+				, head_(head)
+				, keep_alive_(keep_alive)
+				, bytes_sent_(bytes_sent)
+			{
+			}
+
+			bool started() const
+			{
+				return state_ != state::idle;
+			}
+
+			bool complete() const
+			{
+				return state_ == state::done;
+			}
+
+			bool send(int status, const std::string& content_type, const std::vector<boost::asio::const_buffer>& body, const std::string& headers) override
+			{
+				if (state_ != state::idle)
+					return false;
+
+				auto head = header(status, content_type, headers) + "Content-Length: " + boost::lexical_cast<std::string>(boost::asio::buffer_size(body)) + "\r\n\r\n";
+
+				std::vector<boost::asio::const_buffer> buffers;
+				buffers.push_back(boost::asio::buffer(head));
+
+				if (!head_)
+					buffers.insert(buffers.end(), body.begin(), body.end());
+
+				return write(buffers, state::done);
+			}
+
+			bool begin_chunked(int status, const std::string& content_type, const std::string& headers) override
+			{
+				if (state_ != state::idle)
+					return false;
+
+				auto head = header(status, content_type, headers) + "Transfer-Encoding: chunked\r\n\r\n";
+
+				return write(std::vector<boost::asio::const_buffer>{ boost::asio::buffer(head) }, state::chunked);
+			}
+
+			bool chunk(const std::vector<boost::asio::const_buffer>& data) override
+			{
+				if (state_ != state::chunked)
+					return false;
+
+				auto size = boost::asio::buffer_size(data);
+
+				// An empty chunk would end the body.
+				if (size == 0 || head_)
+					return true;
+
+				char prefix[32];
+				std::snprintf(prefix, sizeof(prefix), "%llx\r\n", static_cast<unsigned long long>(size));
+
+				std::vector<boost::asio::const_buffer> buffers;
+				buffers.push_back(boost::asio::buffer(prefix, std::strlen(prefix)));
+				buffers.insert(buffers.end(), data.begin(), data.end());
+				buffers.push_back(boost::asio::buffer("\r\n", 2));
+
+				return write(buffers, state::chunked);
+			}
+
+			bool end_chunked() override
+			{
+				if (state_ != state::chunked)
+					return false;
+
+				if (head_)
+				{
+					state_ = state::done;
+					return true;
+				}
+
+				return write(std::vector<boost::asio::const_buffer>{ boost::asio::buffer("0\r\n\r\n", 5) }, state::done);
+			}
+		private:
+			std::string header(int status, const std::string& content_type, const std::string& headers) const
+			{
+				return "HTTP/1.1 " + boost::lexical_cast<std::string>(status) + " " + status_text(status) + "\r\n"
+					+ "Content-Type: " + content_type + "\r\n"
+					+ "Access-Control-Allow-Origin: *\r\n"
+					+ (keep_alive_ ? "Connection: keep-alive\r\n" : "Connection: close\r\n")
+					+ headers;
+			}
+
+			bool write(const std::vector<boost::asio::const_buffer>& buffers, state next)
+			{
+				boost::system::error_code ec;
+				bytes_sent_ += boost::asio::write(socket_, buffers, ec);
+
+				if (ec)
+				{
+					state_ = state::failed;
+					return false;
+				}
+
+				state_ = next;
+				return true;
+			}
+		};
+
+		struct http_connection : boost::noncopyable
+		{
+			boost::asio::ip::tcp::socket	socket;
+			boost::thread					thread;
+			tbb::atomic<bool>				done;
+
+			explicit http_connection(boost::asio::io_service& service)
+				: socket(service)
+			{
+				done = false;
+			}
+		};
+
+		struct http_server::impl : boost::noncopyable
+		{
+			const handler									handler_;
+			const size_t									max_connections_;
+
+			boost::asio::io_service							service_;
+			boost::asio::ip::tcp::acceptor					acceptor_;
+
+			boost::mutex									mutex_;
+			std::list<std::shared_ptr<http_connection>>		connections_;
+
+			tbb::atomic<bool>								is_running_;
+			tbb::atomic<size_t>								active_connections_;
+			tbb::atomic<uint64_t>							accepted_;
+			tbb::atomic<uint64_t>							rejected_;
+			tbb::atomic<uint64_t>							requests_;
+			tbb::atomic<uint64_t>							bytes_sent_;
+
+			boost::thread									thread_;
+
+			impl(const std::string& address, int port, const handler& handler, size_t max_connections)
+				: handler_(handler)
+				, max_connections_(max_connections)
+				, acceptor_(service_)
+			{
+				is_running_			= true;
+				active_connections_	= 0;
+				accepted_			= 0;
+				rejected_			= 0;
+				requests_			= 0;
+				bytes_sent_			= 0;
+
+				boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string(address.empty() ? "0.0.0.0" : address), static_cast<unsigned short>(port));
+
+				acceptor_.open(endpoint.protocol());
+				acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+				acceptor_.bind(endpoint);
+				acceptor_.listen();
+
+				accept();
+
+				thread_ = boost::thread([this]
+				{
+					ensure_gpf_handler_installed_for_thread("http-server");
+					service_.run();
+				});
+
+				CASPAR_LOG(info) << print() << L" Listening.";
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+
+				// The aborted accept was the only work left.
+				service_.post([this]
+				{
+					boost::system::error_code ec;
+					acceptor_.close(ec);
+				});
+				thread_.join();
+
+				std::list<std::shared_ptr<http_connection>> connections;
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					connections.swap(connections_);
+
+					// Wakes threads blocked reading the next request.
+					for (auto& connection : connections)
+					{
+						boost::system::error_code ec;
+						connection->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+					}
+				}
+
+				for (auto& connection : connections)
+					connection->thread.join();
+			}
+
+			void accept()
+			{
+				auto connection = std::make_shared<http_connection>(service_);
+
+				acceptor_.async_accept(connection->socket, [this, connection](const boost::system::error_code& ec)
+				{
+					if (!is_running_ || ec == boost::asio::error::operation_aborted)
+						return;
+
+					if (ec)
+						CASPAR_LOG(warning) << print() << L" Accept failed: " << ec.message().c_str();
+					else
+						start(connection);
+
+					accept();
+				});
+			}
+
+			void start(const std::shared_ptr<http_connection>& connection)
+			{
+				++accepted_;
+
+				boost::system::error_code ec;
+				connection->socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+
+				boost::lock_guard<boost::mutex> lock(mutex_);
+
+				// Joins the threads of connections that have ended since.
+				for (auto it = connections_.begin(); it != connections_.end();)
+				{
+					if ((*it)->done)
+					{
+						(*it)->thread.join();
+						it = connections_.erase(it);
+					}
+					else
+						++it;
+				}
+
+				if (active_connections_ >= max_connections_)
+				{
+					++rejected_;
+					connection_response response(connection->socket, false, false, bytes_sent_);
+					response.send(503, "text/plain", std::string("Too many connections\n"));
+					connection->socket.close(ec);
+					return;
+				}
+
+				++active_connections_;
+				connections_.push_back(connection);
+				connection->thread = boost::thread([this, connection] { serve(*connection); });
+			}
+
+			void serve(http_connection& connection)
+			{
+				ensure_gpf_handler_installed_for_thread("http-server-connection");
+
+				try
+				{
+					boost::asio::streambuf buffer(MAX_REQUEST_HEADER);
+
+					while (is_running_)
+					{
+						boost::system::error_code ec;
+						auto size = boost::asio::read_until(connection.socket, buffer, "\r\n\r\n", ec);
+
+						if (ec)
+							break;
+
+						std::string head(boost::asio::buffers_begin(buffer.data()), boost::asio::buffers_begin(buffer.data()) + size);
+						buffer.consume(size);
+
+						request req;
+						auto keep_alive = false;
+
+						if (!parse_request(head, req, keep_alive))
+						{
+							connection_response response(connection.socket, false, false, bytes_sent_);
+							response.send(400, "text/plain", std::string("Bad request\n"));
+							break;
+						}
+
+						++requests_;
+
+						connection_response response(connection.socket, req.method == "HEAD", keep_alive, bytes_sent_);
+
+						if (req.method == "GET" || req.method == "HEAD")
+							handler_(req, response);
+						else
+							response.send(405, "text/plain", std::string("Method not allowed\n"));
+
+						if (!response.started())
+							response.send(404, "text/plain", std::string("Not found\n"));
+
+						if (!keep_alive || !response.complete())
+							break;
+					}
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				{
+					// Under the lock, the destructor may be shutting it down.
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					boost::system::error_code ec;
+					connection.socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+					connection.socket.close(ec);
+				}
+
+				--active_connections_;
+				connection.done = true;
+			}
+
+			std::wstring print() const
+			{
+				boost::system::error_code ec;
+				return L"http_server[" + boost::lexical_cast<std::wstring>(acceptor_.local_endpoint(ec).port()) + L"]";
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::system::error_code ec;
+				boost::property_tree::wptree info;
+				info.add(L"port", acceptor_.local_endpoint(ec).port());
+				info.add(L"connections", active_connections_);
+				info.add(L"accepted", accepted_);
+				info.add(L"rejected", rejected_);
+				info.add(L"requests", requests_);
+				info.add(L"bytes-sent", bytes_sent_);
+
+				return info;
+			}
+		};
+
+		http_server::http_server(const std::string& address, int port, const handler& handler, size_t max_connections)
+			: impl_(new impl(address, port, handler, max_connections))
+		{
+		}
+
+		http_server::~http_server()
+		{
+		}
+
+		int http_server::port() const
+		{
+			boost::system::error_code ec;
+			return impl_->acceptor_.local_endpoint(ec).port();
+		}
+
+		boost::property_tree::wptree http_server::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <common/memory.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Minimal HTTP/1.1 server for serving outputs to local caches and for
+		// testing. Supports GET and HEAD and keep-alive. Each connection has a
+		// thread of its own, so a handler may block, e.g. until the resource it
+		// was asked for exists.
+		class http_server : boost::noncopyable
+		{
+		public:
+			struct request
+			{
+				std::string							method;
+				std::string							path;	// Percent decoded, without the query.
+				std::map<std::string, std::string>	query;
+			};
+
+			// Sends the response to one request, either in one piece or chunked.
+			// Bodies are sent from the caller's buffers with a single gathering
+			// write (writev), they only need to stay valid during the call. The
+			// methods return false once the client has gone.
+			class response : boost::noncopyable
+			{
+			public:
+				virtual ~response() {}
+
+				virtual bool	send(int status, const std::string& content_type, const std::vector<boost::asio::const_buffer>& body, const std::string& headers = "") = 0;
+				bool			send(int status, const std::string& content_type, const std::string& body, const std::string& headers = "")
+				{
+					return send(status, content_type, std::vector<boost::asio::const_buffer>{ boost::asio::buffer(body) }, headers);
+				}
+
+				virtual bool	begin_chunked(int status, const std::string& content_type, const std::string& headers = "") = 0;
+				virtual bool	chunk(const std::vector<boost::asio::const_buffer>& data) = 0;
+				virtual bool	end_chunked() = 0;
+			};
+
+			// Called on the connection's thread. Requests the handler does not
+			// respond to get a 404.
+			typedef std::function<void(const request&, response&)> handler;
+
+			http_server(const std::string& address, int port, const handler& handler, size_t max_connections = 64);
+			~http_server();
+
+			int								port() const;
+			boost::property_tree::wptree	info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,266 @@
+#include "../StdAfx.h"
+
+#include "muxer.h"
+
+#include "../ffmpeg_error.h"
+
+#include <common/log.h>
+#include <common/scope_exit.h>
+
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		struct muxer::impl : boost::noncopyable
+		{
+			const std::string						format_name_;
+			const std::shared_ptr<AVFormatContext>	input_;
+			const write_func						write_;
+			std::vector<int>						stream_map_;
+			std::shared_ptr<AVFormatContext>		context_;
+			bool									header_written_		= false;
+			bool									closed_				= false;
+
+			impl(const std::string& format_name, const std::shared_ptr<AVFormatContext>& input, const ffmpeg_options& options, const write_func& write, int io_buffer_size)
+				: format_name_(format_name)
+				, input_(input)
+				, write_(write)
+				, stream_map_(input->nb_streams, -1)
+			{
+				AVFormatContext* weak_context = nullptr;
+				THROW_ON_ERROR2(avformat_alloc_output_context2(&weak_context, nullptr, format_name_.c_str(), nullptr), print());
+
+				context_.reset(weak_context, [](AVFormatContext* ptr)
+				{
+					if (ptr->pb)
+					{
+						av_freep(&ptr->pb->buffer);
+						av_freep(&ptr->pb);
+					}
+
+					avformat_free_context(ptr);
+				});
+
+				for (unsigned int i = 0; i < input_->nb_streams; ++i)
+				{
+					auto in_stream	= input_->streams[i];
+					auto type		= in_stream->codec->codec_type;
+
+					if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO && type != AVMEDIA_TYPE_SUBTITLE)
+						continue;
+
+					if (avformat_query_codec(context_->oformat, in_stream->codec->codec_id, 0) == 0)
+					{
+						CASPAR_LOG(warning) << print() << L" Skipping stream " << i << L", codec " << avcodec_get_name(in_stream->codec->codec_id) << L" is not supported.";
+						continue;
+					}
+
+					auto out_stream = avformat_new_stream(context_.get(), nullptr);
+
+					if (!out_stream)
+						CASPAR_THROW_EXCEPTION(ffmpeg_error() << msg_info("avformat_new_stream failed"));
+
+					THROW_ON_ERROR2(avcodec_copy_context(out_stream->codec, in_stream->codec), print());
+
+					out_stream->codec->codec_tag	= 0;
+					out_stream->time_base			= in_stream->time_base;
+
+					if (context_->oformat->flags & AVFMT_GLOBALHEADER)
+						out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+					stream_map_[i] = out_stream->index;
+				}
+
+				if (context_->nb_streams == 0)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"No streams to mux in " + print()));
+
+				auto buffer = static_cast<unsigned char*>(av_malloc(io_buffer_size));
+
+				if (!buffer)
+					throw std::bad_alloc();
+
+				context_->pb = avio_alloc_context(buffer, io_buffer_size, 1, this, nullptr, &impl::write_packet, nullptr);
+
+				if (!context_->pb)
+				{
+					av_free(buffer);
+					throw std::bad_alloc();
+				}
+
+				context_->flags |= AVFMT_FLAG_CUSTOM_IO;
+				// The default of 10 seconds is far too long for a live output waiting
+				// on a sparse stream.
+				context_->max_interleave_delta = AV_TIME_BASE / 2;
+
+				AVDictionary* format_options = nullptr;
+
+				CASPAR_SCOPE_EXIT
+				{
+					if (format_options)
+						av_dict_free(&format_options);
+				};
+
+				for (auto& option : options)
+					av_dict_set(&format_options, option.first.c_str(), option.second.c_str(), 0);
+
+				THROW_ON_ERROR2(avformat_write_header(context_.get(), &format_options), print());
+				header_written_ = true;
+
+				AVDictionaryEntry* t = nullptr;
+
+				while ((t = av_dict_get(format_options, "", t, AV_DICT_IGNORE_SUFFIX)) != nullptr)
+					CASPAR_LOG(warning) << print() << L" Unused option " << t->key << L"=" << t->value;
+			}
+
+			~impl()
+			{
+				try
+				{
+					close();
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+			}
+
+			bool write(const std::shared_ptr<AVPacket>& packet)
+			{
+				if (closed_ || !packet || !packet->data)
+					return false;
+
+				auto index = output_index(packet->stream_index);
+
+				if (index < 0)
+					return false;
+
+				AVPacket pkt;
+				av_init_packet(&pkt);
+
+				// Shares the refcounted buffer of the input packet, no copy.
+				THROW_ON_ERROR2(av_packet_ref(&pkt, packet.get()), print());
+
+				CASPAR_SCOPE_EXIT
+				{
+					av_packet_unref(&pkt);
+				};
+
+				pkt.stream_index = index;
+				av_packet_rescale_ts(&pkt, input_->streams[packet->stream_index]->time_base, context_->streams[index]->time_base);
+
+				auto ret = av_interleaved_write_frame(context_.get(), &pkt);
+
+				if (ret < 0)
+				{
+					CASPAR_LOG(warning) << print() << L" Dropped packet on stream " << index << L": " << av_error_str(ret).c_str();
+					return false;
+				}
+
+				return true;
+			}
+
+			void flush()
+			{
+				if (context_->pb)
+					avio_flush(context_->pb);
+			}
+
+			void fragment()
+			{
+				if (closed_)
+					return;
+
+				THROW_ON_ERROR2(av_interleaved_write_frame(context_.get(), nullptr), print());
+
+				if (context_->oformat->flags & AVFMT_ALLOW_FLUSH)
+					THROW_ON_ERROR2(av_write_frame(context_.get(), nullptr), print());
+
+				flush();
+			}
+
+			void close()
+			{
+				if (closed_)
+					return;
+
+				closed_ = true;
+
+				if (header_written_)
+				{
+					LOG_ON_ERROR2(av_write_trailer(context_.get()), print());
+					flush();
+				}
+			}
+
+			int output_index(int input_index) const
+			{
+				if (input_index < 0 || input_index >= static_cast<int>(stream_map_.size()))
+					return -1;
+
+				return stream_map_[input_index];
+			}
+
+			std::wstring print() const
+			{
+				return L"muxer[" + u16(format_name_) + L"]";
+			}
+
+			static int write_packet(void* opaque, uint8_t* buf, int buf_size)
+			{
+				auto self = static_cast<impl*>(opaque);
+
+				try
+				{
+					self->write_(buf, buf_size);
+					return buf_size;
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+					return AVERROR(EIO);
+				}
+			}
+		};
+
+		muxer::muxer(const std::string& format_name, const std::shared_ptr<AVFormatContext>& input, const ffmpeg_options& options, const write_func& write, int io_buffer_size)
+			: impl_(new impl(format_name, input, options, write, io_buffer_size))
+		{
+		}
+
+		bool muxer::write(const std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->write(packet);
+		}
+
+		void muxer::flush()
+		{
+			impl_->flush();
+		}
+
+		void muxer::fragment()
+		{
+			impl_->fragment();
+		}
+
+		void muxer::close()
+		{
+			impl_->close();
+		}
+
+		std::shared_ptr<AVFormatContext> muxer::context() const
+		{
+			return impl_->context_;
+		}
+
+		int muxer::output_index(int input_index) const
+		{
+			return impl_->output_index(input_index);
+		}
+
+		std::wstring muxer::print() const
+		{
+			return impl_->print();
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "../util/util.h"
+
+#include <common/memory.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+struct AVFormatContext;
+struct AVPacket;
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Remuxes packets described by an input AVFormatContext into a libavformat
+		// muxer whose output bytes are handed to a callback instead of a file.
+		class muxer : boost::noncopyable
+		{
+		public:
+			typedef std::function<void(const uint8_t* data, int size)> write_func;
+
+			muxer(const std::string& format_name, const std::shared_ptr<AVFormatContext>& input, const ffmpeg_options& options, const write_func& write, int io_buffer_size = 32 * 1024);
+
+			// Returns false if the packet belongs to a stream that is not muxed or
+			// was rejected by the muxer. Flush packets are ignored.
+			bool								write(const std::shared_ptr<AVPacket>& packet);
+			// Pushes bytes buffered in the io context to the callback.
+			void								flush();
+			// Writes out the packets held for interleaving and ends the current
+			// fragment of muxers that support it (mp4 with movflags=frag_custom),
+			// then flushes, so the bytes handed to the callback so far can be
+			// decoded without what follows.
+			void								fragment();
+			// Writes the trailer, the muxer may not be written to afterwards.
+			void								close();
+
+			std::shared_ptr<AVFormatContext>	context() const;
+			// Index of the output stream an input stream is muxed as, or -1.
+			int									output_index(int input_index) const;
+			std::wstring						print() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
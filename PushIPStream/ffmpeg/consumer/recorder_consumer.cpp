@@ -0,0 +1,652 @@
+#include "../StdAfx.h"
+
+#include "recorder_consumer.h"
+#include "muxer.h"
+
+#include "../bitstream_filter.h"
+#include "../ffmpeg_error.h"
+#include "../packet_source.h"
+#include "../timestamp_normalizer.h"
+
+#include <common/except.h>
+#include <common/executor.h>
+#include <common/log.h>
+#include <common/os/direct_file.h>
+#include <common/os/general_protection_fault.h>
+#include <common/param.h>
+
+#include <boost/align/aligned_alloc.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int MUXER_IO_BUFFER_SIZE = 64 * 1024;
+
+		struct recorder_url
+		{
+			std::wstring	directory;
+			std::wstring	name			= L"segment";
+			std::string		format			= "mpegts";
+			std::wstring	extension		= L".ts";
+			int64_t			segment			= 10 * AV_TIME_BASE;
+			size_t			keep			= 360;
+			bool			remove			= false;
+			bool			direct			= true;
+			size_t			block_size		= 1024 * 1024;
+			size_t			blocks			= 8;
+			ffmpeg_options	muxer_options;
+		};
+
+		static recorder_url parse_recorder_url(const std::wstring& url)
+		{
+			auto parts = protocol_split(url);
+
+			if (!boost::iequals(parts.at(0), L"record"))
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Not a record url: " + url));
+
+			auto rest	= parts.at(1);
+			auto query	= std::string();
+			auto q		= rest.find(L'?');
+
+			if (q != std::wstring::npos)
+			{
+				query	= u8(rest.substr(q + 1));
+				rest	= rest.substr(0, q);
+			}
+
+			if (rest.empty())
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Missing directory in " + url));
+
+			recorder_url result;
+			result.directory = rest;
+
+			std::vector<std::string> pairs;
+			boost::split(pairs, query, boost::is_any_of("&"), boost::token_compress_on);
+
+			for (auto& pair : pairs)
+			{
+				if (pair.empty())
+					continue;
+
+				auto eq		= pair.find('=');
+				auto key	= pair.substr(0, eq);
+				auto value	= eq == std::string::npos ? std::string() : pair.substr(eq + 1);
+
+				try
+				{
+					if (key == "segment")
+						result.segment = static_cast<int64_t>(boost::lexical_cast<double>(value) * AV_TIME_BASE);
+					else if (key == "format")
+					{
+						if (value == "ts" || value == "mpegts")
+						{
+							result.format		= "mpegts";
+							result.extension	= L".ts";
+						}
+						else if (value == "mp4")
+						{
+							result.format		= "mp4";
+							result.extension	= L".mp4";
+						}
+						else
+							CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"format must be ts or mp4 in " + url));
+					}
+					else if (key == "name")
+						result.name = u16(value);
+					else if (key == "keep")
+						result.keep = boost::lexical_cast<size_t>(value);
+					else if (key == "delete")
+						result.remove = boost::lexical_cast<int>(value) != 0;
+					else if (key == "direct")
+						result.direct = boost::lexical_cast<int>(value) != 0;
+					else if (key == "block_size")
+						result.block_size = boost::lexical_cast<size_t>(value);
+					else if (key == "blocks")
+						result.blocks = boost::lexical_cast<size_t>(value);
+					else
+						result.muxer_options.push_back(std::make_pair(key, value));
+				}
+				catch (const boost::bad_lexical_cast&)
+				{
+					CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Invalid value for " + u16(key) + L" in " + url));
+				}
+			}
+
+			if (result.segment <= 0)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"segment must be positive in " + url));
+
+			if (result.block_size == 0 || result.block_size % direct_file::alignment != 0)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"block_size must be a multiple of 4096 in " + url));
+
+			if (result.blocks < 2)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"blocks must be at least 2 in " + url));
+
+			if (result.name.empty() || result.name.find_first_of(L"/\\") != std::wstring::npos)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Invalid name in " + url));
+
+			// A fragmented mp4 needs no seeking back to the moov box, so it is
+			// written front to back like a TS and survives a crash.
+			if (result.format == "mp4" && std::none_of(result.muxer_options.begin(), result.muxer_options.end(), [](const std::pair<std::string, std::string>& option) { return option.first == "movflags"; }))
+				result.muxer_options.push_back(std::make_pair("movflags", "frag_keyframe+empty_moov+default_base_moof"));
+
+			return result;
+		}
+
+		struct write_block : boost::noncopyable
+		{
+			uint8_t*	data;
+			size_t		used = 0;
+
+			explicit write_block(size_t size)
+				: data(static_cast<uint8_t*>(boost::alignment::aligned_alloc(direct_file::alignment, size)))
+			{
+				if (!data)
+					throw std::bad_alloc();
+			}
+
+			~write_block()
+			{
+				boost::alignment::aligned_free(data);
+			}
+		};
+
+		struct segment : boost::noncopyable
+		{
+			std::wstring				name;
+			std::string					started;							// UTC wall clock.
+			int64_t						first_time	= AV_NOPTS_VALUE;		// AV_TIME_BASE.
+			int64_t						last_time	= AV_NOPTS_VALUE;
+			uint64_t					length		= 0;					// Bytes muxed.
+
+			// Only touched by the io thread.
+			std::unique_ptr<direct_file>	file;
+			bool							failed		= false;
+		};
+
+		struct index_entry
+		{
+			std::wstring	name;
+			std::string		started;
+			double			duration;
+			uint64_t		length;
+		};
+
+		struct recorder_consumer::impl : boost::noncopyable
+		{
+			const std::wstring									url_;
+			const recorder_url									config_;
+			const boost::filesystem::path						directory_;
+
+			packet_source										source_;
+			int													cut_stream_			= -1;	// Segments start on a key frame of this stream.
+			std::unique_ptr<muxer>								muxer_;
+			std::shared_ptr<segment>							current_;
+			std::shared_ptr<write_block>						block_;
+			bool												cut_pending_		= false;
+			uint64_t											sequence_			= 0;
+
+			tbb::concurrent_bounded_queue<std::shared_ptr<write_block>>	free_blocks_;
+			std::deque<index_entry>								index_;				// Only touched by the io thread.
+
+			mutable tbb::spin_mutex								current_name_mutex_;
+			std::wstring										current_name_;
+
+			tbb::atomic<bool>									is_running_;
+			tbb::atomic<bool>									direct_;
+			tbb::atomic<uint64_t>								packets_muxed_;
+			tbb::atomic<uint64_t>								segments_written_;
+			tbb::atomic<uint64_t>								segments_failed_;
+			tbb::atomic<uint64_t>								bytes_written_;
+			tbb::atomic<uint64_t>								write_stalls_;
+			tbb::atomic<uint64_t>								write_errors_;
+			tbb::atomic<size_t>									index_size_;
+
+			boost::thread										thread_;
+			executor											io_;	// Last, drains its writes before the members above go.
+
+			impl(const std::shared_ptr<packetProducer>& producer, const std::wstring& url)
+				: url_(url)
+				, config_(parse_recorder_url(url))
+				, directory_(config_.directory)
+				, source_(config_.format == "mpegts" ? std::shared_ptr<packetProducer>(std::make_shared<bitstream_filter_producer>(producer, bitstream_target::mpegts)) : producer)
+				, io_(L"recorder-io")
+			{
+				is_running_			= true;
+				direct_				= config_.direct;
+				packets_muxed_		= 0;
+				segments_written_	= 0;
+				segments_failed_	= 0;
+				bytes_written_		= 0;
+				write_stalls_		= 0;
+				write_errors_		= 0;
+				index_size_			= 0;
+
+				boost::filesystem::create_directories(directory_);
+
+				auto context = source_.context();
+
+				for (unsigned int i = 0; i < context->nb_streams; ++i)
+				{
+					if (context->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+					{
+						cut_stream_ = static_cast<int>(i);
+						break;
+					}
+				}
+
+				// Without video every audio packet is a key frame.
+				if (cut_stream_ < 0 && context->nb_streams > 0)
+					cut_stream_ = 0;
+
+				for (size_t i = 0; i < config_.blocks; ++i)
+					free_blocks_.push(std::make_shared<write_block>(config_.block_size));
+
+				load_index();
+
+				thread_ = boost::thread([this] { record(); });
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+				thread_.join();
+			}
+
+			void record()
+			{
+				ensure_gpf_handler_installed_for_thread("recorder-consumer");
+
+				try
+				{
+					while (is_running_)
+					{
+						std::shared_ptr<AVPacket> packet;
+
+						if (!source_.try_pop(packet))
+						{
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+							continue;
+						}
+
+						if (!packet->data)
+						{
+							if (packet->pos == -1) // End of input.
+								break;
+
+							cut_pending_ = true; // Seek or loop.
+							continue;
+						}
+
+						if (packet->flags & PKT_FLAG_DISCONTINUITY)
+							cut_pending_ = true;
+
+						auto time = packet_time(*packet);
+
+						if (muxer_ && is_cut(*packet, time))
+							finish_segment(time);
+
+						// Nothing is recorded before the first key frame.
+						if (!muxer_)
+						{
+							if (!is_key(*packet))
+								continue;
+
+							start_segment(time);
+						}
+
+						if (muxer_->write(packet))
+							++packets_muxed_;
+
+						if (time != AV_NOPTS_VALUE)
+						{
+							if (current_->first_time == AV_NOPTS_VALUE)
+								current_->first_time = time;
+
+							current_->last_time = current_->last_time == AV_NOPTS_VALUE ? time : std::max(current_->last_time, time);
+						}
+					}
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				try
+				{
+					finish_segment(AV_NOPTS_VALUE);
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				CASPAR_LOG(info) << print() << L" Recording stopped.";
+			}
+
+			int64_t packet_time(const AVPacket& packet) const
+			{
+				auto ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+				if (ts == AV_NOPTS_VALUE)
+					return AV_NOPTS_VALUE;
+
+				return av_rescale_q(ts, source_.context()->streams[packet.stream_index]->time_base, AV_TIME_BASE_Q);
+			}
+
+			bool is_key(const AVPacket& packet) const
+			{
+				return packet.stream_index == cut_stream_ && (packet.flags & AV_PKT_FLAG_KEY);
+			}
+
+			bool is_cut(const AVPacket& packet, int64_t time) const
+			{
+				if (!is_key(packet))
+					return false;
+
+				if (cut_pending_)
+					return true;
+
+				return time != AV_NOPTS_VALUE && current_->first_time != AV_NOPTS_VALUE && time - current_->first_time >= config_.segment;
+			}
+
+			void start_segment(int64_t time)
+			{
+				auto now	= boost::posix_time::microsec_clock::universal_time();
+				auto seg	= std::make_shared<segment>();
+
+				seg->name		= config_.name + L"-" + u16(boost::posix_time::to_iso_string(boost::posix_time::ptime(now.date(), boost::posix_time::seconds(now.time_of_day().total_seconds())))) + L"-" + boost::lexical_cast<std::wstring>(sequence_++) + config_.extension;
+				seg->started	= boost::posix_time::to_iso_extended_string(now) + "Z";
+				seg->first_time	= time;
+
+				auto path	= (directory_ / seg->name).wstring();
+				auto direct	= config_.direct;
+
+				io_.begin_invoke([=]
+				{
+					try
+					{
+						seg->file.reset(new direct_file(path, direct));
+						direct_ = seg->file->direct();
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						fail(*seg);
+					}
+				});
+
+				current_	= seg;
+				cut_pending_	= false;
+
+				{
+					tbb::spin_mutex::scoped_lock lock(current_name_mutex_);
+					current_name_ = seg->name;
+				}
+
+				// The header goes straight into the first block.
+				muxer_.reset(new muxer(config_.format, source_.context(), config_.muxer_options, [this](const uint8_t* data, int size)
+				{
+					append(data, size);
+				}, MUXER_IO_BUFFER_SIZE));
+			}
+
+			void finish_segment(int64_t end_time)
+			{
+				if (!muxer_)
+					return;
+
+				muxer_->close();
+				muxer_.reset();
+
+				// The last block goes to the segment before it is let go.
+				if (block_)
+					submit();
+
+				auto seg = std::move(current_);
+
+				auto end		= end_time != AV_NOPTS_VALUE ? end_time : seg->last_time;
+				auto duration	= seg->first_time != AV_NOPTS_VALUE && end != AV_NOPTS_VALUE ? static_cast<double>(end - seg->first_time) / AV_TIME_BASE : 0.0;
+
+				io_.begin_invoke([=]
+				{
+					if (seg->file && !seg->failed)
+					{
+						try
+						{
+							seg->file->close(seg->length);
+						}
+						catch (...)
+						{
+							CASPAR_LOG_CURRENT_EXCEPTION();
+							fail(*seg);
+						}
+					}
+
+					seg->file.reset();
+
+					if (seg->failed)
+						return;
+
+					++segments_written_;
+					add_to_index(index_entry{ seg->name, seg->started, duration, seg->length });
+				});
+			}
+
+			void append(const uint8_t* data, int size)
+			{
+				current_->length += size;
+
+				while (size > 0)
+				{
+					if (!block_)
+					{
+						// All blocks queued for the io thread, the disk is behind.
+						if (!free_blocks_.try_pop(block_))
+						{
+							++write_stalls_;
+							free_blocks_.pop(block_);
+						}
+					}
+
+					auto count = std::min(static_cast<size_t>(size), config_.block_size - block_->used);
+
+					std::memcpy(block_->data + block_->used, data, count);
+					block_->used	+= count;
+					data			+= count;
+					size			-= static_cast<int>(count);
+
+					if (block_->used == config_.block_size)
+						submit();
+				}
+			}
+
+			// Hands the current block to the io thread. Only the last block of a
+			// segment is partial, it is padded to the alignment and the padding
+			// is cut off again when the file is closed.
+			void submit()
+			{
+				auto seg	= current_;
+				auto block	= std::move(block_);
+				auto size	= (block->used + direct_file::alignment - 1) / direct_file::alignment * direct_file::alignment;
+
+				std::memset(block->data + block->used, 0, size - block->used);
+
+				io_.begin_invoke([=]
+				{
+					if (seg->file && !seg->failed)
+					{
+						try
+						{
+							seg->file->write(block->data, size);
+							bytes_written_ += block->used;
+						}
+						catch (...)
+						{
+							CASPAR_LOG_CURRENT_EXCEPTION();
+							fail(*seg);
+						}
+					}
+
+					block->used = 0;
+					free_blocks_.push(block);
+				});
+			}
+
+			// Io thread. The segment is abandoned, the recording goes on with the
+			// next one.
+			void fail(segment& seg)
+			{
+				if (seg.failed)
+					return;
+
+				seg.failed = true;
+				seg.file.reset();
+				++write_errors_;
+				++segments_failed_;
+
+				CASPAR_LOG(error) << print() << L" Failed to write " << seg.name << L".";
+			}
+
+			boost::filesystem::path index_path() const
+			{
+				return directory_ / (config_.name + L".index");
+			}
+
+			// Picks up the index of an earlier run so that keep and delete also
+			// cover the segments it recorded.
+			void load_index()
+			{
+				boost::filesystem::ifstream file(index_path());
+				std::string line;
+
+				while (std::getline(file, line))
+				{
+					std::vector<std::string> fields;
+					boost::split(fields, line, boost::is_any_of("\t"));
+
+					if (line.empty() || line[0] == '#' || fields.size() != 4)
+						continue;
+
+					index_entry entry;
+					entry.name		= u16(fields[0]);
+					entry.started	= fields[1];
+
+					if (!boost::conversion::try_lexical_convert(fields[2], entry.duration) || !boost::conversion::try_lexical_convert(fields[3], entry.length))
+						continue;
+
+					index_.push_back(entry);
+				}
+
+				index_size_ = index_.size();
+			}
+
+			// Io thread. The index is replaced by a rename so a reader never sees a
+			// partial one.
+			void add_to_index(const index_entry& entry)
+			{
+				index_.push_back(entry);
+
+				while (config_.keep > 0 && index_.size() > config_.keep)
+				{
+					if (config_.remove)
+					{
+						boost::system::error_code ec;
+						boost::filesystem::remove(directory_ / index_.front().name, ec);
+					}
+
+					index_.pop_front();
+				}
+
+				index_size_ = index_.size();
+
+				try
+				{
+					auto path		= index_path();
+					auto temporary	= path;
+					temporary += L".tmp";
+
+					{
+						boost::filesystem::ofstream file(temporary, std::ios::out | std::ios::trunc);
+						file << "# file\tstarted\tduration\tbytes\n";
+
+						for (auto& e : index_)
+							file << u8(e.name) << '\t' << e.started << '\t' << e.duration << '\t' << e.length << '\n';
+
+						if (!file.flush())
+							CASPAR_THROW_EXCEPTION(file_write_error() << msg_info("Failed to write segment index") << file_name_info(temporary.wstring()));
+					}
+
+					boost::filesystem::rename(temporary, path);
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+					++write_errors_;
+				}
+			}
+
+			std::wstring print() const
+			{
+				return L"recorder_consumer[" + url_ + L"]";
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"type", L"record");
+				info.add(L"url", url_);
+				info.add(L"format", u16(config_.format));
+				info.add(L"direct", direct_);
+
+				{
+					tbb::spin_mutex::scoped_lock lock(current_name_mutex_);
+					info.add(L"current-segment", current_name_);
+				}
+
+				info.add(L"packets-muxed", packets_muxed_);
+				info.add(L"segments-written", segments_written_);
+				info.add(L"segments-failed", segments_failed_);
+				info.add(L"bytes-written", bytes_written_);
+				info.add(L"blocks-in-flight", config_.blocks - static_cast<size_t>(std::max<std::ptrdiff_t>(free_blocks_.size(), 0)));
+				info.add(L"write-stalls", write_stalls_);
+				info.add(L"write-errors", write_errors_);
+				info.add(L"index-size", index_size_);
+
+				return info;
+			}
+		};
+
+		recorder_consumer::recorder_consumer(const std::shared_ptr<packetProducer>& producer, const std::wstring& url)
+			: impl_(new impl(producer, url))
+		{
+		}
+
+		recorder_consumer::~recorder_consumer()
+		{
+		}
+
+		std::wstring recorder_consumer::print() const
+		{
+			return impl_->print();
+		}
+
+		boost::property_tree::wptree recorder_consumer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "../../packetConsumer.h"
+#include "../../packetProducer.h"
+
+#include <common/memory.h>
+
+#include <memory>
+#include <string>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Records a packetProducer to a directory as a sequence of self contained
+		// segments that start on a video key frame, for a url of the form
+		// record://<directory>?segment=10&format=ts. Feed it a packet_hub
+		// subscription to record a stream that is also pushed elsewhere, TS
+		// recordings run it through bitstream_filter_producer like udp outputs.
+		//
+		// Segments are written through direct_file in large aligned blocks, which
+		// bypass the page cache where possible, by an io thread that also does
+		// the fdatasync when a segment is closed, so a slow disk only delays the
+		// io thread. Once all blocks are in flight the recording thread waits
+		// for one and a packet_hub subscription drops by its own policy.
+		//
+		// Query parameters of the url: segment (target duration in seconds,
+		// default 10, segments are cut at the first key frame after it and after
+		// a timeline discontinuity), format (ts or mp4, fragmented so a segment
+		// is readable while it is written), name (file name prefix, default
+		// segment), keep (segments listed in the rolling <name>.index file,
+		// default 360, 0 for all), delete (1 removes segments that leave the
+		// index), direct (0 disables unbuffered writes), block_size (bytes per
+		// write, a multiple of 4096, default 1 MiB) and blocks (default 8). Any
+		// other parameter is passed to the muxer.
+		//
+		// tools/recorder_check checks the segments of a recording against its
+		// index, their lengths and that TS segments are whole to the end.
+		class recorder_consumer : public packetConsumer
+		{
+		public:
+			recorder_consumer(const std::shared_ptr<packetProducer>& producer, const std::wstring& url);
+			virtual ~recorder_consumer();
+
+			std::wstring						print() const override;
+			boost::property_tree::wptree		info() const override;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,1236 @@
+#include "../StdAfx.h"
+
+#include "rtmp_client.h"
+
+#include <common/except.h>
+#include <common/log.h>
+#include <common/os/general_protection_fault.h>
+#include <common/os/tcp_stats.h>
+#include <common/param.h>
+
+#include <boost/asio.hpp>
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <random>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const size_t		OUT_CHUNK_SIZE		= 4096;
+		static const size_t		HANDSHAKE_SIZE		= 1536;
+		static const size_t		MAX_WRITE_BATCH		= 256 * 1024;
+		static const int		COMMAND_TIMEOUT		= 10;	// seconds
+		static const size_t		MAX_SEND_MARKS		= 4096;
+
+		enum chunk_stream_id
+		{
+			CS_CONTROL	= 2,
+			CS_COMMAND	= 3,
+			CS_AUDIO	= 4,
+			CS_DATA		= 5,
+			CS_VIDEO	= 6
+		};
+
+		enum message_type
+		{
+			MSG_SET_CHUNK_SIZE		= 1,
+			MSG_ABORT				= 2,
+			MSG_ACK					= 3,
+			MSG_USER_CONTROL		= 4,
+			MSG_WINDOW_ACK_SIZE		= 5,
+			MSG_SET_PEER_BANDWIDTH	= 6,
+			MSG_AUDIO				= 8,
+			MSG_VIDEO				= 9,
+			MSG_DATA_AMF0			= 18,
+			MSG_COMMAND_AMF0		= 20
+		};
+
+		static void put_be(std::vector<uint8_t>& out, uint64_t value, int bytes)
+		{
+			for (int i = bytes - 1; i >= 0; --i)
+				out.push_back(static_cast<uint8_t>(value >> (i * 8)));
+		}
+
+		static uint32_t get_be(const uint8_t* p, int bytes)
+		{
+			uint32_t value = 0;
+
+			for (int i = 0; i < bytes; ++i)
+				value = (value << 8) | p[i];
+
+			return value;
+		}
+
+		static int64_t now_ms()
+		{
+			return boost::chrono::duration_cast<boost::chrono::milliseconds>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		namespace amf0 {
+
+			void number(std::vector<uint8_t>& out, double value)
+			{
+				uint64_t bits;
+				std::memcpy(&bits, &value, sizeof(bits));
+				out.push_back(0x00);
+				put_be(out, bits, 8);
+			}
+
+			void boolean(std::vector<uint8_t>& out, bool value)
+			{
+				out.push_back(0x01);
+				out.push_back(value ? 1 : 0);
+			}
+
+			void key(std::vector<uint8_t>& out, const std::string& value)
+			{
+				put_be(out, value.size(), 2);
+				out.insert(out.end(), value.begin(), value.end());
+			}
+
+			void string(std::vector<uint8_t>& out, const std::string& value)
+			{
+				out.push_back(0x02);
+				key(out, value);
+			}
+
+			void null(std::vector<uint8_t>& out)
+			{
+				out.push_back(0x05);
+			}
+
+			void object_begin(std::vector<uint8_t>& out)
+			{
+				out.push_back(0x03);
+			}
+
+			void object_end(std::vector<uint8_t>& out)
+			{
+				put_be(out, 0x000009, 3);
+			}
+
+			// Decoded value. Object and array properties are flattened to strings,
+			// nested objects are skipped; commands do not need more.
+			struct value
+			{
+				int									type	= -1;
+				double								number	= 0.0;
+				std::string							string;
+				std::map<std::string, std::string>	object;
+			};
+
+			class reader
+			{
+				const uint8_t*	p_;
+				const uint8_t*	end_;
+			public:
+				reader(const uint8_t* data, size_t size)
+					: p_(data)
+					, end_(data + size)
+				{
+				}
+
+				bool read(value& v)
+				{
+					return read_value(v, 0);
+				}
+			private:
+				bool has(size_t n) const
+				{
+					return static_cast<size_t>(end_ - p_) >= n;
+				}
+
+				bool read_string(std::string& s, int length_bytes)
+				{
+					if (!has(length_bytes))
+						return false;
+
+					auto length = get_be(p_, length_bytes);
+					p_ += length_bytes;
+
+					if (!has(length))
+						return false;
+
+					s.assign(reinterpret_cast<const char*>(p_), length);
+					p_ += length;
+
+					return true;
+				}
+
+				bool read_properties(value& v, int depth)
+				{
+					while (true)
+					{
+						std::string name;
+
+						if (!read_string(name, 2))
+							return false;
+
+						if (name.empty() && has(1) && *p_ == 0x09)
+						{
+							++p_;
+							return true;
+						}
+
+						value property;
+
+						if (!read_value(property, depth + 1))
+							return false;
+
+						if (property.type == 0x00)
+							v.object[name] = boost::lexical_cast<std::string>(property.number);
+						else if (property.type == 0x01)
+							v.object[name] = property.number != 0.0 ? "true" : "false";
+						else if (property.type == 0x02 || property.type == 0x0C)
+							v.object[name] = property.string;
+					}
+				}
+
+				bool read_value(value& v, int depth)
+				{
+					if (!has(1) || depth > 8)
+						return false;
+
+					v.type = *p_++;
+
+					switch (v.type)
+					{
+					case 0x00: // number
+					{
+						if (!has(8))
+							return false;
+
+						uint64_t bits = (static_cast<uint64_t>(get_be(p_, 4)) << 32) | get_be(p_ + 4, 4);
+						std::memcpy(&v.number, &bits, sizeof(bits));
+						p_ += 8;
+						return true;
+					}
+					case 0x01: // boolean
+						if (!has(1))
+							return false;
+
+						v.number = *p_++ ? 1.0 : 0.0;
+						return true;
+					case 0x02: // string
+						return read_string(v.string, 2);
+					case 0x0C: // long string
+						return read_string(v.string, 4);
+					case 0x03: // object
+						return read_properties(v, depth);
+					case 0x08: // ecma array
+						if (!has(4))
+							return false;
+
+						p_ += 4;
+						return read_properties(v, depth);
+					case 0x0A: // strict array
+					{
+						if (!has(4))
+							return false;
+
+						auto count = get_be(p_, 4);
+						p_ += 4;
+
+						for (uint32_t i = 0; i < count; ++i)
+						{
+							value element;
+
+							if (!read_value(element, depth + 1))
+								return false;
+						}
+
+						return true;
+					}
+					case 0x0B: // date
+						if (!has(10))
+							return false;
+
+						p_ += 10;
+						return true;
+					case 0x05: // null
+					case 0x06: // undefined
+						return true;
+					default:
+						return false;
+					}
+				}
+			};
+		}
+
+		struct rtmp_client::impl : boost::noncopyable
+		{
+			struct message
+			{
+				std::vector<uint8_t>	header;			// Basic and type 0 message header of the first chunk.
+				std::array<uint8_t, 5>	continuation;	// Type 3 header of the following chunks.
+				size_t					continuation_size	= 1;
+				std::vector<uint8_t>	payload;
+				uint32_t				timestamp			= 0;
+				bool					media				= false;
+				frame_class				cls					= frame_class::metadata;
+
+				size_t size() const
+				{
+					auto chunks = std::max<size_t>((payload.size() + OUT_CHUNK_SIZE - 1) / OUT_CHUNK_SIZE, 1);
+
+					return header.size() + (chunks - 1) * continuation_size + payload.size();
+				}
+
+				bool is_video() const
+				{
+					return cls == frame_class::key_frame || cls == frame_class::reference_frame || cls == frame_class::non_reference_frame;
+				}
+			};
+
+			struct in_chunk_stream
+			{
+				uint32_t				timestamp	= 0;
+				uint32_t				delta		= 0;
+				uint32_t				length		= 0;
+				uint8_t					type		= 0;
+				uint32_t				stream_id	= 0;
+				bool					extended	= false;
+				bool					partial		= false;
+				std::vector<uint8_t>	payload;
+			};
+
+			const std::wstring								url_;
+			const overflow_policy							policy_;
+			const int64_t									max_queued_bytes_;
+			const int64_t									max_queued_ms_;
+			std::string										host_;
+			std::string										port_;
+			std::string										app_;
+			std::string										stream_;
+			std::string										tc_url_;
+
+			boost::asio::io_service							service_;
+			std::unique_ptr<boost::asio::io_service::work>	work_;
+			boost::asio::ip::tcp::socket					socket_;
+			boost::thread									io_thread_;
+
+			mutable boost::mutex							mutex_;
+			boost::condition_variable						state_changed_;
+			std::deque<message>								queue_;
+			int64_t											queued_bytes_			= 0;
+			bool											waiting_for_key_frame_	= false;
+			std::map<double, std::vector<amf0::value>>		results_;
+			std::string										publish_status_;
+			std::string										error_;
+			uint32_t										stream_id_				= 0;
+
+			// Only touched on the io thread.
+			bool											writing_				= false;
+			std::deque<message>								in_flight_;
+			std::vector<boost::asio::const_buffer>			write_buffers_;
+			std::deque<std::pair<uint64_t, int64_t>>		send_marks_;			// (bytes sent, time written)
+			std::array<uint8_t, 16 * 1024>					read_buffer_;
+			std::vector<uint8_t>							in_;
+			uint32_t										in_chunk_size_			= 128;
+			uint32_t										in_window_				= 0;
+			uint64_t										bytes_received_			= 0;
+			uint64_t										last_ack_sent_			= 0;
+			std::map<uint32_t, in_chunk_stream>				in_streams_;
+
+			tbb::atomic<bool>								connected_;
+			tbb::atomic<bool>								closing_;
+			tbb::atomic<uint64_t>							bytes_sent_;
+			tbb::atomic<uint64_t>							bytes_acknowledged_;
+			tbb::atomic<int64_t>							ack_delay_ms_;
+			tbb::atomic<uint64_t>							dropped_frames_;
+			tbb::atomic<uint64_t>							dropped_bytes_;
+			tbb::atomic<uint64_t>							dropped_non_reference_;
+			tbb::atomic<uint64_t>							key_frame_waits_;
+
+			impl(const std::wstring& url, overflow_policy policy, int64_t max_queued_bytes, int64_t max_queued_ms)
+				: url_(url)
+				, policy_(policy)
+				, max_queued_bytes_(max_queued_bytes)
+				, max_queued_ms_(max_queued_ms)
+				, work_(new boost::asio::io_service::work(service_))
+				, socket_(service_)
+			{
+				connected_				= false;
+				closing_				= false;
+				bytes_sent_				= 0;
+				bytes_acknowledged_		= 0;
+				ack_delay_ms_			= -1;
+				dropped_frames_			= 0;
+				dropped_bytes_			= 0;
+				dropped_non_reference_	= 0;
+				key_frame_waits_		= 0;
+
+				parse_url();
+
+				io_thread_ = boost::thread([this]
+				{
+					ensure_gpf_handler_installed_for_thread("rtmp-client-io");
+					service_.run();
+				});
+			}
+
+			~impl()
+			{
+				closing_	= true;
+				connected_	= false;
+
+				service_.post([this]
+				{
+					boost::system::error_code ec;
+					socket_.close(ec);
+				});
+
+				work_.reset();
+				state_changed_.notify_all();
+				io_thread_.join();
+			}
+
+			void parse_url()
+			{
+				auto parts = protocol_split(url_);
+
+				if (!boost::iequals(parts.at(0), L"rtmp"))
+					CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Not an rtmp url: " + url_));
+
+				auto rest		= u8(parts.at(1));
+				auto slash		= rest.find('/');
+				auto host_port	= rest.substr(0, slash);
+				auto path		= slash == std::string::npos ? std::string() : rest.substr(slash + 1);
+				auto app_end	= path.find('/');
+
+				if (app_end == std::string::npos || app_end == 0 || app_end + 1 == path.size())
+					CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Expected rtmp://host[:port]/app/stream, got " + url_));
+
+				auto colon	= host_port.rfind(':');
+				host_		= colon == std::string::npos ? host_port : host_port.substr(0, colon);
+				port_		= colon == std::string::npos ? "1935" : host_port.substr(colon + 1);
+				app_		= path.substr(0, app_end);
+				stream_		= path.substr(app_end + 1);
+				tc_url_		= "rtmp://" + host_port + "/" + app_;
+			}
+
+			// Connection setup
+
+			void wait(std::future<boost::system::error_code>& result, const char* step)
+			{
+				if (result.wait_for(std::chrono::seconds(COMMAND_TIMEOUT)) != std::future_status::ready)
+				{
+					service_.post([this]
+					{
+						boost::system::error_code ec;
+						socket_.close(ec);
+					});
+
+					result.wait();
+					CASPAR_THROW_EXCEPTION(timed_out() << msg_info(print() + L" Timed out during " + u16(step)));
+				}
+
+				auto ec = result.get();
+
+				if (ec)
+					CASPAR_THROW_EXCEPTION(io_error() << msg_info(print() + L" " + u16(step) + L" failed: " + u16(ec.message())));
+			}
+
+			void connect()
+			{
+				boost::asio::ip::tcp::resolver resolver(service_);
+				auto endpoints = resolver.resolve(boost::asio::ip::tcp::resolver::query(host_, port_));
+
+				{
+					auto promise = std::make_shared<std::promise<boost::system::error_code>>();
+					auto result = promise->get_future();
+
+					boost::asio::async_connect(socket_, endpoints, [promise](const boost::system::error_code& ec, boost::asio::ip::tcp::resolver::iterator)
+					{
+						promise->set_value(ec);
+					});
+
+					wait(result, "connect");
+				}
+
+				socket_.set_option(boost::asio::ip::tcp::no_delay(true));
+
+				handshake();
+
+				in_.reserve(read_buffer_.size());
+				service_.post([this] { start_read(); });
+
+				std::vector<uint8_t> chunk_size;
+				put_be(chunk_size, OUT_CHUNK_SIZE, 4);
+				enqueue_control(make_message(CS_CONTROL, MSG_SET_CHUNK_SIZE, 0, 0, std::move(chunk_size)));
+
+				std::vector<uint8_t> connect;
+				amf0::string(connect, "connect");
+				amf0::number(connect, 1);
+				amf0::object_begin(connect);
+				amf0::key(connect, "app");
+				amf0::string(connect, app_);
+				amf0::key(connect, "type");
+				amf0::string(connect, "nonprivate");
+				amf0::key(connect, "flashVer");
+				amf0::string(connect, "FMLE/3.0 (compatible; PushIPStream)");
+				amf0::key(connect, "tcUrl");
+				amf0::string(connect, tc_url_);
+				amf0::object_end(connect);
+				send_command(std::move(connect), 0);
+
+				auto connect_result = wait_for_result(1, "connect");
+
+				if (connect_result.at(0).string != "_result")
+					CASPAR_THROW_EXCEPTION(user_error() << msg_info(print() + L" Connect rejected: " + u16(describe(connect_result))));
+
+				// Not all servers answer releaseStream/FCPublish, so they are not waited for.
+				std::vector<uint8_t> release;
+				amf0::string(release, "releaseStream");
+				amf0::number(release, 2);
+				amf0::null(release);
+				amf0::string(release, stream_);
+				send_command(std::move(release), 0);
+
+				std::vector<uint8_t> fc_publish;
+				amf0::string(fc_publish, "FCPublish");
+				amf0::number(fc_publish, 3);
+				amf0::null(fc_publish);
+				amf0::string(fc_publish, stream_);
+				send_command(std::move(fc_publish), 0);
+
+				std::vector<uint8_t> create_stream;
+				amf0::string(create_stream, "createStream");
+				amf0::number(create_stream, 4);
+				amf0::null(create_stream);
+				send_command(std::move(create_stream), 0);
+
+				auto create_result = wait_for_result(4, "createStream");
+
+				if (create_result.at(0).string != "_result" || create_result.size() < 4 || create_result.at(3).type != 0x00)
+					CASPAR_THROW_EXCEPTION(user_error() << msg_info(print() + L" createStream rejected: " + u16(describe(create_result))));
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					stream_id_ = static_cast<uint32_t>(create_result.at(3).number);
+				}
+
+				std::vector<uint8_t> publish;
+				amf0::string(publish, "publish");
+				amf0::number(publish, 5);
+				amf0::null(publish);
+				amf0::string(publish, stream_);
+				amf0::string(publish, "live");
+				send_command(std::move(publish), stream_id_);
+
+				{
+					boost::unique_lock<boost::mutex> lock(mutex_);
+
+					if (!state_changed_.wait_for(lock, boost::chrono::seconds(COMMAND_TIMEOUT), [this] { return !publish_status_.empty() || !error_.empty(); }))
+						CASPAR_THROW_EXCEPTION(timed_out() << msg_info(print() + L" Timed out waiting for publish"));
+
+					if (publish_status_ != "NetStream.Publish.Start")
+						CASPAR_THROW_EXCEPTION(user_error() << msg_info(print() + L" Publish failed: " + u16(error_.empty() ? publish_status_ : error_)));
+				}
+
+				connected_ = true;
+
+				CASPAR_LOG(info) << print() << L" Publishing.";
+			}
+
+			void handshake()
+			{
+				// Plain (non digest) handshake, C0 + C1 then echo S1 as C2.
+				std::vector<uint8_t> c0c1(1 + HANDSHAKE_SIZE, 0);
+				c0c1[0] = 0x03;
+
+				std::mt19937 random(static_cast<uint32_t>(now_ms()));
+
+				for (size_t i = 9; i < c0c1.size(); ++i)
+					c0c1[i] = static_cast<uint8_t>(random());
+
+				write_blocking(c0c1, "handshake");
+
+				std::vector<uint8_t> s0s1s2(1 + 2 * HANDSHAKE_SIZE);
+				read_blocking(s0s1s2, "handshake");
+
+				if (s0s1s2[0] != 0x03)
+					CASPAR_THROW_EXCEPTION(io_error() << msg_info(print() + L" Unsupported rtmp version " + boost::lexical_cast<std::wstring>(static_cast<int>(s0s1s2[0]))));
+
+				std::vector<uint8_t> c2(s0s1s2.begin() + 1, s0s1s2.begin() + 1 + HANDSHAKE_SIZE);
+				write_blocking(c2, "handshake");
+			}
+
+			void write_blocking(const std::vector<uint8_t>& data, const char* step)
+			{
+				auto promise = std::make_shared<std::promise<boost::system::error_code>>();
+				auto result = promise->get_future();
+
+				boost::asio::async_write(socket_, boost::asio::buffer(data), [promise](const boost::system::error_code& ec, size_t)
+				{
+					promise->set_value(ec);
+				});
+
+				wait(result, step);
+
+				bytes_sent_ += data.size(); // Peers count the handshake in their acknowledgements.
+			}
+
+			void read_blocking(std::vector<uint8_t>& data, const char* step)
+			{
+				auto promise = std::make_shared<std::promise<boost::system::error_code>>();
+				auto result = promise->get_future();
+
+				boost::asio::async_read(socket_, boost::asio::buffer(data), [promise](const boost::system::error_code& ec, size_t)
+				{
+					promise->set_value(ec);
+				});
+
+				wait(result, step);
+			}
+
+			std::vector<amf0::value> wait_for_result(double transaction, const char* step)
+			{
+				boost::unique_lock<boost::mutex> lock(mutex_);
+
+				if (!state_changed_.wait_for(lock, boost::chrono::seconds(COMMAND_TIMEOUT), [&] { return results_.count(transaction) > 0 || !error_.empty(); }))
+					CASPAR_THROW_EXCEPTION(timed_out() << msg_info(print() + L" Timed out waiting for " + u16(step)));
+
+				if (!error_.empty())
+					CASPAR_THROW_EXCEPTION(io_error() << msg_info(print() + L" " + u16(step) + L" failed: " + u16(error_)));
+
+				auto result = std::move(results_[transaction]);
+				results_.erase(transaction);
+
+				return result;
+			}
+
+			static std::string describe(const std::vector<amf0::value>& command)
+			{
+				for (auto& v : command)
+				{
+					auto it = v.object.find("description");
+
+					if (it != v.object.end())
+						return it->second;
+
+					it = v.object.find("code");
+
+					if (it != v.object.end())
+						return it->second;
+				}
+
+				return command.empty() ? std::string() : command.front().string;
+			}
+
+			// Sending
+
+			static message make_message(uint32_t csid, uint8_t type, uint32_t timestamp, uint32_t stream_id, std::vector<uint8_t>&& payload)
+			{
+				message m;
+				auto extended = timestamp >= 0xFFFFFF;
+
+				m.header.reserve(16);
+				m.header.push_back(static_cast<uint8_t>(csid));	// fmt 0
+				put_be(m.header, extended ? 0xFFFFFF : timestamp, 3);
+				put_be(m.header, payload.size(), 3);
+				m.header.push_back(type);
+
+				for (int i = 0; i < 4; ++i)	// Little endian, unlike everything else.
+					m.header.push_back(static_cast<uint8_t>(stream_id >> (i * 8)));
+
+				if (extended)
+					put_be(m.header, timestamp, 4);
+
+				m.continuation[0] = static_cast<uint8_t>(0xC0 | csid);	// fmt 3
+
+				if (extended)
+				{
+					for (int i = 0; i < 4; ++i)
+						m.continuation[1 + i] = static_cast<uint8_t>(timestamp >> ((3 - i) * 8));
+
+					m.continuation_size = 5;
+				}
+
+				m.payload	= std::move(payload);
+				m.timestamp	= timestamp;
+
+				return m;
+			}
+
+			void send_command(std::vector<uint8_t>&& payload, uint32_t stream_id)
+			{
+				enqueue_control(make_message(CS_COMMAND, MSG_COMMAND_AMF0, 0, stream_id, std::move(payload)));
+			}
+
+			void enqueue_control(message&& m)
+			{
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					queued_bytes_ += m.size();
+					queue_.push_back(std::move(m));
+				}
+
+				service_.post([this] { start_write(); });
+			}
+
+			bool send(uint8_t type, uint32_t timestamp, std::vector<uint8_t>&& payload, frame_class cls)
+			{
+				if (!connected_)
+					return false;
+
+				auto csid = type == MSG_AUDIO ? CS_AUDIO : type == MSG_VIDEO ? CS_VIDEO : CS_DATA;
+				auto m = make_message(csid, type, timestamp, stream_id_, std::move(payload));
+				m.media	= true;
+				m.cls	= cls;
+
+				{
+					boost::unique_lock<boost::mutex> lock(mutex_);
+
+					if (policy_ == overflow_policy::block)
+					{
+						while (connected_ && over_limit())
+							state_changed_.wait_for(lock, boost::chrono::milliseconds(100));
+
+						if (!connected_)
+							return false;
+					}
+					else if (!admit(m))
+					{
+						++dropped_frames_;
+						dropped_bytes_ += m.payload.size();
+						return false;
+					}
+
+					queued_bytes_ += m.size();
+					queue_.push_back(std::move(m));
+
+					if (policy_ == overflow_policy::drop)
+						enforce_limits();
+				}
+
+				service_.post([this] { start_write(); });
+
+				return true;
+			}
+
+			bool admit(const message& m)
+			{
+				if (!waiting_for_key_frame_ || !m.is_video())
+					return true;
+
+				if (m.cls != frame_class::key_frame)
+					return false;
+
+				waiting_for_key_frame_ = false;
+
+				return true;
+			}
+
+			int64_t queued_ms() const
+			{
+				auto first = std::find_if(queue_.begin(), queue_.end(), [](const message& m) { return m.media; });
+
+				if (first == queue_.end())
+					return 0;
+
+				return static_cast<int64_t>(queue_.back().timestamp) - static_cast<int64_t>(first->timestamp);
+			}
+
+			bool over_limit() const
+			{
+				return queued_bytes_ > max_queued_bytes_ || queued_ms() > max_queued_ms_;
+			}
+
+			template<typename Predicate>
+			bool drop_first(Predicate predicate)
+			{
+				auto it = std::find_if(queue_.begin(), queue_.end(), predicate);
+
+				if (it == queue_.end())
+					return false;
+
+				drop(it);
+
+				return true;
+			}
+
+			std::deque<message>::iterator drop(std::deque<message>::iterator it)
+			{
+				++dropped_frames_;
+				dropped_bytes_	+= it->payload.size();
+				queued_bytes_	-= it->size();
+
+				return queue_.erase(it);
+			}
+
+			void enforce_limits()
+			{
+				while (over_limit())
+				{
+					// Nothing references a non-reference frame, so they go first.
+					if (drop_first([](const message& m) { return m.cls == frame_class::non_reference_frame; }))
+					{
+						++dropped_non_reference_;
+						continue;
+					}
+
+					// Then all queued video, and video stays off until the next key
+					// frame so the decoder never sees a frame with a missing reference.
+					auto dropped_video = false;
+
+					for (auto it = queue_.begin(); it != queue_.end();)
+					{
+						if (it->is_video())
+						{
+							it = drop(it);
+							dropped_video = true;
+						}
+						else
+							++it;
+					}
+
+					if (dropped_video)
+					{
+						waiting_for_key_frame_ = true;
+						++key_frame_waits_;
+						continue;
+					}
+
+					// Audio only as a last resort.
+					if (!drop_first([](const message& m) { return m.cls == frame_class::audio; }))
+						break;
+				}
+			}
+
+			void start_write()
+			{
+				if (writing_ || !socket_.is_open())
+					return;
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+
+					size_t batch = 0;
+
+					while (!queue_.empty() && batch < MAX_WRITE_BATCH)
+					{
+						batch			+= queue_.front().size();
+						queued_bytes_	-= queue_.front().size();
+						in_flight_.push_back(std::move(queue_.front()));
+						queue_.pop_front();
+					}
+				}
+
+				if (in_flight_.empty())
+					return;
+
+				state_changed_.notify_all();
+
+				write_buffers_.clear();
+
+				for (auto& m : in_flight_)
+				{
+					size_t offset = 0;
+					auto first = true;
+
+					do
+					{
+						auto n = std::min(OUT_CHUNK_SIZE, m.payload.size() - offset);
+
+						if (first)
+							write_buffers_.push_back(boost::asio::buffer(m.header));
+						else
+							write_buffers_.push_back(boost::asio::buffer(m.continuation.data(), m.continuation_size));
+
+						if (n > 0)
+							write_buffers_.push_back(boost::asio::buffer(m.payload.data() + offset, n));
+
+						offset	+= n;
+						first	= false;
+					} while (offset < m.payload.size());
+				}
+
+				writing_ = true;
+
+				boost::asio::async_write(socket_, write_buffers_, [this](const boost::system::error_code& ec, size_t bytes_written)
+				{
+					writing_ = false;
+					in_flight_.clear();
+
+					if (ec)
+					{
+						on_error(ec);
+						return;
+					}
+
+					bytes_sent_ += bytes_written;
+					send_marks_.push_back(std::make_pair(static_cast<uint64_t>(bytes_sent_), now_ms()));
+
+					if (send_marks_.size() > MAX_SEND_MARKS)
+						send_marks_.pop_front();
+
+					start_write();
+				});
+			}
+
+			// Receiving
+
+			void start_read()
+			{
+				socket_.async_read_some(boost::asio::buffer(read_buffer_), [this](const boost::system::error_code& ec, size_t bytes_read)
+				{
+					if (ec)
+					{
+						on_error(ec);
+						return;
+					}
+
+					in_.insert(in_.end(), read_buffer_.begin(), read_buffer_.begin() + bytes_read);
+					bytes_received_ += bytes_read;
+
+					try
+					{
+						parse_chunks();
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						on_error(boost::asio::error::make_error_code(boost::asio::error::invalid_argument));
+						return;
+					}
+
+					if (in_window_ > 0 && bytes_received_ - last_ack_sent_ >= in_window_)
+					{
+						std::vector<uint8_t> ack;
+						put_be(ack, static_cast<uint32_t>(bytes_received_), 4);
+						enqueue_control(make_message(CS_CONTROL, MSG_ACK, 0, 0, std::move(ack)));
+						last_ack_sent_ = bytes_received_;
+					}
+
+					start_read();
+				});
+			}
+
+			void parse_chunks()
+			{
+				static const size_t message_header_size[] = { 11, 7, 3, 0 };
+
+				size_t pos = 0;
+
+				while (true)
+				{
+					auto p		= in_.data() + pos;
+					auto avail	= in_.size() - pos;
+
+					if (avail < 1)
+						break;
+
+					auto fmt	= p[0] >> 6;
+					uint32_t csid = p[0] & 0x3f;
+					size_t used	= 1;
+
+					if (csid == 0)
+					{
+						if (avail < 2)
+							break;
+
+						csid = 64 + p[1];
+						used = 2;
+					}
+					else if (csid == 1)
+					{
+						if (avail < 3)
+							break;
+
+						csid = 64 + p[1] + p[2] * 256;
+						used = 3;
+					}
+
+					if (avail < used + message_header_size[fmt])
+						break;
+
+					auto& s		= in_streams_[csid];
+					auto h		= p + used;
+					uint32_t ts	= fmt <= 2 ? get_be(h, 3) : 0;
+					auto length	= fmt <= 1 ? get_be(h + 3, 3) : s.length;
+					auto type	= fmt <= 1 ? h[6] : s.type;
+					auto sid	= fmt == 0 ? static_cast<uint32_t>(h[7] | (h[8] << 8) | (h[9] << 16) | (h[10] << 24)) : s.stream_id;
+					used		+= message_header_size[fmt];
+
+					auto extended = fmt <= 2 ? ts == 0xFFFFFF : s.extended;
+
+					if (extended)
+					{
+						if (avail < used + 4)
+							break;
+
+						ts = get_be(p + used, 4);
+						used += 4;
+					}
+
+					auto starting	= !s.partial || fmt != 3;
+					auto have		= starting ? 0 : s.payload.size();
+					auto chunk		= std::min<size_t>(in_chunk_size_, length - have);
+
+					if (avail < used + chunk)
+						break;
+
+					if (starting)
+					{
+						if (fmt == 0)
+						{
+							s.timestamp	= ts;
+							s.delta		= 0;
+						}
+						else if (fmt == 3)
+							s.timestamp += s.delta;
+						else
+						{
+							s.delta		= ts;
+							s.timestamp	+= ts;
+						}
+
+						s.length	= length;
+						s.type		= type;
+						s.stream_id	= sid;
+						s.extended	= extended;
+						s.partial	= true;
+						s.payload.clear();
+					}
+
+					s.payload.insert(s.payload.end(), p + used, p + used + chunk);
+					pos += used + chunk;
+
+					if (s.payload.size() == s.length)
+					{
+						s.partial = false;
+						handle_message(s.type, s.payload);
+					}
+				}
+
+				in_.erase(in_.begin(), in_.begin() + pos);
+			}
+
+			void handle_message(uint8_t type, const std::vector<uint8_t>& payload)
+			{
+				switch (type)
+				{
+				case MSG_SET_CHUNK_SIZE:
+					if (payload.size() >= 4)
+						in_chunk_size_ = std::max<uint32_t>(get_be(payload.data(), 4) & 0x7fffffff, 1);
+					break;
+				case MSG_ABORT:
+					if (payload.size() >= 4)
+					{
+						auto& s = in_streams_[get_be(payload.data(), 4)];
+						s.partial = false;
+						s.payload.clear();
+					}
+					break;
+				case MSG_ACK:
+					if (payload.size() >= 4)
+						on_ack(get_be(payload.data(), 4));
+					break;
+				case MSG_USER_CONTROL:
+					if (payload.size() >= 6 && get_be(payload.data(), 2) == 6) // Ping request.
+					{
+						std::vector<uint8_t> pong;
+						put_be(pong, 7, 2);
+						pong.insert(pong.end(), payload.begin() + 2, payload.begin() + 6);
+						enqueue_control(make_message(CS_CONTROL, MSG_USER_CONTROL, 0, 0, std::move(pong)));
+					}
+					break;
+				case MSG_WINDOW_ACK_SIZE:
+					if (payload.size() >= 4)
+						in_window_ = get_be(payload.data(), 4);
+					break;
+				case MSG_COMMAND_AMF0:
+					on_command(payload);
+					break;
+				default:
+					break;
+				}
+			}
+
+			void on_ack(uint32_t sequence)
+			{
+				// The sequence number wraps at 32 bits, unwrap it against what was sent.
+				uint64_t sent	= bytes_sent_;
+				uint64_t behind	= static_cast<uint32_t>(static_cast<uint32_t>(sent) - sequence);
+				auto acked		= behind <= sent ? sent - behind : 0;
+				bytes_acknowledged_ = acked;
+
+				while (send_marks_.size() > 1 && send_marks_[1].first <= acked)
+					send_marks_.pop_front();
+
+				if (!send_marks_.empty() && send_marks_.front().first <= acked)
+					ack_delay_ms_ = now_ms() - send_marks_.front().second;
+			}
+
+			void on_command(const std::vector<uint8_t>& payload)
+			{
+				amf0::reader reader(payload.data(), payload.size());
+				std::vector<amf0::value> command;
+				amf0::value v;
+
+				while (reader.read(v))
+				{
+					command.push_back(std::move(v));
+					v = amf0::value();
+				}
+
+				if (command.size() < 2 || command[0].type != 0x02)
+					return;
+
+				auto& name = command[0].string;
+
+				if (name == "_result" || name == "_error")
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					results_[command[1].number] = command;
+				}
+				else if (name == "onStatus")
+				{
+					std::string code;
+					std::string level;
+
+					for (auto& arg : command)
+					{
+						auto it = arg.object.find("code");
+
+						if (it != arg.object.end())
+							code = it->second;
+
+						it = arg.object.find("level");
+
+						if (it != arg.object.end())
+							level = it->second;
+					}
+
+					if (connected_ && level == "error")
+						CASPAR_LOG(warning) << print() << L" " << u16(code) << L": " << u16(describe(command));
+
+					boost::lock_guard<boost::mutex> lock(mutex_);
+
+					if (code.find("NetStream.Publish.") == 0 && publish_status_.empty())
+					{
+						publish_status_ = code;
+
+						if (level == "error")
+							error_ = code + " " + describe(command);
+					}
+				}
+				else
+					return;
+
+				state_changed_.notify_all();
+			}
+
+			void on_error(const boost::system::error_code& ec)
+			{
+				if (!socket_.is_open()) // Already handled, this is an aborted operation.
+				{
+					connected_ = false;
+					return;
+				}
+
+				boost::system::error_code ignored;
+				socket_.close(ignored);
+
+				if (!closing_)
+					CASPAR_LOG(error) << print() << L" Connection lost: " << u16(ec.message());
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+
+					if (error_.empty())
+						error_ = ec.message();
+				}
+
+				connected_ = false;
+				state_changed_.notify_all();
+			}
+
+			std::intptr_t native_socket() const
+			{
+				return static_cast<std::intptr_t>(const_cast<boost::asio::ip::tcp::socket&>(socket_).native_handle());
+			}
+
+			statistics stats() const
+			{
+				statistics s;
+				s.connected				= connected_;
+				s.bytes_sent			= bytes_sent_;
+				s.bytes_acknowledged	= bytes_acknowledged_;
+				s.ack_delay_ms			= ack_delay_ms_;
+				s.dropped_frames		= dropped_frames_;
+				s.dropped_bytes			= dropped_bytes_;
+				s.dropped_non_reference	= dropped_non_reference_;
+				s.key_frame_waits		= key_frame_waits_;
+
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					s.queued_bytes	= queued_bytes_;
+					s.queued_ms		= queued_ms();
+				}
+
+				tcp_stats tcp;
+				read_tcp_stats(native_socket(), tcp);
+				s.rtt_us			= tcp.rtt_us;
+				s.socket_in_flight	= tcp.bytes_in_flight;
+				s.socket_unsent		= tcp.bytes_unsent;
+
+				return s;
+			}
+
+			std::wstring print() const
+			{
+				return L"rtmp_client[" + u16(tc_url_) + L"]";
+			}
+		};
+
+		rtmp_client::rtmp_client(const std::wstring& url, overflow_policy policy, int64_t max_queued_bytes, int64_t max_queued_ms)
+			: impl_(new impl(url, policy, max_queued_bytes, max_queued_ms))
+		{
+		}
+
+		rtmp_client::~rtmp_client()
+		{
+		}
+
+		void rtmp_client::connect()
+		{
+			impl_->connect();
+		}
+
+		bool rtmp_client::send(uint8_t type, uint32_t timestamp, std::vector<uint8_t>&& payload, frame_class cls)
+		{
+			return impl_->send(type, timestamp, std::move(payload), cls);
+		}
+
+		std::intptr_t rtmp_client::native_socket() const
+		{
+			return impl_->native_socket();
+		}
+
+		bool rtmp_client::is_connected() const
+		{
+			return impl_->connected_;
+		}
+
+		rtmp_client::statistics rtmp_client::stats() const
+		{
+			return impl_->stats();
+		}
+
+		std::wstring rtmp_client::print() const
+		{
+			return impl_->print();
+		}
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <common/memory.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Minimal RTMP publisher. Connects, handshakes and publishes synchronously,
+		// after which all socket I/O is asynchronous on a private io thread and
+		// send() only ever queues.
+		class rtmp_client : boost::noncopyable
+		{
+		public:
+			enum class frame_class
+			{
+				metadata,
+				sequence_header,
+				audio,
+				key_frame,
+				reference_frame,
+				non_reference_frame
+			};
+
+			enum class overflow_policy
+			{
+				block,	// send() waits for room, back-pressuring the caller.
+				drop	// Non-reference frames are dropped first, then video until the next key frame.
+			};
+
+			struct statistics
+			{
+				bool		connected;
+				int64_t		queued_bytes;
+				int64_t		queued_ms;				// Timestamp span of the queued media.
+				uint64_t	bytes_sent;				// Written to the socket.
+				uint64_t	bytes_acknowledged;		// Reported received by the peer.
+				int64_t		ack_delay_ms;			// Time from writing to peer acknowledgement, -1 if unknown.
+				int64_t		rtt_us;					// From the kernel, -1 if unavailable.
+				int64_t		socket_in_flight;
+				int64_t		socket_unsent;
+				uint64_t	dropped_frames;
+				uint64_t	dropped_bytes;
+				uint64_t	dropped_non_reference;
+				uint64_t	key_frame_waits;		// Times video was dropped until the next key frame.
+			};
+
+			rtmp_client(const std::wstring& url, overflow_policy policy, int64_t max_queued_bytes, int64_t max_queued_ms);
+			~rtmp_client();
+
+			// Blocks until publishing has started, throws on failure or timeout.
+			void			connect();
+
+			// Queues an FLV tag body as an RTMP message. Returns false if it was
+			// dropped, or if the connection has been lost.
+			bool			send(uint8_t type, uint32_t timestamp, std::vector<uint8_t>&& payload, frame_class cls);
+
+			// The connected socket, e.g. for pacing offload.
+			std::intptr_t	native_socket() const;
+			bool			is_connected() const;
+			statistics		stats() const;
+			std::wstring	print() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,380 @@
+#include "../StdAfx.h"
+
+#include "rtmp_consumer.h"
+#include "muxer.h"
+#include "rtmp_client.h"
+#include "traffic_shaper.h"
+
+#include "../packet_source.h"
+
+#include <common/except.h>
+#include <common/log.h>
+#include <common/os/general_protection_fault.h>
+#include <common/pacing_clock.h>
+#include <common/param.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+
+#include <array>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int64_t PACING_LEAD_MS		= 500;	// How far ahead of real time tags may be sent.
+		static const int64_t MAX_TIMESTAMP_GAP	= 1000;	// ms, larger jumps restart pacing.
+		static const int64_t MAX_PACING_LAG		= 1000;	// ms behind real time before pacing gives the time up.
+
+		enum flv_tag_type
+		{
+			FLV_AUDIO	= 8,
+			FLV_VIDEO	= 9,
+			FLV_SCRIPT	= 18
+		};
+
+		struct flv_tag
+		{
+			uint8_t					type;
+			uint32_t				timestamp;
+			std::vector<uint8_t>	data;
+		};
+
+		// Splits the byte stream of the flv muxer back into tags.
+		class flv_tag_reader
+		{
+			size_t					skip_			= 13;	// File header and PreviousTagSize0.
+			std::array<uint8_t, 11>	header_;
+			size_t					header_size_	= 0;
+			flv_tag					tag_;
+			size_t					data_size_		= 0;
+			size_t					trailer_size_	= 0;
+		public:
+			void push(const uint8_t* data, size_t size, std::vector<flv_tag>& tags)
+			{
+				while (size > 0)
+				{
+					size_t n = 0;
+
+					if (skip_ > 0)
+					{
+						n = std::min(skip_, size);
+						skip_ -= n;
+					}
+					else if (header_size_ < header_.size())
+					{
+						n = std::min(header_.size() - header_size_, size);
+						std::copy(data, data + n, header_.begin() + header_size_);
+						header_size_ += n;
+
+						if (header_size_ == header_.size())
+						{
+							tag_.type		= header_[0] & 0x1f;
+							tag_.timestamp	= (header_[4] << 16) | (header_[5] << 8) | header_[6] | (static_cast<uint32_t>(header_[7]) << 24);
+							tag_.data.resize((header_[1] << 16) | (header_[2] << 8) | header_[3]);
+							data_size_		= 0;
+							trailer_size_	= 0;
+						}
+					}
+					else if (data_size_ < tag_.data.size())
+					{
+						n = std::min(tag_.data.size() - data_size_, size);
+						std::copy(data, data + n, tag_.data.begin() + data_size_);
+						data_size_ += n;
+					}
+					else
+					{
+						n = std::min(4 - trailer_size_, size);	// PreviousTagSize
+						trailer_size_ += n;
+
+						if (trailer_size_ == 4)
+						{
+							tags.push_back(std::move(tag_));
+							tag_			= flv_tag();
+							header_size_	= 0;
+						}
+					}
+
+					data += n;
+					size -= n;
+				}
+			}
+		};
+
+		static bool is_reference_avc(const std::vector<uint8_t>& data)
+		{
+			// AVCVIDEOPACKET: codec byte, packet type, 24 bit composition time, then
+			// NAL units with 4 byte lengths as written by the flv muxer.
+			size_t pos = 5;
+			auto has_slice = false;
+
+			while (pos + 4 < data.size())
+			{
+				size_t length = (static_cast<size_t>(data[pos]) << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+				pos += 4;
+
+				if (length == 0 || pos + length > data.size())
+					break;
+
+				auto type		= data[pos] & 0x1f;
+				auto ref_idc	= (data[pos] >> 5) & 0x03;
+
+				if (type >= 1 && type <= 5)
+				{
+					if (ref_idc != 0)
+						return true;
+
+					has_slice = true;
+				}
+
+				pos += length;
+			}
+
+			return !has_slice;
+		}
+
+		static rtmp_client::frame_class classify(const flv_tag& tag)
+		{
+			if (tag.type == FLV_SCRIPT || tag.data.size() < 2)
+				return rtmp_client::frame_class::metadata;
+
+			if (tag.type == FLV_AUDIO)
+			{
+				auto is_aac = (tag.data[0] >> 4) == 10;
+
+				return is_aac && tag.data[1] == 0 ? rtmp_client::frame_class::sequence_header : rtmp_client::frame_class::audio;
+			}
+
+			auto frame_type = tag.data[0] >> 4;
+			auto is_avc		= (tag.data[0] & 0x0f) == 7;
+
+			if (is_avc && tag.data[1] != 1) // Sequence header or end of sequence.
+				return rtmp_client::frame_class::sequence_header;
+
+			if (frame_type == 1)
+				return rtmp_client::frame_class::key_frame;
+
+			if (frame_type == 3)
+				return rtmp_client::frame_class::non_reference_frame;
+
+			if (is_avc && !is_reference_avc(tag.data))
+				return rtmp_client::frame_class::non_reference_frame;
+
+			return rtmp_client::frame_class::reference_frame;
+		}
+
+		static rtmp_client::overflow_policy parse_policy(const std::vector<std::wstring>& params)
+		{
+			auto policy = get_param(L"POLICY", params, L"DROP");
+
+			if (boost::iequals(policy, L"BLOCK"))
+				return rtmp_client::overflow_policy::block;
+
+			if (boost::iequals(policy, L"DROP"))
+				return rtmp_client::overflow_policy::drop;
+
+			CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Unknown rtmp POLICY " + policy));
+		}
+
+		static pacing_clock::settings clock_settings()
+		{
+			pacing_clock::settings result;
+			result.lead		= PACING_LEAD_MS * 1000000;
+			result.max_gap	= MAX_TIMESTAMP_GAP * 1000000;
+			result.max_lag	= MAX_PACING_LAG * 1000000;
+			return result;
+		}
+
+		static traffic_shaper::settings shaper_settings(const std::vector<std::wstring>& params)
+		{
+			traffic_shaper::settings result;
+			result.rate		= get_param(L"RATE", params, static_cast<int64_t>(0)) * 1000;
+			result.burst	= get_param(L"BURST", params, static_cast<int64_t>(0));
+			result.nic		= get_param(L"NIC", params, std::wstring());
+			result.nic_rate	= get_param(L"NIC_RATE", params, static_cast<int64_t>(0)) * 1000;
+			result.offload	= contains_param(L"PACING_OFFLOAD", params);
+
+			if (result.rate < 0 || result.burst < 0 || result.nic_rate < 0)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Invalid rtmp RATE, BURST or NIC_RATE"));
+
+			return result;
+		}
+
+		struct rtmp_consumer::impl : boost::noncopyable
+		{
+			const std::wstring					url_;
+			rtmp_client							client_;
+			packet_source						source_;
+			flv_tag_reader						reader_;
+			std::vector<flv_tag>				tags_;
+			muxer								muxer_;
+
+			pacing_clock						clock_;
+			traffic_shaper						shaper_;
+
+			tbb::atomic<bool>					is_running_;
+			tbb::atomic<uint64_t>				tags_sent_;
+			tbb::atomic<uint64_t>				tags_dropped_;
+
+			boost::thread						thread_;
+
+			impl(const std::shared_ptr<packetProducer>& producer, const std::wstring& url, const std::vector<std::wstring>& params)
+				: url_(url)
+				, client_(url, parse_policy(params), get_param(L"MAX_QUEUE_KB", params, static_cast<int64_t>(8192)) * 1024, get_param(L"MAX_QUEUE_MS", params, static_cast<int64_t>(2000)))
+				, source_(producer)
+				, muxer_("flv", producer->context(), ffmpeg_options(), [this](const uint8_t* data, int size)
+				{
+					reader_.push(data, size, tags_);
+				})
+				, clock_(clock_settings())
+				, shaper_(shaper_settings(params))
+			{
+				is_running_		= true;
+				tags_sent_		= 0;
+				tags_dropped_	= 0;
+
+				client_.connect();
+
+				if (shaper_.offload(client_.native_socket()))
+					CASPAR_LOG(info) << print() << L" Output rate paced by the kernel.";
+
+				thread_ = boost::thread([this] { run(); });
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+				thread_.join();
+			}
+
+			void run()
+			{
+				ensure_gpf_handler_installed_for_thread("rtmp-consumer");
+
+				try
+				{
+					while (is_running_ && client_.is_connected())
+					{
+						std::shared_ptr<AVPacket> packet;
+
+						if (!source_.try_pop(packet))
+						{
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+							continue;
+						}
+
+						if (!packet->data)
+						{
+							if (packet->pos == -1) // End of input.
+								break;
+
+							continue;
+						}
+
+						muxer_.write(packet);
+						send_tags();
+					}
+
+					muxer_.close();
+					send_tags();
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				CASPAR_LOG(info) << print() << L" Stopped.";
+			}
+
+			void send_tags()
+			{
+				for (auto& tag : tags_)
+				{
+					auto cls = classify(tag);
+
+					if (tag.type == FLV_SCRIPT)
+					{
+						static const uint8_t set_data_frame[] = { 0x02, 0x00, 0x0D, '@', 's', 'e', 't', 'D', 'a', 't', 'a', 'F', 'r', 'a', 'm', 'e' };
+						tag.data.insert(tag.data.begin(), std::begin(set_data_frame), std::end(set_data_frame));
+					}
+					else
+						pace(tag.timestamp);
+
+					if (shaper_.enabled() && is_running_)
+						clock_.wait_until(shaper_.schedule(tag.data.size(), pacing_clock::now()));
+
+					if (client_.send(tag.type, tag.timestamp, std::move(tag.data), cls))
+						++tags_sent_;
+					else
+						++tags_dropped_;
+				}
+
+				tags_.clear();
+			}
+
+			// Files are demuxed faster than real time, so hold tags back to their
+			// timestamps (minus a lead) or the server would be flooded.
+			void pace(uint32_t timestamp)
+			{
+				if (is_running_)
+					clock_.wait_media(static_cast<int64_t>(timestamp) * 1000000);
+			}
+
+			std::wstring print() const
+			{
+				return L"rtmp_consumer[" + url_ + L"]";
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				auto stats = client_.stats();
+
+				boost::property_tree::wptree info;
+				info.add(L"type", L"rtmp");
+				info.add(L"url", url_);
+				info.add(L"connected", stats.connected);
+				info.add(L"tags-sent", tags_sent_);
+				info.add(L"tags-dropped", tags_dropped_);
+				info.add(L"queued-bytes", stats.queued_bytes);
+				info.add(L"queued-ms", stats.queued_ms);
+				info.add(L"bytes-sent", stats.bytes_sent);
+				info.add(L"bytes-acknowledged", stats.bytes_acknowledged);
+				info.add(L"ack-delay-ms", stats.ack_delay_ms);
+				info.add(L"rtt-us", stats.rtt_us);
+				info.add(L"socket-in-flight", stats.socket_in_flight);
+				info.add(L"socket-unsent", stats.socket_unsent);
+				info.add(L"dropped-frames", stats.dropped_frames);
+				info.add(L"dropped-bytes", stats.dropped_bytes);
+				info.add(L"dropped-non-reference", stats.dropped_non_reference);
+				info.add(L"key-frame-waits", stats.key_frame_waits);
+				info.add_child(L"pacing-clock", clock_.info());
+
+				if (shaper_.enabled())
+					info.add_child(L"shaping", shaper_.info());
+
+				return info;
+			}
+		};
+
+		rtmp_consumer::rtmp_consumer(const std::shared_ptr<packetProducer>& producer, const std::wstring& url, const std::vector<std::wstring>& params)
+			: impl_(new impl(producer, url, params))
+		{
+		}
+
+		rtmp_consumer::~rtmp_consumer()
+		{
+		}
+
+		std::wstring rtmp_consumer::print() const
+		{
+			return impl_->print();
+		}
+
+		boost::property_tree::wptree rtmp_consumer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
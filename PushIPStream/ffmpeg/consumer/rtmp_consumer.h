@@ -0,0 +1,38 @@
+#pragma once
+
+#include "../../packetConsumer.h"
+#include "../../packetProducer.h"
+
+#include <common/memory.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Remuxes a packetProducer to FLV and publishes it to an rtmp:// url.
+		// Socket writes never block the muxing thread; when the peer is slow the
+		// send queue is bounded by MAX_QUEUE_MS / MAX_QUEUE_KB and POLICY decides
+		// between dropping frames (DROP, default) and back-pressure (BLOCK).
+		// RATE (kbit/s) and BURST (bytes) cap the output with a traffic_shaper,
+		// NIC names an interface whose NIC_RATE (kbit/s) all outputs naming it
+		// share and PACING_OFFLOAD has the kernel pace RATE on the socket.
+		//
+		// tools/rtmp_test_server accepts the output on loopback and can read it
+		// slowly or stall, to try the overflow policies against a congested peer.
+		class rtmp_consumer : public packetConsumer
+		{
+		public:
+			rtmp_consumer(const std::shared_ptr<packetProducer>& producer, const std::wstring& url, const std::vector<std::wstring>& params);
+			virtual ~rtmp_consumer();
+
+			std::wstring						print() const override;
+			boost::property_tree::wptree		info() const override;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,176 @@
+#include "../StdAfx.h"
+
+#include "traffic_shaper.h"
+
+#include <common/os/socket_pacing.h>
+#include <common/token_bucket.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int64_t MIN_BURST = 12000; // bytes, a few datagrams.
+
+		static int64_t default_burst(int64_t rate)
+		{
+			return std::max(rate / 8 / 100, MIN_BURST);
+		}
+
+		// Buckets of interfaces live as long as an output uses them. A later output
+		// that sets a rate replaces the rate of the others.
+		static std::shared_ptr<token_bucket> nic_bucket(const std::wstring& name, int64_t rate)
+		{
+			static boost::mutex											mutex;
+			static std::map<std::wstring, std::weak_ptr<token_bucket>>	buckets;
+
+			boost::lock_guard<boost::mutex> lock(mutex);
+
+			auto bucket = buckets[name].lock();
+
+			if (!bucket)
+			{
+				bucket = std::make_shared<token_bucket>(rate, default_burst(rate));
+				buckets[name] = bucket;
+			}
+			else if (rate > 0)
+				bucket->set_rate(rate, default_burst(rate));
+
+			return bucket;
+		}
+
+		struct traffic_shaper::impl : boost::noncopyable
+		{
+			const settings					settings_;
+			token_bucket					bucket_;
+			std::shared_ptr<token_bucket>	nic_;
+
+			tbb::atomic<bool>				offloaded_;
+			tbb::atomic<uint64_t>			sends_;
+			tbb::atomic<uint64_t>			bytes_;
+			tbb::atomic<uint64_t>			delayed_;
+			tbb::atomic<int64_t>			delay_sum_;
+			tbb::atomic<int64_t>			delay_max_;
+			tbb::atomic<int64_t>			delay_last_;
+
+			impl(const settings& settings)
+				: settings_(settings)
+				, bucket_(settings.rate, settings.burst > 0 ? settings.burst : default_burst(settings.rate))
+			{
+				if (!settings_.nic.empty())
+					nic_ = nic_bucket(settings_.nic, settings_.nic_rate);
+
+				offloaded_	= false;
+				sends_		= 0;
+				bytes_		= 0;
+				delayed_	= 0;
+				delay_sum_	= 0;
+				delay_max_	= 0;
+				delay_last_	= 0;
+			}
+
+			bool offload(std::intptr_t native_socket)
+			{
+				if (!settings_.offload || settings_.rate == 0)
+					return false;
+
+				offloaded_ = set_socket_pacing_rate(native_socket, static_cast<uint64_t>(settings_.rate / 8));
+
+				return offloaded_;
+			}
+
+			int64_t schedule(std::size_t size, int64_t deadline)
+			{
+				auto result = offloaded_ ? deadline : bucket_.reserve(size, deadline);
+
+				if (nic_)
+					result = nic_->reserve(size, result);
+
+				auto delay = result - deadline;
+
+				++sends_;
+				bytes_ += size;
+				delay_last_ = delay;
+
+				if (delay > 0)
+				{
+					++delayed_;
+					delay_sum_ += delay;
+
+					for (auto max = delay_max_.load(); delay > max; max = delay_max_.load())
+					{
+						if (delay_max_.compare_and_swap(delay, max) == max)
+							break;
+					}
+				}
+
+				return result;
+			}
+
+			bool enabled() const
+			{
+				return settings_.rate > 0 || nic_;
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"rate-kbps", settings_.rate / 1000);
+				info.add(L"offloaded", offloaded_);
+
+				if (nic_)
+				{
+					info.add(L"nic", settings_.nic);
+					info.add(L"nic-rate-kbps", nic_->rate() / 1000);
+				}
+
+				uint64_t delayed = delayed_;
+
+				info.add(L"sends", sends_);
+				info.add(L"bytes", bytes_);
+				info.add(L"delayed-sends", delayed);
+				info.add(L"delay-mean-us", delayed > 0 ? static_cast<double>(delay_sum_) / static_cast<double>(delayed) / 1000.0 : 0.0);
+				info.add(L"delay-max-us", static_cast<double>(delay_max_) / 1000.0);
+				info.add(L"delay-us", static_cast<double>(delay_last_) / 1000.0);
+
+				return info;
+			}
+		};
+
+		traffic_shaper::traffic_shaper(const settings& settings)
+			: impl_(new impl(settings))
+		{
+		}
+
+		traffic_shaper::~traffic_shaper()
+		{
+		}
+
+		bool traffic_shaper::offload(std::intptr_t native_socket)
+		{
+			return impl_->offload(native_socket);
+		}
+
+		int64_t traffic_shaper::schedule(std::size_t bytes, int64_t deadline)
+		{
+			return impl_->schedule(bytes, deadline);
+		}
+
+		bool traffic_shaper::enabled() const
+		{
+			return impl_->enabled();
+		}
+
+		boost::property_tree::wptree traffic_shaper::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
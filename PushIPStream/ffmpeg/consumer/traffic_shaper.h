@@ -0,0 +1,56 @@
+#pragma once
+
+#include <common/memory.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Keeps an output under a bitrate of its own and, together with every
+		// other output naming the same interface, under the rate of that
+		// interface, so file sources pushed faster than real time and key frame
+		// bursts do not overflow receivers or a shared uplink.
+		//
+		// Both limits are token buckets, the output's chained to the interface's.
+		// schedule() returns when a send conforms to both and the output waits
+		// for it on its pacing_clock, the extra queueing delay that adds is
+		// reported by info(). The output rate can be offloaded to the kernel
+		// (SO_MAX_PACING_RATE), the interface rate spans sockets and stays in
+		// user space.
+		class traffic_shaper : boost::noncopyable
+		{
+		public:
+			struct settings
+			{
+				int64_t			rate			= 0;	// bit/s of this output, 0 for unlimited.
+				int64_t			burst			= 0;	// bytes, 0 for 10 ms at the rate.
+				std::wstring	nic;					// Outputs naming the same interface share its rate.
+				int64_t			nic_rate		= 0;	// bit/s, 0 keeps the rate other outputs set.
+				bool			offload			= false;
+			};
+
+			explicit traffic_shaper(const settings& settings);
+			~traffic_shaper();
+
+			// Tries to have the kernel pace native_socket at the output rate. If
+			// it does, schedule() only applies the interface rate.
+			bool							offload(std::intptr_t native_socket);
+
+			// Takes bytes to be sent at deadline (ns, pacing_clock) from the buckets
+			// and returns when they may be sent.
+			int64_t							schedule(std::size_t bytes, int64_t deadline);
+
+			bool							enabled() const;
+			boost::property_tree::wptree	info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
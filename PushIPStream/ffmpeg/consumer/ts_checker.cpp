@@ -0,0 +1,389 @@
+#include "../StdAfx.h"
+
+#include "ts_checker.h"
+
+#include "../util/crc32.h"
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int		TS_PACKET_SIZE			= 188;
+		static const int		NULL_PID				= 0x1FFF;
+		static const int64_t	CLOCK					= 27000000;
+		static const int64_t	PCR_WRAP				= (int64_t(1) << 33) * 300;
+		static const int		PCR_BYTE_OFFSET			= 10;
+		static const int64_t	MAX_PSI_INTERVAL		= CLOCK / 2;
+		static const int64_t	MAX_PCR_INTERVAL		= CLOCK / 25;
+		static const int64_t	MAX_PCR_DISCONTINUITY	= CLOCK / 10;
+		static const int64_t	MAX_PCR_INACCURACY		= 14;	// 27 MHz ticks, just over 500 ns.
+		static const int64_t	MAX_PTS_INTERVAL		= CLOCK * 7 / 10;
+		static const int64_t	MAX_PID_ABSENCE			= CLOCK * 5;
+
+		struct ts_checker::impl : boost::noncopyable
+		{
+			struct pid_state
+			{
+				int			cc				= -1;
+				int64_t		last_seen		= -1;
+				int64_t		last_psi		= -1;
+				int64_t		last_pts		= -1;
+				int			stream_type		= -1;	// Set for pids referenced by a PMT.
+				bool		is_pmt			= false;
+			};
+
+			const int64_t				mux_rate_;
+			mutable tbb::spin_mutex		mutex_;
+
+			std::vector<pid_state>		pids_;
+			uint8_t						partial_[TS_PACKET_SIZE];
+			int							partial_size_				= 0;
+			bool						synced_						= true;
+			int64_t						position_					= 0;
+
+			int							pcr_pid_					= -1;
+			bool						has_pcr_					= false;
+			int64_t						first_pcr_					= 0;	// Unwrapped.
+			int64_t						first_pcr_position_			= 0;
+			int64_t						last_pcr_					= 0;	// Unwrapped.
+			int64_t						last_pcr_time_				= 0;
+
+			uint64_t					packets_					= 0;
+			uint64_t					sync_errors_				= 0;
+			uint64_t					transport_errors_			= 0;
+			uint64_t					continuity_errors_			= 0;
+			uint64_t					pat_errors_					= 0;
+			uint64_t					pmt_errors_					= 0;
+			uint64_t					crc_errors_					= 0;
+			uint64_t					pid_errors_					= 0;
+			uint64_t					pcr_repetition_errors_		= 0;
+			uint64_t					pcr_discontinuity_errors_	= 0;
+			uint64_t					pcr_accuracy_errors_		= 0;
+			uint64_t					pts_errors_					= 0;
+			int64_t						max_pcr_interval_			= 0;
+			int64_t						max_pcr_inaccuracy_			= 0;
+
+			explicit impl(int64_t mux_rate)
+				: mux_rate_(mux_rate)
+				, pids_(NULL_PID + 1)
+			{
+			}
+
+			int64_t clock_at(int64_t position) const
+			{
+				return mux_rate_ > 0 ? av_rescale(position * 8, CLOCK, mux_rate_) : last_pcr_;
+			}
+
+			void push(const uint8_t* data, size_t size)
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				while (size > 0)
+				{
+					if (partial_size_ == 0)
+					{
+						if (*data != 0x47)
+						{
+							if (synced_)
+								++sync_errors_;
+
+							synced_ = false;
+							++data;
+							--size;
+							++position_;
+							continue;
+						}
+
+						synced_ = true;
+
+						if (size >= TS_PACKET_SIZE)
+						{
+							on_packet(data);
+							data		+= TS_PACKET_SIZE;
+							size		-= TS_PACKET_SIZE;
+							position_	+= TS_PACKET_SIZE;
+							continue;
+						}
+					}
+
+					auto n = std::min<size_t>(size, TS_PACKET_SIZE - partial_size_);
+					std::memcpy(partial_ + partial_size_, data, n);
+					partial_size_	+= static_cast<int>(n);
+					data			+= n;
+					size			-= n;
+
+					if (partial_size_ == TS_PACKET_SIZE)
+					{
+						on_packet(partial_);
+						partial_size_	= 0;
+						position_		+= TS_PACKET_SIZE;
+					}
+				}
+			}
+
+			void on_packet(const uint8_t* p)
+			{
+				++packets_;
+
+				if (p[1] & 0x80)
+					++transport_errors_;
+
+				auto pid	= ((p[1] & 0x1F) << 8) | p[2];
+				auto pusi	= (p[1] & 0x40) != 0;
+				auto afc	= (p[3] >> 4) & 0x03;
+				auto cc		= p[3] & 0x0F;
+				auto now	= clock_at(position_);
+
+				if (pid == NULL_PID)
+					return;
+
+				auto& state				= pids_[pid];
+				auto discontinuity		= false;
+				auto payload			= 4;
+
+				state.last_seen = now;
+
+				if (afc & 0x02)
+				{
+					auto length = p[4];
+					payload += 1 + length;
+
+					if (length > 0)
+					{
+						discontinuity = (p[5] & 0x80) != 0;
+
+						if ((p[5] & 0x10) && length >= 7)
+							on_pcr(pid, p + 6, discontinuity);
+					}
+				}
+
+				if (state.cc >= 0 && !discontinuity)
+				{
+					// A payload packet advances the counter (one duplicate is allowed),
+					// an adaptation field only packet repeats it.
+					auto ok = afc & 0x01 ? cc == ((state.cc + 1) & 0x0F) || cc == state.cc : cc == state.cc;
+
+					if (!ok)
+						++continuity_errors_;
+				}
+
+				state.cc = cc;
+
+				if (!(afc & 0x01) || payload >= TS_PACKET_SIZE || !pusi)
+					return;
+
+				if (pid == 0 || state.is_pmt)
+					on_section(pid, p + payload, TS_PACKET_SIZE - payload, now);
+				else if (state.stream_type >= 0)
+					on_pes(state, p + payload, TS_PACKET_SIZE - payload, now);
+			}
+
+			void on_pcr(int pid, const uint8_t* p, bool discontinuity)
+			{
+				auto base	= (static_cast<int64_t>(p[0]) << 25) | (p[1] << 17) | (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+				auto pcr	= base * 300 + (((p[4] & 0x01) << 8) | p[5]);
+				auto offset	= position_ + PCR_BYTE_OFFSET;
+
+				if (pid != pcr_pid_ && pcr_pid_ >= 0)
+					return;
+
+				if (!has_pcr_ || discontinuity)
+				{
+					has_pcr_			= true;
+					first_pcr_			= pcr;
+					first_pcr_position_	= offset;
+					last_pcr_			= pcr;
+					last_pcr_time_		= clock_at(offset);
+					return;
+				}
+
+				auto delta		= ((pcr - last_pcr_) % PCR_WRAP + PCR_WRAP) % PCR_WRAP;
+				auto interval	= mux_rate_ > 0 ? clock_at(offset) - last_pcr_time_ : delta;
+
+				max_pcr_interval_ = std::max(max_pcr_interval_, interval);
+
+				if (interval > MAX_PCR_INTERVAL)
+					++pcr_repetition_errors_;
+
+				if (delta > MAX_PCR_DISCONTINUITY)
+				{
+					++pcr_discontinuity_errors_;
+					first_pcr_			= last_pcr_ + delta;
+					first_pcr_position_	= offset;
+				}
+
+				last_pcr_		+= delta;
+				last_pcr_time_	= clock_at(offset);
+
+				if (mux_rate_ > 0)
+				{
+					auto expected	= first_pcr_ + av_rescale((offset - first_pcr_position_) * 8, CLOCK, mux_rate_);
+					auto error		= std::abs(last_pcr_ - expected);
+
+					max_pcr_inaccuracy_ = std::max(max_pcr_inaccuracy_, error);
+
+					if (error > MAX_PCR_INACCURACY)
+						++pcr_accuracy_errors_;
+				}
+			}
+
+			void on_section(int pid, const uint8_t* p, int size, int64_t now)
+			{
+				auto pointer = p[0];
+
+				if (1 + pointer + 3 > size)
+					return;
+
+				auto section	= p + 1 + pointer;
+				auto table_id	= section[0];
+				auto length		= 3 + (((section[1] & 0x0F) << 8) | section[2]);
+				auto& state		= pids_[pid];
+
+				if (pid == 0 ? table_id != 0x00 : table_id != 0x02)
+				{
+					++(pid == 0 ? pat_errors_ : pmt_errors_);
+					return;
+				}
+
+				if (state.last_psi >= 0 && now - state.last_psi > MAX_PSI_INTERVAL)
+					++(pid == 0 ? pat_errors_ : pmt_errors_);
+
+				state.last_psi = now;
+
+				if (1 + pointer + length > size) // Spans packets, only single packet sections are verified.
+					return;
+
+				if (length < 12 || crc32_mpeg2(section, length) != 0)
+				{
+					++crc_errors_;
+					return;
+				}
+
+				if (pid == 0)
+				{
+					for (auto q = section + 8; q + 4 <= section + length - 4; q += 4)
+					{
+						auto program	= (q[0] << 8) | q[1];
+						auto pmt_pid	= ((q[2] & 0x1F) << 8) | q[3];
+
+						if (program != 0)
+							pids_[pmt_pid].is_pmt = true;
+					}
+				}
+				else
+					on_pmt(section, length, now);
+			}
+
+			void on_pmt(const uint8_t* section, int length, int64_t now)
+			{
+				pcr_pid_ = ((section[8] & 0x1F) << 8) | section[9];
+
+				auto info_length	= ((section[10] & 0x0F) << 8) | section[11];
+				auto q				= section + 12 + info_length;
+				auto end			= section + length - 4;
+
+				while (q + 5 <= end)
+				{
+					auto type	= q[0];
+					auto pid	= ((q[1] & 0x1F) << 8) | q[2];
+					auto& es	= pids_[pid];
+
+					if (es.stream_type < 0)
+						es.last_seen = now;
+					else if (now - es.last_seen > MAX_PID_ABSENCE)
+					{
+						++pid_errors_;
+						es.last_seen = now;
+					}
+
+					es.stream_type = type;
+					q += 5 + (((q[3] & 0x0F) << 8) | q[4]);
+				}
+			}
+
+			void on_pes(pid_state& state, const uint8_t* p, int size, int64_t now)
+			{
+				if (size < 9 || p[0] != 0 || p[1] != 0 || p[2] != 1)
+					return;
+
+				switch (state.stream_type)
+				{
+				case 0x01: case 0x02: case 0x1B: case 0x24:			// Video.
+				case 0x03: case 0x04: case 0x0F: case 0x11:			// Audio, private streams may be sparse.
+					break;
+				default:
+					return;
+				}
+
+				if (!(p[7] & 0x80))
+					return;
+
+				if (state.last_pts >= 0 && now - state.last_pts > MAX_PTS_INTERVAL)
+					++pts_errors_;
+
+				state.last_pts = now;
+			}
+
+			uint64_t errors() const
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				return sync_errors_ + transport_errors_ + continuity_errors_ + pat_errors_ + pmt_errors_ + crc_errors_ + pid_errors_
+						+ pcr_repetition_errors_ + pcr_discontinuity_errors_ + pcr_accuracy_errors_ + pts_errors_;
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				boost::property_tree::wptree info;
+				info.add(L"packets", packets_);
+				info.add(L"sync-errors", sync_errors_);
+				info.add(L"transport-errors", transport_errors_);
+				info.add(L"continuity-errors", continuity_errors_);
+				info.add(L"pat-errors", pat_errors_);
+				info.add(L"pmt-errors", pmt_errors_);
+				info.add(L"crc-errors", crc_errors_);
+				info.add(L"pid-errors", pid_errors_);
+				info.add(L"pcr-repetition-errors", pcr_repetition_errors_);
+				info.add(L"pcr-discontinuity-errors", pcr_discontinuity_errors_);
+				info.add(L"pcr-accuracy-errors", pcr_accuracy_errors_);
+				info.add(L"pts-errors", pts_errors_);
+				info.add(L"max-pcr-interval-ms", static_cast<double>(max_pcr_interval_) * 1000.0 / CLOCK);
+
+				if (mux_rate_ > 0)
+					info.add(L"max-pcr-inaccuracy-ns", static_cast<double>(max_pcr_inaccuracy_) * 1000000000.0 / CLOCK);
+
+				return info;
+			}
+		};
+
+		ts_checker::ts_checker(int64_t mux_rate)
+			: impl_(new impl(mux_rate))
+		{
+		}
+
+		void ts_checker::push(const uint8_t* data, size_t size)
+		{
+			impl_->push(data, size);
+		}
+
+		uint64_t ts_checker::errors() const
+		{
+			return impl_->errors();
+		}
+
+		boost::property_tree::wptree ts_checker::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <common/memory.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Checks an MPEG-TS byte stream against the ETSI TR 101 290 priority 1
+		// and 2 indicators a muxer is responsible for: sync, continuity counters,
+		// PAT/PMT presence, interval and CRC, referenced pids, PCR repetition,
+		// discontinuity and accuracy, and PTS repetition.
+		//
+		// Intervals are measured on the stream's own clock, the byte position at
+		// mux_rate when it is known, otherwise the last PCR. PCR accuracy is only
+		// checked with a known mux_rate. Thread safe.
+		class ts_checker : boost::noncopyable
+		{
+		public:
+			explicit ts_checker(int64_t mux_rate = 0);
+
+			void							push(const uint8_t* data, size_t size);
+
+			uint64_t						errors() const;
+			boost::property_tree::wptree	info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,778 @@
+#include "../StdAfx.h"
+
+#include "ts_muxer.h"
+
+#include "../ffmpeg_error.h"
+#include "../util/crc32.h"
+
+#include <common/except.h>
+#include <common/log.h>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int		TS_PACKET_SIZE		= 188;
+		static const int		NULL_PID			= 0x1FFF;
+		static const int64_t	CLOCK				= 27000000;
+		static const int64_t	PTS_MASK			= (int64_t(1) << 33) - 1;
+		static const int		PCR_BYTE_OFFSET		= 10;	// Byte holding the last bit of program_clock_reference_base.
+		static const int64_t	MAX_FORWARD_JUMP	= 10 * CLOCK;
+		static const int64_t	MAX_BACKWARD_JUMP	= CLOCK;
+
+		// Gathers the parts of a PES packet (header, data, trailer) so they can be
+		// copied straight into transport packets.
+		class pes_reader
+		{
+			std::array<std::pair<const uint8_t*, size_t>, 4>	parts_;
+			size_t												count_		= 0;
+			size_t												current_	= 0;
+			size_t												offset_		= 0;
+			size_t												remaining_	= 0;
+		public:
+			void add(const uint8_t* data, size_t size)
+			{
+				if (size == 0)
+					return;
+
+				parts_.at(count_++) = std::make_pair(data, size);
+				remaining_ += size;
+			}
+
+			size_t remaining() const
+			{
+				return remaining_;
+			}
+
+			void read(uint8_t* dest, size_t size)
+			{
+				remaining_ -= size;
+
+				while (size > 0)
+				{
+					auto& part	= parts_[current_];
+					auto n		= std::min(size, part.second - offset_);
+
+					std::memcpy(dest, part.first + offset_, n);
+					dest	+= n;
+					size	-= n;
+					offset_	+= n;
+
+					if (offset_ == part.second)
+					{
+						++current_;
+						offset_ = 0;
+					}
+				}
+			}
+		};
+
+		struct ts_muxer::impl : boost::noncopyable
+		{
+			struct stream
+			{
+				int						input_index;
+				int						pid;
+				AVCodecID				codec_id;
+				AVRational				time_base;
+				uint8_t					stream_type;
+				uint8_t					stream_id;
+				std::vector<uint8_t>	descriptors;
+				uint8_t					cc					= 0;
+				bool					is_video			= false;
+				bool					adts				= false;	// Raw AAC needing an ADTS header.
+				std::array<uint8_t, 7>	adts_header;
+				bool					warned				= false;
+				int64_t					last_dts			= AV_NOPTS_VALUE;	// Input timeline, 27 MHz.
+			};
+
+			const std::shared_ptr<AVFormatContext>	input_;
+			const write_func						write_;
+
+			int64_t									mux_rate_			= 0;
+			int64_t									mux_delay_			= CLOCK * 7 / 10;
+			int64_t									pcr_period_			= CLOCK / 50;
+			int64_t									psi_period_			= CLOCK / 10;
+			int										transport_stream_id_	= 1;
+			int										service_id_			= 1;
+			int										pmt_pid_			= 0x1000;
+			int										first_pid_			= 0x100;
+
+			std::vector<stream>						streams_;
+			std::vector<int>						stream_map_;
+			int										pcr_pid_			= -1;
+
+			std::array<uint8_t, TS_PACKET_SIZE>		pat_packet_;
+			std::array<uint8_t, TS_PACKET_SIZE>		pmt_packet_;
+			std::array<uint8_t, TS_PACKET_SIZE>		null_packet_;
+			uint8_t									pat_cc_				= 0;
+			uint8_t									pmt_cc_				= 0;
+			uint8_t									pcr_cc_				= 0;	// Shared with the pcr stream if it has one.
+
+			std::vector<uint8_t>					output_;
+			std::vector<uint8_t>					pes_header_;
+			std::vector<uint8_t>					prefix_;
+			int64_t									bytes_				= 0;	// Output position.
+			bool									started_			= false;
+			bool									discontinuity_		= false;
+			int64_t									ts_offset_			= 0;	// Input timeline to output clock, 27 MHz.
+			int64_t									next_dts_			= 0;	// End of the last packet on the output clock.
+			int64_t									last_pcr_			= 0;
+			int64_t									last_psi_			= 0;
+			bool									closed_				= false;
+
+			tbb::atomic<uint64_t>					ts_packets_;
+			tbb::atomic<uint64_t>					null_packets_;
+			tbb::atomic<uint64_t>					pes_packets_;
+			tbb::atomic<uint64_t>					pcr_count_;
+			tbb::atomic<uint64_t>					late_packets_;
+			tbb::atomic<uint64_t>					discontinuities_;
+			tbb::atomic<int64_t>					max_lag_;	// How far the output clock fell behind a dts, 27 MHz.
+
+			impl(const std::shared_ptr<AVFormatContext>& input, const ffmpeg_options& options, const write_func& write)
+				: input_(input)
+				, write_(write)
+				, stream_map_(input->nb_streams, -1)
+			{
+				ts_packets_			= 0;
+				null_packets_		= 0;
+				pes_packets_		= 0;
+				pcr_count_			= 0;
+				late_packets_		= 0;
+				discontinuities_	= 0;
+				max_lag_			= 0;
+
+				parse_options(options);
+
+				if (mux_rate_ <= 0)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"muxrate is required by " + print()));
+
+				for (unsigned int i = 0; i < input_->nb_streams; ++i)
+					add_stream(i);
+
+				if (streams_.empty())
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"No streams to mux in " + print()));
+
+				auto video = std::find_if(streams_.begin(), streams_.end(), [](const stream& s) { return s.is_video; });
+				pcr_pid_ = (video != streams_.end() ? *video : streams_.front()).pid;
+
+				build_pat();
+				build_pmt();
+
+				null_packet_.fill(0xFF);
+				null_packet_[0] = 0x47;
+				null_packet_[1] = NULL_PID >> 8;
+				null_packet_[2] = NULL_PID & 0xFF;
+				null_packet_[3] = 0x10;
+
+				last_pcr_ = last_psi_ = -std::max(pcr_period_, psi_period_);
+			}
+
+			~impl()
+			{
+				try
+				{
+					close();
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+			}
+
+			void parse_options(const ffmpeg_options& options)
+			{
+				for (auto& option : options)
+				{
+					auto& key	= option.first;
+					auto& value	= option.second;
+
+					try
+					{
+						if (key == "muxrate")
+							mux_rate_ = boost::lexical_cast<int64_t>(value);
+						else if (key == "muxdelay")
+							mux_delay_ = static_cast<int64_t>(boost::lexical_cast<double>(value) * CLOCK);
+						else if (key == "pcr_period")
+							pcr_period_ = boost::lexical_cast<int64_t>(value) * (CLOCK / 1000);
+						else if (key == "pat_period")
+							psi_period_ = static_cast<int64_t>(boost::lexical_cast<double>(value) * CLOCK);
+						else if (key == "mpegts_transport_stream_id")
+							transport_stream_id_ = boost::lexical_cast<int>(value);
+						else if (key == "mpegts_service_id")
+							service_id_ = boost::lexical_cast<int>(value);
+						else if (key == "mpegts_pmt_start_pid")
+							pmt_pid_ = boost::lexical_cast<int>(value);
+						else if (key == "mpegts_start_pid")
+							first_pid_ = boost::lexical_cast<int>(value);
+						else
+							CASPAR_LOG(warning) << print() << L" Unused option " << u16(key) << L"=" << u16(value);
+					}
+					catch (const boost::bad_lexical_cast&)
+					{
+						CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"Invalid value for " + u16(key) + L" in " + print()));
+					}
+				}
+
+				if (pmt_pid_ < 0x10 || pmt_pid_ >= NULL_PID || first_pid_ < 0x10 || first_pid_ >= NULL_PID - static_cast<int>(input_->nb_streams))
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"Invalid pid in " + print()));
+
+				if (mux_delay_ < 0 || pcr_period_ <= 0 || pcr_period_ > CLOCK / 10 || psi_period_ <= 0)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"Invalid muxdelay, pcr_period or pat_period in " + print()));
+			}
+
+			void add_stream(int index)
+			{
+				auto in_stream	= input_->streams[index];
+				auto codec		= in_stream->codec;
+
+				stream s;
+				s.input_index	= index;
+				s.pid			= first_pid_ + static_cast<int>(streams_.size());
+				s.codec_id		= codec->codec_id;
+				s.time_base		= in_stream->time_base;
+
+				switch (codec->codec_id)
+				{
+				case AV_CODEC_ID_MPEG2VIDEO:	s.stream_type = 0x02; s.stream_id = 0xE0; s.is_video = true;	break;
+				case AV_CODEC_ID_H264:			s.stream_type = 0x1B; s.stream_id = 0xE0; s.is_video = true;	break;
+				case AV_CODEC_ID_HEVC:			s.stream_type = 0x24; s.stream_id = 0xE0; s.is_video = true;	break;
+				case AV_CODEC_ID_MP2:
+				case AV_CODEC_ID_MP3:			s.stream_type = 0x03; s.stream_id = 0xC0;						break;
+				case AV_CODEC_ID_AAC:			s.stream_type = 0x0F; s.stream_id = 0xC0;						break;
+				case AV_CODEC_ID_AC3:			s.stream_type = 0x06; s.stream_id = 0xBD;						break;
+				case AV_CODEC_ID_DVB_SUBTITLE:	s.stream_type = 0x06; s.stream_id = 0xBD;						break;
+				default:
+					if (codec->codec_type == AVMEDIA_TYPE_VIDEO || codec->codec_type == AVMEDIA_TYPE_AUDIO || codec->codec_type == AVMEDIA_TYPE_SUBTITLE)
+						CASPAR_LOG(warning) << print() << L" Skipping stream " << index << L", codec " << avcodec_get_name(codec->codec_id) << L" is not supported.";
+					return;
+				}
+
+				std::string language;
+				auto entry = av_dict_get(in_stream->metadata, "language", nullptr, 0);
+
+				if (entry && std::strlen(entry->value) == 3)
+					language = entry->value;
+
+				if (codec->codec_id == AV_CODEC_ID_DVB_SUBTITLE)
+				{
+					// subtitling_descriptor, page ids from extradata as the ffmpeg demuxer stores them.
+					auto lang = language.empty() ? std::string("und") : language;
+					uint8_t page[4] = { 0, 1, 0, 1 };
+
+					if (codec->extradata && codec->extradata_size >= 4)
+						std::memcpy(page, codec->extradata, 4);
+
+					uint8_t descriptor[] = { 0x59, 8, uint8_t(lang[0]), uint8_t(lang[1]), uint8_t(lang[2]), 0x10, page[0], page[1], page[2], page[3] };
+					s.descriptors.assign(descriptor, descriptor + sizeof(descriptor));
+				}
+				else if (!language.empty())
+				{
+					uint8_t descriptor[] = { 0x0A, 4, uint8_t(language[0]), uint8_t(language[1]), uint8_t(language[2]), 0 };
+					s.descriptors.assign(descriptor, descriptor + sizeof(descriptor));
+				}
+
+				if (codec->codec_id == AV_CODEC_ID_AC3)
+				{
+					uint8_t descriptor[] = { 0x6A, 1, 0 }; // AC-3_descriptor, no optional fields.
+					s.descriptors.insert(s.descriptors.end(), descriptor, descriptor + sizeof(descriptor));
+				}
+
+				if (codec->codec_id == AV_CODEC_ID_AAC && codec->extradata && codec->extradata_size >= 2)
+				{
+					// AudioSpecificConfig: object type, sampling frequency index, channel configuration.
+					auto object_type	= codec->extradata[0] >> 3;
+					auto frequency		= ((codec->extradata[0] & 0x07) << 1) | (codec->extradata[1] >> 7);
+					auto channels		= (codec->extradata[1] >> 3) & 0x0F;
+
+					if (object_type == 5 || object_type == 29) // Explicit SBR/PS, ADTS can only signal the core.
+						object_type = 2;
+
+					if (object_type < 1 || object_type > 4 || frequency > 12)
+					{
+						CASPAR_LOG(warning) << print() << L" Skipping stream " << index << L", AAC configuration can not be carried in ADTS.";
+						return;
+					}
+
+					s.adts = true;
+					s.adts_header[0] = 0xFF;
+					s.adts_header[1] = 0xF1;
+					s.adts_header[2] = static_cast<uint8_t>(((object_type - 1) << 6) | (frequency << 2) | (channels >> 2));
+					s.adts_header[3] = static_cast<uint8_t>((channels & 0x03) << 6);
+					s.adts_header[4] = 0;
+					s.adts_header[5] = 0x1F;
+					s.adts_header[6] = 0xFC;
+				}
+
+				stream_map_[index] = static_cast<int>(streams_.size());
+				streams_.push_back(std::move(s));
+			}
+
+			static void write_section_packet(std::array<uint8_t, TS_PACKET_SIZE>& packet, int pid, const std::vector<uint8_t>& section)
+			{
+				if (section.size() + 5 > TS_PACKET_SIZE)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info("PSI section does not fit in one transport packet"));
+
+				packet.fill(0xFF);
+				packet[0] = 0x47;
+				packet[1] = static_cast<uint8_t>(0x40 | (pid >> 8));
+				packet[2] = static_cast<uint8_t>(pid & 0xFF);
+				packet[3] = 0x10;
+				packet[4] = 0; // pointer_field
+				std::copy(section.begin(), section.end(), packet.begin() + 5);
+			}
+
+			static void finish_section(std::vector<uint8_t>& section)
+			{
+				auto length = section.size() - 3 + 4;
+				section[1] = static_cast<uint8_t>(0xB0 | (length >> 8));
+				section[2] = static_cast<uint8_t>(length & 0xFF);
+
+				auto crc = crc32_mpeg2(section.data(), section.size());
+				section.push_back(static_cast<uint8_t>(crc >> 24));
+				section.push_back(static_cast<uint8_t>(crc >> 16));
+				section.push_back(static_cast<uint8_t>(crc >> 8));
+				section.push_back(static_cast<uint8_t>(crc));
+			}
+
+			void build_pat()
+			{
+				std::vector<uint8_t> section =
+				{
+					0x00, 0, 0,
+					uint8_t(transport_stream_id_ >> 8), uint8_t(transport_stream_id_),
+					0xC1, 0x00, 0x00,
+					uint8_t(service_id_ >> 8), uint8_t(service_id_),
+					uint8_t(0xE0 | (pmt_pid_ >> 8)), uint8_t(pmt_pid_)
+				};
+
+				finish_section(section);
+				write_section_packet(pat_packet_, 0, section);
+			}
+
+			void build_pmt()
+			{
+				std::vector<uint8_t> section =
+				{
+					0x02, 0, 0,
+					uint8_t(service_id_ >> 8), uint8_t(service_id_),
+					0xC1, 0x00, 0x00,
+					uint8_t(0xE0 | (pcr_pid_ >> 8)), uint8_t(pcr_pid_),
+					0xF0, 0x00
+				};
+
+				for (auto& s : streams_)
+				{
+					auto length = s.descriptors.size();
+					section.push_back(s.stream_type);
+					section.push_back(static_cast<uint8_t>(0xE0 | (s.pid >> 8)));
+					section.push_back(static_cast<uint8_t>(s.pid & 0xFF));
+					section.push_back(static_cast<uint8_t>(0xF0 | (length >> 8)));
+					section.push_back(static_cast<uint8_t>(length & 0xFF));
+					section.insert(section.end(), s.descriptors.begin(), s.descriptors.end());
+				}
+
+				finish_section(section);
+				write_section_packet(pmt_packet_, pmt_pid_, section);
+			}
+
+			// Output clock at a byte position, 27 MHz.
+			int64_t clock_at(int64_t position) const
+			{
+				return av_rescale(position * 8, CLOCK, mux_rate_);
+			}
+
+			int64_t now() const
+			{
+				return clock_at(bytes_);
+			}
+
+			uint8_t* begin_packet()
+			{
+				auto size = output_.size();
+				output_.resize(size + TS_PACKET_SIZE);
+				return output_.data() + size;
+			}
+
+			void end_packet()
+			{
+				bytes_ += TS_PACKET_SIZE;
+				++ts_packets_;
+			}
+
+			void write_template(const std::array<uint8_t, TS_PACKET_SIZE>& packet, uint8_t& cc)
+			{
+				auto p = begin_packet();
+				std::memcpy(p, packet.data(), TS_PACKET_SIZE);
+				p[3] = static_cast<uint8_t>((p[3] & 0xF0) | cc);
+				cc = (cc + 1) & 0x0F;
+				end_packet();
+			}
+
+			uint8_t* write_pcr(uint8_t* p)
+			{
+				auto pcr	= clock_at(bytes_ + PCR_BYTE_OFFSET);
+				auto base	= (pcr / 300) & PTS_MASK;
+				auto ext	= pcr % 300;
+
+				p[0] = static_cast<uint8_t>(base >> 25);
+				p[1] = static_cast<uint8_t>(base >> 17);
+				p[2] = static_cast<uint8_t>(base >> 9);
+				p[3] = static_cast<uint8_t>(base >> 1);
+				p[4] = static_cast<uint8_t>(((base & 1) << 7) | 0x7E | (ext >> 8));
+				p[5] = static_cast<uint8_t>(ext & 0xFF);
+
+				last_pcr_ = pcr;
+				++pcr_count_;
+
+				return p + 6;
+			}
+
+			bool pcr_due() const
+			{
+				return now() - last_pcr_ >= pcr_period_;
+			}
+
+			// Adaptation field only packet on the pcr pid, the continuity counter
+			// does not advance without payload.
+			void write_pcr_packet()
+			{
+				auto p = begin_packet();
+				p[0] = 0x47;
+				p[1] = static_cast<uint8_t>(pcr_pid_ >> 8);
+				p[2] = static_cast<uint8_t>(pcr_pid_ & 0xFF);
+				p[3] = static_cast<uint8_t>(0x20 | ((pcr_cc_ - 1) & 0x0F));
+				p[4] = TS_PACKET_SIZE - 5;
+				p[5] = 0x10;
+				auto end = write_pcr(p + 6);
+				std::memset(end, 0xFF, p + TS_PACKET_SIZE - end);
+				end_packet();
+			}
+
+			// Puts out PSI and stand alone PCRs when due, ahead of a packet on pid.
+			void service(int pid)
+			{
+				if (now() - last_psi_ >= psi_period_)
+				{
+					last_psi_ = now();
+					write_template(pat_packet_, pat_cc_);
+					write_template(pmt_packet_, pmt_cc_);
+				}
+
+				if (pid != pcr_pid_ && pcr_due())
+					write_pcr_packet();
+			}
+
+			void fill_until(int64_t clock)
+			{
+				while (now() < clock)
+				{
+					service(NULL_PID);
+
+					if (now() >= clock)
+						break;
+
+					auto p = begin_packet();
+					std::memcpy(p, null_packet_.data(), TS_PACKET_SIZE);
+					end_packet();
+					++null_packets_;
+				}
+			}
+
+			void write_pes(stream& s, pes_reader& payload, bool random_access)
+			{
+				auto& cc	= s.pid == pcr_pid_ ? pcr_cc_ : s.cc;
+				auto start	= true;
+
+				while (payload.remaining() > 0)
+				{
+					service(s.pid);
+
+					auto pcr	= s.pid == pcr_pid_ && pcr_due();
+					auto rai	= start && random_access;
+					auto p		= begin_packet();
+					size_t af	= pcr || rai ? (pcr ? 8 : 2) : 0;
+					auto room	= TS_PACKET_SIZE - 4 - af;
+					auto n		= std::min(payload.remaining(), room);
+
+					if (n < room)
+						af += room - n;
+
+					p[0] = 0x47;
+					p[1] = static_cast<uint8_t>((start ? 0x40 : 0) | (s.pid >> 8));
+					p[2] = static_cast<uint8_t>(s.pid & 0xFF);
+					p[3] = static_cast<uint8_t>((af > 0 ? 0x30 : 0x10) | cc);
+					cc = (cc + 1) & 0x0F;
+
+					auto q = p + 4;
+
+					if (af > 0)
+					{
+						q[0] = static_cast<uint8_t>(af - 1);
+
+						if (af > 1)
+						{
+							q[1] = static_cast<uint8_t>((rai ? 0x40 : 0) | (pcr ? 0x10 : 0));
+							auto end = pcr ? write_pcr(q + 2) : q + 2;
+							std::memset(end, 0xFF, q + af - end);
+						}
+
+						q += af;
+					}
+
+					payload.read(q, n);
+					end_packet();
+					start = false;
+				}
+
+				++pes_packets_;
+			}
+
+			static void write_timestamp(std::vector<uint8_t>& out, int prefix, int64_t ts)
+			{
+				ts &= PTS_MASK;
+				out.push_back(static_cast<uint8_t>((prefix << 4) | ((ts >> 29) & 0x0E) | 1));
+				out.push_back(static_cast<uint8_t>(ts >> 22));
+				out.push_back(static_cast<uint8_t>(((ts >> 14) & 0xFE) | 1));
+				out.push_back(static_cast<uint8_t>(ts >> 7));
+				out.push_back(static_cast<uint8_t>(((ts << 1) & 0xFE) | 1));
+			}
+
+			bool has_start_code(const AVPacket& pkt) const
+			{
+				return pkt.size >= 4 && pkt.data[0] == 0 && pkt.data[1] == 0 && (pkt.data[2] == 1 || (pkt.data[2] == 0 && pkt.data[3] == 1));
+			}
+
+			// Access unit delimiter for H.264/HEVC, ADTS header for raw AAC and the
+			// DVB subtitle data identifier. Returns false to reject the packet.
+			bool prepare_prefix(stream& s, const AVPacket& pkt, std::vector<uint8_t>& suffix)
+			{
+				prefix_.clear();
+				suffix.clear();
+
+				if (s.codec_id == AV_CODEC_ID_H264 || s.codec_id == AV_CODEC_ID_HEVC)
+				{
+					if (!has_start_code(pkt))
+					{
+						if (!s.warned)
+							CASPAR_LOG(warning) << print() << L" Dropping stream " << s.input_index << L" packets, bitstream is not Annex B.";
+
+						s.warned = true;
+						return false;
+					}
+
+					auto nal = pkt.data[2] == 1 ? pkt.data[3] : pkt.data[4];
+
+					if (s.codec_id == AV_CODEC_ID_H264 && (nal & 0x1F) != 9)
+						prefix_ = { 0, 0, 0, 1, 0x09, 0xF0 };
+					else if (s.codec_id == AV_CODEC_ID_HEVC && ((nal >> 1) & 0x3F) != 35)
+						prefix_ = { 0, 0, 0, 1, 0x46, 0x01, 0x50 };
+				}
+				else if (s.adts && !(pkt.size >= 2 && pkt.data[0] == 0xFF && (pkt.data[1] & 0xF0) == 0xF0))
+				{
+					auto length = pkt.size + 7;
+
+					if (length > 0x1FFF)
+						return false;
+
+					prefix_.assign(s.adts_header.begin(), s.adts_header.end());
+					prefix_[3] |= static_cast<uint8_t>(length >> 11);
+					prefix_[4]  = static_cast<uint8_t>((length >> 3) & 0xFF);
+					prefix_[5] |= static_cast<uint8_t>((length & 0x07) << 5);
+				}
+				else if (s.codec_id == AV_CODEC_ID_DVB_SUBTITLE && !(pkt.size >= 2 && pkt.data[0] == 0x20 && pkt.data[1] == 0x00))
+				{
+					prefix_ = { 0x20, 0x00 };
+					suffix	= { 0xFF };
+				}
+
+				return true;
+			}
+
+			bool write(const std::shared_ptr<AVPacket>& packet)
+			{
+				if (closed_ || !packet)
+					return false;
+
+				if (!packet->data)
+				{
+					discontinuity_ = started_;
+					return false;
+				}
+
+				auto index = packet->stream_index >= 0 && packet->stream_index < static_cast<int>(stream_map_.size()) ? stream_map_[packet->stream_index] : -1;
+
+				if (index < 0)
+					return false;
+
+				auto& s		= streams_[index];
+				auto& pkt	= *packet;
+				auto dts	= pkt.dts != AV_NOPTS_VALUE ? pkt.dts : pkt.pts;
+
+				if (dts == AV_NOPTS_VALUE)
+				{
+					if (s.last_dts == AV_NOPTS_VALUE)
+						return false;
+
+					dts = av_rescale_q(s.last_dts, AVRational{ 1, CLOCK }, s.time_base);
+				}
+
+				auto dts27	= av_rescale_q(dts, s.time_base, AVRational{ 1, CLOCK });
+				auto pts27	= pkt.pts != AV_NOPTS_VALUE ? av_rescale_q(pkt.pts, s.time_base, AVRational{ 1, CLOCK }) : dts27;
+
+				std::vector<uint8_t> suffix;
+
+				if (!prepare_prefix(s, pkt, suffix))
+					return false;
+
+				if (!started_)
+				{
+					ts_offset_	= mux_delay_ - dts27;
+					started_	= true;
+				}
+				else if (discontinuity_ || (s.last_dts != AV_NOPTS_VALUE && (dts27 - s.last_dts > MAX_FORWARD_JUMP || s.last_dts - dts27 > MAX_BACKWARD_JUMP)))
+				{
+					// Continue the output timeline where it is rather than following
+					// the input, receivers see no discontinuity.
+					ts_offset_		= std::max(now() + mux_delay_, next_dts_) - dts27;
+					discontinuity_	= false;
+					++discontinuities_;
+
+					for (auto& other : streams_)
+						other.last_dts = AV_NOPTS_VALUE;
+				}
+
+				s.last_dts = dts27;
+
+				// The offset is anchored on the first packet muxed, a stream that
+				// starts earlier than that by more than the mux delay would go
+				// below zero and wrap to the end of the 33 bit range.
+				auto out_dts = std::max<int64_t>(dts27 + ts_offset_, 0);
+				auto out_pts = std::max<int64_t>(pts27 + ts_offset_, out_dts);
+
+				fill_until(out_dts - mux_delay_);
+
+				auto lag = now() - out_dts;
+
+				if (lag > 0)
+				{
+					++late_packets_;
+					max_lag_ = std::max<int64_t>(max_lag_, lag);
+				}
+
+				auto payload_size = prefix_.size() + pkt.size + suffix.size();
+
+				pes_header_ = { 0x00, 0x00, 0x01, s.stream_id, 0, 0, 0x84, 0, 0 };
+
+				if (out_pts != out_dts)
+				{
+					pes_header_[7] = 0xC0;
+					pes_header_[8] = 10;
+					write_timestamp(pes_header_, 3, out_pts / 300);
+					write_timestamp(pes_header_, 1, out_dts / 300);
+				}
+				else
+				{
+					pes_header_[7] = 0x80;
+					pes_header_[8] = 5;
+					write_timestamp(pes_header_, 2, out_pts / 300);
+				}
+
+				auto pes_length = pes_header_.size() - 6 + payload_size;
+
+				if (pes_length <= 0xFFFF && !s.is_video)
+				{
+					pes_header_[4] = static_cast<uint8_t>(pes_length >> 8);
+					pes_header_[5] = static_cast<uint8_t>(pes_length & 0xFF);
+				}
+
+				pes_reader reader;
+				reader.add(pes_header_.data(), pes_header_.size());
+				reader.add(prefix_.data(), prefix_.size());
+				reader.add(pkt.data, pkt.size);
+				reader.add(suffix.data(), suffix.size());
+
+				write_pes(s, reader, s.is_video && (pkt.flags & AV_PKT_FLAG_KEY));
+
+				auto duration = pkt.duration > 0 ? av_rescale_q(pkt.duration, s.time_base, AVRational{ 1, CLOCK }) : 0;
+				next_dts_ = std::max(next_dts_, out_dts + duration);
+
+				deliver();
+
+				return true;
+			}
+
+			void deliver()
+			{
+				if (output_.empty())
+					return;
+
+				write_(output_.data(), static_cast<int>(output_.size()));
+				output_.clear();
+			}
+
+			void close()
+			{
+				if (closed_)
+					return;
+
+				closed_ = true;
+				deliver();
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"mux-rate", mux_rate_);
+				info.add(L"ts-packets", ts_packets_);
+				info.add(L"null-packets", null_packets_);
+				info.add(L"pes-packets", pes_packets_);
+				info.add(L"pcrs", pcr_count_);
+				info.add(L"late-packets", late_packets_);
+				info.add(L"max-lag-ms", static_cast<double>(max_lag_) * 1000.0 / CLOCK);
+				info.add(L"discontinuities", discontinuities_);
+				info.add(L"fill-ratio", ts_packets_ > 0 ? 1.0 - static_cast<double>(null_packets_) / static_cast<double>(ts_packets_) : 0.0);
+
+				return info;
+			}
+
+			std::wstring print() const
+			{
+				return L"ts_muxer[" + boost::lexical_cast<std::wstring>(mux_rate_) + L"]";
+			}
+		};
+
+		ts_muxer::ts_muxer(const std::shared_ptr<AVFormatContext>& input, const ffmpeg_options& options, const write_func& write)
+			: impl_(new impl(input, options, write))
+		{
+		}
+
+		bool ts_muxer::write(const std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->write(packet);
+		}
+
+		void ts_muxer::close()
+		{
+			impl_->close();
+		}
+
+		boost::property_tree::wptree ts_muxer::info() const
+		{
+			return impl_->info();
+		}
+
+		std::wstring ts_muxer::print() const
+		{
+			return impl_->print();
+		}
+	}
+}
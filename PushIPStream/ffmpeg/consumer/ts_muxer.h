@@ -0,0 +1,56 @@
+#pragma once
+
+#include "../util/util.h"
+
+#include <common/memory.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+struct AVFormatContext;
+struct AVPacket;
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Constant bitrate MPEG-TS muxer writing transport packets directly from
+		// demuxed packets, without libavformat.
+		//
+		// The output clock is the output byte position at the mux rate: every
+		// PCR is computed from the position of the packet carrying it, and null
+		// packets are inserted until the clock reaches a packet's dts minus the
+		// mux delay, so the stream is exactly CBR with no PCR jitter of its own.
+		// PAT and PMT are built once into packet templates.
+		//
+		// Options (ffmpeg mpegts names where there is one): muxrate (bit/s,
+		// required), muxdelay (s, default 0.7), pcr_period (ms, default 20),
+		// pat_period (s, default 0.1), mpegts_transport_stream_id,
+		// mpegts_service_id, mpegts_pmt_start_pid and mpegts_start_pid.
+		class ts_muxer : boost::noncopyable
+		{
+		public:
+			typedef std::function<void(const uint8_t* data, int size)> write_func;
+
+			ts_muxer(const std::shared_ptr<AVFormatContext>& input, const ffmpeg_options& options, const write_func& write);
+
+			// Returns false if the packet belongs to a stream that is not muxed or
+			// was rejected. A flush packet makes the next packet start a new
+			// timeline continuing from the current output clock.
+			bool							write(const std::shared_ptr<AVPacket>& packet);
+			// Hands the remaining output to the callback, the muxer may not be
+			// written to afterwards.
+			void							close();
+
+			boost::property_tree::wptree	info() const;
+			std::wstring					print() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
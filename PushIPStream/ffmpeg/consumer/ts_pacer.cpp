@@ -0,0 +1,201 @@
+#include "ts_pacer.h"
+
+#include <common/os/precise_sleep.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int64_t PCR_FREQUENCY	= 27000000;
+		static const int64_t PCR_WRAP		= (static_cast<int64_t>(1) << 33) * 300;
+		static const int64_t MAX_PCR_GAP	= PCR_FREQUENCY;	// ISO 13818-1 requires at most 100ms, anything above a second is a discontinuity.
+
+		static bool read_pcr(const uint8_t* packet, int64_t& pcr)
+		{
+			auto has_adaptation = (packet[3] & 0x20) != 0;
+
+			if (!has_adaptation || packet[4] < 7 || (packet[5] & 0x10) == 0)
+				return false;
+
+			auto p		= packet + 6;
+			auto base	= (static_cast<int64_t>(p[0]) << 25) | (static_cast<int64_t>(p[1]) << 17) | (static_cast<int64_t>(p[2]) << 9) | (static_cast<int64_t>(p[3]) << 1) | (p[4] >> 7);
+			auto ext	= ((p[4] & 0x01) << 8) | p[5];
+			pcr			= base * 300 + ext;
+
+			return true;
+		}
+
+		ts_pacer::ts_pacer(int packets_per_datagram, int64_t latency)
+			: datagram_size_(static_cast<size_t>(std::max(packets_per_datagram, 1)) * TS_PACKET_SIZE)
+			, latency_(latency)
+		{
+			current_.data.reserve(datagram_size_);
+		}
+
+		int64_t ts_pacer::now()
+		{
+			return monotonic_now();
+		}
+
+		void ts_pacer::push(const uint8_t* data, int size, std::vector<datagram>& ready)
+		{
+			while (size > 0)
+			{
+				if (partial_size_ == 0)
+				{
+					if (*data != 0x47)
+					{
+						if (synced_)
+							++sync_losses_;
+
+						synced_ = false;
+						++data;
+						--size;
+						continue;
+					}
+
+					synced_ = true;
+
+					if (size >= TS_PACKET_SIZE)
+					{
+						on_packet(data, ready);
+						data += TS_PACKET_SIZE;
+						size -= TS_PACKET_SIZE;
+						continue;
+					}
+				}
+
+				auto n = std::min(TS_PACKET_SIZE - partial_size_, size);
+				std::memcpy(partial_ + partial_size_, data, n);
+				partial_size_	+= n;
+				data			+= n;
+				size			-= n;
+
+				if (partial_size_ == TS_PACKET_SIZE)
+				{
+					on_packet(partial_, ready);
+					partial_size_ = 0;
+				}
+			}
+		}
+
+		void ts_pacer::flush(std::vector<datagram>& ready)
+		{
+			if (!current_.data.empty())
+			{
+				pending_.push_back(pending_datagram { std::move(current_), offset_ });
+				current_ = datagram();
+				current_.data.reserve(datagram_size_);
+			}
+
+			auto deadline = std::max(last_deadline_, now());
+
+			for (auto& p : pending_)
+			{
+				p.dgram.deadline = deadline;
+				ready.push_back(std::move(p.dgram));
+			}
+
+			pending_.clear();
+			partial_size_ = 0;
+		}
+
+		void ts_pacer::on_packet(const uint8_t* packet, std::vector<datagram>& ready)
+		{
+			auto packet_offset = offset_;
+
+			current_.data.insert(current_.data.end(), packet, packet + TS_PACKET_SIZE);
+			offset_ += TS_PACKET_SIZE;
+
+			if (current_.data.size() >= datagram_size_)
+			{
+				pending_.push_back(pending_datagram { std::move(current_), offset_ });
+				current_ = datagram();
+				current_.data.reserve(datagram_size_);
+			}
+
+			int64_t pcr = 0;
+
+			if (read_pcr(packet, pcr))
+				on_pcr(packet_offset, pcr, ready);
+		}
+
+		void ts_pacer::on_pcr(int64_t offset, int64_t pcr, std::vector<datagram>& ready)
+		{
+			if (!anchored_)
+			{
+				anchored_		= true;
+				anchor_offset_	= offset;
+				anchor_pcr_		= pcr;
+				anchor_wall_	= std::max(now() + latency_, last_deadline_);
+
+				// Whatever precedes the first PCR (PAT, PMT) goes out with it.
+				schedule_until(offset, anchor_wall_, ready);
+				return;
+			}
+
+			auto delta = pcr - anchor_pcr_;
+
+			if (delta < -PCR_WRAP / 2)
+				delta += PCR_WRAP;
+
+			if (delta <= 0 || delta > MAX_PCR_GAP || offset <= anchor_offset_)
+			{
+				// Nothing to interpolate against, so send what is pending at the last
+				// known send time and start a new timeline from here.
+				++discontinuities_;
+
+				auto wall = std::max(anchor_wall_, last_deadline_);
+				schedule_until(offset, wall, ready);
+
+				anchor_offset_	= offset;
+				anchor_pcr_		= pcr;
+				anchor_wall_	= wall;
+				return;
+			}
+
+			auto wall = anchor_wall_ + delta * 1000 / 27;
+			auto late = now() - wall;
+
+			if (late > latency_)
+			{
+				// The input could not keep up (or stalled), catching up by bursting
+				// would defeat the purpose, so move the timeline instead.
+				++resyncs_;
+				anchor_wall_	+= late;
+				wall			+= late;
+			}
+
+			schedule_until(offset, wall, ready);
+
+			anchor_offset_	= offset;
+			anchor_pcr_		= pcr;
+			anchor_wall_	= wall;
+		}
+
+		void ts_pacer::schedule_until(int64_t offset, int64_t wall_at_offset, std::vector<datagram>& ready)
+		{
+			auto span = offset - anchor_offset_;
+
+			while (!pending_.empty() && pending_.front().end_offset <= offset)
+			{
+				auto& p = pending_.front();
+
+				auto deadline = wall_at_offset;
+
+				if (span > 0)
+					deadline = anchor_wall_ + (wall_at_offset - anchor_wall_) * std::max<int64_t>(p.end_offset - anchor_offset_, 0) / span;
+
+				deadline		= std::max(deadline, last_deadline_);
+				last_deadline_	= deadline;
+
+				p.dgram.deadline = deadline;
+				ready.push_back(std::move(p.dgram));
+				pending_.pop_front();
+			}
+		}
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Splits an MPEG-TS byte stream into datagrams and gives each one a send
+		// time derived from the PCRs in the stream. The bytes between two PCRs are
+		// spread evenly over the time between them, so the output rate follows
+		// the mux rate instead of the rate at which packets are demuxed.
+		class ts_pacer : boost::noncopyable
+		{
+		public:
+			static const int TS_PACKET_SIZE = 188;
+
+			struct datagram
+			{
+				std::vector<uint8_t>	data;
+				int64_t					deadline	= 0;	// steady clock, nanoseconds.
+			};
+
+			// latency is added to the first PCR (and after every resync) to give the
+			// sender some slack, it is also how late the output may fall behind the
+			// PCR timeline before being resynchronised to the clock.
+			explicit ts_pacer(int packets_per_datagram = 7, int64_t latency = 100000000);
+
+			// Feeds muxed bytes and appends the datagrams whose send time became
+			// known to ready.
+			void				push(const uint8_t* data, int size, std::vector<datagram>& ready);
+			// Schedules everything still waiting for a PCR, at end of stream.
+			void				flush(std::vector<datagram>& ready);
+
+			uint64_t			discontinuities() const	{ return discontinuities_; }
+			uint64_t			resyncs() const			{ return resyncs_; }
+			uint64_t			sync_losses() const		{ return sync_losses_; }
+
+			static int64_t		now();
+		private:
+			struct pending_datagram
+			{
+				datagram	dgram;
+				int64_t		end_offset;
+			};
+
+			void				on_packet(const uint8_t* packet, std::vector<datagram>& ready);
+			void				on_pcr(int64_t offset, int64_t pcr, std::vector<datagram>& ready);
+			void				schedule_until(int64_t offset, int64_t wall_at_offset, std::vector<datagram>& ready);
+
+			const size_t					datagram_size_;
+			const int64_t					latency_;
+
+			uint8_t							partial_[TS_PACKET_SIZE];
+			int								partial_size_		= 0;
+			bool							synced_				= true;
+			datagram						current_;
+			std::deque<pending_datagram>	pending_;
+			int64_t							offset_				= 0;	// Bytes accepted so far.
+
+			bool							anchored_			= false;
+			int64_t							anchor_offset_		= 0;
+			int64_t							anchor_pcr_			= 0;
+			int64_t							anchor_wall_		= 0;
+			int64_t							last_deadline_		= 0;
+
+			uint64_t						discontinuities_	= 0;
+			uint64_t						resyncs_			= 0;
+			uint64_t						sync_losses_		= 0;
+		};
+	}
+}
@@ -0,0 +1,508 @@
+#include "../StdAfx.h"
+
+#include "udp_consumer.h"
+#include "muxer.h"
+#include "ts_checker.h"
+#include "ts_muxer.h"
+#include "ts_pacer.h"
+#include "traffic_shaper.h"
+
+#include "../packet_source.h"
+
+#include <common/blocking_bounded_queue_adapter.h>
+#include <common/except.h>
+#include <common/log.h>
+#include <common/os/datagram_sender.h>
+#include <common/os/general_protection_fault.h>
+#include <common/pacing_clock.h>
+#include <common/param.h>
+
+#include <boost/asio.hpp>
+#include <boost/chrono/thread_clock.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int MAX_QUEUED_DATAGRAMS	= 4096;
+		static const int64_t LATE_THRESHOLD		= 1000000;	// ns, a datagram sent later than this counts as late.
+
+		struct udp_url
+		{
+			std::string		host;
+			std::string		port;
+			int				ttl				= -1;
+			std::string		localaddr;
+			int				pkt_size		= 7 * ts_pacer::TS_PACKET_SIZE;
+			int				buffer_size		= -1;
+			int64_t			latency			= 100;	// ms
+			int64_t			batch_delay		= 1000;	// us, how early a datagram may be sent to share a batch.
+			int64_t			spin			= 0;	// us before a batch is due to stop sleeping and spin.
+			int				max_batch		= 64;
+			traffic_shaper::settings	shaping;
+			bool			gso				= true;
+			bool			native_muxer	= false;
+			bool			check			= false;
+			ffmpeg_options	muxer_options;
+		};
+
+		static udp_url parse_udp_url(const std::wstring& url)
+		{
+			auto parts = protocol_split(url);
+
+			if (!boost::iequals(parts.at(0), L"udp"))
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Not a udp url: " + url));
+
+			auto rest	= u8(parts.at(1));
+			auto query	= std::string();
+			auto q		= rest.find('?');
+
+			if (q != std::string::npos)
+			{
+				query	= rest.substr(q + 1);
+				rest	= rest.substr(0, q);
+			}
+
+			auto colon = rest.rfind(':');
+
+			if (colon == std::string::npos || colon + 1 == rest.size())
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Missing port in " + url));
+
+			udp_url result;
+			result.host = rest.substr(0, colon);
+			result.port = rest.substr(colon + 1);
+
+			if (result.host.size() > 2 && result.host.front() == '[' && result.host.back() == ']')
+				result.host = result.host.substr(1, result.host.size() - 2);
+
+			std::vector<std::string> pairs;
+			boost::split(pairs, query, boost::is_any_of("&"), boost::token_compress_on);
+
+			for (auto& pair : pairs)
+			{
+				if (pair.empty())
+					continue;
+
+				auto eq		= pair.find('=');
+				auto key	= pair.substr(0, eq);
+				auto value	= eq == std::string::npos ? std::string() : pair.substr(eq + 1);
+
+				try
+				{
+					if (key == "ttl")
+						result.ttl = boost::lexical_cast<int>(value);
+					else if (key == "localaddr")
+						result.localaddr = value;
+					else if (key == "pkt_size")
+						result.pkt_size = boost::lexical_cast<int>(value);
+					else if (key == "buffer_size")
+						result.buffer_size = boost::lexical_cast<int>(value);
+					else if (key == "latency")
+						result.latency = boost::lexical_cast<int64_t>(value);
+					else if (key == "batch_delay")
+						result.batch_delay = boost::lexical_cast<int64_t>(value);
+					else if (key == "rate")
+						result.shaping.rate = boost::lexical_cast<int64_t>(value) * 1000;
+					else if (key == "burst")
+						result.shaping.burst = boost::lexical_cast<int64_t>(value);
+					else if (key == "nic")
+						result.shaping.nic = u16(value);
+					else if (key == "nic_rate")
+						result.shaping.nic_rate = boost::lexical_cast<int64_t>(value) * 1000;
+					else if (key == "offload")
+						result.shaping.offload = boost::lexical_cast<int>(value) != 0;
+					else if (key == "spin")
+						result.spin = boost::lexical_cast<int64_t>(value);
+					else if (key == "max_batch")
+						result.max_batch = boost::lexical_cast<int>(value);
+					else if (key == "gso")
+						result.gso = boost::lexical_cast<int>(value) != 0;
+					else if (key == "muxer")
+					{
+						if (value != "native" && value != "lavf")
+							CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"muxer must be native or lavf in " + url));
+
+						result.native_muxer = value == "native";
+					}
+					else if (key == "check")
+						result.check = boost::lexical_cast<int>(value) != 0;
+					else
+						result.muxer_options.push_back(std::make_pair(key, value));
+				}
+				catch (const boost::bad_lexical_cast&)
+				{
+					CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Invalid value for " + u16(key) + L" in " + url));
+				}
+			}
+
+			if (result.pkt_size < ts_pacer::TS_PACKET_SIZE || result.pkt_size % ts_pacer::TS_PACKET_SIZE != 0)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"pkt_size must be a multiple of 188 in " + url));
+
+			if (result.shaping.rate < 0 || result.shaping.burst < 0 || result.shaping.nic_rate < 0)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Invalid rate, burst or nic_rate in " + url));
+
+			if (result.batch_delay < 0 || result.max_batch < 1 || result.spin < 0)
+				CASPAR_THROW_EXCEPTION(user_error() << msg_info(L"Invalid batch_delay, max_batch or spin in " + url));
+
+			return result;
+		}
+
+		struct udp_consumer::impl : boost::noncopyable
+		{
+			typedef blocking_bounded_queue_adapter<tbb::concurrent_queue<ts_pacer::datagram>> datagram_queue;
+
+			const std::wstring					url_;
+			const udp_url						config_;
+
+			boost::asio::io_service				service_;
+			boost::asio::ip::udp::socket		socket_;
+			boost::asio::ip::udp::endpoint		endpoint_;
+			std::unique_ptr<datagram_sender>	sender_;
+
+			packet_source						source_;
+			ts_pacer							pacer_;
+			pacing_clock						clock_;
+			traffic_shaper						shaper_;
+			size_t								batch_bytes_		= 0;
+			std::vector<ts_pacer::datagram>		ready_;
+			std::unique_ptr<ts_checker>			checker_;
+			std::unique_ptr<muxer>				muxer_;
+			std::unique_ptr<ts_muxer>			ts_muxer_;
+			datagram_queue						queue_;
+
+			tbb::atomic<bool>					is_running_;
+			tbb::atomic<uint64_t>				packets_muxed_;
+			tbb::atomic<uint64_t>				late_datagrams_;
+			tbb::atomic<uint64_t>				batches_sent_;
+			tbb::atomic<uint64_t>				send_cpu_ns_;
+
+			mutable tbb::spin_mutex				jitter_mutex_;
+			uint64_t							jitter_count_		= 0;
+			double								jitter_mean_		= 0.0;
+			double								jitter_m2_			= 0.0;
+			int64_t								jitter_max_			= 0;
+			int64_t								first_send_			= 0;
+			int64_t								last_send_			= 0;
+
+			boost::thread						mux_thread_;
+			boost::thread						send_thread_;
+
+			impl(const std::shared_ptr<packetProducer>& producer, const std::wstring& url)
+				: url_(url)
+				, config_(parse_udp_url(url))
+				, socket_(service_)
+				, source_(producer)
+				, pacer_(config_.pkt_size / ts_pacer::TS_PACKET_SIZE, config_.latency * 1000000)
+				, clock_(clock_settings(config_))
+				, shaper_(config_.shaping)
+				, queue_(MAX_QUEUED_DATAGRAMS)
+			{
+				auto write = [this](const uint8_t* data, int size)
+				{
+					if (checker_)
+						checker_->push(data, size);
+
+					pacer_.push(data, size, ready_);
+				};
+
+				if (config_.check)
+					checker_.reset(new ts_checker(mux_rate()));
+
+				if (config_.native_muxer)
+					ts_muxer_.reset(new ts_muxer(producer->context(), config_.muxer_options, write));
+				else
+					muxer_.reset(new muxer("mpegts", producer->context(), config_.muxer_options, write, config_.pkt_size * 8));
+
+				is_running_			= true;
+				packets_muxed_		= 0;
+				late_datagrams_		= 0;
+				batches_sent_		= 0;
+				send_cpu_ns_		= 0;
+
+				open_socket();
+
+				send_thread_	= boost::thread([this] { send(); });
+				mux_thread_		= boost::thread([this] { mux(); });
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+				mux_thread_.join();
+				send_thread_.join();
+			}
+
+			static pacing_clock::settings clock_settings(const udp_url& config)
+			{
+				pacing_clock::settings result;
+				result.spin = config.spin * 1000;
+				return result;
+			}
+
+			int64_t mux_rate() const
+			{
+				int64_t result = 0;
+
+				for (auto& option : config_.muxer_options)
+				{
+					if (option.first == "muxrate")
+						return boost::conversion::try_lexical_convert(option.second, result) ? result : 0;
+				}
+
+				return 0;
+			}
+
+			void open_socket()
+			{
+				boost::asio::ip::udp::resolver resolver(service_);
+				endpoint_ = *resolver.resolve(boost::asio::ip::udp::resolver::query(config_.host, config_.port));
+
+				socket_.open(endpoint_.protocol());
+
+				if (config_.buffer_size > 0)
+					socket_.set_option(boost::asio::socket_base::send_buffer_size(config_.buffer_size));
+
+				if (endpoint_.address().is_multicast())
+				{
+					if (config_.ttl >= 0)
+						socket_.set_option(boost::asio::ip::multicast::hops(config_.ttl));
+
+					if (!config_.localaddr.empty())
+						socket_.set_option(boost::asio::ip::multicast::outbound_interface(boost::asio::ip::address_v4::from_string(config_.localaddr)));
+				}
+				else if (config_.ttl >= 0)
+					socket_.set_option(boost::asio::ip::unicast::hops(config_.ttl));
+
+				sender_.reset(new datagram_sender(
+						socket_.native_handle(),
+						endpoint_.data(),
+						static_cast<int>(endpoint_.size()),
+						config_.max_batch,
+						config_.pkt_size,
+						config_.gso));
+
+				if (shaper_.offload(socket_.native_handle()))
+					CASPAR_LOG(info) << print() << L" Output rate paced by the kernel.";
+			}
+
+			void enqueue_ready()
+			{
+				if (ready_.empty())
+					return;
+
+				queue_.push_bulk(std::make_move_iterator(ready_.begin()), std::make_move_iterator(ready_.end()));
+				ready_.clear();
+			}
+
+			void mux()
+			{
+				ensure_gpf_handler_installed_for_thread("udp-consumer-mux");
+
+				try
+				{
+					while (is_running_)
+					{
+						std::shared_ptr<AVPacket> packet;
+
+						if (!source_.try_pop(packet))
+						{
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+							continue;
+						}
+
+						if (!packet->data && packet->pos == -1) // End of input.
+							break;
+
+						if (ts_muxer_ ? ts_muxer_->write(packet) : muxer_->write(packet))
+							++packets_muxed_;
+
+						enqueue_ready();
+					}
+
+					if (ts_muxer_)
+						ts_muxer_->close();
+					else
+						muxer_->close();
+					pacer_.flush(ready_);
+					enqueue_ready();
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				CASPAR_LOG(info) << print() << L" Muxing stopped.";
+
+				queue_.push(ts_pacer::datagram()); // Tells the sender to stop.
+			}
+
+			// Datagrams due within batch_delay of the first one in a batch are sent
+			// together at its deadline, in as few system calls as the platform
+			// allows. At high bitrates that is tens of datagrams per call, at low
+			// bitrates batches degenerate to single datagrams sent on time.
+			void send()
+			{
+				ensure_gpf_handler_installed_for_thread("udp-consumer-send");
+
+				std::vector<int64_t> deadlines;
+				auto batch_delay = config_.batch_delay * 1000;
+
+				while (true)
+				{
+					ts_pacer::datagram dgram;
+
+					if (deadlines.empty())
+						queue_.pop(dgram);
+					else if (!queue_.try_pop(dgram))
+					{
+						send_batch(deadlines);
+						continue;
+					}
+
+					if (dgram.data.empty())
+						break;
+
+					if (!is_running_)
+						continue; // Drain so the mux thread is not blocked on a full queue.
+
+					if (!deadlines.empty() && (dgram.deadline - deadlines.front() > batch_delay || deadlines.size() == static_cast<size_t>(config_.max_batch)))
+						send_batch(deadlines);
+
+					sender_->add(dgram.data.data(), dgram.data.size());
+					deadlines.push_back(dgram.deadline);
+					batch_bytes_ += dgram.data.size();
+				}
+
+				if (is_running_ && !deadlines.empty())
+					send_batch(deadlines);
+			}
+
+			void send_batch(std::vector<int64_t>& deadlines)
+			{
+				auto deadline = deadlines.front();
+
+				if (shaper_.enabled())
+					deadline = shaper_.schedule(batch_bytes_, deadline);
+
+				batch_bytes_ = 0;
+				clock_.wait_until(deadline);
+
+				auto errors	= sender_->stats().errors;
+				auto cpu	= boost::chrono::thread_clock::now();
+
+				sender_->flush();
+
+				send_cpu_ns_ += boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::thread_clock::now() - cpu).count();
+				++batches_sent_;
+
+				auto stats	= sender_->stats();
+				auto now	= ts_pacer::now();
+
+				if (errors == 0 && stats.errors > 0)
+					CASPAR_LOG(warning) << print() << L" Send failed, further errors are only counted.";
+
+				for (auto deadline : deadlines)
+					record_jitter(now - deadline, now);
+
+				deadlines.clear();
+			}
+
+			void record_jitter(int64_t error, int64_t now)
+			{
+				if (error > LATE_THRESHOLD)
+					++late_datagrams_;
+
+				tbb::spin_mutex::scoped_lock lock(jitter_mutex_);
+
+				// Welford's running mean and variance.
+				++jitter_count_;
+				auto delta		= static_cast<double>(error) - jitter_mean_;
+				jitter_mean_	+= delta / static_cast<double>(jitter_count_);
+				jitter_m2_		+= delta * (static_cast<double>(error) - jitter_mean_);
+				jitter_max_		= std::max(jitter_max_, error);
+
+				if (first_send_ == 0)
+					first_send_ = now;
+
+				last_send_ = now;
+			}
+
+			std::wstring print() const
+			{
+				return L"udp_consumer[" + url_ + L"]";
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"type", L"udp");
+				info.add(L"url", url_);
+				auto stats = sender_->stats();
+
+				info.add(L"packets-muxed", packets_muxed_);
+				info.add(L"datagrams-sent", stats.datagrams);
+				info.add(L"bytes-sent", stats.bytes);
+				info.add(L"send-errors", stats.errors);
+				info.add(L"batches-sent", batches_sent_);
+				info.add(L"syscalls", stats.syscalls);
+				info.add(L"segmentation-offload", stats.segmentation_offload);
+				info.add(L"queued-datagrams", queue_.size());
+				info.add(L"pcr-discontinuities", pacer_.discontinuities());
+				info.add(L"pacing-resyncs", pacer_.resyncs());
+				info.add(L"late-datagrams", late_datagrams_);
+				info.add_child(L"pacing-clock", clock_.info());
+
+				if (shaper_.enabled())
+					info.add_child(L"shaping", shaper_.info());
+
+				if (ts_muxer_)
+					info.add_child(L"ts-muxer", ts_muxer_->info());
+
+				if (checker_)
+					info.add_child(L"conformance", checker_->info());
+
+				tbb::spin_mutex::scoped_lock lock(jitter_mutex_);
+
+				auto stddev		= jitter_count_ > 1 ? std::sqrt(jitter_m2_ / static_cast<double>(jitter_count_ - 1)) : 0.0;
+				auto elapsed	= last_send_ - first_send_;
+
+				info.add(L"jitter-mean-us", jitter_mean_ / 1000.0);
+				info.add(L"jitter-stddev-us", stddev / 1000.0);
+				info.add(L"jitter-max-us", static_cast<double>(jitter_max_) / 1000.0);
+				info.add(L"bitrate-kbps", elapsed > 0 ? static_cast<double>(stats.bytes) * 8.0 * 1000000.0 / static_cast<double>(elapsed) : 0.0);
+				info.add(L"syscalls-per-second", elapsed > 0 ? static_cast<double>(stats.syscalls) * 1000000000.0 / static_cast<double>(elapsed) : 0.0);
+				info.add(L"cpu-ms-per-gbit", stats.bytes > 0 ? static_cast<double>(send_cpu_ns_) / 1000000.0 / (static_cast<double>(stats.bytes) * 8.0 / 1000000000.0) : 0.0);
+
+				return info;
+			}
+		};
+
+		udp_consumer::udp_consumer(const std::shared_ptr<packetProducer>& producer, const std::wstring& url)
+			: impl_(new impl(producer, url))
+		{
+		}
+
+		udp_consumer::~udp_consumer()
+		{
+		}
+
+		std::wstring udp_consumer::print() const
+		{
+			return impl_->print();
+		}
+
+		boost::property_tree::wptree udp_consumer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
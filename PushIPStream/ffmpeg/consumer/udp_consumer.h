@@ -0,0 +1,46 @@
+#pragma once
+
+#include "../../packetConsumer.h"
+#include "../../packetProducer.h"
+
+#include <common/memory.h>
+
+#include <memory>
+#include <string>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Remuxes a packetProducer to MPEG-TS and sends it to a udp:// unicast or
+		// multicast destination, paced by the PCRs of the muxed stream.
+		//
+		// Query parameters of the url: ttl, localaddr (multicast interface),
+		// pkt_size (multiple of 188, default 1316), buffer_size (socket send buffer)
+		// latency (ms of pacing slack, default 100), batch_delay (us a datagram may
+		// be sent ahead of its deadline to share a system call, default 1000),
+		// spin (us before a batch is due to stop sleeping and busy wait, for
+		// microsecond accurate sends at the cost of cpu, default 0), max_batch
+		// (default 64) and gso (0 disables UDP segmentation offload).
+		// rate (kbit/s) and burst (bytes) cap the output with a traffic_shaper,
+		// nic names an interface whose nic_rate (kbit/s) all outputs naming it
+		// share and offload=1 has the kernel pace the rate (needs the fq qdisc).
+		// muxer=native selects ts_muxer instead of libavformat, for CBR output with
+		// exact PCRs (requires muxrate), and check=1 runs the output through
+		// ts_checker. Any other parameter is passed to the muxer, e.g. muxrate.
+		//
+		// tools/udp_receiver receives the output on loopback and reports the
+		// inter-arrival jitter of the datagrams.
+		class udp_consumer : public packetConsumer
+		{
+		public:
+			udp_consumer(const std::shared_ptr<packetProducer>& producer, const std::wstring& url);
+			virtual ~udp_consumer();
+
+			std::wstring						print() const override;
+			boost::property_tree::wptree		info() const override;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
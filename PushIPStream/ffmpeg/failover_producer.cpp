@@ -0,0 +1,504 @@
+#include "StdAfx.h"
+
+#include "failover_producer.h"
+
+#include "ffmpeg_error.h"
+#include "packet_lanes.h"
+#include "packet_source.h"
+#include "timeline_splicer.h"
+
+#include <common/except.h>
+#include <common/executor.h>
+#include <common/log.h>
+
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const size_t MAX_WINDOW_PACKETS = 5000;
+
+		typedef boost::chrono::steady_clock failover_clock;
+
+		struct failover_connection : boost::noncopyable
+		{
+			std::shared_ptr<packetProducer>			producer;
+			std::shared_ptr<AVFormatContext>		context;
+			std::unique_ptr<packet_source>			packets;
+			std::vector<int>						stream_map;
+		};
+
+		struct failover_source : boost::noncopyable
+		{
+			const std::wstring									name;
+			const std::wstring									url;
+			std::shared_ptr<failover_connection>				connection;
+			std::future<std::shared_ptr<failover_connection>>	opening;
+			executor											opener;
+			failover_clock::time_point							retry_at;
+			failover_clock::time_point							last_arrival;
+			failover_clock::time_point							flowing_since;
+			bool												flowing			= false;
+			std::deque<std::shared_ptr<AVPacket>>				window;
+			tbb::atomic<bool>									connected;
+
+			failover_source(const std::wstring& name, const std::wstring& url)
+				: name(name)
+				, url(url)
+				, opener(L"failover-opener-" + name)
+			{
+				connected = false;
+			}
+		};
+
+		struct failover_producer::impl : boost::noncopyable
+		{
+			const factory						create_;
+			const settings						settings_;
+			std::shared_ptr<AVFormatContext>	output_;
+			std::unique_ptr<packet_lanes>		lanes_;
+			std::unique_ptr<timeline_splicer>	splicer_;
+			bool								has_video_		= false;
+
+			failover_source						primary_;
+			failover_source						backup_;
+			failover_source*					active_			= nullptr;
+			bool								awaiting_key_	= true;
+
+			tbb::atomic<bool>					on_backup_;
+			tbb::atomic<uint64_t>				switches_;
+			tbb::atomic<uint64_t>				stalls_;
+			tbb::atomic<uint64_t>				reopens_;
+
+			tbb::atomic<bool>					is_running_;
+			boost::thread						thread_;
+
+			impl(const std::wstring& primary, const std::wstring& backup, const factory& create, const settings& settings)
+				: create_(create)
+				, settings_(settings)
+				, primary_(L"primary", primary)
+				, backup_(L"backup", backup)
+			{
+				on_backup_	= false;
+				switches_	= 0;
+				stalls_		= 0;
+				reopens_	= 0;
+
+				auto now = failover_clock::now();
+
+				for (auto s : { &primary_, &backup_ })
+				{
+					try
+					{
+						connect(*s, open(*s), now);
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						s->retry_at = now + interval(settings_.reopen_interval);
+					}
+				}
+
+				active_ = primary_.connection ? &primary_ : &backup_;
+
+				if (!active_->connection)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"Neither " + primary + L" nor " + backup + L" could be opened."));
+
+				output_		= clone_layout(*active_->connection->context, AVRational{ 0, 1 });
+				lanes_.reset(new packet_lanes(*output_));
+				splicer_.reset(new timeline_splicer(output_));
+				on_backup_	= active_ == &backup_;
+
+				for (unsigned int i = 0; i < output_->nb_streams; ++i)
+					has_video_ = has_video_ || output_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO;
+
+				for (auto s : { &primary_, &backup_ })
+				{
+					if (!s->connection)
+						continue;
+
+					try
+					{
+						s->connection->stream_map = splicer_->map(*s->connection->context, s->name);
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						disconnect(*s, now);
+					}
+				}
+
+				is_running_ = true;
+				thread_ = boost::thread([this] { run(); });
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+				thread_.join();
+			}
+
+			static failover_clock::duration interval(int64_t value)
+			{
+				return boost::chrono::duration_cast<failover_clock::duration>(boost::chrono::microseconds(value));
+			}
+
+			std::shared_ptr<failover_connection> open(const failover_source& s) const
+			{
+				auto connection = std::make_shared<failover_connection>();
+				connection->producer = create_(s.url);
+
+				if (!connection->producer)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"Could not open " + s.url));
+
+				connection->context = connection->producer->context();
+				connection->packets.reset(new packet_source(connection->producer));
+
+				// Not known yet while the constructor opens the sources.
+				if (splicer_)
+					connection->stream_map = splicer_->map(*connection->context, s.name);
+
+				return connection;
+			}
+
+			void connect(failover_source& s, const std::shared_ptr<failover_connection>& connection, failover_clock::time_point now)
+			{
+				s.connection	= connection;
+				s.connected		= true;
+				s.flowing		= false;
+				s.last_arrival	= now;	// Grace period before it can count as stalled.
+
+				// A reconnected source on air starts a new timeline.
+				if (&s == active_)
+				{
+					awaiting_key_ = true;
+					splicer_->splice();
+				}
+			}
+
+			void disconnect(failover_source& s, failover_clock::time_point now)
+			{
+				s.connection.reset();
+				s.connected	= false;
+				s.flowing	= false;
+				s.window.clear();
+				s.retry_at	= now + interval(settings_.reopen_interval);
+			}
+
+			void run()
+			{
+				try
+				{
+					while (is_running_)
+					{
+						auto now	= failover_clock::now();
+						auto busy	= false;
+
+						for (auto s : { &primary_, &backup_ })
+						{
+							maintain(*s, now);
+							busy = read(*s, now) || busy;
+						}
+
+						evaluate(now);
+
+						if (!busy)
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+					}
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				if (is_running_)
+					lanes_->push_end();
+			}
+
+			// Reopens a source that ended, in the background.
+			void maintain(failover_source& s, failover_clock::time_point now)
+			{
+				if (s.opening.valid())
+				{
+					if (s.opening.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+						return;
+
+					try
+					{
+						connect(s, s.opening.get(), now);
+						++reopens_;
+
+						CASPAR_LOG(info) << L"[failover] Reopened " << s.name << L" " << s.url;
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						s.retry_at = now + interval(settings_.reopen_interval);
+					}
+
+					return;
+				}
+
+				if (!s.connection && now >= s.retry_at)
+				{
+					auto source = &s;
+					s.opening = s.opener.begin_invoke([=] { return open(*source); });
+				}
+			}
+
+			bool read(failover_source& s, failover_clock::time_point now)
+			{
+				if (!s.connection)
+					return false;
+
+				auto on_air	= &s == active_;
+				auto count	= 0;
+				std::shared_ptr<AVPacket> packet;
+
+				while (true)
+				{
+					if (on_air && lanes_->full())
+					{
+						// Back-pressure from the output, not a stall of the source: it
+						// still counts as arriving while packets wait in its own queue.
+						if (s.connection->packets->ready())
+							s.last_arrival = now;
+
+						break;
+					}
+
+					if (!s.connection->packets->try_pop(packet))
+						break;
+
+					++count;
+
+					if (!packet->data)
+					{
+						if (packet->pos == -1)
+						{
+							CASPAR_LOG(warning) << L"[failover] " << s.name << L" " << s.url << L" ended, reopening.";
+							disconnect(s, now);
+							break;
+						}
+
+						continue;
+					}
+
+					if (!s.flowing)
+					{
+						s.flowing		= true;
+						s.flowing_since	= now;
+					}
+
+					s.last_arrival = now;
+
+					if (on_air && !awaiting_key_)
+						emit(s, packet);
+					else
+					{
+						s.window.push_back(packet);
+
+						if (on_air)
+							start_from_key(s);
+						else
+							trim(s);
+					}
+				}
+
+				return count > 0;
+			}
+
+			bool stalled(const failover_source& s, failover_clock::time_point now) const
+			{
+				return !s.connection || now - s.last_arrival > interval(settings_.stall_timeout);
+			}
+
+			void evaluate(failover_clock::time_point now)
+			{
+				for (auto s : { &primary_, &backup_ })
+				{
+					if (s->flowing && stalled(*s, now))
+					{
+						CASPAR_LOG(warning) << L"[failover] " << s->name << L" " << s->url << L" stalled.";
+						s->flowing = false;
+						++stalls_;
+					}
+				}
+
+				auto& standby = active_ == &primary_ ? backup_ : primary_;
+
+				if (stalled(*active_, now))
+				{
+					if (!stalled(standby, now) && standby.flowing)
+						switch_to(standby);
+				}
+				else if (active_ == &backup_ && primary_.flowing && now - primary_.flowing_since >= interval(settings_.recovery))
+					switch_to(primary_);
+			}
+
+			void switch_to(failover_source& s)
+			{
+				CASPAR_LOG(warning) << L"[failover] Switching to " << s.name << L" " << s.url;
+
+				active_->window.clear();
+				active_			= &s;
+				on_backup_		= active_ == &backup_;
+				awaiting_key_	= true;
+				++switches_;
+
+				splicer_->splice();
+				start_from_key(s);
+			}
+
+			static bool is_video(const failover_source& s, const AVPacket& packet)
+			{
+				auto& context = *s.connection->context;
+
+				return packet.stream_index >= 0
+					&& packet.stream_index < static_cast<int>(context.nb_streams)
+					&& context.streams[packet.stream_index]->codec->codec_type == AVMEDIA_TYPE_VIDEO;
+			}
+
+			bool is_key(const failover_source& s, const AVPacket& packet) const
+			{
+				return !has_video_ || (is_video(s, packet) && (packet.flags & AV_PKT_FLAG_KEY));
+			}
+
+			int64_t dts_of(const failover_source& s, const AVPacket& packet) const
+			{
+				auto ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+				if (ts == AV_NOPTS_VALUE)
+					return AV_NOPTS_VALUE;
+
+				return av_rescale_q(ts, s.connection->context->streams[packet.stream_index]->time_base, AVRational{ 1, AV_TIME_BASE });
+			}
+
+			// Goes on air from the latest key frame in the window, packets of other
+			// streams from before it are dropped. Without a key frame the window
+			// keeps filling until one arrives.
+			void start_from_key(failover_source& s)
+			{
+				auto key = std::find_if(s.window.rbegin(), s.window.rend(), [&](const std::shared_ptr<AVPacket>& p)
+				{
+					return is_key(s, *p);
+				});
+
+				if (key == s.window.rend())
+				{
+					if (s.window.size() > MAX_WINDOW_PACKETS)
+						s.window.pop_front();
+
+					return;
+				}
+
+				auto begin		= std::prev(key.base());
+				auto key_dts	= dts_of(s, **begin);
+
+				for (auto it = begin; it != s.window.end(); ++it)
+				{
+					if (it != begin && key_dts != AV_NOPTS_VALUE && !is_video(s, **it))
+					{
+						auto dts = dts_of(s, **it);
+
+						if (dts != AV_NOPTS_VALUE && dts < key_dts)
+							continue;
+					}
+
+					emit(s, *it);
+				}
+
+				s.window.clear();
+				awaiting_key_ = false;
+			}
+
+			// Keeps about window worth of packets, dropping whole GOPs from the front
+			// so it starts at a key frame.
+			void trim(failover_source& s)
+			{
+				while (s.window.size() > 1)
+				{
+					auto first	= dts_of(s, *s.window.front());
+					auto last	= dts_of(s, *s.window.back());
+					auto span	= first != AV_NOPTS_VALUE && last != AV_NOPTS_VALUE ? last - first : 0;
+
+					if (span <= settings_.window && s.window.size() <= MAX_WINDOW_PACKETS)
+						break;
+
+					auto next_key = std::find_if(s.window.begin() + 1, s.window.end(), [&](const std::shared_ptr<AVPacket>& p)
+					{
+						return is_key(s, *p);
+					});
+
+					if (next_key != s.window.end())
+						s.window.erase(s.window.begin(), next_key);
+					else if (s.window.size() > MAX_WINDOW_PACKETS)
+						s.window.pop_front();
+					else
+						break;
+				}
+			}
+
+			void emit(failover_source& s, const std::shared_ptr<AVPacket>& packet)
+			{
+				if (splicer_->apply(*s.connection->context, s.connection->stream_map, *packet))
+					lanes_->push(packet);
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"on-air", on_backup_ ? L"backup" : L"primary");
+				info.add(L"primary", primary_.url);
+				info.add(L"backup", backup_.url);
+				info.add(L"primary-connected", primary_.connected);
+				info.add(L"backup-connected", backup_.connected);
+				info.add(L"switches", switches_);
+				info.add(L"stalls", stalls_);
+				info.add(L"reopens", reopens_);
+
+				return info;
+			}
+		};
+
+		failover_producer::failover_producer(const std::wstring& primary, const std::wstring& backup, const factory& create, const settings& settings)
+			: impl_(new impl(primary, backup, create, settings))
+		{
+		}
+
+		bool failover_producer::receive_v(std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->lanes_->receive_v(packet);
+		}
+
+		bool failover_producer::receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			return impl_->lanes_->receive_a(packet, stream_index);
+		}
+
+		bool failover_producer::receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			return impl_->lanes_->receive_s(packet, stream_index);
+		}
+
+		std::shared_ptr<AVFormatContext> failover_producer::context()
+		{
+			return impl_->output_;
+		}
+
+		boost::property_tree::wptree failover_producer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
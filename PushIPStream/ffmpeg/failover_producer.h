@@ -0,0 +1,56 @@
+#pragma once
+
+#include "../packetProducer.h"
+#include "util/util.h"
+
+#include <common/memory.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Hot standby for live sources. The primary and the backup are both kept
+		// open and demuxing. The one on air goes straight to the output, the other
+		// only keeps a rolling window of its latest packets, starting at a key
+		// frame where it can.
+		//
+		// A source that delivers nothing for stall_timeout counts as stalled. A
+		// read that hangs is interrupted by the input after its own timeout and
+		// the source is reopened in the background. When the source on air stalls
+		// and the other one is flowing, the output continues from the latest key
+		// frame of the other one, rebased to where the output ends. The primary
+		// takes over again once it has been flowing for the recovery time.
+		class failover_producer : public packetProducer
+		{
+		public:
+			typedef std::function<std::shared_ptr<packetProducer>(const std::wstring& url)> factory;
+
+			struct settings
+			{
+				int64_t		stall_timeout		= AV_TIME_BASE / 2;		// AV_TIME_BASE units, as all below.
+				int64_t		window				= 2 * AV_TIME_BASE;		// What the standby source keeps buffered.
+				int64_t		recovery			= 3 * AV_TIME_BASE;		// How long the primary flows before it goes back on air.
+				int64_t		reopen_interval		= AV_TIME_BASE;			// Between attempts to reopen a source that ended.
+			};
+
+			// Opens both sources before returning, the stream layout is the one of
+			// the primary, or of the backup when only that one opens.
+			failover_producer(const std::wstring& primary, const std::wstring& backup, const factory& create, const settings& settings);
+
+			bool								receive_v(std::shared_ptr<AVPacket>& packet) override;
+			bool								receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index) override;
+			bool								receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index) override;
+			std::shared_ptr<AVFormatContext>	context() override;
+
+			boost::property_tree::wptree		info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
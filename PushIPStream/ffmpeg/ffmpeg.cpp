@@ -12,8 +12,17 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/thread/tss.hpp>
 #include <boost/bind.hpp>
+#include <boost/chrono/system_clocks.hpp>
 
+#include <tbb/atomic.h>
 #include <tbb/recursive_mutex.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
 
 #if defined(_MSC_VER)
 #pragma warning (disable : 4244)
@@ -80,57 +89,242 @@ namespace caspar {
 			}
 		}
 
+		// Token bucket per logging AVClass instance. A broken stream can make a
+		// single demuxer or decoder emit thousands of warnings per second, so
+		// each instance may log LOG_BURST messages at once and LOG_RATE per
+		// second after that. Messages over the limit are counted and reported
+		// once the instance is allowed to log again.
+		static const double			LOG_RATE = 10.0;
+		static const double			LOG_BURST = 50.0;
+		static const std::size_t	MAX_LOG_BUCKETS = 1024;
+
+		struct log_bucket
+		{
+			double			tokens;
+			std::int64_t	last_refill;
+			std::uint64_t	suppressed;
+		};
+
+		tbb::atomic<std::uint64_t>& get_suppressed_log_messages()
+		{
+			static tbb::atomic<std::uint64_t> instance;
+
+			return instance;
+		}
+
+		std::int64_t log_clock_now()
+		{
+			using namespace boost::chrono;
+
+			return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+		}
+
+		bool try_consume_log_token(const void* instance, std::uint64_t& previously_suppressed)
+		{
+			static tbb::spin_mutex									mutex;
+			static std::unordered_map<const void*, log_bucket>		buckets;
+
+			auto now = log_clock_now();
+
+			tbb::spin_mutex::scoped_lock lock(mutex);
+
+			if (buckets.size() > MAX_LOG_BUCKETS)
+			{
+				// Forget instances that have been refilled to the brim, most
+				// likely they have been destroyed.
+				for (auto it = buckets.begin(); it != buckets.end();)
+				{
+					if (now - it->second.last_refill > static_cast<std::int64_t>(LOG_BURST / LOG_RATE * 1000000.0) && it->second.suppressed == 0)
+						it = buckets.erase(it);
+					else
+						++it;
+				}
+			}
+
+			auto result = buckets.insert(std::make_pair(instance, log_bucket { LOG_BURST, now, 0 }));
+			auto& bucket = result.first->second;
+
+			bucket.tokens		= std::min(LOG_BURST, bucket.tokens + (now - bucket.last_refill) * LOG_RATE / 1000000.0);
+			bucket.last_refill	= now;
+
+			if (bucket.tokens < 1.0)
+			{
+				++bucket.suppressed;
+				return false;
+			}
+
+			bucket.tokens			-= 1.0;
+			previously_suppressed	= bucket.suppressed;
+			bucket.suppressed		= 0;
+
+			return true;
+		}
+
+		boost::log::trivial::severity_level to_severity(int level)
+		{
+			if (level == AV_LOG_VERBOSE)
+				return boost::log::trivial::debug;
+			else if (level == AV_LOG_INFO)
+				return boost::log::trivial::info;
+			else if (level == AV_LOG_WARNING)
+				return boost::log::trivial::warning;
+			else if (level == AV_LOG_ERROR)
+				return boost::log::trivial::error;
+			else if (level == AV_LOG_FATAL)
+				return boost::log::trivial::fatal;
+			else
+				return boost::log::trivial::trace;
+		}
+
+		void write_log_line(int level, const char* line)
+		{
+			try
+			{
+				BOOST_LOG_CHANNEL_SEV(::caspar::log::logger::get(), ::caspar::log::log_category::normal, to_severity(level)) << L"[ffmpeg] " << line;
+			}
+			catch (...)
+			{
+			}
+		}
+
+		// How often a message repeated for a long time is reported while it
+		// keeps repeating.
+		static const std::int64_t	REPEAT_REPORT_INTERVAL = 1000000;
+
+		// Formatting state is kept per thread so that concurrent decoder
+		// threads neither share the buffers nor each other's line prefix and
+		// repeat detection. Repeats still pending are reported when the thread
+		// exits.
+		struct log_thread_state
+		{
+			char			line[8192];
+			char			previous[8192];
+			int				previous_level	= 0;
+			std::uint64_t	repeat_count	= 0;
+			std::int64_t	repeat_reported	= 0;
+			bool			print_prefix	= true;
+
+			log_thread_state()
+			{
+				line[0]		= 0;
+				previous[0]	= 0;
+			}
+
+			~log_thread_state()
+			{
+				report_repeats();
+			}
+
+			void report_repeats()
+			{
+				if (repeat_count == 0)
+					return;
+
+				char notice[64];
+				snprintf(notice, sizeof(notice), "Last message repeated %llu times", static_cast<unsigned long long>(repeat_count));
+				write_log_line(previous_level, notice);
+				repeat_count	= 0;
+				repeat_reported	= log_clock_now();
+			}
+		};
+
+		log_thread_state& get_log_thread_state()
+		{
+			static boost::thread_specific_ptr<log_thread_state> state_for_thread;
+
+			auto local = state_for_thread.get();
+
+			if (!local)
+			{
+				local = new log_thread_state();
+				state_for_thread.reset(local);
+			}
+
+			return *local;
+		}
+
+		std::uint64_t suppressed_log_messages()
+		{
+			return get_suppressed_log_messages();
+		}
+
 		void log_callback(void* ptr, int level, const char* fmt, va_list vl)
 		{
-			static int print_prefix = 1;
-			static char prev[1024];
-			char line[8192];
-			AVClass* avc = ptr ? *(AVClass**)ptr : NULL;
 			if (level > AV_LOG_DEBUG)
 				return;
+
+			// Cheapest possible rejection, before anything is formatted.
+			if (to_severity(level) < log::get_log_level())
+				return;
+
+			auto& state = get_log_thread_state();
+			auto line = state.line;
+			auto capacity = sizeof(state.line);
+			AVClass* avc = ptr ? *(AVClass**)ptr : NULL;
+			std::size_t len = 0;
+
 			line[0] = 0;
 
-#undef fprintf
-			if (print_prefix && avc)
+			if (state.print_prefix && avc)
 			{
 				if (avc->parent_log_context_offset)
 				{
 					AVClass** parent = *(AVClass***)(((uint8_t*)ptr) + avc->parent_log_context_offset);
 					if (parent && *parent)
-						std::sprintf(line, "[%s @ %p] ", (*parent)->item_name(parent), parent);
+						len += std::max(0, snprintf(line, capacity, "[%s @ %p] ", (*parent)->item_name(parent), parent));
 				}
-				std::sprintf(line + strlen(line), "[%s @ %p] ", avc->item_name(ptr), ptr);
+				if (len < capacity)
+					len += std::max(0, snprintf(line + len, capacity - len, "[%s @ %p] ", avc->item_name(ptr), ptr));
 			}
 
-			std::vsprintf(line + strlen(line), fmt, vl);
+			if (len < capacity)
+				vsnprintf(line + len, capacity - len, fmt, vl);
 
-			print_prefix = strlen(line) && line[strlen(line) - 1] == '\n';
+			line[capacity - 1] = 0;
+			len = strlen(line);
+
+			state.print_prefix = len && line[len - 1] == '\n';
 
-			//strcpy(prev, line);
 			sanitize((uint8_t*)line);
 
-			auto len = strlen(line);
-			if (len > 0)
+			if (len > 0 && line[len - 1] == '\n')
 				line[len - 1] = 0;
 
-			try
+			// Collapse identical consecutive messages from this thread, before the
+			// rate limit so repeats do not use up the budget of other messages.
+			if (level == state.previous_level && strcmp(line, state.previous) == 0)
 			{
-				if (level == AV_LOG_VERBOSE)
-					CASPAR_LOG(debug) << L"[ffmpeg] " << line;
-				else if (level == AV_LOG_INFO)
-					CASPAR_LOG(info) << L"[ffmpeg] " << line;
-				else if (level == AV_LOG_WARNING)
-					CASPAR_LOG(warning) << L"[ffmpeg] " << line;
-				else if (level == AV_LOG_ERROR)
-					CASPAR_LOG(error) << L"[ffmpeg] " << line;
-				else if (level == AV_LOG_FATAL)
-					CASPAR_LOG(fatal) << L"[ffmpeg] " << line;
-				else
-					CASPAR_LOG(trace) << L"[ffmpeg] " << line;
+				++state.repeat_count;
+				++get_suppressed_log_messages();
+
+				if (log_clock_now() - state.repeat_reported > REPEAT_REPORT_INTERVAL)
+					state.report_repeats();
+
+				return;
 			}
-			catch (...)
+
+			std::uint64_t previously_suppressed = 0;
+
+			if (!try_consume_log_token(ptr, previously_suppressed))
+			{
+				++get_suppressed_log_messages();
+				return;
+			}
+
+			if (previously_suppressed > 0)
 			{
+				char notice[128];
+				snprintf(notice, sizeof(notice), "%llu messages suppressed from %p", static_cast<unsigned long long>(previously_suppressed), ptr);
+				write_log_line(AV_LOG_WARNING, notice);
 			}
+
+			state.report_repeats();
+
+			std::memcpy(state.previous, line, strlen(line) + 1);
+			state.previous_level	= level;
+			state.repeat_reported	= log_clock_now();
+
+			write_log_line(level, line);
 		}
 
 		std::wstring make_version(unsigned int ver)
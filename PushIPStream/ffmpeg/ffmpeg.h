@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
 
 namespace caspar { namespace ffmpeg {
@@ -13,5 +15,6 @@ void uninit();
 std::shared_ptr<void> temporary_enable_quiet_logging_for_thread(bool enable);
 void enable_quiet_logging_for_thread();
 bool is_logging_quiet_for_thread();
+std::uint64_t suppressed_log_messages();
 
 }}
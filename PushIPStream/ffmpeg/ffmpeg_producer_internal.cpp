@@ -7,9 +7,10 @@ namespace caspar
 {
 	namespace ffmpeg {
 
-		ffmpeg_producer_internal::ffmpeg_producer_internal(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params)
+		ffmpeg_producer_internal::ffmpeg_producer_internal(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params, const timestamp_normalizer::settings& timestamps, int trick_play)
 			:filename_(url_or_file)
-			, input_(url_or_file, loop, in, out, vid_params)
+			, input_(url_or_file, loop, in, out, vid_params, trick_play)
+			, normalizer_(input_.context(), timestamps)
 			, current_video_pts_(0)
 			, current_audio_pts_(0)
 			, current_subti_pts_(0)
@@ -57,7 +58,16 @@ namespace caspar
 				}
 
 				std::shared_ptr<AVPacket> pkt;
-				input_.try_pop(pkt);
+
+				if (!input_.try_pop(pkt))
+				{
+					boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+					continue;
+				}
+
+				if (pkt)
+					normalizer_.normalize(*pkt);
+
 				//߳ʵǿ˳
 				video_packets_->push(pkt);
 
@@ -82,6 +92,11 @@ namespace caspar
 
 			}
 		}
+		bool ffmpeg_producer_internal::buffered()
+		{
+			return !video_packets_ || static_cast<size_t>(video_packets_->getSize()) >= PKT_BUFFER_COUNT || input_.eof();
+		}
+
 		bool ffmpeg_producer_internal::receive_v(std::shared_ptr<AVPacket>& packet)
 		{
 
@@ -141,6 +156,11 @@ namespace caspar
 
 			return true;
 		}
+
+		std::shared_ptr<AVFormatContext> ffmpeg_producer_internal::context()
+		{
+			return normalizer_.context();
+		}
 	}
 }
 
@@ -3,6 +3,7 @@
 #include "util/util.h"
 #include "input.h"
 #include "packetsQueue.h"
+#include "timestamp_normalizer.h"
 
 #include <boost/thread.hpp>
 
@@ -16,12 +17,13 @@ namespace caspar
 			public packetProducer
 		{
 		public:
-			ffmpeg_producer_internal(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params);
+			ffmpeg_producer_internal(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params, const timestamp_normalizer::settings& timestamps = timestamp_normalizer::settings(), int trick_play = 0);
 			virtual ~ffmpeg_producer_internal();
 
 		public:
 			const std::wstring									filename_;
 			input												input_;
+			timestamp_normalizer								normalizer_;
 			std::unique_ptr<packetsQueue>                       video_packets_;
 			std::vector<std::unique_ptr<packetsQueue>>			audio_packets_;
 			std::vector<std::unique_ptr<packetsQueue>>			subti_packets_;
@@ -40,6 +42,10 @@ namespace caspar
 			bool receive_v(std::shared_ptr<AVPacket>& packet);
 			bool receive_a(std::shared_ptr<AVPacket>& packet,int& stream_index);
 			bool receive_s(std::shared_ptr<AVPacket>& packet,int& stream_index);
+			std::shared_ptr<AVFormatContext> context();
+			// Whether the first buffer fill is done: the video queue is full or the
+			// input ended.
+			bool buffered();
 		private:
 			void run();
 		};
@@ -0,0 +1,132 @@
+#include "StdAfx.h"
+
+#include "gop_cache.h"
+
+#include "util/util.h"
+
+#include <boost/property_tree/ptree.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		struct gop_cache::impl : boost::noncopyable
+		{
+			const std::shared_ptr<AVFormatContext>	context_;
+			const size_t							max_bytes_;
+			int										video_index_	= -1;
+			std::vector<std::shared_ptr<AVPacket>>	packets_;
+			size_t									bytes_			= 0;
+			int64_t									first_dts_		= AV_NOPTS_VALUE;
+			int64_t									last_dts_		= AV_NOPTS_VALUE;
+			uint64_t								gops_			= 0;
+			uint64_t								overflows_		= 0;
+			bool									overflowed_		= false;
+
+			impl(const std::shared_ptr<AVFormatContext>& context, size_t max_bytes)
+				: context_(context)
+				, max_bytes_(max_bytes)
+			{
+				// Same stream selection as packet_backlog.
+				for (unsigned int i = 0; i < context_->nb_streams; ++i)
+				{
+					if (context_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+						video_index_ = i;
+				}
+			}
+
+			void push(const std::shared_ptr<AVPacket>& packet)
+			{
+				if (video_index_ < 0 || max_bytes_ == 0)
+					return;
+
+				if (!packet->data)
+				{
+					clear();
+					return;
+				}
+
+				auto is_video = packet->stream_index == video_index_;
+
+				if (is_video && (packet->flags & AV_PKT_FLAG_KEY))
+				{
+					clear();
+					overflowed_ = false;
+					++gops_;
+				}
+				else if (packets_.empty())
+					return; // Waiting for a key frame.
+
+				if (bytes_ + packet->size > max_bytes_)
+				{
+					if (!overflowed_)
+						++overflows_;
+
+					overflowed_ = true;
+					clear();
+					return;
+				}
+
+				packets_.push_back(packet);
+				bytes_ += packet->size;
+
+				if (is_video && packet->dts != AV_NOPTS_VALUE)
+				{
+					if (first_dts_ == AV_NOPTS_VALUE)
+						first_dts_ = packet->dts;
+
+					last_dts_ = packet->dts;
+				}
+			}
+
+			void clear()
+			{
+				packets_.clear();
+				bytes_		= 0;
+				first_dts_	= AV_NOPTS_VALUE;
+				last_dts_	= AV_NOPTS_VALUE;
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				int64_t duration = 0;
+
+				if (first_dts_ != AV_NOPTS_VALUE)
+					duration = av_rescale_q(last_dts_ - first_dts_, context_->streams[video_index_]->time_base, AVRational{ 1, 1000 });
+
+				boost::property_tree::wptree info;
+				info.add(L"packets", packets_.size());
+				info.add(L"bytes", bytes_);
+				info.add(L"duration-ms", duration);
+				info.add(L"gops", gops_);
+				info.add(L"overflows", overflows_);
+
+				return info;
+			}
+		};
+
+		gop_cache::gop_cache(const std::shared_ptr<AVFormatContext>& context, size_t max_bytes)
+			: impl_(new impl(context, max_bytes))
+		{
+		}
+
+		void gop_cache::push(const std::shared_ptr<AVPacket>& packet)
+		{
+			impl_->push(packet);
+		}
+
+		void gop_cache::clear()
+		{
+			impl_->clear();
+		}
+
+		const std::vector<std::shared_ptr<AVPacket>>& gop_cache::packets() const
+		{
+			return impl_->packets_;
+		}
+
+		boost::property_tree::wptree gop_cache::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <common/memory.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct AVFormatContext;
+struct AVPacket;
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// The packets of all streams of a live input since its last video key
+		// frame, so an output attached while it runs can start from that key
+		// frame at once, with the original timestamps, instead of waiting up to
+		// a GOP for the next one.
+		//
+		// Packets are the refcounted ones every output gets, so the cache only
+		// holds on to a GOP's worth of buffers per input. A GOP larger than
+		// max_bytes, a flush (discontinuity or end of input) or an input without
+		// video empties it until the next key frame. Not thread safe.
+		class gop_cache : boost::noncopyable
+		{
+		public:
+			static const size_t DEFAULT_MAX_BYTES = 64 * 1024 * 1024;
+
+			explicit gop_cache(const std::shared_ptr<AVFormatContext>& context, size_t max_bytes = DEFAULT_MAX_BYTES);
+
+			void											push(const std::shared_ptr<AVPacket>& packet);
+			void											clear();
+
+			// In input order, starting with a video key frame, or empty.
+			const std::vector<std::shared_ptr<AVPacket>>&	packets() const;
+
+			boost::property_tree::wptree					info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -2,6 +2,7 @@
 
 #include "ffmpeg_error.h"
 #include "ffmpeg.h"
+#include "read_cache.h"
 #include "util/flv.h"
 
 #include <common/executor.h>
@@ -14,6 +15,9 @@
 #include <tbb/atomic.h>
 #include <tbb/recursive_mutex.h>
 
+#include <algorithm>
+#include <vector>
+
 #if defined(_MSC_VER)
 #pragma warning (push)
 #pragma warning (disable : 4244)
@@ -33,6 +37,12 @@ static const size_t MAX_BUFFER_COUNT = 100;
 static const size_t MAX_BUFFER_COUNT_RT = 3;
 static const size_t MIN_BUFFER_COUNT = 50;
 static const size_t MAX_BUFFER_SIZE = 64 * 1000000;
+static const int MIN_TRICK_SPEED = 2;
+static const int MAX_TRICK_SPEED = 64;
+// Packets read after a jump before giving up on finding its key frame.
+static const int MAX_KEYFRAME_READS = 1000;
+// Jumps without a new key frame before trick play gives up, as at the end.
+static const int MAX_KEYFRAME_SEEKS = 100;
 namespace caspar {
 	namespace ffmpeg {
 
@@ -54,7 +64,22 @@ namespace caspar {
 			boost::posix_time::ptime                                    last_checktime_;
 			int															check_timeout_;
 
-			explicit impl(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params)
+			// Trick play, used on the executor only except speed_.
+			struct keyframe
+			{
+				int64_t	timestamp;	// Video stream time base.
+			};
+
+			const int													video_index_ = av_find_best_stream(format_context_.get(), AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+			tbb::atomic<int>											speed_;
+			std::vector<keyframe>										keyframes_;		// From the demuxer, empty seeks by timestamp.
+			size_t														next_keyframe_ = 0;
+			int64_t														next_target_ = AV_NOPTS_VALUE;
+			int64_t														trick_origin_ = AV_NOPTS_VALUE;
+			int64_t														trick_last_ = AV_NOPTS_VALUE;	// Key frame played last.
+			int64_t														last_video_ts_ = AV_NOPTS_VALUE;
+
+			explicit impl(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params, int trick_play)
 				:format_context_(open_input(url_or_file, vid_params))
 				,filename_(url_or_file)
 				,executor_(print())
@@ -77,7 +102,11 @@ namespace caspar {
 				}
 				loop_ = loop;
 				buffer_size_ = 0;
-				if (in_ > 0)
+				speed_ = 0;
+				// Before the first read, so no packet is read at normal speed.
+				if (trick_play > 0)
+					set_trick_play(trick_play);
+				else if (in_ > 0)
 					queued_seek(in_);
 
 			}
@@ -112,6 +141,9 @@ namespace caspar {
 
 				file_frame_number_ = target;
 
+				if (speed_ > 0)
+					restart_trick_play(timestamp_of(target));
+
 				auto flush_packet = create_packet();
 				flush_packet->data = nullptr;
 				flush_packet->size = 0;
@@ -164,7 +196,10 @@ namespace caspar {
 					{
 						auto packet = create_packet();
 
-						auto ret = av_read_frame(format_context_.get(), packet.get()); // packet is only valid until next call of av_read_frame. Use av_dup_packet to extend its life.
+						// The interrupt timeout applies to each read, not to the input as a whole.
+						setCurrentCheckTime(check_timeout_);
+
+						auto ret = speed_ > 0 ? read_keyframe(*packet) : av_read_frame(format_context_.get(), packet.get()); // packet is only valid until next call of av_read_frame. Use av_dup_packet to extend its life.
 
 						if (is_eof(ret))
 						{
@@ -195,6 +230,9 @@ namespace caspar {
 							if (packet->stream_index == default_stream_index_)
 								++file_frame_number_;
 
+							if (packet->stream_index == video_index_ && speed_ == 0)
+								last_video_ts_ = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
 							THROW_ON_ERROR2(av_dup_packet(packet.get()), print());
 
 							// Make sure that the packet is correctly deallocated even if size and data is modified during decoding.
@@ -215,11 +253,245 @@ namespace caspar {
 					}
 					catch (...)
 					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+
+						// Read errors and interrupts end the input like EOF does, so
+						// whoever reads the packets learns that nothing more is coming.
+						auto flush_packet = create_packet();
+						flush_packet->data = nullptr;
+						flush_packet->size = 0;
+						flush_packet->pos = -1;
+
+						buffer_.try_push(flush_packet);
+
 						executor_.stop();
 					}
 				});
             }
 
+			void trick_play(int speed)
+			{
+				if (!executor_.is_running())
+					return;
+
+				executor_.begin_invoke([=]
+				{
+					set_trick_play(speed);
+				});
+			}
+
+			// Switches between normal play (0) and key frames only at speed. The
+			// output continues where it is, from the key frame at the position
+			// played last.
+			void set_trick_play(int speed)
+			{
+				if (speed > 0)
+					speed = std::max(MIN_TRICK_SPEED, std::min(speed, MAX_TRICK_SPEED));
+
+				if (speed == speed_)
+					return;
+
+				uint32_t position = last_video_ts_ != AV_NOPTS_VALUE ? frame_of(last_video_ts_) : static_cast<uint32_t>(in_);
+
+				if (speed > 0 && !load_keyframe_index())
+				{
+					CASPAR_LOG(warning) << print() << L" Trick play needs a seekable input with a video stream.";
+					speed = 0;
+
+					if (speed_ == 0)
+					{
+						if (position > 0)
+							queued_seek(position);
+
+						return;
+					}
+				}
+
+				speed_ = speed;
+
+				// Only the key frames of the video are read in trick play, the demuxer
+				// skips the packets of the other streams without reading them where
+				// it can.
+				for (unsigned int index = 0; index < format_context_->nb_streams; ++index)
+				{
+					format_context_->streams[index]->discard = speed == 0 ? AVDISCARD_DEFAULT
+						: static_cast<int>(index) == video_index_ ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+				}
+
+				CASPAR_LOG(info) << print() << (speed > 0 ? L" Trick play at x" + std::to_wstring(speed) + L"." : std::wstring(L" Normal play."));
+
+				queued_seek(position);
+			}
+
+			void restart_trick_play(int64_t position)
+			{
+				next_keyframe_ = std::lower_bound(keyframes_.begin(), keyframes_.end(), position, [](const keyframe& key, int64_t timestamp)
+				{
+					return key.timestamp < timestamp;
+				}) - keyframes_.begin();
+
+				next_target_	= position;
+				trick_origin_	= AV_NOPTS_VALUE;
+				trick_last_		= AV_NOPTS_VALUE;
+			}
+
+			// The key frames of the video from the index of the demuxer, when it
+			// has one (mp4, mov, mkv with cues). Without one trick play seeks by
+			// timestamp to each key frame it plays, so nothing is read up front.
+			// False when the input can not jump.
+			bool load_keyframe_index()
+			{
+				keyframes_.clear();
+
+				if (video_index_ < 0 || !format_context_->pb || !(format_context_->pb->seekable & AVIO_SEEKABLE_NORMAL))
+					return false;
+
+				auto stream = format_context_->streams[video_index_];
+
+				for (int index = 0; index < stream->nb_index_entries; ++index)
+				{
+					auto& entry = stream->index_entries[index];
+
+					if (entry.flags & AVINDEX_KEYFRAME)
+						keyframes_.push_back(keyframe{ entry.timestamp });
+				}
+
+				if (keyframes_.size() > 1)
+					CASPAR_LOG(info) << print() << L" " << keyframes_.size() << L" key frames in the index of the demuxer.";
+				else
+					keyframes_.clear();
+
+				return true;
+			}
+
+			// Jumps to the next key frame due at the trick play speed and reads
+			// only it, retimed so the output runs speed times faster than the
+			// source. Key frames closer than speed frames to the one played are
+			// skipped, so the output has at most one frame per frame duration.
+			int read_keyframe(AVPacket& packet)
+			{
+				auto stream		= format_context_->streams[video_index_];
+				auto out		= out_ != std::numeric_limits<uint32_t>::max() ? timestamp_of(out_) : std::numeric_limits<int64_t>::max();
+				auto fps		= read_fps(*format_context_, 25.0);
+				auto step		= std::max<int64_t>(1, static_cast<int64_t>(speed_ * stream->time_base.den / (fps * stream->time_base.num)));
+				auto jump		= step;
+
+				for (int seeks = 0; seeks < MAX_KEYFRAME_SEEKS; ++seeks)
+				{
+					if (!keyframes_.empty())
+					{
+						while (next_keyframe_ < keyframes_.size() && trick_last_ != AV_NOPTS_VALUE && keyframes_[next_keyframe_].timestamp < trick_last_ + step)
+							++next_keyframe_;
+
+						// The index may only cover what was read so far, seek by timestamp
+						// past its end.
+						if (next_keyframe_ >= keyframes_.size())
+						{
+							keyframes_.clear();
+
+							if (trick_last_ != AV_NOPTS_VALUE)
+								next_target_ = trick_last_ + step;
+
+							continue;
+						}
+					}
+
+					auto indexed	= !keyframes_.empty();
+					auto target		= indexed ? keyframes_[next_keyframe_++].timestamp : next_target_;
+
+					if (target >= out)
+						break;
+
+					next_target_ = target + step;
+
+					setCurrentCheckTime(check_timeout_);
+
+					// Without AVSEEK_FLAG_BACKWARD the demuxer goes to the key frame at
+					// or after the target, which is the one wanted.
+					auto ret = av_seek_frame(format_context_.get(), video_index_, target, indexed ? AVSEEK_FLAG_BACKWARD : 0);
+
+					if (ret < 0)
+					{
+						if (indexed)
+							continue;
+
+						break; // Past the last key frame.
+					}
+
+					auto found = false;
+
+					for (int reads = 0; reads < MAX_KEYFRAME_READS && !found; ++reads)
+					{
+						setCurrentCheckTime(check_timeout_);
+
+						ret = av_read_frame(format_context_.get(), &packet);
+
+						if (ret < 0)
+							return ret;
+
+						found = packet.stream_index == video_index_ && (packet.flags & AV_PKT_FLAG_KEY);
+
+						if (!found)
+							av_packet_unref(&packet);
+					}
+
+					if (!found)
+						continue;
+
+					auto timestamp = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+
+					if (timestamp == AV_NOPTS_VALUE)
+						timestamp = target;
+
+					// Seeks by timestamp are approximate, they may land on the key frame
+					// played last. Jump further each time until past it.
+					if (trick_last_ != AV_NOPTS_VALUE && timestamp <= trick_last_)
+					{
+						jump *= 2;
+						next_target_ = target + jump;
+						av_packet_unref(&packet);
+						continue;
+					}
+
+					next_target_ = std::max(next_target_, timestamp + step);
+
+					if (trick_origin_ == AV_NOPTS_VALUE)
+						trick_origin_ = timestamp;
+
+					trick_last_			= timestamp;
+					last_video_ts_		= timestamp;
+					file_frame_number_	= frame_of(timestamp);
+					packet.dts			= trick_origin_ + (timestamp - trick_origin_) / speed_;
+					packet.pts			= packet.dts;
+
+					if (packet.duration > 0)
+						packet.duration = std::max<int64_t>(1, packet.duration / speed_);
+
+					return 0;
+				}
+
+				return AVERROR_EOF;
+			}
+
+			// Between frame numbers, as used by IN and OUT, and video timestamps.
+			int64_t timestamp_of(uint32_t frame) const
+			{
+				auto stream	= format_context_->streams[video_index_ >= 0 ? video_index_ : default_stream_index_];
+				auto fps	= read_fps(*format_context_, 25.0);
+				auto start	= stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+				return static_cast<int64_t>((frame / fps * stream->time_base.den) / stream->time_base.num) + start;
+			}
+
+			uint32_t frame_of(int64_t timestamp) const
+			{
+				auto stream	= format_context_->streams[video_index_ >= 0 ? video_index_ : default_stream_index_];
+				auto fps	= read_fps(*format_context_, 25.0);
+				auto start	= stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+				return static_cast<uint32_t>(std::max<int64_t>(0, static_cast<int64_t>((timestamp - start) * fps * stream->time_base.num / stream->time_base.den)));
+			}
+
 			spl::shared_ptr<AVFormatContext> open_input(const std::wstring& url_or_file, const ffmpeg_options& vid_params)
 			{
 				AVDictionary* format_options = nullptr;
@@ -249,6 +521,17 @@ namespace caspar {
 				weak_context->probesize = weak_context->probesize * 4;
 				weak_context->interrupt_callback.opaque = this;
 				weak_context->interrupt_callback.callback = this->check_interrupt;
+
+				// Local files are read through the process wide block cache, so
+				// channels playing the same file read it from disk once.
+				auto io = protocol.empty() || protocol == L"file" ? read_cache::instance().open(path) : nullptr;
+
+				if (io)
+				{
+					weak_context->pb = io.get();
+					weak_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+				}
+
 				setCurrentCheckTime(5);
 				try
 				{
@@ -258,7 +541,7 @@ namespace caspar {
 				{
 				}
 
-				spl::shared_ptr<AVFormatContext> context(weak_context, [](AVFormatContext* ptr)
+				spl::shared_ptr<AVFormatContext> context(weak_context, [io](AVFormatContext* ptr)
 				{
 					avformat_close_input(&ptr);
 				});
@@ -341,8 +624,8 @@ namespace caspar {
 			}
 		};
 
-		input::input(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params)
-			:impl_(new impl(url_or_file, loop, in, out, vid_params))
+		input::input(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params, int trick_play)
+			:impl_(new impl(url_or_file, loop, in, out, vid_params, trick_play))
 		{
 		}
 
@@ -361,6 +644,16 @@ namespace caspar {
 			impl_->in_ = value;
 		}
 
+		void input::trick_play(int speed)
+		{
+			impl_->trick_play(speed);
+		}
+
+		int input::trick_play() const
+		{
+			return impl_->speed_;
+		}
+
 		uint32_t input::in() const
 		{
 			return impl_->in_;
@@ -12,7 +12,8 @@ namespace caspar {
 		class input :boost::noncopyable
 		{
 		public:
-			explicit input(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params);
+			// trick_play is the speed to start at, see trick_play(int).
+			explicit input(const std::wstring& url_or_file, bool loop, uint32_t in, uint32_t out, const ffmpeg_options& vid_params, int trick_play = 0);
 
 			bool				try_pop(std::shared_ptr<AVPacket>& packet);
 			bool				eof() const;
@@ -22,6 +23,11 @@ namespace caspar {
 			uint32_t            out() const;
 			void                loop(bool value);
 			bool                loop() const;
+			// Key frames only at speed times real time (2 to 64), 0 plays
+			// normally. Needs a seekable input, jumps between the key frames in
+			// the index of the demuxer or seeks by timestamp to each of them.
+			void				trick_play(int speed);
+			int					trick_play() const;
 
 			int                 num_audio_streams() const;
 
@@ -0,0 +1,252 @@
+#include "StdAfx.h"
+
+#include "input_pool.h"
+
+#include "ffmpeg_producer_internal.h"
+
+#include <common/except.h>
+#include <common/log.h>
+#include <common/thread_pool.h>
+
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Opening network inputs mostly waits, so the pool is wider than the cpu.
+		static const unsigned int NUM_WORKERS = 8;
+		// How long a prepared input may take for its first buffer fill.
+		static const boost::chrono::milliseconds BUFFER_TIMEOUT(5000);
+
+		typedef boost::chrono::steady_clock input_pool_clock;
+
+		enum class prepared_state
+		{
+			queued,
+			opening,
+			buffering,
+			ready,
+			failed,
+			taken
+		};
+
+		static const wchar_t* state_name(prepared_state state)
+		{
+			switch (state)
+			{
+			case prepared_state::queued:	return L"queued";
+			case prepared_state::opening:	return L"opening";
+			case prepared_state::buffering:	return L"buffering";
+			case prepared_state::ready:		return L"ready";
+			case prepared_state::failed:	return L"failed";
+			default:						return L"taken";
+			}
+		}
+
+		static int64_t elapsed_ms(input_pool_clock::time_point since)
+		{
+			return boost::chrono::duration_cast<boost::chrono::milliseconds>(input_pool_clock::now() - since).count();
+		}
+
+		struct input_pool::prepared : boost::noncopyable
+		{
+			const std::wstring								name;
+			const input_pool_clock::time_point				queued	= input_pool_clock::now();
+			std::future<std::shared_ptr<packetProducer>>	producer;
+			tbb::atomic<prepared_state>						state;
+			tbb::atomic<bool>								taken;
+			// ms each step took, -1 until it is done.
+			tbb::atomic<int64_t>							queue_ms;
+			tbb::atomic<int64_t>							open_ms;
+			tbb::atomic<int64_t>							buffer_ms;
+
+			explicit prepared(const std::wstring& name)
+				: name(name)
+			{
+				state		= prepared_state::queued;
+				taken		= false;
+				queue_ms	= -1;
+				open_ms		= -1;
+				buffer_ms	= -1;
+			}
+		};
+
+		struct input_pool::impl : boost::noncopyable
+		{
+			mutable tbb::spin_mutex							mutex_;
+			std::vector<std::weak_ptr<prepared>>			prepared_;
+			tbb::atomic<uint64_t>							prepared_count_;
+			tbb::atomic<uint64_t>							failed_count_;
+			thread_pool										pool_;
+
+			impl()
+				: pool_(L"input_pool", NUM_WORKERS)
+			{
+				prepared_count_	= 0;
+				failed_count_	= 0;
+			}
+
+			handle prepare(const std::wstring& name, const factory& create)
+			{
+				auto result		= std::make_shared<prepared>(name);
+				auto promise	= std::make_shared<std::promise<std::shared_ptr<packetProducer>>>();
+
+				result->producer = promise->get_future();
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					prepared_.erase(std::remove_if(prepared_.begin(), prepared_.end(), [](const std::weak_ptr<prepared>& p) { return p.expired(); }), prepared_.end());
+					prepared_.push_back(result);
+				}
+
+				++prepared_count_;
+
+				std::weak_ptr<prepared> weak = result;
+
+				pool_.post([this, weak, promise, create]
+				{
+					auto self = weak.lock();
+
+					// The handle was dropped before the open started.
+					if (!self)
+					{
+						promise->set_value(nullptr);
+						return;
+					}
+
+					try
+					{
+						self->queue_ms	= elapsed_ms(self->queued);
+						self->state		= prepared_state::opening;
+
+						auto started	= input_pool_clock::now();
+						auto producer	= create();
+
+						self->open_ms	= elapsed_ms(started);
+						self->state		= prepared_state::buffering;
+
+						started = input_pool_clock::now();
+
+						if (auto internal = std::dynamic_pointer_cast<ffmpeg_producer_internal>(producer))
+						{
+							auto deadline = started + BUFFER_TIMEOUT;
+
+							while (!internal->buffered() && input_pool_clock::now() < deadline)
+								boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+						}
+
+						self->buffer_ms	= elapsed_ms(started);
+						self->state		= producer ? prepared_state::ready : prepared_state::failed;
+
+						if (!producer)
+							++failed_count_;
+
+						promise->set_value(std::move(producer));
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						CASPAR_LOG(warning) << L"[input_pool] Failed to prepare " << self->name << L".";
+
+						self->state = prepared_state::failed;
+						++failed_count_;
+
+						promise->set_exception(std::current_exception());
+					}
+				});
+
+				return result;
+			}
+
+			bool ready(const handle& prepared) const
+			{
+				return prepared->producer.valid() && prepared->producer.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+			}
+
+			std::shared_ptr<packetProducer> take(const handle& prepared)
+			{
+				if (prepared->taken.fetch_and_store(true))
+					CASPAR_THROW_EXCEPTION(invalid_operation() << msg_info("Prepared input already taken.") << source_info(prepared->name));
+
+				auto was_ready	= ready(prepared);
+				auto producer	= prepared->producer.get();
+
+				if (producer)
+					prepared->state = prepared_state::taken;
+
+				CASPAR_LOG(info) << L"[input_pool] " << prepared->name
+					<< L" waited " << prepared->queue_ms << L" ms, opened in " << prepared->open_ms
+					<< L" ms, buffered in " << prepared->buffer_ms << L" ms"
+					<< (was_ready ? L"." : L", taken before it was ready.");
+
+				return producer;
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"workers", pool_.size());
+				info.add(L"queued", pool_.queued());
+				info.add(L"prepared", prepared_count_);
+				info.add(L"failed", failed_count_);
+
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				for (auto& weak : prepared_)
+				{
+					auto prepared = weak.lock();
+
+					if (!prepared)
+						continue;
+
+					boost::property_tree::wptree input;
+					input.add(L"name", prepared->name);
+					input.add(L"state", state_name(prepared->state));
+					input.add(L"age-ms", elapsed_ms(prepared->queued));
+
+					if (prepared->queue_ms >= 0)
+						input.add(L"queue-ms", prepared->queue_ms);
+					if (prepared->open_ms >= 0)
+						input.add(L"open-ms", prepared->open_ms);
+					if (prepared->buffer_ms >= 0)
+						input.add(L"buffer-ms", prepared->buffer_ms);
+
+					info.add_child(L"inputs.input", input);
+				}
+
+				return info;
+			}
+		};
+
+		input_pool& input_pool::instance()
+		{
+			static input_pool pool;
+			return pool;
+		}
+
+		input_pool::input_pool()
+			: impl_(new impl())
+		{
+		}
+
+		input_pool::~input_pool()
+		{
+		}
+
+		input_pool::handle input_pool::prepare(const std::wstring& name, const factory& create) { return impl_->prepare(name, create); }
+		bool input_pool::ready(const handle& prepared) const { return impl_->ready(prepared); }
+		std::shared_ptr<packetProducer> input_pool::take(const handle& prepared) { return impl_->take(prepared); }
+		boost::property_tree::wptree input_pool::info() const { return impl_->info(); }
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../packetProducer.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Opens producers ahead of their use, for automation that cues clips
+		// before they are due. prepare() queues the open on a background pool,
+		// where the producer is created (the input opened, probed and seeked to
+		// its IN point) and its first buffer fill is awaited, so take() returns
+		// a producer that delivers packets at once.
+		//
+		// How long each step took is kept per prepared input, reported by info()
+		// and logged when the producer is taken. Dropping a handle cancels the
+		// open when it has not started and closes the producer otherwise.
+		class input_pool : boost::noncopyable
+		{
+		public:
+			typedef std::function<std::shared_ptr<packetProducer>()> factory;
+
+			struct prepared;
+			typedef std::shared_ptr<prepared> handle;
+
+			static input_pool& instance();
+
+			handle							prepare(const std::wstring& name, const factory& create);
+
+			bool							ready(const handle& prepared) const;
+			// Waits for the producer when it is not ready yet and rethrows what
+			// creating it threw. A handle can be taken once.
+			std::shared_ptr<packetProducer>	take(const handle& prepared);
+
+			boost::property_tree::wptree	info() const;
+		private:
+			input_pool();
+			~input_pool();
+
+			struct impl;
+			std::unique_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,435 @@
+#include "StdAfx.h"
+
+#include "packet_backlog.h"
+
+#include "util/util.h"
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		enum class drop_reason
+		{
+			gop,
+			non_reference,
+			video,
+			audio,
+			resync,
+			refused,
+			waiting_for_key_frame,
+			count
+		};
+
+		static const wchar_t* const DROP_REASON_NAMES[] =
+		{
+			L"gop",
+			L"non-reference",
+			L"video",
+			L"audio",
+			L"resync",
+			L"refused",
+			L"waiting-for-key-frame"
+		};
+
+		struct packet_backlog::impl : boost::noncopyable
+		{
+			struct entry
+			{
+				uint64_t					sequence;
+				std::shared_ptr<AVPacket>	packet;
+				int64_t						dts;		// AV_TIME_BASE, AV_NOPTS_VALUE if unknown.
+				bool						reference;
+			};
+
+			typedef std::deque<entry> lane;
+			typedef std::array<uint64_t, static_cast<size_t>(drop_reason::count)> counters;
+
+			const std::shared_ptr<AVFormatContext>	context_;
+			const limits							limits_;
+			std::vector<lane>						lanes_;		// By stream index.
+			int										video_index_			= -1;
+			uint64_t								next_sequence_			= 0;
+			size_t									bytes_					= 0;
+			size_t									packets_				= 0;
+			bool									waiting_for_key_frame_	= false;
+			counters								packets_dropped_;
+			counters								bytes_dropped_;
+
+			impl(const std::shared_ptr<AVFormatContext>& context, const limits& limits)
+				: context_(context)
+				, limits_(limits)
+				, lanes_(context->nb_streams)
+			{
+				packets_dropped_.fill(0);
+				bytes_dropped_.fill(0);
+
+				for (unsigned int i = 0; i < context_->nb_streams; ++i)
+				{
+					if (context_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+						video_index_ = i;
+				}
+			}
+
+			bool push(const std::shared_ptr<AVPacket>& packet)
+			{
+				auto index = packet->stream_index;
+
+				if (index < 0 || index >= static_cast<int>(lanes_.size()))
+					return false;
+
+				auto& l = lanes_[index];
+
+				if (!packet->data)
+				{
+					l.push_back(entry { next_sequence_++, packet, AV_NOPTS_VALUE, true });
+					return true;
+				}
+
+				auto is_video = index == video_index_;
+
+				if (is_video && waiting_for_key_frame_)
+				{
+					if (!(packet->flags & AV_PKT_FLAG_KEY))
+					{
+						count(*packet, drop_reason::waiting_for_key_frame);
+						return false;
+					}
+
+					waiting_for_key_frame_ = false;
+				}
+
+				auto reference = !is_video || limits_.policy != drop_policy::drop_non_reference || is_reference_frame(*packet, *context_->streams[index]->codec);
+
+				l.push_back(entry { next_sequence_++, packet, dts_of(*packet), reference });
+				bytes_ += packet->size;
+				++packets_;
+
+				if (limits_.policy == drop_policy::drop_newest)
+				{
+					if (!over_limit())
+						return true;
+
+					remove(l, l.end() - 1, drop_reason::refused);
+
+					if (is_video)
+						waiting_for_key_frame_ = true;
+
+					return false;
+				}
+
+				auto sequence = l.back().sequence;
+
+				while (over_limit() && make_room())
+				{
+				}
+
+				return !l.empty() && l.back().sequence == sequence;
+			}
+
+			bool pop(int index, std::shared_ptr<AVPacket>& packet)
+			{
+				if (index < 0 || index >= static_cast<int>(lanes_.size()) || lanes_[index].empty())
+					return false;
+
+				auto& l = lanes_[index];
+				packet = std::move(l.front().packet);
+				l.pop_front();
+
+				if (packet->data)
+				{
+					bytes_ -= packet->size;
+					--packets_;
+				}
+
+				return true;
+			}
+
+			int64_t dts_of(const AVPacket& packet) const
+			{
+				auto ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+				if (ts == AV_NOPTS_VALUE)
+					return AV_NOPTS_VALUE;
+
+				return av_rescale_q(ts, context_->streams[packet.stream_index]->time_base, AVRational { 1, AV_TIME_BASE });
+			}
+
+			int64_t duration() const
+			{
+				auto first	= std::numeric_limits<int64_t>::max();
+				auto last	= std::numeric_limits<int64_t>::min();
+
+				for (auto& l : lanes_)
+				{
+					auto front = std::find_if(l.begin(), l.end(), [](const entry& e) { return e.dts != AV_NOPTS_VALUE; });
+
+					if (front == l.end())
+						continue;
+
+					auto back = std::find_if(l.rbegin(), l.rend(), [](const entry& e) { return e.dts != AV_NOPTS_VALUE; });
+
+					first	= std::min(first, front->dts);
+					last	= std::max(last, back->dts);
+				}
+
+				return last > first ? last - first : 0;
+			}
+
+			bool over_limit() const
+			{
+				return bytes_ > limits_.max_bytes
+					|| packets_ > limits_.max_packets
+					|| (limits_.max_duration > 0 && duration() > limits_.max_duration);
+			}
+
+			bool has_room() const
+			{
+				return bytes_ < limits_.max_bytes
+					&& packets_ < limits_.max_packets
+					&& (limits_.max_duration <= 0 || duration() < limits_.max_duration);
+			}
+
+			bool make_room()
+			{
+				switch (limits_.policy)
+				{
+				case drop_policy::drop_non_reference:
+					return drop_non_reference() || drop_gop();
+				case drop_policy::drop_video_keep_audio:
+					return drop_lane(video_index_, drop_reason::video) || drop_oldest(drop_reason::audio);
+				case drop_policy::resync_to_live:
+					return drop_all(drop_reason::resync);
+				default:
+					return drop_gop();
+				}
+			}
+
+			static lane::iterator first_data(lane& l)
+			{
+				return std::find_if(l.begin(), l.end(), [](const entry& e) { return e.packet->data != nullptr; });
+			}
+
+			bool drop_non_reference()
+			{
+				if (video_index_ < 0)
+					return false;
+
+				auto& l = lanes_[video_index_];
+				auto it = std::find_if(l.begin(), l.end(), [](const entry& e) { return e.packet->data && !e.reference; });
+
+				if (it == l.end())
+					return false;
+
+				remove(l, it, drop_reason::non_reference);
+				return true;
+			}
+
+			// Drops every queued packet, on all streams, older than the second key
+			// frame in the video queue, or all video if there is no such key frame.
+			bool drop_gop()
+			{
+				if (video_index_ < 0)
+					return drop_oldest(drop_reason::gop);
+
+				auto& video	= lanes_[video_index_];
+				auto head	= first_data(video);
+
+				if (head == video.end())
+					return drop_oldest(drop_reason::gop);
+
+				auto next_key = std::find_if(head + 1, video.end(), [](const entry& e) { return e.packet->data && (e.packet->flags & AV_PKT_FLAG_KEY); });
+
+				if (next_key == video.end())
+					return drop_lane(video_index_, drop_reason::gop);
+
+				auto cutoff = next_key->sequence;
+
+				for (auto& l : lanes_)
+				{
+					for (auto it = l.begin(); it != l.end() && it->sequence < cutoff;)
+						it = it->packet->data ? remove(l, it, drop_reason::gop) : it + 1;
+				}
+
+				return true;
+			}
+
+			// Drops all queued packets of a stream, except a video key frame that
+			// just arrived since playback can resume right there.
+			bool drop_lane(int index, drop_reason reason)
+			{
+				if (index < 0)
+					return false;
+
+				auto& l			= lanes_[index];
+				auto is_video	= index == video_index_;
+				auto dropped	= false;
+				auto kept		= false;
+
+				for (auto it = l.begin(); it != l.end();)
+				{
+					if (!it->packet->data)
+						++it;
+					else if (is_video && it->sequence + 1 == next_sequence_ && (it->packet->flags & AV_PKT_FLAG_KEY))
+					{
+						kept = true;
+						++it;
+					}
+					else
+					{
+						it		= remove(l, it, reason);
+						dropped	= true;
+					}
+				}
+
+				if (dropped && is_video && !kept)
+					waiting_for_key_frame_ = true;
+
+				return dropped;
+			}
+
+			bool drop_all(drop_reason reason)
+			{
+				auto dropped = false;
+
+				for (int i = 0; i < static_cast<int>(lanes_.size()); ++i)
+					dropped = drop_lane(i, reason) || dropped;
+
+				return dropped;
+			}
+
+			bool drop_oldest(drop_reason reason)
+			{
+				lane* oldest = nullptr;
+				lane::iterator oldest_it;
+
+				for (auto& l : lanes_)
+				{
+					auto it = first_data(l);
+
+					if (it != l.end() && (!oldest || it->sequence < oldest_it->sequence))
+					{
+						oldest		= &l;
+						oldest_it	= it;
+					}
+				}
+
+				if (!oldest)
+					return false;
+
+				auto is_video = video_index_ >= 0 && oldest == &lanes_[video_index_];
+				remove(*oldest, oldest_it, reason);
+
+				if (is_video)
+				{
+					// What followed referenced the dropped frame, resume at a key frame.
+					auto& l = *oldest;
+
+					while (!l.empty() && l.front().packet->data && !(l.front().packet->flags & AV_PKT_FLAG_KEY))
+						remove(l, l.begin(), reason);
+
+					if (l.empty())
+						waiting_for_key_frame_ = true;
+				}
+
+				return true;
+			}
+
+			lane::iterator remove(lane& l, lane::iterator it, drop_reason reason)
+			{
+				bytes_ -= it->packet->size;
+				--packets_;
+				count(*it->packet, reason);
+
+				return l.erase(it);
+			}
+
+			void count(const AVPacket& packet, drop_reason reason)
+			{
+				++packets_dropped_[static_cast<size_t>(reason)];
+				bytes_dropped_[static_cast<size_t>(reason)] += packet.size;
+			}
+
+			uint64_t dropped() const
+			{
+				uint64_t total = 0;
+
+				for (auto n : packets_dropped_)
+					total += n;
+
+				return total;
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				uint64_t bytes_dropped = 0;
+
+				for (auto n : bytes_dropped_)
+					bytes_dropped += n;
+
+				boost::property_tree::wptree info;
+				info.add(L"queued-packets", packets_);
+				info.add(L"queued-bytes", bytes_);
+				info.add(L"queued-ms", duration() / 1000);
+				info.add(L"waiting-for-key-frame", waiting_for_key_frame_);
+				info.add(L"packets-dropped", dropped());
+				info.add(L"bytes-dropped", bytes_dropped);
+
+				for (size_t i = 0; i < packets_dropped_.size(); ++i)
+					info.add(std::wstring(L"drops.") + DROP_REASON_NAMES[i], packets_dropped_[i]);
+
+				return info;
+			}
+		};
+
+		packet_backlog::packet_backlog(const std::shared_ptr<AVFormatContext>& context, const limits& limits)
+			: impl_(new impl(context, limits))
+		{
+		}
+
+		bool packet_backlog::push(const std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->push(packet);
+		}
+
+		bool packet_backlog::pop(int stream_index, std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->pop(stream_index, packet);
+		}
+
+		bool packet_backlog::has_room() const
+		{
+			return impl_->has_room();
+		}
+
+		size_t packet_backlog::bytes() const
+		{
+			return impl_->bytes_;
+		}
+
+		size_t packet_backlog::packets() const
+		{
+			return impl_->packets_;
+		}
+
+		int64_t packet_backlog::duration() const
+		{
+			return impl_->duration();
+		}
+
+		uint64_t packet_backlog::dropped() const
+		{
+			return impl_->dropped();
+		}
+
+		boost::property_tree::wptree packet_backlog::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
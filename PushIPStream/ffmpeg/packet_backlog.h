@@ -0,0 +1,64 @@
+#pragma once
+
+#include <common/memory.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct AVFormatContext;
+struct AVPacket;
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Bounded per stream packet queues for one output. When the output falls
+		// behind and a byte, packet or duration limit is exceeded, packets are
+		// dropped according to the policy, always so that video resumes at a key
+		// frame, and every drop is counted by reason.
+		//
+		// Flush packets (data == nullptr) are never dropped and do not count
+		// against the limits. Not thread safe.
+		class packet_backlog : boost::noncopyable
+		{
+		public:
+			enum class drop_policy
+			{
+				drop_gop,				// Drop everything queued before the next key frame.
+				drop_non_reference,		// Drop non reference frames first, then as drop_gop.
+				drop_video_keep_audio,	// Drop all queued video and keep audio until a key frame.
+				resync_to_live,			// Drop everything queued, video resumes at a key frame.
+				drop_newest				// Refuse new packets, video resumes at a key frame.
+			};
+
+			struct limits
+			{
+				size_t			max_bytes		= 16 * 1024 * 1024;
+				size_t			max_packets		= 2000;
+				int64_t			max_duration	= 0;	// AV_TIME_BASE units from oldest to newest dts, 0 for no limit.
+				drop_policy		policy			= drop_policy::drop_gop;
+			};
+
+			packet_backlog(const std::shared_ptr<AVFormatContext>& context, const limits& limits);
+
+			// Returns false if the packet was dropped instead of queued.
+			bool							push(const std::shared_ptr<AVPacket>& packet);
+			bool							pop(int stream_index, std::shared_ptr<AVPacket>& packet);
+
+			bool							has_room() const;
+			size_t							bytes() const;
+			size_t							packets() const;
+			// AV_TIME_BASE units from the oldest to the newest queued dts.
+			int64_t							duration() const;
+			uint64_t						dropped() const;
+
+			boost::property_tree::wptree	info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
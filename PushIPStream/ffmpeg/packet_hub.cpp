@@ -0,0 +1,332 @@
+#include "StdAfx.h"
+
+#include "packet_hub.h"
+#include "packet_source.h"
+
+#include <common/log.h>
+#include <common/os/general_protection_fault.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int MAX_PACKETS_PER_ROUND = 64;
+
+		class hub_view : public packetProducer
+		{
+			const std::shared_ptr<AVFormatContext>		context_;
+			mutable tbb::spin_mutex						mutex_;
+			packet_backlog								backlog_;
+			std::vector<bool>							forwarded_;
+			int											video_index_			= -1;
+			std::vector<int>							audio_indices_;
+			std::vector<int>							subtitle_indices_;
+			int											audio_next_				= 0;
+			int											subtitle_next_			= 0;
+			uint64_t									packets_received_		= 0;
+			uint64_t									packets_primed_			= 0;
+		public:
+			hub_view(const std::shared_ptr<AVFormatContext>& context, const packet_hub::subscriber_options& options)
+				: context_(context)
+				, backlog_(context, options)
+				, forwarded_(context->nb_streams, false)
+			{
+				// Same stream selection as ffmpeg_producer_internal.
+				for (unsigned int i = 0; i < context_->nb_streams; ++i)
+				{
+					auto type = context_->streams[i]->codec->codec_type;
+
+					if (type == AVMEDIA_TYPE_VIDEO)
+						video_index_ = i;
+					else if (type == AVMEDIA_TYPE_AUDIO)
+						audio_indices_.push_back(i);
+					else if (type == AVMEDIA_TYPE_SUBTITLE)
+						subtitle_indices_.push_back(i);
+					else
+						continue;
+
+					forwarded_[i] = true;
+				}
+			}
+
+			bool has_room() const
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				return backlog_.has_room();
+			}
+
+			void push(const std::shared_ptr<AVPacket>& packet)
+			{
+				auto index = packet->stream_index;
+
+				if (index < 0 || index >= static_cast<int>(forwarded_.size()) || !forwarded_[index])
+					return;
+
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				++packets_received_;
+				backlog_.push(packet);
+			}
+
+			// Queues the packets a subscriber joining a running input starts with.
+			void prime(const std::vector<std::shared_ptr<AVPacket>>& packets)
+			{
+				for (auto& packet : packets)
+				{
+					auto index = packet->stream_index;
+
+					if (index < 0 || index >= static_cast<int>(forwarded_.size()) || !forwarded_[index])
+						continue;
+
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					++packets_primed_;
+					backlog_.push(packet);
+				}
+			}
+
+			bool receive_v(std::shared_ptr<AVPacket>& packet) override
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				return video_index_ >= 0 && backlog_.pop(video_index_, packet);
+			}
+
+			bool receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index) override
+			{
+				return receive_round_robin(audio_indices_, audio_next_, packet, stream_index);
+			}
+
+			bool receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index) override
+			{
+				return receive_round_robin(subtitle_indices_, subtitle_next_, packet, stream_index);
+			}
+
+			std::shared_ptr<AVFormatContext> context() override
+			{
+				return context_;
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				auto info = backlog_.info();
+				info.add(L"packets-received", packets_received_);
+				info.add(L"packets-primed", packets_primed_);
+
+				return info;
+			}
+		private:
+			// Same semantics as ffmpeg_producer_internal: streams are visited round
+			// robin and the turn only advances when a packet was returned.
+			bool receive_round_robin(const std::vector<int>& indices, int& next, std::shared_ptr<AVPacket>& packet, int& stream_index)
+			{
+				if (indices.empty())
+					return true;
+
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				auto i = next % static_cast<int>(indices.size());
+
+				if (!backlog_.pop(indices[i], packet))
+					return false;
+
+				stream_index = i;
+				++next;
+
+				return true;
+			}
+		};
+
+		struct packet_hub::impl : boost::noncopyable
+		{
+			const std::shared_ptr<packetProducer>		source_;
+			packet_source								packets_;
+			mutable tbb::spin_mutex						views_mutex_;
+			std::vector<std::weak_ptr<hub_view>>		views_;
+			uint64_t									subscriptions_	= 0;
+			gop_cache									gop_cache_;
+			tbb::atomic<bool>							is_running_;
+			tbb::atomic<uint64_t>						packets_read_;
+			tbb::atomic<uint64_t>						bytes_read_;
+			boost::thread								thread_;
+
+			impl(const std::shared_ptr<packetProducer>& source, size_t max_gop_cache_bytes)
+				: source_(source)
+				, packets_(source)
+				, gop_cache_(source->context(), max_gop_cache_bytes)
+			{
+				is_running_		= true;
+				packets_read_	= 0;
+				bytes_read_		= 0;
+
+				thread_ = boost::thread([this] { run(); });
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+				thread_.join();
+			}
+
+			std::shared_ptr<packetProducer> subscribe(const subscriber_options& options)
+			{
+				auto view = std::make_shared<hub_view>(source_->context(), options);
+
+				// Priming and joining under the lock that run() updates the cache
+				// under, so every packet reaches the view exactly once, from the
+				// cache or from run().
+				tbb::spin_mutex::scoped_lock lock(views_mutex_);
+				view->prime(gop_cache_.packets());
+				views_.push_back(view);
+				++subscriptions_;
+
+				return view;
+			}
+
+			std::vector<std::shared_ptr<hub_view>> live_views()
+			{
+				tbb::spin_mutex::scoped_lock lock(views_mutex_);
+
+				return live_views_locked();
+			}
+
+			std::vector<std::shared_ptr<hub_view>> live_views_locked()
+			{
+				std::vector<std::shared_ptr<hub_view>> result;
+
+				views_.erase(std::remove_if(views_.begin(), views_.end(), [&](const std::weak_ptr<hub_view>& weak)
+				{
+					auto view = weak.lock();
+
+					if (!view)
+						return true;
+
+					result.push_back(std::move(view));
+					return false;
+				}), views_.end());
+
+				return result;
+			}
+
+			void run()
+			{
+				ensure_gpf_handler_installed_for_thread("packet-hub");
+
+				while (is_running_)
+				{
+					try
+					{
+						std::vector<std::shared_ptr<hub_view>> views;
+						uint64_t subscriptions;
+
+						{
+							tbb::spin_mutex::scoped_lock lock(views_mutex_);
+							views			= live_views_locked();
+							subscriptions	= subscriptions_;
+						}
+
+						// Reading on behalf of nobody would only throw packets away.
+						if (std::none_of(views.begin(), views.end(), [](const std::shared_ptr<hub_view>& v) { return v->has_room(); }))
+						{
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+							continue;
+						}
+
+						int count = 0;
+						std::shared_ptr<AVPacket> packet;
+
+						while (count < MAX_PACKETS_PER_ROUND && packets_.try_pop(packet))
+						{
+							{
+								tbb::spin_mutex::scoped_lock lock(views_mutex_);
+								gop_cache_.push(packet);
+
+								// Views that joined since the round started were primed
+								// without this packet.
+								if (subscriptions != subscriptions_)
+								{
+									views			= live_views_locked();
+									subscriptions	= subscriptions_;
+								}
+							}
+
+							for (auto& view : views)
+								view->push(packet);
+
+							++count;
+							++packets_read_;
+
+							if (packet->data)
+								bytes_read_ += packet->size;
+						}
+
+						if (count == 0)
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(2));
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
+					}
+				}
+			}
+
+			boost::property_tree::wptree info()
+			{
+				boost::property_tree::wptree info;
+				info.add(L"packets-read", packets_read_);
+				info.add(L"bytes-read", bytes_read_);
+
+				{
+					tbb::spin_mutex::scoped_lock lock(views_mutex_);
+					info.add_child(L"gop-cache", gop_cache_.info());
+				}
+
+				for (auto& view : live_views())
+					info.add_child(L"subscribers.subscriber", view->info());
+
+				return info;
+			}
+		};
+
+		packet_hub::packet_hub(const std::shared_ptr<packetProducer>& source, size_t max_gop_cache_bytes)
+			: impl_(new impl(source, max_gop_cache_bytes))
+		{
+		}
+
+		packet_hub::~packet_hub()
+		{
+		}
+
+		std::shared_ptr<packetProducer> packet_hub::subscribe(const subscriber_options& options)
+		{
+			return impl_->subscribe(options);
+		}
+
+		std::shared_ptr<packetProducer> packet_hub::subscribe()
+		{
+			return impl_->subscribe(subscriber_options());
+		}
+
+		size_t packet_hub::subscribers() const
+		{
+			return impl_->live_views().size();
+		}
+
+		boost::property_tree::wptree packet_hub::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../packetProducer.h"
+#include "gop_cache.h"
+#include "packet_backlog.h"
+
+#include <common/memory.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Demuxes one producer once and fans its packets out to any number of
+		// subscribers. Every subscriber gets the same refcounted packets in a
+		// queue of its own, so a slow subscriber only ever loses its own packets
+		// and never holds up the others. The source is read as fast as the
+		// fastest subscriber consumes it. How far a subscriber may fall behind,
+		// and what is dropped when it does, is set per subscriber.
+		//
+		// The hub keeps a gop_cache of the packets since the last video key
+		// frame and a new subscriber is primed from it, so it starts at once
+		// from that key frame instead of waiting for the next one.
+		class packet_hub : boost::noncopyable
+		{
+		public:
+			typedef packet_backlog::limits subscriber_options;
+
+			// max_gop_cache_bytes of 0 disables the cache.
+			explicit packet_hub(const std::shared_ptr<packetProducer>& source, size_t max_gop_cache_bytes = gop_cache::DEFAULT_MAX_BYTES);
+			~packet_hub();
+
+			// The returned producer stops receiving packets once the hub is destroyed.
+			std::shared_ptr<packetProducer>	subscribe(const subscriber_options& options);
+			std::shared_ptr<packetProducer>	subscribe();
+
+			size_t							subscribers() const;
+			boost::property_tree::wptree	info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,166 @@
+#include "StdAfx.h"
+
+#include "packet_lanes.h"
+
+#include "util/util.h"
+
+#include <tbb/spin_mutex.h>
+
+#include <deque>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const size_t PKT_BUFFER_COUNT = 50;
+
+		struct packet_lanes::impl : boost::noncopyable
+		{
+			typedef std::deque<std::shared_ptr<AVPacket>> lane;
+
+			mutable tbb::spin_mutex	mutex_;
+			lane					video_;
+			std::vector<lane>		audio_;
+			std::vector<lane>		subtitles_;
+			std::vector<lane*>		by_stream_;		// Null for streams without a lane.
+			bool					has_video_		= false;
+			int						audio_index_	= 0;
+			int						subtitle_index_	= 0;
+
+			explicit impl(const AVFormatContext& layout)
+			{
+				for (unsigned int i = 0; i < layout.nb_streams; ++i)
+				{
+					auto type = layout.streams[i]->codec->codec_type;
+
+					if (type == AVMEDIA_TYPE_AUDIO)
+						audio_.push_back(lane());
+					else if (type == AVMEDIA_TYPE_SUBTITLE)
+						subtitles_.push_back(lane());
+				}
+
+				size_t audio	= 0;
+				size_t subtitle	= 0;
+
+				for (unsigned int i = 0; i < layout.nb_streams; ++i)
+				{
+					auto type = layout.streams[i]->codec->codec_type;
+
+					if (type == AVMEDIA_TYPE_VIDEO && !has_video_)
+					{
+						by_stream_.push_back(&video_);
+						has_video_ = true;
+					}
+					else if (type == AVMEDIA_TYPE_AUDIO)
+						by_stream_.push_back(&audio_[audio++]);
+					else if (type == AVMEDIA_TYPE_SUBTITLE)
+						by_stream_.push_back(&subtitles_[subtitle++]);
+					else
+						by_stream_.push_back(nullptr);
+				}
+			}
+
+			void push(const std::shared_ptr<AVPacket>& packet)
+			{
+				auto index = packet->stream_index;
+
+				if (index < 0 || index >= static_cast<int>(by_stream_.size()) || !by_stream_[index])
+					return;
+
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+				by_stream_[index]->push_back(packet);
+			}
+
+			void push_end()
+			{
+				auto flush_packet = create_packet();
+				flush_packet->data = nullptr;
+				flush_packet->size = 0;
+				flush_packet->pos = -1;
+
+				push(flush_packet);
+			}
+
+			bool full() const
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				if (has_video_)
+					return video_.size() > PKT_BUFFER_COUNT;
+
+				return !audio_.empty() && audio_.front().size() > PKT_BUFFER_COUNT;
+			}
+
+			static bool pop(lane& l, std::shared_ptr<AVPacket>& packet)
+			{
+				if (l.empty())
+					return false;
+
+				packet = std::move(l.front());
+				l.pop_front();
+
+				return true;
+			}
+
+			bool receive_v(std::shared_ptr<AVPacket>& packet)
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				return pop(video_, packet);
+			}
+
+			bool receive(std::vector<lane>& lanes, int& next, std::shared_ptr<AVPacket>& packet, int& stream_index)
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				if (lanes.empty())
+					return false;
+
+				auto i = next % static_cast<int>(lanes.size());
+
+				if (!pop(lanes[i], packet))
+					return false;
+
+				stream_index = i;
+				++next;
+
+				return true;
+			}
+		};
+
+		packet_lanes::packet_lanes(const AVFormatContext& layout)
+			: impl_(new impl(layout))
+		{
+		}
+
+		void packet_lanes::push(const std::shared_ptr<AVPacket>& packet)
+		{
+			impl_->push(packet);
+		}
+
+		void packet_lanes::push_end()
+		{
+			impl_->push_end();
+		}
+
+		bool packet_lanes::full() const
+		{
+			return impl_->full();
+		}
+
+		bool packet_lanes::receive_v(std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->receive_v(packet);
+		}
+
+		bool packet_lanes::receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			return impl_->receive(impl_->audio_, impl_->audio_index_, packet, stream_index);
+		}
+
+		bool packet_lanes::receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			return impl_->receive(impl_->subtitles_, impl_->subtitle_index_, packet, stream_index);
+		}
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <common/memory.h>
+
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+
+struct AVFormatContext;
+struct AVPacket;
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// The per stream output queues of a producer that makes its packets on a
+		// thread of its own, read through the packetProducer interface: one video
+		// lane and one lane per audio and subtitle stream, served round robin.
+		class packet_lanes : boost::noncopyable
+		{
+		public:
+			explicit packet_lanes(const AVFormatContext& layout);
+
+			// Queues the packet in the lane of its stream_index.
+			void	push(const std::shared_ptr<AVPacket>& packet);
+			// Queues an end of stream flush packet (pos == -1).
+			void	push_end();
+			// Whether the video lane, or the first audio lane without video, is
+			// as far ahead as a producer should get.
+			bool	full() const;
+
+			bool	receive_v(std::shared_ptr<AVPacket>& packet);
+			bool	receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index);
+			bool	receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index);
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
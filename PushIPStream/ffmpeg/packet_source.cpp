@@ -0,0 +1,183 @@
+#include "StdAfx.h"
+
+#include "packet_source.h"
+
+#include <deque>
+#include <limits>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		struct packet_source::impl : boost::noncopyable
+		{
+			typedef std::deque<std::shared_ptr<AVPacket>> lane;
+
+			const std::shared_ptr<packetProducer>	producer_;
+			const std::shared_ptr<AVFormatContext>	context_;
+			lane									video_;
+			std::vector<lane>						audio_;
+			std::vector<lane>						subtitles_;
+
+			explicit impl(const std::shared_ptr<packetProducer>& producer)
+				: producer_(producer)
+				, context_(producer->context())
+			{
+				for (unsigned int i = 0; i < context_->nb_streams; ++i)
+				{
+					auto type = context_->streams[i]->codec->codec_type;
+
+					if (type == AVMEDIA_TYPE_AUDIO)
+						audio_.push_back(lane());
+					else if (type == AVMEDIA_TYPE_SUBTITLE)
+						subtitles_.push_back(lane());
+				}
+			}
+
+			bool try_pop(std::shared_ptr<AVPacket>& packet)
+			{
+				fill();
+
+				lane* next = nullptr;
+				auto next_ts = std::numeric_limits<int64_t>::max();
+
+				auto consider = [&](lane& l)
+				{
+					if (l.empty())
+						return;
+
+					auto ts = sort_key(*l.front());
+
+					if (!next || ts < next_ts)
+					{
+						next = &l;
+						next_ts = ts;
+					}
+				};
+
+				consider(video_);
+
+				for (auto& l : audio_)
+					consider(l);
+
+				for (auto& l : subtitles_)
+					consider(l);
+
+				if (!next)
+					return false;
+
+				packet = std::move(next->front());
+				next->pop_front();
+
+				return true;
+			}
+
+			bool ready()
+			{
+				// Only pulls when nothing is held, so asking repeatedly while the
+				// caller does not pop leaves the rest queued in the producer.
+				if (!any())
+					fill();
+
+				return any();
+			}
+
+			bool any() const
+			{
+				if (!video_.empty())
+					return true;
+
+				for (auto& l : audio_)
+				{
+					if (!l.empty())
+						return true;
+				}
+
+				for (auto& l : subtitles_)
+				{
+					if (!l.empty())
+						return true;
+				}
+
+				return false;
+			}
+
+			void fill()
+			{
+				std::shared_ptr<AVPacket> packet;
+
+				if (video_.empty() && producer_->receive_v(packet))
+					stash(video_, packet);
+
+				// receive_a/receive_s visit their queues round robin and stop at the
+				// first empty one, so a single round is all that can be asked for.
+				for (size_t n = 0; n < audio_.size(); ++n)
+				{
+					int index = 0;
+					packet.reset();
+
+					if (!producer_->receive_a(packet, index))
+						break;
+
+					if (index >= 0 && index < static_cast<int>(audio_.size()))
+						stash(audio_[index], packet);
+				}
+
+				for (size_t n = 0; n < subtitles_.size(); ++n)
+				{
+					int index = 0;
+					packet.reset();
+
+					if (!producer_->receive_s(packet, index))
+						break;
+
+					if (index >= 0 && index < static_cast<int>(subtitles_.size()))
+						stash(subtitles_[index], packet);
+				}
+			}
+
+			static void stash(lane& l, const std::shared_ptr<AVPacket>& packet)
+			{
+				if (packet)
+					l.push_back(packet);
+			}
+
+			int64_t sort_key(const AVPacket& packet) const
+			{
+				// Flush packets and packets without timing go out as soon as they
+				// reach the head of their lane.
+				if (!packet.data || packet.stream_index < 0 || packet.stream_index >= static_cast<int>(context_->nb_streams))
+					return std::numeric_limits<int64_t>::min();
+
+				auto ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+				if (ts == AV_NOPTS_VALUE)
+					return std::numeric_limits<int64_t>::min();
+
+				AVRational time_base_q = { 1, AV_TIME_BASE };
+
+				return av_rescale_q(ts, context_->streams[packet.stream_index]->time_base, time_base_q);
+			}
+		};
+
+		packet_source::packet_source(const std::shared_ptr<packetProducer>& producer)
+			: impl_(new impl(producer))
+		{
+		}
+
+		bool packet_source::try_pop(std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->try_pop(packet);
+		}
+
+		bool packet_source::ready()
+		{
+			return impl_->ready();
+		}
+
+		std::shared_ptr<AVFormatContext> packet_source::context() const
+		{
+			return impl_->context_;
+		}
+	}
+}
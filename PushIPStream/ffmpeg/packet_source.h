@@ -0,0 +1,33 @@
+#pragma once
+
+#include "../packetProducer.h"
+
+#include <common/memory.h>
+
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Merges the per stream queues of a packetProducer back into a single
+		// stream of packets in dts order, which is what muxers expect.
+		class packet_source : boost::noncopyable
+		{
+		public:
+			explicit packet_source(const std::shared_ptr<packetProducer>& producer);
+
+			// Returns false when no packet is currently available. Flush packets
+			// (data == nullptr) are passed through as soon as they are seen.
+			bool try_pop(std::shared_ptr<AVPacket>& packet);
+			// Whether try_pop would return a packet, without taking it.
+			bool ready();
+
+			std::shared_ptr<AVFormatContext> context() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
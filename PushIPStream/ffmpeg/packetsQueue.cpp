@@ -2,17 +2,22 @@
 
 #include "util/util.h"
 
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+
 using namespace caspar;
 
+// Pushed by the producer thread, polled by the consumers' threads.
 struct packetsQueue::implementation :boost::noncopyable
 {
 	int													index_;
-	std::queue<spl::shared_ptr<AVPacket>>				packets_;
+	tbb::concurrent_queue<std::shared_ptr<AVPacket>>	packets_;
+	tbb::atomic<int>									size_;
 public:
 	explicit implementation(int stream_index)
 	:index_(stream_index)
 	{
-
+		size_ = 0;
 	}
 
 	void push(const std::shared_ptr<AVPacket>& packet)
@@ -20,21 +25,26 @@ public:
 		if (!packet)
 			return;
 		if (packet->stream_index == index_)
-			packets_.push(spl::make_shared_ptr(packet));
+		{
+			packets_.push(packet);
+			++size_;
+		}
 	}
 
 	std::shared_ptr<AVPacket> poll()
 	{
-		if (packets_.empty())
+		std::shared_ptr<AVPacket> packet;
+
+		if (!packets_.try_pop(packet))
 			return nullptr;
-		auto packet = packets_.front();
-		packets_.pop();
+
+		--size_;
 		return packet;
 	}
 
 	bool ready() const
 	{
-		return packets_.size() > 10;
+		return size_ > 10;
 	}
 
 	int getIndex()
@@ -44,7 +54,7 @@ public:
 
 	int getSize()
 	{
-		return packets_.size();
+		return size_;
 	}
 };
 
@@ -0,0 +1,372 @@
+#include "StdAfx.h"
+
+#include "playlist_producer.h"
+
+#include "ffmpeg_error.h"
+#include "packet_lanes.h"
+#include "packet_source.h"
+#include "timeline_splicer.h"
+
+#include <common/except.h>
+#include <common/executor.h>
+#include <common/log.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		struct playlist_item : boost::noncopyable
+		{
+			std::wstring							name;
+			std::shared_ptr<packetProducer>			producer;
+			std::shared_ptr<AVFormatContext>		context;
+			std::unique_ptr<packet_source>			source;
+			std::vector<int>						stream_map;
+			std::deque<std::shared_ptr<AVPacket>>	preroll;
+			size_t									preroll_bytes	= 0;
+			bool									ended			= false;
+			int64_t									duration		= AV_NOPTS_VALUE;	// AV_TIME_BASE.
+		};
+
+		struct playlist_producer::impl : boost::noncopyable
+		{
+			const std::vector<std::wstring>				items_;
+			const factory								create_;
+			const settings								settings_;
+			std::shared_ptr<AVFormatContext>			output_;
+
+			std::unique_ptr<packet_lanes>				lanes_;
+			std::unique_ptr<timeline_splicer>			splicer_;
+
+			std::shared_ptr<playlist_item>				current_;
+			std::shared_ptr<playlist_item>				next_item_;
+			std::future<std::shared_ptr<playlist_item>>	next_;
+			int											next_index_			= 0;	// -1 once the list is done.
+			int											next_opening_index_	= -1;
+			size_t										consecutive_failures_	= 0;
+
+			tbb::atomic<int>							current_index_;
+			tbb::atomic<uint64_t>						splices_;
+			tbb::atomic<uint64_t>						late_splices_;
+			tbb::atomic<uint64_t>						failed_items_;
+			tbb::atomic<size_t>							preroll_bytes_;
+			tbb::atomic<bool>							finished_;
+
+			tbb::atomic<bool>							is_running_;
+			boost::thread								thread_;
+			executor									opener_;	// Last, the opening task uses the members above.
+
+			impl(const std::vector<std::wstring>& items, const factory& create, const settings& settings)
+				: items_(items)
+				, create_(create)
+				, settings_(settings)
+				, opener_(L"playlist-opener")
+			{
+				current_index_	= 0;
+				splices_		= 0;
+				late_splices_	= 0;
+				failed_items_	= 0;
+				preroll_bytes_	= 0;
+				finished_		= false;
+
+				if (items_.empty())
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info("Empty playlist."));
+
+				// The first item that opens defines the stream layout.
+				while (!current_ && next_index_ >= 0)
+				{
+					auto index = take_index();
+
+					try
+					{
+						current_ = open(index);
+						current_index_ = index;
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						failed(index);
+					}
+				}
+
+				if (!current_)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info("No playlist item could be opened."));
+
+				output_		= clone_layout(*current_->context, AVRational{ 0, 1 });
+				lanes_.reset(new packet_lanes(*output_));
+				splicer_.reset(new timeline_splicer(output_));
+				current_->stream_map = splicer_->map(*current_->context, current_->name);
+
+				is_running_ = true;
+				thread_ = boost::thread([this] { run(); });
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+				thread_.join();
+			}
+
+			int take_index()
+			{
+				auto index = next_index_;
+
+				if (index < 0)
+					return index;
+
+				next_index_ = index + 1 < static_cast<int>(items_.size()) ? index + 1 : (settings_.loop ? 0 : -1);
+
+				return index;
+			}
+
+			void failed(int index)
+			{
+				CASPAR_LOG(warning) << L"[playlist] Skipping " << items_.at(index);
+				++failed_items_;
+
+				// Stops a looping playlist in which nothing opens any more.
+				if (++consecutive_failures_ >= items_.size())
+					next_index_ = -1;
+			}
+
+			std::shared_ptr<playlist_item> open(int index) const
+			{
+				auto item = std::make_shared<playlist_item>();
+				item->name		= items_.at(index);
+				item->producer	= create_(item->name);
+
+				if (!item->producer)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"Could not open playlist item " + item->name));
+
+				item->context	= item->producer->context();
+				item->source.reset(new packet_source(item->producer));
+				item->duration	= item->context->duration;
+
+				return item;
+			}
+
+			void run()
+			{
+				try
+				{
+					while (is_running_)
+					{
+						if (lanes_->full())
+						{
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(20));
+							continue;
+						}
+
+						prepare_next();
+						preroll_next();
+
+						std::shared_ptr<AVPacket> packet;
+
+						if (!pop(*current_, packet))
+						{
+							if (!current_->ended)
+							{
+								boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+								continue;
+							}
+
+							if (!splice())
+								break;
+
+							continue;
+						}
+
+						// Seeks within the item and its end, neither reaches the output.
+						if (!packet->data)
+						{
+							if (packet->pos == -1)
+								current_->ended = true;
+
+							continue;
+						}
+
+						if (splicer_->apply(*current_->context, current_->stream_map, *packet))
+							lanes_->push(packet);
+					}
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				if (is_running_)
+				{
+					finished_ = true;
+					lanes_->push_end();
+				}
+			}
+
+			void prepare_next()
+			{
+				if (next_item_ || next_.valid() || next_index_ < 0)
+					return;
+
+				auto remaining	= current_->duration != AV_NOPTS_VALUE ? current_->duration - splicer_->position() : AV_NOPTS_VALUE;
+				auto due		= current_->ended || (remaining != AV_NOPTS_VALUE && remaining <= settings_.lead_time);
+
+				if (!due)
+					return;
+
+				auto index = take_index();
+
+				next_ = opener_.begin_invoke([=]
+				{
+					auto item = open(index);
+					item->stream_map = splicer_->map(*item->context, item->name);
+					return item;
+				});
+				next_opening_index_ = index;
+			}
+
+			void take_next()
+			{
+				try
+				{
+					next_item_ = next_.get();
+					consecutive_failures_ = 0;
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+					failed(next_opening_index_);
+				}
+			}
+
+			void preroll_next()
+			{
+				if (next_.valid() && next_.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+					take_next();
+
+				if (!next_item_)
+					return;
+
+				auto& item = *next_item_;
+				std::shared_ptr<AVPacket> packet;
+
+				while (item.preroll_bytes < settings_.max_preroll_bytes && item.source->try_pop(packet))
+				{
+					item.preroll_bytes += packet->size;
+					item.preroll.push_back(std::move(packet));
+				}
+
+				preroll_bytes_ = item.preroll_bytes;
+			}
+
+			static bool pop(playlist_item& item, std::shared_ptr<AVPacket>& packet)
+			{
+				if (item.preroll.empty())
+					return item.source->try_pop(packet);
+
+				packet = std::move(item.preroll.front());
+				item.preroll.pop_front();
+				item.preroll_bytes -= packet->size;
+
+				return true;
+			}
+
+			bool splice()
+			{
+				auto late = false;
+
+				while (!next_item_)
+				{
+					if (!is_running_)
+						return false;
+
+					if (!next_.valid())
+					{
+						if (next_index_ < 0)
+							return false;
+
+						prepare_next();
+						continue;
+					}
+
+					if (!late && next_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+					{
+						CASPAR_LOG(warning) << L"[playlist] " << items_.at(next_opening_index_) << L" is not ready at the end of " << current_->name << L".";
+						++late_splices_;
+						late = true;
+					}
+
+					next_.wait();
+					take_next();
+				}
+
+				CASPAR_LOG(info) << L"[playlist] Playing " << next_item_->name << L".";
+
+				splicer_->splice();
+				current_		= std::move(next_item_);
+				current_index_	= next_opening_index_;
+				preroll_bytes_	= 0;
+				++splices_;
+
+				return true;
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+				info.add(L"items", items_.size());
+				info.add(L"current", items_.at(current_index_));
+				info.add(L"loop", settings_.loop);
+				info.add(L"splices", splices_);
+				info.add(L"late-splices", late_splices_);
+				info.add(L"failed-items", failed_items_);
+				info.add(L"preroll-bytes", preroll_bytes_);
+				info.add(L"finished", finished_);
+
+				return info;
+			}
+		};
+
+		playlist_producer::playlist_producer(const std::vector<std::wstring>& items, const factory& create, const settings& settings)
+			: impl_(new impl(items, create, settings))
+		{
+		}
+
+		playlist_producer::~playlist_producer()
+		{
+		}
+
+		bool playlist_producer::receive_v(std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->lanes_->receive_v(packet);
+		}
+
+		bool playlist_producer::receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			return impl_->lanes_->receive_a(packet, stream_index);
+		}
+
+		bool playlist_producer::receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			return impl_->lanes_->receive_s(packet, stream_index);
+		}
+
+		std::shared_ptr<AVFormatContext> playlist_producer::context()
+		{
+			return impl_->output_;
+		}
+
+		boost::property_tree::wptree playlist_producer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
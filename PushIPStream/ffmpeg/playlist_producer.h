@@ -0,0 +1,56 @@
+#pragma once
+
+#include "../packetProducer.h"
+#include "util/util.h"
+
+#include <common/memory.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Plays a list of items as one continuous stream. The next item is opened
+		// and pre-buffered on a background thread while the current one plays,
+		// then spliced in at the dts where the current one ends, so the output
+		// neither pauses nor jumps.
+		//
+		// The stream layout is the one of the first item. Later items are mapped
+		// onto it by stream type and order and skipped if a mapped audio or video
+		// stream has another codec. The first packet of every stream after a
+		// splice carries PKT_FLAG_DISCONTINUITY and, when the codec parameters
+		// changed, AV_PKT_DATA_NEW_EXTRADATA.
+		class playlist_producer : public packetProducer
+		{
+		public:
+			typedef std::function<std::shared_ptr<packetProducer>(const std::wstring& item)> factory;
+
+			struct settings
+			{
+				int64_t		lead_time			= 5 * AV_TIME_BASE;		// How long before the end of an item the next one is opened.
+				size_t		max_preroll_bytes	= 16 * 1024 * 1024;		// Cap on what is read ahead from the next item.
+				bool		loop				= false;
+			};
+
+			// The first item is opened before returning, the context of the
+			// playlist is known from then on.
+			playlist_producer(const std::vector<std::wstring>& items, const factory& create, const settings& settings);
+			~playlist_producer();
+
+			bool								receive_v(std::shared_ptr<AVPacket>& packet) override;
+			bool								receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index) override;
+			bool								receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index) override;
+			std::shared_ptr<AVFormatContext>	context() override;
+
+			boost::property_tree::wptree		info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,583 @@
+#include "StdAfx.h"
+
+#include "playout_scheduler.h"
+
+#include "ffmpeg_error.h"
+#include "input_pool.h"
+#include "packet_lanes.h"
+#include "packet_source.h"
+#include "timeline_splicer.h"
+
+#include <common/except.h>
+#include <common/log.h>
+#include <common/os/precise_sleep.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Later than this counts as a late start.
+		static const int64_t LATE_TOLERANCE = AV_TIME_BASE / 1000;
+		// Longest sleep of the release loop, AV_TIME_BASE.
+		static const int64_t POLL_INTERVAL = AV_TIME_BASE / 200;
+
+		struct scheduled_clip : boost::noncopyable
+		{
+			playout_scheduler::entry				entry;
+			int64_t									start		= AV_NOPTS_VALUE;	// Output time, AV_TIME_BASE, as below.
+			int64_t									placed_at	= AV_NOPTS_VALUE;	// Output time of first_time.
+			int64_t									first_time	= AV_NOPTS_VALUE;	// First timestamp of the clip.
+			bool									filler		= false;
+			input_pool::handle						prepared;
+			std::shared_ptr<packetProducer>			producer;
+			std::shared_ptr<AVFormatContext>		context;
+			std::unique_ptr<packet_source>			source;
+			std::vector<int>						stream_map;
+			bool									ended		= false;
+			bool									tried		= false;	// Was due and not ready.
+			bool									waiting		= false;	// Not ready at its start, logged.
+		};
+
+		struct playout_scheduler::impl : boost::noncopyable
+		{
+			const factory									create_;
+			const settings									settings_;
+			const int64_t									wall_epoch_		= wall_now();
+			const int64_t									clock_epoch_	= monotonic_now();
+			std::shared_ptr<AVFormatContext>				output_;
+
+			std::unique_ptr<packet_lanes>					lanes_;
+			std::unique_ptr<timeline_splicer>				splicer_;
+
+			mutable tbb::spin_mutex							mutex_;
+			std::deque<std::shared_ptr<scheduled_clip>>		pending_;	// By start, with on_air_ guarded by mutex_.
+			std::wstring									on_air_;
+
+			std::shared_ptr<scheduled_clip>					current_;
+			std::shared_ptr<scheduled_clip>					filler_;	// Prepared for the next gap.
+			std::shared_ptr<AVPacket>						held_;		// Next packet of current_, waiting for its time.
+			int64_t											held_time_		= AV_NOPTS_VALUE;
+			bool											on_air_once_	= false;
+			bool											underrun_		= false;
+			int64_t											underrun_since_	= 0;
+
+			tbb::atomic<int64_t>							output_end_;	// Output time released so far.
+			tbb::atomic<uint64_t>							starts_;
+			tbb::atomic<uint64_t>							late_starts_;
+			tbb::atomic<int64_t>							late_total_;
+			tbb::atomic<int64_t>							late_max_;
+			tbb::atomic<uint64_t>							cuts_;
+			tbb::atomic<uint64_t>							missed_;
+			tbb::atomic<uint64_t>							failed_;
+			tbb::atomic<uint64_t>							underruns_;
+			tbb::atomic<int64_t>							underrun_total_;
+			tbb::atomic<uint64_t>							filler_starts_;
+
+			tbb::atomic<bool>								is_running_;
+			boost::thread									thread_;
+
+			impl(const std::vector<entry>& schedule, const factory& create, const settings& settings)
+				: create_(create)
+				, settings_(settings)
+			{
+				output_end_		= AV_NOPTS_VALUE;
+				starts_			= 0;
+				late_starts_	= 0;
+				late_total_		= 0;
+				late_max_		= 0;
+				cuts_			= 0;
+				missed_			= 0;
+				failed_			= 0;
+				underruns_		= 0;
+				underrun_total_	= 0;
+				filler_starts_	= 0;
+
+				for (auto& entry : schedule)
+					add(entry);
+
+				if (pending_.empty() && settings_.filler.empty())
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info("Empty schedule."));
+
+				// The filler, or the first clip, defines the stream layout.
+				if (!settings_.filler.empty())
+					filler_ = make_filler();
+
+				auto& first = filler_ ? *filler_ : *pending_.front();
+
+				if (!first.prepared)
+					prepare(first);
+
+				first.producer = input_pool::instance().take(first.prepared);
+
+				if (!first.producer)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"Could not open " + first.entry.clip));
+
+				first.context	= first.producer->context();
+				first.source.reset(new packet_source(first.producer));
+
+				output_			= clone_layout(*first.context, AVRational{ 0, 1 });
+				lanes_.reset(new packet_lanes(*output_));
+				splicer_.reset(new timeline_splicer(output_));
+				first.stream_map = splicer_->map(*first.context, first.entry.clip);
+
+				is_running_ = true;
+				thread_ = boost::thread([this] { run(); });
+			}
+
+			~impl()
+			{
+				is_running_ = false;
+				thread_.join();
+			}
+
+			// Master clock, the output time now.
+			int64_t master_now() const
+			{
+				return (monotonic_now() - clock_epoch_) / (1000000000 / AV_TIME_BASE);
+			}
+
+			void sleep_until_output_time(int64_t time) const
+			{
+				sleep_until(clock_epoch_ + time * (1000000000 / AV_TIME_BASE));
+			}
+
+			void add(const entry& entry)
+			{
+				auto clip = std::make_shared<scheduled_clip>();
+				clip->entry	= entry;
+				clip->start	= entry.start - wall_epoch_;
+
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				auto position = std::upper_bound(pending_.begin(), pending_.end(), clip, [](const std::shared_ptr<scheduled_clip>& a, const std::shared_ptr<scheduled_clip>& b)
+				{
+					return a->start < b->start;
+				});
+
+				pending_.insert(position, clip);
+			}
+
+			std::shared_ptr<scheduled_clip> make_filler() const
+			{
+				auto clip = std::make_shared<scheduled_clip>();
+				clip->entry.clip	= settings_.filler;
+				clip->entry.loop	= true;
+				clip->filler		= true;
+				prepare(*clip);
+
+				return clip;
+			}
+
+			void prepare(scheduled_clip& clip) const
+			{
+				auto create	= create_;
+				auto entry	= clip.entry;
+
+				clip.prepared = input_pool::instance().prepare(entry.clip, [create, entry]
+				{
+					return create(entry);
+				});
+			}
+
+			// Whether the clip is open, throws when opening it failed.
+			bool open(scheduled_clip& clip)
+			{
+				if (clip.producer)
+					return true;
+
+				if (!clip.prepared)
+					prepare(clip);
+
+				if (!input_pool::instance().ready(clip.prepared))
+					return false;
+
+				clip.producer = input_pool::instance().take(clip.prepared);
+
+				if (!clip.producer)
+					CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(L"Could not open " + clip.entry.clip));
+
+				clip.context	= clip.producer->context();
+				clip.source.reset(new packet_source(clip.producer));
+				clip.stream_map	= splicer_->map(*clip.context, clip.entry.clip);
+
+				return true;
+			}
+
+			void run()
+			{
+				try
+				{
+					while (is_running_)
+					{
+						auto now = master_now();
+
+						prepare_due(now);
+
+						if (switch_clips(now))
+							continue;
+
+						if (!current_ || lanes_->full())
+						{
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+							continue;
+						}
+
+						// The next packet goes round once more, a clip due at its time cuts it.
+						if (!held_)
+						{
+							if (!pop(now))
+								boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+
+							continue;
+						}
+
+						auto due = held_time_ - settings_.lead;
+
+						if (due > now)
+						{
+							sleep_until_output_time(std::min(due, now + POLL_INTERVAL));
+							continue;
+						}
+
+						release(now);
+					}
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				if (is_running_)
+					lanes_->push_end();
+			}
+
+			void prepare_due(int64_t now)
+			{
+				std::vector<std::shared_ptr<scheduled_clip>> due;
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					for (auto& clip : pending_)
+					{
+						if (clip->start - settings_.preroll > now)
+							break;
+
+						if (!clip->prepared && !clip->producer)
+							due.push_back(clip);
+					}
+				}
+
+				for (auto& clip : due)
+					prepare(*clip);
+			}
+
+			// Puts the next clip, or the filler, on air when it is due. Returns
+			// whether the output changed.
+			bool switch_clips(int64_t now)
+			{
+				std::shared_ptr<scheduled_clip> next;
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					// Clips whose slot passed before they could start: the next clip's
+					// start passed on the master clock, or it is due and this one was
+					// tried and is still not ready.
+					while (pending_.size() > 1 && (pending_[1]->start <= now || (pending_[1]->start <= now + settings_.lead && pending_.front()->tried)))
+					{
+						CASPAR_LOG(warning) << L"[schedule] Missed " << pending_.front()->entry.clip << L".";
+						++missed_;
+						pending_.pop_front();
+					}
+
+					if (!pending_.empty())
+						next = pending_.front();
+				}
+
+				if (next && now + settings_.lead >= next->start && (!held_ || held_time_ >= next->start))
+				{
+					try
+					{
+						if (!open(*next))
+						{
+							next->tried = true;
+
+							if (!next->waiting && now >= next->start)
+							{
+								CASPAR_LOG(warning) << L"[schedule] " << next->entry.clip << L" is not ready at its start.";
+								next->waiting = true;
+							}
+
+							return false;
+						}
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						CASPAR_LOG(warning) << L"[schedule] Skipping " << next->entry.clip << L".";
+						++failed_;
+						remove(next);
+
+						return true;
+					}
+
+					// A late clip starts now, after what was released of the one before it.
+					auto start = next->start;
+
+					if (now - start > LATE_TOLERANCE)
+						start = output_end_ != AV_NOPTS_VALUE ? std::max<int64_t>(output_end_, now) : now;
+
+					auto late = start - next->start;
+
+					if (late > LATE_TOLERANCE)
+					{
+						CASPAR_LOG(warning) << L"[schedule] " << next->entry.clip << L" started " << late / 1000 << L" ms late.";
+						++late_starts_;
+						late_total_ += late;
+
+						if (late > late_max_)
+							late_max_ = late;
+					}
+					else
+						CASPAR_LOG(info) << L"[schedule] Playing " << next->entry.clip << L".";
+
+					remove(next);
+					on_air(next, start);
+
+					return true;
+				}
+
+				if ((!current_ || current_->ended) && filler_)
+				{
+					try
+					{
+						if (!open(*filler_))
+							return false;
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						CASPAR_LOG(warning) << L"[schedule] Filler " << settings_.filler << L" failed, gaps stay silent.";
+						++failed_;
+						filler_.reset();
+
+						return true;
+					}
+
+					auto filler = std::move(filler_);
+					filler_ = make_filler();
+
+					++filler_starts_;
+					on_air(filler, output_end_ != AV_NOPTS_VALUE ? std::max<int64_t>(output_end_, now) : now);
+
+					return true;
+				}
+
+				return false;
+			}
+
+			void remove(const std::shared_ptr<scheduled_clip>& clip)
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				pending_.erase(std::remove(pending_.begin(), pending_.end(), clip), pending_.end());
+			}
+
+			void on_air(const std::shared_ptr<scheduled_clip>& clip, int64_t start)
+			{
+				if (on_air_once_)
+					splicer_->splice();
+
+				splicer_->start_at(start);
+				on_air_once_ = true;
+
+				if (current_ && !current_->ended && !current_->filler)
+					++cuts_;
+
+				if (!clip->filler)
+					++starts_;
+
+				if (underrun_)
+					end_underrun(master_now());
+
+				clip->placed_at	= start;
+				current_		= clip;
+				held_.reset();
+
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+				on_air_ = clip->entry.clip;
+			}
+
+			bool pop(int64_t now)
+			{
+				std::shared_ptr<AVPacket> packet;
+
+				while (current_->source->try_pop(packet))
+				{
+					// Seeks within the clip and its end, neither reaches the output.
+					if (!packet->data)
+					{
+						if (packet->pos == -1)
+							current_->ended = true;
+
+						continue;
+					}
+
+					auto index = packet->stream_index;
+
+					if (index < 0 || index >= static_cast<int>(current_->stream_map.size()) || current_->stream_map[index] < 0)
+						continue;
+
+					// Where the splicer will put it, it is only applied when released
+					// so a packet dropped by a cut leaves no trace on the output.
+					auto dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+					if (dts != AV_NOPTS_VALUE)
+					{
+						auto time = av_rescale_q(dts, current_->context->streams[index]->time_base, AV_TIME_BASE_Q);
+
+						if (current_->first_time == AV_NOPTS_VALUE)
+							current_->first_time = time;
+
+						held_time_ = current_->placed_at + time - current_->first_time;
+					}
+					else
+						held_time_ = now;
+
+					held_ = std::move(packet);
+
+					return true;
+				}
+
+				// The clip on air fell behind the master clock, the output runs dry.
+				if (!current_->ended && !underrun_ && output_end_ != AV_NOPTS_VALUE && now > output_end_)
+				{
+					CASPAR_LOG(warning) << L"[schedule] Underrun on " << current_->entry.clip << L".";
+					underrun_		= true;
+					underrun_since_	= output_end_;
+					++underruns_;
+				}
+
+				return false;
+			}
+
+			void release(int64_t now)
+			{
+				auto packet = std::move(held_);
+
+				if (!splicer_->apply(*current_->context, current_->stream_map, *packet))
+					return;
+
+				auto duration	= packet->duration > 0 ? av_rescale_q(packet->duration, output_->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q) : 0;
+				auto end		= held_time_ + duration;
+
+				if (output_end_ == AV_NOPTS_VALUE || end > output_end_)
+					output_end_ = end;
+
+				lanes_->push(packet);
+
+				// The underrun lasts until the output is ahead of the clock again.
+				if (underrun_ && output_end_ > now)
+					end_underrun(now);
+			}
+
+			void end_underrun(int64_t now)
+			{
+				underrun_total_ += now - underrun_since_;
+				underrun_ = false;
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				auto now = master_now();
+
+				boost::property_tree::wptree info;
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					info.add(L"on-air", on_air_);
+					info.add(L"scheduled", pending_.size());
+
+					if (!pending_.empty())
+					{
+						info.add(L"next", pending_.front()->entry.clip);
+						info.add(L"next-in-ms", (pending_.front()->start - now) / 1000);
+					}
+				}
+
+				info.add(L"master-time-ms", now / 1000);
+				info.add(L"output-ahead-ms", output_end_ != AV_NOPTS_VALUE ? (output_end_ - now) / 1000 : 0);
+				info.add(L"starts", starts_);
+				info.add(L"late-starts", late_starts_);
+				info.add(L"late-ms-total", late_total_ / 1000);
+				info.add(L"late-ms-max", late_max_ / 1000);
+				info.add(L"cuts", cuts_);
+				info.add(L"missed", missed_);
+				info.add(L"failed", failed_);
+				info.add(L"underruns", underruns_);
+				info.add(L"underrun-ms", underrun_total_ / 1000);
+				info.add(L"filler-starts", filler_starts_);
+
+				return info;
+			}
+		};
+
+		playout_scheduler::playout_scheduler(const std::vector<entry>& schedule, const factory& create, const settings& settings)
+			: impl_(new impl(schedule, create, settings))
+		{
+		}
+
+		playout_scheduler::~playout_scheduler()
+		{
+		}
+
+		void playout_scheduler::schedule(const entry& entry)
+		{
+			impl_->add(entry);
+		}
+
+		int64_t playout_scheduler::wall_now()
+		{
+			static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+
+			return av_rescale((boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds(), AV_TIME_BASE, 1000000);
+		}
+
+		bool playout_scheduler::receive_v(std::shared_ptr<AVPacket>& packet)
+		{
+			return impl_->lanes_->receive_v(packet);
+		}
+
+		bool playout_scheduler::receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			return impl_->lanes_->receive_a(packet, stream_index);
+		}
+
+		bool playout_scheduler::receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index)
+		{
+			return impl_->lanes_->receive_s(packet, stream_index);
+		}
+
+		std::shared_ptr<AVFormatContext> playout_scheduler::context()
+		{
+			return impl_->output_;
+		}
+
+		boost::property_tree::wptree playout_scheduler::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
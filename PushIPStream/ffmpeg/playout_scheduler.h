@@ -0,0 +1,84 @@
+#pragma once
+
+#include "../packetProducer.h"
+#include "util/util.h"
+
+#include <common/memory.h>
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Plays clips at scheduled wall clock times, as one stream for one
+		// output.
+		//
+		// Output timestamps come from a single master clock, the monotonic clock
+		// counted from when the scheduler started and tied to the wall clock
+		// once, so a clip scheduled at a wall clock time starts at the matching
+		// output time and clock adjustments do not move the schedule. Packets
+		// are released when their output time is lead ahead of the master
+		// clock, which keeps the output real time whatever the producers do.
+		//
+		// Each clip is prepared on the input_pool preroll before its start. It
+		// starts at its time, cutting the clip before it, and plays until its
+		// OUT point or the start of the next one. Gaps play the filler clip, in
+		// a loop, or leave the output silent. A clip that is not ready at its
+		// start keeps the one before it playing and starts late. Late starts,
+		// underruns (the producer on air falling behind the master clock) and
+		// clips that could not be played are counted in info() and logged.
+		//
+		// The stream layout is the one of the filler, or of the first clip, and
+		// later clips are mapped onto it as in playlist_producer. Runs until
+		// destroyed, clips may be added to the schedule at any time.
+		class playout_scheduler : public packetProducer
+		{
+		public:
+			struct entry
+			{
+				int64_t			start	= 0;									// Wall clock, AV_TIME_BASE since the unix epoch (UTC).
+				std::wstring	clip;
+				uint32_t		in		= 0;									// As the IN and OUT of createProducer.
+				uint32_t		out		= std::numeric_limits<uint32_t>::max();
+				bool			loop	= false;
+			};
+
+			typedef std::function<std::shared_ptr<packetProducer>(const entry& entry)> factory;
+
+			struct settings
+			{
+				int64_t			preroll		= 10 * AV_TIME_BASE;		// How long before its start a clip is prepared.
+				int64_t			lead		= AV_TIME_BASE / 2;			// How far packets are released ahead of the master clock.
+				std::wstring	filler;									// Played in gaps, empty leaves them silent.
+			};
+
+			// Opens the filler, or the first clip, before returning, the context of
+			// the scheduler is known from then on.
+			playout_scheduler(const std::vector<entry>& schedule, const factory& create, const settings& settings);
+			~playout_scheduler();
+
+			// Adds a clip, in start order with the clips already scheduled.
+			void								schedule(const entry& entry);
+
+			// The wall clock of the schedule, AV_TIME_BASE since the unix epoch.
+			static int64_t						wall_now();
+
+			bool								receive_v(std::shared_ptr<AVPacket>& packet) override;
+			bool								receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index) override;
+			bool								receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index) override;
+			std::shared_ptr<AVFormatContext>	context() override;
+
+			boost::property_tree::wptree		info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
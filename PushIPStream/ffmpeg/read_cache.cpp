@@ -0,0 +1,315 @@
+#include "StdAfx.h"
+
+#include "read_cache.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C"
+{
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+#include <libavutil/avutil.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// The AVIOContext's own buffer, reads are served from cached blocks so
+		// a larger one only adds a copy.
+		static const int IO_BUFFER_SIZE = 32 * 1024;
+
+		struct read_cache::impl : public std::enable_shared_from_this<impl>
+		{
+			struct block
+			{
+				std::vector<uint8_t>	data;
+				bool					ready	= false;
+				bool					failed	= false;
+			};
+
+			typedef std::pair<std::wstring, uint64_t> key;
+
+			struct entry
+			{
+				std::shared_ptr<block>		cached;
+				std::list<key>::iterator	lru;	// lru_.end() while being read.
+			};
+
+			// One per AVIOContext, read from the thread of its input.
+			struct reader
+			{
+				std::shared_ptr<impl>			cache;
+				std::wstring					file;
+				uint64_t						size		= 0;
+				uint64_t						position	= 0;
+				boost::filesystem::ifstream		stream;
+				std::shared_ptr<const block>	current;
+				uint64_t						current_index	= 0;
+
+				bool load(uint64_t index, std::vector<uint8_t>& data)
+				{
+					auto offset = index * BLOCK_SIZE;
+
+					data.resize(static_cast<size_t>(std::min(static_cast<uint64_t>(BLOCK_SIZE), size - offset)));
+
+					stream.clear();
+					stream.seekg(static_cast<std::streamoff>(offset));
+					stream.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+
+					return stream.gcount() == static_cast<std::streamsize>(data.size());
+				}
+
+				static int read_packet(void* opaque, uint8_t* buf, int buf_size)
+				{
+					auto& self = *static_cast<reader*>(opaque);
+
+					if (self.position >= self.size)
+						return AVERROR_EOF;
+
+					auto index = self.position / BLOCK_SIZE;
+
+					if (!self.current || self.current_index != index)
+					{
+						self.current		= self.cache->get(self, index);
+						self.current_index	= index;
+
+						if (!self.current)
+							return AVERROR(EIO);
+					}
+
+					auto offset	= static_cast<size_t>(self.position % BLOCK_SIZE);
+					auto count	= std::min(static_cast<size_t>(buf_size), self.current->data.size() - offset);
+
+					std::memcpy(buf, self.current->data.data() + offset, count);
+					self.position += count;
+
+					return static_cast<int>(count);
+				}
+
+				static int64_t seek(void* opaque, int64_t offset, int whence)
+				{
+					auto& self = *static_cast<reader*>(opaque);
+					int64_t position;
+
+					switch (whence & ~AVSEEK_FORCE)
+					{
+					case AVSEEK_SIZE:	return static_cast<int64_t>(self.size);
+					case SEEK_SET:		position = offset;											break;
+					case SEEK_CUR:		position = static_cast<int64_t>(self.position) + offset;	break;
+					case SEEK_END:		position = static_cast<int64_t>(self.size) + offset;		break;
+					default:			return AVERROR(EINVAL);
+					}
+
+					if (position < 0)
+						return AVERROR(EINVAL);
+
+					self.position = static_cast<uint64_t>(position);
+
+					return position;
+				}
+			};
+
+			mutable boost::mutex		mutex_;
+			boost::condition_variable	read_done_;
+			std::map<key, entry>		blocks_;
+			std::list<key>				lru_;		// Most recently used first.
+			size_t						capacity_	= DEFAULT_CAPACITY;
+			size_t						bytes_		= 0;
+			size_t						reading_	= 0;
+
+			uint64_t					hits_		= 0;
+			uint64_t					misses_		= 0;
+			uint64_t					coalesced_	= 0;
+			uint64_t					disk_bytes_	= 0;
+			uint64_t					evictions_	= 0;
+			uint64_t					failures_	= 0;
+
+			void set_capacity(size_t capacity)
+			{
+				boost::lock_guard<boost::mutex> lock(mutex_);
+
+				capacity_ = capacity;
+				evict();
+			}
+
+			std::shared_ptr<AVIOContext> open(const std::wstring& path)
+			{
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+
+					if (capacity_ == 0)
+						return nullptr;
+				}
+
+				boost::system::error_code ec;
+				auto absolute	= boost::filesystem::absolute(path);
+				auto size		= boost::filesystem::file_size(absolute, ec);
+				auto modified	= ec ? 0 : boost::filesystem::last_write_time(absolute, ec);
+
+				if (ec)
+					return nullptr;
+
+				auto file = std::unique_ptr<reader>(new reader);
+				file->cache	= shared_from_this();
+				file->file	= absolute.wstring() + L"|" + std::to_wstring(size) + L"|" + std::to_wstring(static_cast<int64_t>(modified));
+				file->size	= size;
+				file->stream.open(absolute, std::ios::in | std::ios::binary);
+
+				if (!file->stream)
+					return nullptr;
+
+				// Blocks are read whole, the stream's own buffer would only add a copy.
+				file->stream.rdbuf()->pubsetbuf(nullptr, 0);
+
+				auto buffer = static_cast<uint8_t*>(av_malloc(IO_BUFFER_SIZE));
+
+				if (!buffer)
+					throw std::bad_alloc();
+
+				auto context = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, file.get(), &reader::read_packet, nullptr, &reader::seek);
+
+				if (!context)
+				{
+					av_free(buffer);
+					throw std::bad_alloc();
+				}
+
+				return std::shared_ptr<AVIOContext>(context, [file = std::shared_ptr<reader>(std::move(file))](AVIOContext* ptr)
+				{
+					av_freep(&ptr->buffer);
+					av_freep(&ptr);
+				});
+			}
+
+			std::shared_ptr<const block> get(reader& file, uint64_t index)
+			{
+				auto block_key = key(file.file, index);
+
+				boost::unique_lock<boost::mutex> lock(mutex_);
+
+				auto it = blocks_.find(block_key);
+
+				if (it != blocks_.end())
+				{
+					auto result = it->second.cached;
+
+					if (result->ready)
+					{
+						++hits_;
+						lru_.splice(lru_.begin(), lru_, it->second.lru);
+						return result;
+					}
+
+					// Another input is reading it, wait for that read.
+					++coalesced_;
+					read_done_.wait(lock, [&] { return result->ready || result->failed; });
+
+					return result->ready ? result : nullptr;
+				}
+
+				++misses_;
+				++reading_;
+
+				auto result = std::make_shared<block>();
+				blocks_.insert(std::make_pair(block_key, entry{ result, lru_.end() }));
+
+				lock.unlock();
+				auto loaded = file.load(index, result->data);
+				lock.lock();
+
+				--reading_;
+				it = blocks_.find(block_key);
+
+				if (loaded)
+				{
+					result->ready		= true;
+					it->second.lru		= lru_.insert(lru_.begin(), block_key);
+					bytes_				+= result->data.size();
+					disk_bytes_			+= result->data.size();
+					evict();
+				}
+				else
+				{
+					result->failed = true;
+					blocks_.erase(it);
+					++failures_;
+				}
+
+				read_done_.notify_all();
+
+				return loaded ? result : nullptr;
+			}
+
+			void evict()
+			{
+				while (bytes_ > capacity_ && !lru_.empty())
+				{
+					auto it = blocks_.find(lru_.back());
+
+					bytes_ -= it->second.cached->data.size();
+					blocks_.erase(it);
+					lru_.pop_back();
+					++evictions_;
+				}
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::lock_guard<boost::mutex> lock(mutex_);
+
+				boost::property_tree::wptree info;
+				info.add(L"capacity-mb", capacity_ / (1024 * 1024));
+				info.add(L"cached-mb", static_cast<double>(bytes_) / (1024.0 * 1024.0));
+				info.add(L"blocks", lru_.size());
+				info.add(L"reading", reading_);
+				info.add(L"hits", hits_);
+				info.add(L"misses", misses_);
+				info.add(L"coalesced", coalesced_);
+				info.add(L"hit-ratio", hits_ + misses_ + coalesced_ > 0 ? static_cast<double>(hits_ + coalesced_) / static_cast<double>(hits_ + misses_ + coalesced_) : 0.0);
+				info.add(L"disk-read-mb", static_cast<double>(disk_bytes_) / (1024.0 * 1024.0));
+				info.add(L"evictions", evictions_);
+				info.add(L"read-failures", failures_);
+
+				return info;
+			}
+		};
+
+		read_cache& read_cache::instance()
+		{
+			static read_cache cache;
+			return cache;
+		}
+
+		read_cache::read_cache()
+			: impl_(std::make_shared<impl>())
+		{
+		}
+
+		read_cache::~read_cache()
+		{
+		}
+
+		void read_cache::set_capacity(size_t capacity) { impl_->set_capacity(capacity); }
+		std::shared_ptr<AVIOContext> read_cache::open(const std::wstring& path) { return impl_->open(path); }
+		boost::property_tree::wptree read_cache::info() const { return impl_->info(); }
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct AVIOContext;
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Process wide cache of file blocks, shared by every input playing a
+		// local file, so channels looping the same clip read it from disk once.
+		//
+		// Files are read in large aligned blocks keyed by (file, block), where a
+		// file is its absolute path, size and modification time, so a replaced
+		// file is never served from stale blocks. Blocks are evicted least
+		// recently used first once the cache holds more than its capacity;
+		// blocks still being read by an input stay alive until it moves on. A
+		// block requested while another input is reading it from disk is not
+		// read again, the requester waits for that read instead.
+		//
+		// Inputs use it through an AVIOContext, set as AVFormatContext::pb
+		// together with AVFMT_FLAG_CUSTOM_IO. Thread safe.
+		class read_cache : boost::noncopyable
+		{
+		public:
+			static const size_t BLOCK_SIZE			= 1024 * 1024;
+			static const size_t DEFAULT_CAPACITY	= 256 * 1024 * 1024;
+
+			static read_cache& instance();
+
+			// Bytes of blocks kept, 0 disables caching for files opened after.
+			void							set_capacity(size_t capacity);
+
+			// An AVIOContext reading path through the cache, nullptr when the
+			// cache is disabled or the file can not be opened (the caller then
+			// lets ffmpeg open it). Must outlive the format context using it.
+			std::shared_ptr<AVIOContext>	open(const std::wstring& path);
+
+			boost::property_tree::wptree	info() const;
+		private:
+			read_cache();
+			~read_cache();
+
+			struct impl;
+			std::shared_ptr<impl> impl_;
+		};
+	}
+}
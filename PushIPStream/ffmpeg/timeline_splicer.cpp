@@ -0,0 +1,236 @@
+#include "StdAfx.h"
+
+#include "timeline_splicer.h"
+
+#include "ffmpeg_error.h"
+#include "timestamp_normalizer.h"
+
+#include <common/except.h>
+#include <common/log.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		struct timeline_splicer::impl : boost::noncopyable
+		{
+			struct stream_state
+			{
+				int64_t					last_dts		= AV_NOPTS_VALUE;	// Output time base.
+				int64_t					last_duration	= 0;
+				bool					started			= false;			// Since the last splice.
+				std::vector<uint8_t>	extradata;		// Last sent.
+			};
+
+			const std::shared_ptr<AVFormatContext>	output_;
+			std::vector<stream_state>				streams_;
+			int64_t									end_			= AV_NOPTS_VALUE;	// AV_TIME_BASE, as all below.
+			int64_t									offset_			= 0;
+			int64_t									segment_start_	= 0;
+			int64_t									next_start_		= AV_NOPTS_VALUE;
+			bool									pending_		= true;
+			uint64_t								splices_		= 0;
+
+			explicit impl(const std::shared_ptr<AVFormatContext>& output)
+				: output_(output)
+			{
+				for (unsigned int i = 0; i < output_->nb_streams; ++i)
+				{
+					auto codec = output_->streams[i]->codec;
+					stream_state s;
+
+					if (codec->extradata)
+						s.extradata.assign(codec->extradata, codec->extradata + codec->extradata_size);
+
+					streams_.push_back(s);
+				}
+			}
+
+			static int ordinal(const AVFormatContext& context, unsigned int index)
+			{
+				auto type	= context.streams[index]->codec->codec_type;
+				int n		= 0;
+
+				for (unsigned int i = 0; i < index; ++i)
+				{
+					if (context.streams[i]->codec->codec_type == type)
+						++n;
+				}
+
+				return n;
+			}
+
+			std::vector<int> map(const AVFormatContext& source, const std::wstring& name) const
+			{
+				std::vector<int> result(source.nb_streams, -1);
+
+				for (unsigned int i = 0; i < source.nb_streams; ++i)
+				{
+					auto codec = source.streams[i]->codec;
+
+					for (unsigned int o = 0; o < output_->nb_streams; ++o)
+					{
+						auto out_codec = output_->streams[o]->codec;
+
+						if (out_codec->codec_type != codec->codec_type || ordinal(*output_, o) != ordinal(source, i))
+							continue;
+
+						if (out_codec->codec_id != codec->codec_id && (codec->codec_type == AVMEDIA_TYPE_VIDEO || codec->codec_type == AVMEDIA_TYPE_AUDIO))
+						{
+							CASPAR_THROW_EXCEPTION(ffmpeg_user_error() << msg_info(name + L" has codec " + u16(avcodec_get_name(codec->codec_id))
+								+ L" where the output has " + u16(avcodec_get_name(out_codec->codec_id))));
+						}
+
+						result[i] = o;
+					}
+				}
+
+				for (unsigned int o = 0; o < output_->nb_streams; ++o)
+				{
+					if (std::find(result.begin(), result.end(), static_cast<int>(o)) == result.end())
+						CASPAR_LOG(warning) << name << L" has nothing for output stream " << o << L", it stays silent.";
+				}
+
+				return result;
+			}
+
+			void splice()
+			{
+				pending_ = true;
+				++splices_;
+
+				for (auto& s : streams_)
+					s.started = false;
+			}
+
+			void start_at(int64_t time)
+			{
+				pending_	= true;
+				next_start_	= time;
+			}
+
+			bool apply(const AVFormatContext& source, const std::vector<int>& map, AVPacket& packet)
+			{
+				auto in_index = packet.stream_index;
+
+				if (in_index < 0 || in_index >= static_cast<int>(map.size()) || map[in_index] < 0)
+					return false;
+
+				auto out_index	= map[in_index];
+				auto& s			= streams_[out_index];
+				auto in_tb		= source.streams[in_index]->time_base;
+				auto out_tb		= output_->streams[out_index]->time_base;
+				auto dts		= packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+				if (dts != AV_NOPTS_VALUE)
+				{
+					if (pending_)
+					{
+						auto first		= av_rescale_q(dts, in_tb, AVRational{ 1, AV_TIME_BASE });
+						auto start		= next_start_ != AV_NOPTS_VALUE ? next_start_ : end_;
+						offset_			= start != AV_NOPTS_VALUE ? start - first : 0;
+						segment_start_	= start != AV_NOPTS_VALUE ? start : first;
+						next_start_		= AV_NOPTS_VALUE;
+						pending_		= false;
+					}
+
+					auto offset		= av_rescale_q(offset_, AVRational{ 1, AV_TIME_BASE }, out_tb);
+					auto out_dts	= av_rescale_q(dts, in_tb, out_tb) + offset;
+					auto out_pts	= packet.pts != AV_NOPTS_VALUE ? av_rescale_q(packet.pts, in_tb, out_tb) + offset : out_dts;
+					auto duration	= packet.duration > 0 ? av_rescale_q(packet.duration, in_tb, out_tb) : 0;
+
+					// Packets slightly out of order around the splice point.
+					if (s.last_dts != AV_NOPTS_VALUE && out_dts <= s.last_dts)
+					{
+						out_pts += s.last_dts + 1 - out_dts;
+						out_dts	= s.last_dts + 1;
+					}
+
+					if (duration <= 0 && s.last_dts != AV_NOPTS_VALUE)
+						duration = out_dts - s.last_dts;
+
+					if (duration > 0)
+						s.last_duration = duration;
+
+					s.last_dts = out_dts;
+
+					auto end = av_rescale_q(out_dts + s.last_duration, out_tb, AVRational{ 1, AV_TIME_BASE });
+					end_ = end_ != AV_NOPTS_VALUE ? std::max(end_, end) : end;
+
+					packet.dts = out_dts;
+					packet.pts = std::max(out_pts, out_dts);
+				}
+
+				packet.duration		= av_rescale_q(packet.duration, in_tb, out_tb);
+				packet.stream_index	= out_index;
+
+				if (!s.started)
+				{
+					s.started = true;
+
+					if (splices_ > 0)
+					{
+						packet.flags |= PKT_FLAG_DISCONTINUITY;
+						send_extradata(s, *source.streams[in_index]->codec, packet);
+					}
+				}
+
+				return true;
+			}
+
+			static void send_extradata(stream_state& s, const AVCodecContext& codec, AVPacket& packet)
+			{
+				if (!codec.extradata || codec.extradata_size <= 0)
+					return;
+
+				if (s.extradata.size() == static_cast<size_t>(codec.extradata_size) && std::equal(s.extradata.begin(), s.extradata.end(), codec.extradata))
+					return;
+
+				auto side = av_packet_new_side_data(&packet, AV_PKT_DATA_NEW_EXTRADATA, codec.extradata_size);
+
+				if (!side)
+					throw std::bad_alloc();
+
+				std::memcpy(side, codec.extradata, codec.extradata_size);
+				s.extradata.assign(codec.extradata, codec.extradata + codec.extradata_size);
+			}
+		};
+
+		timeline_splicer::timeline_splicer(const std::shared_ptr<AVFormatContext>& output)
+			: impl_(new impl(output))
+		{
+		}
+
+		std::vector<int> timeline_splicer::map(const AVFormatContext& source, const std::wstring& name) const
+		{
+			return impl_->map(source, name);
+		}
+
+		void timeline_splicer::splice()
+		{
+			impl_->splice();
+		}
+
+		bool timeline_splicer::apply(const AVFormatContext& source, const std::vector<int>& map, AVPacket& packet)
+		{
+			return impl_->apply(source, map, packet);
+		}
+
+		int64_t timeline_splicer::position() const
+		{
+			return impl_->end_ != AV_NOPTS_VALUE && !impl_->pending_ ? impl_->end_ - impl_->segment_start_ : 0;
+		}
+
+		void timeline_splicer::start_at(int64_t time)
+		{
+			impl_->start_at(time);
+		}
+
+		uint64_t timeline_splicer::splices() const
+		{
+			return impl_->splices_;
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <common/memory.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+struct AVFormatContext;
+struct AVPacket;
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Puts the packets of a sequence of sources onto one output timeline, for
+		// producers that switch between inputs (playlists, failover).
+		//
+		// Streams of a source are mapped onto the output layout by type and order.
+		// After splice() the next packet with a timestamp starts where the output
+		// ends, the furthest dts + duration of any stream, and the rest of the
+		// source keeps that offset. The first packet of every stream after a
+		// splice carries PKT_FLAG_DISCONTINUITY and, when the codec parameters
+		// differ from what was sent last, AV_PKT_DATA_NEW_EXTRADATA.
+		class timeline_splicer : boost::noncopyable
+		{
+		public:
+			explicit timeline_splicer(const std::shared_ptr<AVFormatContext>& output);
+
+			// Source stream index to output stream index, -1 for streams the output
+			// has no place for. Throws ffmpeg_user_error when a mapped audio or
+			// video stream has another codec than the output.
+			std::vector<int>	map(const AVFormatContext& source, const std::wstring& name) const;
+
+			// Starts a new segment with the next packet given to apply().
+			void				splice();
+			// Places the next segment, or the first one, at time (AV_TIME_BASE on
+			// the output timeline) instead of where the output ends.
+			void				start_at(int64_t time);
+
+			// Rewrites stream_index and timestamps into the output. Returns false
+			// for packets of unmapped streams.
+			bool				apply(const AVFormatContext& source, const std::vector<int>& map, AVPacket& packet);
+
+			// Output time covered since the last splice, in AV_TIME_BASE.
+			int64_t				position() const;
+			uint64_t			splices() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,715 @@
+#include "StdAfx.h"
+
+#include "timeshift_buffer.h"
+#include "ffmpeg_error.h"
+#include "packet_lanes.h"
+#include "packet_source.h"
+#include "timestamp_normalizer.h"
+
+#include <common/except.h>
+#include <common/log.h>
+#include <common/os/general_protection_fault.h>
+#include <common/os/mapped_file.h>
+#include <common/scope_exit.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		static const int64_t AUDIO_GOP_DURATION = AV_TIME_BASE; // GOP length of inputs without video.
+
+		// A packet in the ring file, followed by its data and side data.
+		struct packet_record
+		{
+			int32_t		stream_index;
+			int32_t		flags;
+			int32_t		size;				// -1 for flush packets.
+			int32_t		side_data_elems;
+			int64_t		pts;
+			int64_t		dts;
+			int64_t		duration;
+			int64_t		pos;
+		};
+
+		struct side_data_record
+		{
+			int32_t		type;
+			int32_t		size;
+		};
+
+		static void append(std::vector<uint8_t>& out, const void* data, size_t size)
+		{
+			auto bytes = static_cast<const uint8_t*>(data);
+			out.insert(out.end(), bytes, bytes + size);
+		}
+
+		static void serialize(const AVPacket& packet, std::vector<uint8_t>& out)
+		{
+			packet_record record;
+			record.stream_index		= packet.stream_index;
+			record.flags			= packet.flags;
+			record.size				= packet.data ? packet.size : -1;
+			record.side_data_elems	= packet.side_data_elems;
+			record.pts				= packet.pts;
+			record.dts				= packet.dts;
+			record.duration			= packet.duration;
+			record.pos				= packet.pos;
+
+			append(out, &record, sizeof(record));
+
+			if (packet.data)
+				append(out, packet.data, packet.size);
+
+			for (int n = 0; n < packet.side_data_elems; ++n)
+			{
+				side_data_record side;
+				side.type	= packet.side_data[n].type;
+				side.size	= packet.side_data[n].size;
+
+				append(out, &side, sizeof(side));
+				append(out, packet.side_data[n].data, side.size);
+			}
+		}
+
+		// Reads the packet at data and moves data past it.
+		static std::shared_ptr<AVPacket> deserialize(const uint8_t*& data)
+		{
+			packet_record record;
+			std::memcpy(&record, data, sizeof(record));
+			data += sizeof(record);
+
+			std::shared_ptr<AVPacket> packet = create_packet();
+
+			if (record.size >= 0)
+			{
+				THROW_ON_ERROR2(av_new_packet(packet.get(), record.size), L"timeshift_buffer");
+				std::memcpy(packet->data, data, record.size);
+				data += record.size;
+			}
+			else
+			{
+				packet->data = nullptr;
+				packet->size = 0;
+			}
+
+			packet->stream_index	= record.stream_index;
+			packet->flags			= record.flags;
+			packet->pts				= record.pts;
+			packet->dts				= record.dts;
+			packet->duration		= record.duration;
+			packet->pos				= record.pos;
+
+			for (int n = 0; n < record.side_data_elems; ++n)
+			{
+				side_data_record side;
+				std::memcpy(&side, data, sizeof(side));
+				data += sizeof(side);
+
+				auto target = av_packet_new_side_data(packet.get(), static_cast<AVPacketSideDataType>(side.type), side.size);
+
+				if (target)
+					std::memcpy(target, data, side.size);
+
+				data += side.size;
+			}
+
+			return packet;
+		}
+
+		struct timeshift_gop
+		{
+			uint64_t								sequence	= 0;
+			int64_t									start		= AV_NOPTS_VALUE;
+			int64_t									end			= AV_NOPTS_VALUE;
+			std::vector<std::shared_ptr<AVPacket>>	packets;	// While in memory.
+			size_t									bytes		= 0;
+			bool									complete	= false;
+			bool									on_disk		= false;
+			uint64_t								offset		= 0;
+			uint64_t								length		= 0;
+		};
+
+		struct timeshift_buffer::impl : boost::noncopyable
+		{
+			// Where a view is: the GOP it reads and how many of its packets it has.
+			struct cursor
+			{
+				uint64_t	sequence	= 0;
+				size_t		index		= 0;
+			};
+
+			enum class read_result
+			{
+				read,
+				waiting,	// At the live edge.
+				ended
+			};
+
+			class view : public packetProducer
+			{
+				const std::shared_ptr<impl>				buffer_;
+				packet_lanes							lanes_;
+				cursor									cursor_;
+				std::vector<bool>						discontinuity_;	// By stream, after a skip.
+				std::vector<std::shared_ptr<AVPacket>>	batch_;
+				bool									ended_			= false;
+			public:
+				view(const std::shared_ptr<impl>& buffer, uint64_t sequence)
+					: buffer_(buffer)
+					, lanes_(*buffer->context_)
+					, discontinuity_(buffer->context_->nb_streams, false)
+				{
+					cursor_.sequence = sequence;
+				}
+
+				bool receive_v(std::shared_ptr<AVPacket>& packet) override
+				{
+					fill();
+					return lanes_.receive_v(packet);
+				}
+
+				bool receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index) override
+				{
+					fill();
+					return lanes_.receive_a(packet, stream_index);
+				}
+
+				bool receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index) override
+				{
+					fill();
+					return lanes_.receive_s(packet, stream_index);
+				}
+
+				std::shared_ptr<AVFormatContext> context() override
+				{
+					return buffer_->context_;
+				}
+			private:
+				void fill()
+				{
+					while (!ended_ && !lanes_.full())
+					{
+						bool skipped = false;
+
+						batch_.clear();
+						auto result = buffer_->read(cursor_, batch_, skipped);
+
+						if (skipped)
+							std::fill(discontinuity_.begin(), discontinuity_.end(), true);
+
+						for (auto& packet : batch_)
+							lanes_.push(mark(packet));
+
+						if (result == read_result::ended)
+						{
+							lanes_.push_end();
+							ended_ = true;
+						}
+						else if (result == read_result::waiting)
+							break;
+					}
+				}
+
+				std::shared_ptr<AVPacket> mark(const std::shared_ptr<AVPacket>& packet)
+				{
+					auto index = packet->stream_index;
+
+					if (!packet->data || index < 0 || index >= static_cast<int>(discontinuity_.size()) || !discontinuity_[index])
+						return packet;
+
+					discontinuity_[index] = false;
+
+					// Packets are shared with the buffer and other views.
+					std::shared_ptr<AVPacket> result = create_packet();
+					THROW_ON_ERROR2(av_packet_ref(result.get(), packet.get()), L"timeshift_buffer");
+					result->flags |= PKT_FLAG_DISCONTINUITY;
+
+					return result;
+				}
+			};
+
+			const settings							settings_;
+			const std::shared_ptr<AVFormatContext>	context_;
+			packet_source							packets_;
+			std::unique_ptr<mapped_file>			file_;
+			int										time_index_		= 0;	// Stream that times GOPs.
+			bool									has_video_		= false;
+
+			mutable tbb::spin_mutex					mutex_;
+			std::deque<timeshift_gop>				gops_;
+			uint64_t								next_sequence_	= 0;
+			int64_t									newest_			= AV_NOPTS_VALUE;
+			size_t									ram_bytes_		= 0;
+			uint64_t								disk_bytes_		= 0;
+
+			uint64_t								write_position_	= 0;
+			std::vector<uint8_t>					spill_buffer_;
+			// Ring file ranges (offset, length) that views are copying from.
+			std::vector<std::pair<uint64_t, uint64_t>>	reading_;
+
+			tbb::atomic<bool>						is_running_;
+			tbb::atomic<bool>						ended_;
+			tbb::atomic<uint64_t>					packets_read_;
+			tbb::atomic<uint64_t>					packets_before_key_frame_;
+			tbb::atomic<uint64_t>					gops_spilled_;
+			tbb::atomic<uint64_t>					gops_evicted_;
+			tbb::atomic<uint64_t>					bytes_written_;
+			tbb::atomic<uint64_t>					view_skips_;
+
+			boost::thread							thread_;
+
+			impl(const std::shared_ptr<packetProducer>& source, const settings& settings)
+				: settings_(settings)
+				, context_(source->context())
+				, packets_(source)
+			{
+				// Same video stream as packet_lanes.
+				for (unsigned int i = 0; i < context_->nb_streams; ++i)
+				{
+					if (context_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+					{
+						time_index_	= i;
+						has_video_	= true;
+						break;
+					}
+				}
+
+				if (!settings_.file.empty())
+					file_.reset(new mapped_file(settings_.file, settings_.file_size));
+
+				is_running_					= true;
+				ended_						= false;
+				packets_read_				= 0;
+				packets_before_key_frame_	= 0;
+				gops_spilled_				= 0;
+				gops_evicted_				= 0;
+				bytes_written_				= 0;
+				view_skips_					= 0;
+
+				thread_ = boost::thread([this] { run(); });
+			}
+
+			~impl()
+			{
+				stop();
+			}
+
+			void stop()
+			{
+				is_running_ = false;
+
+				if (thread_.joinable())
+					thread_.join();
+			}
+
+			void run()
+			{
+				ensure_gpf_handler_installed_for_thread("timeshift-buffer");
+
+				while (is_running_)
+				{
+					try
+					{
+						std::shared_ptr<AVPacket> packet;
+
+						if (!packets_.try_pop(packet))
+						{
+							boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+							continue;
+						}
+
+						++packets_read_;
+
+						if (!packet->data && packet->pos == -1) // End of input.
+							break;
+
+						ingest(packet);
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
+					}
+				}
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					if (!gops_.empty())
+						gops_.back().complete = true;
+				}
+
+				ended_ = true;
+			}
+
+			int64_t to_time(const AVPacket& packet) const
+			{
+				auto ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+				if (ts == AV_NOPTS_VALUE)
+					return AV_NOPTS_VALUE;
+
+				return av_rescale_q(ts, context_->streams[packet.stream_index]->time_base, AVRational{ 1, AV_TIME_BASE });
+			}
+
+			// Only this thread changes gops_, so it reads them without the lock.
+			void ingest(const std::shared_ptr<AVPacket>& packet)
+			{
+				auto time = packet->data && packet->stream_index == time_index_ ? to_time(*packet) : AV_NOPTS_VALUE;
+				auto starts_gop = false;
+
+				if (time != AV_NOPTS_VALUE)
+				{
+					if (has_video_)
+						starts_gop = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+					else
+						starts_gop = gops_.empty() || time - gops_.back().start >= AUDIO_GOP_DURATION || time < gops_.back().start;
+				}
+
+				if (!starts_gop && gops_.empty())
+				{
+					++packets_before_key_frame_;
+					return;
+				}
+
+				auto size = packet->data ? static_cast<size_t>(packet->size) : 0;
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					if (starts_gop)
+					{
+						if (!gops_.empty())
+							gops_.back().complete = true;
+
+						timeshift_gop gop;
+						gop.sequence	= next_sequence_++;
+						gop.start		= time;
+						gop.end			= time;
+						gops_.push_back(std::move(gop));
+					}
+
+					auto& gop = gops_.back();
+					gop.packets.push_back(packet);
+					gop.bytes	+= size;
+					ram_bytes_	+= size;
+
+					if (time != AV_NOPTS_VALUE)
+					{
+						gop.end = std::max(gop.end, time);
+						newest_ = time;
+					}
+				}
+
+				if (starts_gop)
+					maintain();
+			}
+
+			void maintain()
+			{
+				while (gops_.size() > 1 && gops_.front().start < newest_ - settings_.window)
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+					evict_front();
+				}
+
+				if (!file_)
+					return;
+
+				while (true)
+				{
+					auto it = std::find_if(gops_.begin(), gops_.end(), [](const timeshift_gop& gop) { return !gop.on_disk; });
+
+					if (it == gops_.end() || !it->complete || it->start >= newest_ - settings_.ram)
+						break;
+
+					spill(it->sequence);
+				}
+			}
+
+			// Requires the lock.
+			void evict_front()
+			{
+				auto& gop = gops_.front();
+
+				if (gop.on_disk)
+					disk_bytes_ -= gop.length;
+				else
+					ram_bytes_ -= gop.bytes;
+
+				gops_.pop_front();
+				++gops_evicted_;
+			}
+
+			timeshift_gop& find(uint64_t sequence)
+			{
+				return gops_[static_cast<size_t>(sequence - gops_.front().sequence)];
+			}
+
+			// Moves a GOP from memory to the ring file in one sequential write,
+			// first evicting the GOPs whose space it takes.
+			void spill(uint64_t sequence)
+			{
+				spill_buffer_.clear();
+
+				for (auto& packet : find(sequence).packets)
+					serialize(*packet, spill_buffer_);
+
+				auto length	= static_cast<uint64_t>(spill_buffer_.size());
+				auto offset	= write_position_;
+				auto wrap	= offset + length > file_->size();
+
+				auto taken = [&](const timeshift_gop& gop)
+				{
+					auto end = gop.offset + gop.length;
+
+					if (wrap)
+						return end > offset || gop.offset < length;
+
+					return gop.offset < offset + length && end > offset;
+				};
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					// Larger than the whole ring, it cannot be kept.
+					if (length > file_->size())
+					{
+						while (gops_.front().sequence <= sequence)
+							evict_front();
+
+						return;
+					}
+
+					while (gops_.front().on_disk && taken(gops_.front()))
+						evict_front();
+				}
+
+				if (wrap)
+					offset = 0;
+
+				// The GOPs in the way are out of the index, so no view starts
+				// reading them now, but views may still be copying them.
+				while (true)
+				{
+					{
+						tbb::spin_mutex::scoped_lock lock(mutex_);
+
+						auto overlaps = [&](const std::pair<uint64_t, uint64_t>& range)
+						{
+							return range.first < offset + length && range.first + range.second > offset;
+						};
+
+						if (std::none_of(reading_.begin(), reading_.end(), overlaps))
+							break;
+					}
+
+					boost::this_thread::yield();
+				}
+
+				file_->write(offset, spill_buffer_.data(), spill_buffer_.size());
+				write_position_ = offset + length;
+				bytes_written_ += length;
+				++gops_spilled_;
+
+				std::vector<std::shared_ptr<AVPacket>> released;
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					auto& gop = find(sequence);
+					gop.on_disk	= true;
+					gop.offset	= offset;
+					gop.length	= length;
+					ram_bytes_	-= gop.bytes;
+					disk_bytes_	+= length;
+					released.swap(gop.packets);
+				}
+			}
+
+			// Appends what a view has not read of its GOP to out. A view behind the
+			// window is moved to its start and skipped is set.
+			read_result read(cursor& position, std::vector<std::shared_ptr<AVPacket>>& out, bool& skipped)
+			{
+				uint64_t sequence;
+				uint64_t offset;
+				uint64_t length;
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					if (!gops_.empty() && position.sequence < gops_.front().sequence)
+					{
+						position.sequence	= gops_.front().sequence;
+						position.index		= 0;
+						skipped				= true;
+						++view_skips_;
+					}
+
+					if (gops_.empty() || position.sequence >= gops_.back().sequence + 1)
+						return ended_ ? read_result::ended : read_result::waiting;
+
+					auto& gop = find(position.sequence);
+
+					if (!gop.on_disk)
+					{
+						auto first = std::min(position.index, gop.packets.size());
+						out.insert(out.end(), gop.packets.begin() + first, gop.packets.end());
+						position.index = gop.packets.size();
+
+						if (gop.complete)
+						{
+							++position.sequence;
+							position.index = 0;
+						}
+						else if (out.empty())
+							return read_result::waiting;
+
+						return read_result::read;
+					}
+
+					sequence	= gop.sequence;
+					offset		= gop.offset;
+					length		= gop.length;
+
+					// Pins the range, spill() does not overwrite it until the
+					// copy below is done.
+					reading_.emplace_back(offset, length);
+				}
+
+				// Read through the mapping without the lock.
+				std::vector<std::shared_ptr<AVPacket>> packets;
+
+				{
+					CASPAR_SCOPE_EXIT
+					{
+						tbb::spin_mutex::scoped_lock lock(mutex_);
+						reading_.erase(std::find(reading_.begin(), reading_.end(), std::make_pair(offset, length)));
+					};
+
+					auto data	= file_->data() + offset;
+					auto end	= data + length;
+
+					while (data < end)
+						packets.push_back(deserialize(data));
+				}
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					if (gops_.empty() || gops_.front().sequence > sequence)
+						return read_result::read; // Left the window meanwhile, the next read skips.
+				}
+
+				auto first = std::min(position.index, packets.size());
+				out.insert(out.end(), packets.begin() + first, packets.end());
+				++position.sequence;
+				position.index = 0;
+
+				return read_result::read;
+			}
+
+			// The sequence of the GOP with the last start at or before time.
+			uint64_t find_at(int64_t time) const
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				if (gops_.empty())
+					return next_sequence_;
+
+				auto it = std::upper_bound(gops_.begin(), gops_.end(), time, [](int64_t t, const timeshift_gop& gop) { return t < gop.start; });
+
+				if (it != gops_.begin())
+					--it;
+
+				return it->sequence;
+			}
+
+			std::pair<int64_t, int64_t> window() const
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+
+				if (gops_.empty())
+					return std::make_pair(AV_NOPTS_VALUE, AV_NOPTS_VALUE);
+
+				return std::make_pair(gops_.front().start, newest_);
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+
+				{
+					tbb::spin_mutex::scoped_lock lock(mutex_);
+
+					auto on_disk = std::count_if(gops_.begin(), gops_.end(), [](const timeshift_gop& gop) { return gop.on_disk; });
+
+					info.add(L"gops", gops_.size());
+					info.add(L"gops-on-disk", on_disk);
+					info.add(L"ram-bytes", ram_bytes_);
+					info.add(L"disk-bytes", disk_bytes_);
+					info.add(L"window-seconds", gops_.empty() ? 0.0 : static_cast<double>(newest_ - gops_.front().start) / AV_TIME_BASE);
+				}
+
+				if (file_)
+				{
+					info.add(L"file", settings_.file);
+					info.add(L"file-size", file_->size());
+				}
+
+				info.add(L"packets-read", packets_read_);
+				info.add(L"packets-before-key-frame", packets_before_key_frame_);
+				info.add(L"gops-spilled", gops_spilled_);
+				info.add(L"gops-evicted", gops_evicted_);
+				info.add(L"bytes-written", bytes_written_);
+				info.add(L"view-skips", view_skips_);
+				info.add(L"ended", ended_);
+
+				return info;
+			}
+		};
+
+		timeshift_buffer::timeshift_buffer(const std::shared_ptr<packetProducer>& source, const settings& settings)
+			: impl_(new impl(source, settings))
+		{
+		}
+
+		timeshift_buffer::~timeshift_buffer()
+		{
+			// Views keep the buffered data, but no longer get new packets.
+			impl_->stop();
+		}
+
+		std::pair<int64_t, int64_t> timeshift_buffer::window() const
+		{
+			return impl_->window();
+		}
+
+		std::shared_ptr<packetProducer> timeshift_buffer::open_at(int64_t time)
+		{
+			return std::make_shared<impl::view>(impl_, impl_->find_at(time));
+		}
+
+		std::shared_ptr<packetProducer> timeshift_buffer::open_behind(int64_t delay)
+		{
+			auto newest = window().second;
+
+			return open_at(newest == AV_NOPTS_VALUE ? newest : newest - delay);
+		}
+
+		boost::property_tree::wptree timeshift_buffer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
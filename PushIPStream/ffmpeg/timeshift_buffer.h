@@ -0,0 +1,71 @@
+#pragma once
+
+#include "../packetProducer.h"
+#include "util/util.h"
+
+#include <common/memory.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Time-shift (DVR) buffer behind a live producer, for restarting or
+		// rewinding the last minutes of it. The input is read once, as it
+		// arrives, and kept as GOPs that start on a video key frame (one second
+		// of packets without video).
+		//
+		// The most recent GOPs stay in RAM as the refcounted packets of the
+		// input. Older ones are written, one sequential write per GOP, to a
+		// preallocated ring file that readers access through a read-only
+		// mapping, so a reader costs a copy per packet and no system calls. A
+		// GOP leaves the window when it is older than the window or the ring
+		// needs its space; writing over a GOP waits for views still copying it.
+		// GOPs are indexed by start time, seeking is a binary search.
+		//
+		// Views are packetProducers that start at the key frame at or before a
+		// point in the window and follow the input up to the live edge. A view
+		// that falls out of the window skips to its start, the first packet of
+		// each stream after the skip carries PKT_FLAG_DISCONTINUITY. A view is
+		// read from one thread and ends when the input or the buffer does.
+		//
+		// Producers use it through TIMESHIFT in ffmpeg_producer::createProducer.
+		class timeshift_buffer : boost::noncopyable
+		{
+		public:
+			struct settings
+			{
+				int64_t			window		= 30 * 60 * static_cast<int64_t>(AV_TIME_BASE);	// How far back views may start.
+				int64_t			ram			= 30 * static_cast<int64_t>(AV_TIME_BASE);		// Most recent part kept in memory.
+				std::wstring	file;															// Ring file, empty keeps the window in memory.
+				uint64_t		file_size	= 4ull * 1024 * 1024 * 1024;
+			};
+
+			timeshift_buffer(const std::shared_ptr<packetProducer>& source, const settings& settings);
+			~timeshift_buffer();
+
+			// First and last time in the window, AV_TIME_BASE on the timeline of
+			// the input's video (or first) stream. Both are AV_NOPTS_VALUE while
+			// the buffer is empty.
+			std::pair<int64_t, int64_t>		window() const;
+
+			// A view starting at the key frame at or before time, clamped to the
+			// window.
+			std::shared_ptr<packetProducer>	open_at(int64_t time);
+			// A view starting delay (AV_TIME_BASE) before the live edge, 0 starts
+			// at the most recent key frame.
+			std::shared_ptr<packetProducer>	open_behind(int64_t delay);
+
+			boost::property_tree::wptree	info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
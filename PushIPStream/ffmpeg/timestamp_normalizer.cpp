@@ -0,0 +1,351 @@
+#include "StdAfx.h"
+
+#include "timestamp_normalizer.h"
+
+#include <common/log.h>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// A timestamp with the time base it was taken in.
+		struct timestamp
+		{
+			int64_t		value		= AV_NOPTS_VALUE;
+			AVRational	time_base	= AVRational{ 1, AV_TIME_BASE };
+
+			bool valid() const
+			{
+				return value != AV_NOPTS_VALUE;
+			}
+
+			int64_t in(AVRational target) const
+			{
+				return av_rescale_q(value, time_base, target);
+			}
+		};
+
+		struct timestamp_normalizer::impl : boost::noncopyable
+		{
+			struct stream_state
+			{
+				AVRational	in_time_base;
+				AVRational	out_time_base;
+				bool		sparse;
+				int64_t		threshold;		// out_time_base.
+				int64_t		wrap_period		= 0;
+				int64_t		wrap_offset		= 0;
+				int64_t		last_raw_dts	= AV_NOPTS_VALUE;	// Unwrapped, in_time_base.
+				int64_t		last_dts		= AV_NOPTS_VALUE;	// Normalised, out_time_base.
+				int64_t		last_duration	= 0;
+				uint64_t	epoch			= 0;
+			};
+
+			const std::shared_ptr<AVFormatContext>	input_;
+			std::shared_ptr<AVFormatContext>		output_;
+			const settings							settings_;
+			std::vector<stream_state>				streams_;
+
+			bool									started_			= false;
+			bool									rebase_				= false;
+			uint64_t								epoch_				= 0;
+			timestamp								offset_;
+			timestamp								previous_offset_;
+			timestamp								reference_;		// Last unwrapped dts of any stream.
+			timestamp								end_;			// Furthest dts + duration written.
+
+			tbb::atomic<uint64_t>					discontinuities_;
+			tbb::atomic<uint64_t>					rebases_;
+			tbb::atomic<uint64_t>					wraps_;
+			tbb::atomic<uint64_t>					adjusted_;
+			tbb::atomic<uint64_t>					missing_;
+
+			impl(const std::shared_ptr<AVFormatContext>& input, const settings& settings)
+				: input_(input)
+				, output_(input)
+				, settings_(settings)
+			{
+				discontinuities_	= 0;
+				rebases_			= 0;
+				wraps_				= 0;
+				adjusted_			= 0;
+				missing_			= 0;
+
+				if (settings_.time_base.num > 0 && settings_.time_base.den > 0)
+					output_ = clone_layout(*input_, settings_.time_base);
+
+				for (unsigned int i = 0; i < input_->nb_streams; ++i)
+				{
+					auto stream = input_->streams[i];
+
+					stream_state s;
+					s.in_time_base	= stream->time_base;
+					s.out_time_base	= output_->streams[i]->time_base;
+					s.sparse		= stream->codec->codec_type != AVMEDIA_TYPE_VIDEO && stream->codec->codec_type != AVMEDIA_TYPE_AUDIO;
+					s.threshold		= av_rescale_q(settings_.discontinuity_threshold, AVRational{ 1, AV_TIME_BASE }, s.out_time_base);
+
+					if (stream->pts_wrap_bits > 0 && stream->pts_wrap_bits < 63)
+						s.wrap_period = int64_t(1) << stream->pts_wrap_bits;
+
+					streams_.push_back(s);
+				}
+			}
+
+			void normalize(AVPacket& packet)
+			{
+				if (!packet.data)
+				{
+					// Seek or loop, the next packet continues where the output is.
+					if (packet.pos != -1 && started_)
+						rebase_ = true;
+
+					return;
+				}
+
+				if (packet.stream_index < 0 || packet.stream_index >= static_cast<int>(streams_.size()))
+					return;
+
+				auto& s			= streams_[packet.stream_index];
+				auto duration	= packet.duration > 0 ? av_rescale_q(packet.duration, s.in_time_base, s.out_time_base) : 0;
+				auto raw_dts	= packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+				if (raw_dts == AV_NOPTS_VALUE)
+				{
+					++missing_;
+
+					if (s.last_dts == AV_NOPTS_VALUE)
+						return;
+
+					packet.dts		= s.last_dts + s.last_duration;
+					packet.pts		= packet.dts;
+					packet.duration	= duration;
+					advance(s, packet.dts, duration);
+
+					return;
+				}
+
+				auto rebase = rebase_;
+
+				if (rebase)
+				{
+					rebase_ = false;
+
+					for (auto& other : streams_)
+					{
+						other.wrap_offset	= 0;
+						other.last_raw_dts	= AV_NOPTS_VALUE;
+					}
+
+					reference_ = timestamp();
+				}
+
+				auto dts = unwrap(s, raw_dts);
+				auto pts = packet.pts != AV_NOPTS_VALUE ? unwrap_near(s, packet.pts + s.wrap_offset, dts) : dts;
+
+				s.last_raw_dts			= dts;
+				reference_.value		= dts;
+				reference_.time_base	= s.in_time_base;
+
+				auto out_dts		= av_rescale_q(dts, s.in_time_base, s.out_time_base);
+				auto out_pts		= av_rescale_q(pts, s.in_time_base, s.out_time_base);
+				auto offset			= offset_.valid() ? offset_.in(s.out_time_base) : 0;
+				auto old_timeline	= false;
+
+				if (!started_)
+				{
+					offset		= start(s, out_dts, 0);
+					started_	= true;
+				}
+				else if (rebase)
+				{
+					offset = start(s, out_dts, end_.in(s.out_time_base));
+					++rebases_;
+				}
+				else if (!s.sparse && s.last_dts != AV_NOPTS_VALUE)
+				{
+					auto expected = s.last_dts + s.last_duration;
+
+					if (std::abs(out_dts + offset - expected) > s.threshold)
+					{
+						auto previous = previous_offset_.valid() ? previous_offset_.in(s.out_time_base) : 0;
+
+						// A packet of the old timeline interleaved after another stream
+						// already jumped keeps the old offset.
+						old_timeline = previous_offset_.valid() && std::abs(out_dts + previous - expected) <= s.threshold;
+
+						if (old_timeline)
+							offset = previous;
+						else
+						{
+							CASPAR_LOG(debug) << L"[timestamp_normalizer] Stream " << packet.stream_index << L" jumped by "
+								<< av_rescale_q(out_dts + offset - expected, s.out_time_base, AVRational{ 1, 1000 }) << L" ms.";
+
+							previous_offset_	= offset_;
+							offset_.value		= std::max(expected, end_.in(s.out_time_base)) - out_dts;
+							offset_.time_base	= s.out_time_base;
+							offset				= offset_.value;
+							++epoch_;
+							++discontinuities_;
+						}
+					}
+				}
+
+				if (!old_timeline && s.epoch != epoch_)
+				{
+					if (s.last_dts != AV_NOPTS_VALUE)
+						packet.flags |= PKT_FLAG_DISCONTINUITY;
+
+					s.epoch = epoch_;
+				}
+
+				out_dts += offset;
+				out_pts += offset;
+
+				if (s.last_dts != AV_NOPTS_VALUE && out_dts <= s.last_dts)
+				{
+					out_pts += s.last_dts + 1 - out_dts;
+					out_dts	= s.last_dts + 1;
+					++adjusted_;
+				}
+
+				packet.dts		= out_dts;
+				packet.pts		= std::max(out_pts, out_dts);
+				packet.duration	= duration;
+
+				advance(s, out_dts, duration);
+			}
+
+			// Places out_dts at target. At the start and after loops the base is the
+			// container start time when that is close, so streams that begin a
+			// little earlier than the first packet stay above it.
+			int64_t start(stream_state& s, int64_t out_dts, int64_t target)
+			{
+				auto base = out_dts;
+
+				if (input_->start_time != AV_NOPTS_VALUE)
+				{
+					auto start_time = av_rescale_q(input_->start_time, AVRational{ 1, AV_TIME_BASE }, s.out_time_base);
+
+					if (start_time < base && base - start_time <= s.threshold)
+						base = start_time;
+				}
+
+				previous_offset_	= offset_;
+				offset_.value		= target - base;
+				offset_.time_base	= s.out_time_base;
+				++epoch_;
+
+				return offset_.value;
+			}
+
+			int64_t unwrap(stream_state& s, int64_t raw)
+			{
+				if (s.wrap_period == 0)
+					return raw;
+
+				if (s.last_raw_dts != AV_NOPTS_VALUE)
+				{
+					auto value = unwrap_near(s, raw + s.wrap_offset, s.last_raw_dts);
+
+					if (value > raw + s.wrap_offset)
+						++wraps_;
+
+					s.wrap_offset = value - raw;
+
+					return value;
+				}
+
+				// First packet of the stream, line it up with the other streams in
+				// case it already wrapped and they have not, or the other way round.
+				if (reference_.valid())
+				{
+					auto value = unwrap_near(s, raw, reference_.in(s.in_time_base));
+					s.wrap_offset = value - raw;
+
+					return value;
+				}
+
+				return raw;
+			}
+
+			// The representation of value within half a wrap period of near.
+			int64_t unwrap_near(const stream_state& s, int64_t value, int64_t near) const
+			{
+				if (s.wrap_period == 0)
+					return value;
+
+				while (value < near - s.wrap_period / 2)
+					value += s.wrap_period;
+
+				while (value > near + s.wrap_period / 2)
+					value -= s.wrap_period;
+
+				return value;
+			}
+
+			void advance(stream_state& s, int64_t dts, int64_t duration)
+			{
+				if (duration <= 0 && s.last_dts != AV_NOPTS_VALUE && dts > s.last_dts)
+					duration = dts - s.last_dts;
+
+				if (duration > 0)
+					s.last_duration = duration;
+
+				s.last_dts = dts;
+
+				auto end = dts + s.last_duration;
+
+				if (!end_.valid() || av_compare_ts(end, s.out_time_base, end_.value, end_.time_base) > 0)
+				{
+					end_.value		= end;
+					end_.time_base	= s.out_time_base;
+				}
+			}
+
+			boost::property_tree::wptree info() const
+			{
+				boost::property_tree::wptree info;
+
+				if (settings_.time_base.num > 0)
+					info.add(L"time-base", std::to_wstring(settings_.time_base.num) + L"/" + std::to_wstring(settings_.time_base.den));
+				else
+					info.add(L"time-base", L"stream");
+
+				info.add(L"discontinuities", discontinuities_);
+				info.add(L"rebases", rebases_);
+				info.add(L"wraps", wraps_);
+				info.add(L"adjusted-packets", adjusted_);
+				info.add(L"missing-timestamps", missing_);
+
+				return info;
+			}
+		};
+
+		timestamp_normalizer::timestamp_normalizer(const std::shared_ptr<AVFormatContext>& input, const settings& settings)
+			: impl_(new impl(input, settings))
+		{
+		}
+
+		void timestamp_normalizer::normalize(AVPacket& packet)
+		{
+			impl_->normalize(packet);
+		}
+
+		std::shared_ptr<AVFormatContext> timestamp_normalizer::context() const
+		{
+			return impl_->output_;
+		}
+
+		boost::property_tree::wptree timestamp_normalizer::info() const
+		{
+			return impl_->info();
+		}
+	}
+}
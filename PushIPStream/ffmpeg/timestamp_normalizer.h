@@ -0,0 +1,52 @@
+#pragma once
+
+#include "util/util.h"
+
+#include <common/memory.h>
+
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// Set on the first packet of a stream after its timeline was cut, at a
+		// loop point, seek or a jump in the source. Timestamps stay continuous,
+		// the flag only tells outputs that care (segmenters, decoders) about it.
+		static const int PKT_FLAG_DISCONTINUITY = 0x4000;
+
+		// Turns the raw container timestamps of a demuxer into one timeline that
+		// starts near zero and only moves forward, the same for every output.
+		//
+		// 33 bit (pts_wrap_bits) wraparound is unwrapped per stream. Loop points,
+		// seeks and jumps larger than the threshold are removed by moving all
+		// streams by one common offset, so the distance between audio and video
+		// is kept. Smaller backward steps only nudge dts forward. Offsets are kept
+		// as integers in the time base they were taken in and only rescaled when
+		// applied, the state is updated per packet.
+		class timestamp_normalizer : boost::noncopyable
+		{
+		public:
+			struct settings
+			{
+				AVRational	time_base					= AVRational{ 0, 1 };	// Common output time base, {0, 1} keeps the time base of each stream.
+				int64_t		discontinuity_threshold		= AV_TIME_BASE;			// Larger jumps, in AV_TIME_BASE units, are removed.
+			};
+
+			timestamp_normalizer(const std::shared_ptr<AVFormatContext>& input, const settings& settings);
+
+			// Rewrites dts, pts and duration in place. Flush packets pass unchanged.
+			void								normalize(AVPacket& packet);
+
+			// The input layout with the time bases of the normalised packets.
+			std::shared_ptr<AVFormatContext>	context() const;
+
+			boost::property_tree::wptree		info() const;
+		private:
+			struct impl;
+			spl::shared_ptr<impl> impl_;
+		};
+	}
+}
@@ -0,0 +1,58 @@
+#include "../StdAfx.h"
+
+#include "crc32.h"
+
+#include <array>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		namespace {
+
+			// Slice-by-4 tables: table[k][i] is the crc of byte i followed by k
+			// zero bytes, which lets the loop below fold in four bytes per step.
+			typedef std::array<std::array<uint32_t, 256>, 4> crc_tables;
+
+			crc_tables make_tables()
+			{
+				crc_tables tables;
+
+				for (uint32_t i = 0; i < 256; ++i)
+				{
+					auto crc = i << 24;
+
+					for (int bit = 0; bit < 8; ++bit)
+						crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+
+					tables[0][i] = crc;
+				}
+
+				for (int k = 1; k < 4; ++k)
+				{
+					for (uint32_t i = 0; i < 256; ++i)
+						tables[k][i] = (tables[k - 1][i] << 8) ^ tables[0][tables[k - 1][i] >> 24];
+				}
+
+				return tables;
+			}
+		}
+
+		uint32_t crc32_mpeg2(const uint8_t* data, size_t size, uint32_t crc)
+		{
+			static const crc_tables tables = make_tables();
+
+			while (size >= 4)
+			{
+				crc ^= static_cast<uint32_t>(data[0]) << 24 | static_cast<uint32_t>(data[1]) << 16 | static_cast<uint32_t>(data[2]) << 8 | data[3];
+				crc = tables[3][crc >> 24] ^ tables[2][(crc >> 16) & 0xFF] ^ tables[1][(crc >> 8) & 0xFF] ^ tables[0][crc & 0xFF];
+				data += 4;
+				size -= 4;
+			}
+
+			while (size-- > 0)
+				crc = (crc << 8) ^ tables[0][(crc >> 24) ^ *data++];
+
+			return crc;
+		}
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace caspar {
+	namespace ffmpeg {
+
+		// CRC-32/MPEG-2 as used by PSI sections (polynomial 0x04C11DB7, not
+		// reflected, no final xor). A section including its CRC field yields 0.
+		uint32_t crc32_mpeg2(const uint8_t* data, size_t size, uint32_t crc = 0xFFFFFFFF);
+	}
+}
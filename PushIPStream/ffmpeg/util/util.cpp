@@ -204,6 +204,159 @@ namespace caspar {
 			return packet;
 		}
 
+		std::shared_ptr<AVFormatContext> clone_layout(const AVFormatContext& input, AVRational time_base)
+		{
+			auto context = std::shared_ptr<AVFormatContext>(avformat_alloc_context(), avformat_free_context);
+
+			if (!context)
+				CASPAR_THROW_EXCEPTION(ffmpeg_error() << msg_info("avformat_alloc_context failed"));
+
+			auto keep = time_base.num <= 0 || time_base.den <= 0;
+
+			for (unsigned int i = 0; i < input.nb_streams; ++i)
+			{
+				auto in_stream	= input.streams[i];
+				auto out_stream	= avformat_new_stream(context.get(), nullptr);
+
+				if (!out_stream)
+					CASPAR_THROW_EXCEPTION(ffmpeg_error() << msg_info("avformat_new_stream failed"));
+
+				THROW_ON_ERROR2(avcodec_copy_context(out_stream->codec, in_stream->codec), L"clone_layout");
+				THROW_ON_ERROR2(av_dict_copy(&out_stream->metadata, in_stream->metadata, 0), L"clone_layout");
+
+				out_stream->id					= in_stream->id;
+				out_stream->disposition			= in_stream->disposition;
+				out_stream->avg_frame_rate		= in_stream->avg_frame_rate;
+				out_stream->r_frame_rate		= in_stream->r_frame_rate;
+				out_stream->sample_aspect_ratio	= in_stream->sample_aspect_ratio;
+				out_stream->nb_frames			= in_stream->nb_frames;
+				out_stream->time_base			= keep ? in_stream->time_base : time_base;
+				out_stream->start_time			= 0;
+				out_stream->duration			= in_stream->duration != AV_NOPTS_VALUE ? av_rescale_q(in_stream->duration, in_stream->time_base, out_stream->time_base) : AV_NOPTS_VALUE;
+			}
+
+			THROW_ON_ERROR2(av_dict_copy(&context->metadata, input.metadata, 0), L"clone_layout");
+
+			context->start_time	= 0;
+			context->duration	= input.duration;
+			context->bit_rate	= input.bit_rate;
+
+			return context;
+		}
+
+		// Calls func with each NAL unit header of an Annex B or length prefixed
+		// packet until it returns true.
+		template<typename Func>
+		static bool for_each_nal(const uint8_t* data, int size, int length_size, const Func& func)
+		{
+			auto end = data + size;
+
+			if (length_size > 0)
+			{
+				auto p = data;
+
+				while (end - p > length_size)
+				{
+					int64_t length = 0;
+
+					for (int i = 0; i < length_size; ++i)
+						length = (length << 8) | *p++;
+
+					if (length <= 0 || length > end - p)
+						break;
+
+					if (func(p, static_cast<int>(length)))
+						return true;
+
+					p += length;
+				}
+
+				return false;
+			}
+
+			for (auto p = data; end - p > 3; ++p)
+			{
+				if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+				{
+					p += 3;
+
+					if (func(p, static_cast<int>(end - p)))
+						return true;
+				}
+			}
+
+			return false;
+		}
+
+		bool is_reference_frame(const AVPacket& packet, const AVCodecContext& codec)
+		{
+			if ((packet.flags & AV_PKT_FLAG_KEY) || !packet.data || packet.size <= 0)
+				return true;
+
+			auto extradata		= codec.extradata;
+			auto extradata_size	= codec.extradata_size;
+			auto has_slice		= false;
+
+			switch (codec.codec_id)
+			{
+			case AV_CODEC_ID_H264:
+			{
+				// avcC extradata means 1-4 byte lengths instead of start codes.
+				auto length_size = extradata && extradata_size >= 5 && extradata[0] == 1 ? (extradata[4] & 0x03) + 1 : 0;
+
+				auto is_reference = for_each_nal(packet.data, packet.size, length_size, [&](const uint8_t* nal, int)
+				{
+					auto type = nal[0] & 0x1F;
+
+					if (type < 1 || type > 5)
+						return false;
+
+					has_slice = true;
+
+					return ((nal[0] >> 5) & 0x03) != 0;
+				});
+
+				return is_reference || !has_slice;
+			}
+			case AV_CODEC_ID_HEVC:
+			{
+				auto length_size = extradata && extradata_size >= 23 && extradata[0] == 1 ? (extradata[21] & 0x03) + 1 : 0;
+
+				auto is_reference = for_each_nal(packet.data, packet.size, length_size, [&](const uint8_t* nal, int)
+				{
+					auto type = (nal[0] >> 1) & 0x3F;
+
+					if (type > 31)
+						return false;
+
+					has_slice = true;
+
+					// Even types up to RSV_VCL_N14 are sub-layer non-reference pictures.
+					return type > 14 || type % 2 == 1;
+				});
+
+				return is_reference || !has_slice;
+			}
+			case AV_CODEC_ID_MPEG2VIDEO:
+			{
+				auto is_reference = true;
+
+				for_each_nal(packet.data, packet.size, 0, [&](const uint8_t* unit, int size)
+				{
+					if (unit[0] != 0x00 || size < 3) // Picture start code.
+						return false;
+
+					is_reference = ((unit[2] >> 3) & 0x07) != 3; // B picture.
+					return true;
+				});
+
+				return is_reference;
+			}
+			default:
+				return true;
+			}
+		}
+
 		spl::shared_ptr<AVFormatContext> open_input(const std::wstring& filename)
 		{
 			AVFormatContext* weak_context = nullptr;
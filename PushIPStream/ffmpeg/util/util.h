@@ -39,5 +39,13 @@ namespace caspar {
 		boost::rational<int> read_framerate(AVFormatContext& context, const boost::rational<int>& fail_value);
 		std::wstring probe_stem(const std::wstring& stem, bool only_video);
 		spl::shared_ptr<AVPacket> create_packet();
+		// A context without I/O describing the same streams as input, for handing
+		// out a stream layout that outlives the demuxer. A time_base of {0, 1}
+		// keeps the time base of each stream.
+		std::shared_ptr<AVFormatContext> clone_layout(const AVFormatContext& input, AVRational time_base);
+		// Whether other frames may reference this video frame: key frames, H.264
+		// slices with a non zero nal_ref_idc, HEVC reference pictures and MPEG-2
+		// I/P pictures. Anything that can not be parsed counts as a reference.
+		bool is_reference_frame(const AVPacket& packet, const AVCodecContext& codec);
 	}
 }
\ No newline at end of file
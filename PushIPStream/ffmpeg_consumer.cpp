@@ -0,0 +1,42 @@
+#include "ffmpeg_consumer.h"
+#include "ffmpeg/consumer/hls_consumer.h"
+#include "ffmpeg/consumer/recorder_consumer.h"
+#include "ffmpeg/consumer/rtmp_consumer.h"
+#include "ffmpeg/consumer/udp_consumer.h"
+#include "ffmpeg/bitstream_filter.h"
+
+#include <common/param.h>
+
+#include <boost/algorithm/string.hpp>
+
+using namespace caspar;
+using namespace ffmpeg;
+ffmpeg_consumer::ffmpeg_consumer()
+{
+}
+ffmpeg_consumer::~ffmpeg_consumer()
+{
+}
+
+std::shared_ptr<packetConsumer> ffmpeg_consumer::createConsumer(const std::shared_ptr<packetProducer>& producer, const std::vector<std::wstring>& params)
+{
+	if (!producer || params.empty())
+		return nullptr;
+
+	auto url = params.at(0);
+	auto protocol = boost::to_lower_copy(protocol_split(url).at(0));
+
+	if (protocol == L"udp")
+		return std::make_shared<udp_consumer>(std::make_shared<bitstream_filter_producer>(producer, bitstream_target::mpegts), url);
+
+	if (protocol == L"rtmp")
+		return std::make_shared<rtmp_consumer>(std::make_shared<bitstream_filter_producer>(producer, bitstream_target::flv), url, params);
+
+	if (protocol == L"hls")
+		return std::make_shared<hls_consumer>(producer, url);
+
+	if (protocol == L"record")
+		return std::make_shared<recorder_consumer>(producer, url);
+
+	return nullptr;
+};
@@ -0,0 +1,17 @@
+#pragma once
+#include "packetConsumer.h"
+#include "packetProducer.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class ffmpeg_consumer
+{
+public:
+	ffmpeg_consumer();
+	virtual ~ffmpeg_consumer();
+public:
+	// params[0] is the destination url, its protocol selects the output.
+	std::shared_ptr<packetConsumer> createConsumer(const std::shared_ptr<packetProducer>& producer, const std::vector<std::wstring>& params);
+};
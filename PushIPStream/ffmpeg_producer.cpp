@@ -1,9 +1,24 @@
 #include "ffmpeg_producer.h"
 #include "ffmpeg/util/util.h"
+#include "ffmpeg/failover_producer.h"
 #include "ffmpeg/ffmpeg_producer_internal.h"
+#include "ffmpeg/playlist_producer.h"
+#include "ffmpeg/playout_scheduler.h"
+#include "ffmpeg/timeshift_buffer.h"
 
 #include <common/param.h>
 #include <common/env.h>
+#include <common/log.h>
+#include <common/utf.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <tbb/spin_mutex.h>
+
+#include <functional>
+#include <map>
 
 using namespace caspar;
 using namespace ffmpeg;
@@ -15,8 +30,236 @@ ffmpeg_producer::~ffmpeg_producer()
 {
 }
 
+// A UTC date and time (2026-10-19T12:00:00.040) or +seconds from now, on the
+// wall clock of playout_scheduler.
+static int64_t parse_schedule_time(const std::wstring& text)
+{
+	auto value = boost::trim_copy(text);
+
+	if (boost::starts_with(value, L"+"))
+		return playout_scheduler::wall_now() + static_cast<int64_t>(boost::lexical_cast<double>(value.substr(1)) * AV_TIME_BASE);
+
+	static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+
+	auto time = boost::posix_time::time_from_string(u8(boost::replace_all_copy(boost::trim_right_copy_if(value, boost::is_any_of(L"Zz")), L"T", L" ")));
+
+	return av_rescale((time - epoch).total_microseconds(), AV_TIME_BASE, 1000000);
+}
+
+// A view of a timeshift_buffer that keeps the buffer running while it plays.
+// Buffers are shared by source, so a second TIMESHIFT of a source that is
+// already playing rewinds within the running buffer instead of opening the
+// source again. The buffer stops with its last view.
+class timeshift_producer : public packetProducer
+{
+	const std::shared_ptr<timeshift_buffer>	buffer_;
+	const std::shared_ptr<packetProducer>	view_;
+public:
+	timeshift_producer(const std::shared_ptr<timeshift_buffer>& buffer, const std::shared_ptr<packetProducer>& view)
+		: buffer_(buffer)
+		, view_(view)
+	{
+	}
+
+	bool receive_v(std::shared_ptr<AVPacket>& packet) override
+	{
+		return view_->receive_v(packet);
+	}
+
+	bool receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index) override
+	{
+		return view_->receive_a(packet, stream_index);
+	}
+
+	bool receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index) override
+	{
+		return view_->receive_s(packet, stream_index);
+	}
+
+	std::shared_ptr<AVFormatContext> context() override
+	{
+		return view_->context();
+	}
+
+	static std::shared_ptr<timeshift_buffer> find_or_create(const std::wstring& source, const std::function<std::shared_ptr<timeshift_buffer>()>& factory)
+	{
+		static tbb::spin_mutex											mutex;
+		static std::map<std::wstring, std::weak_ptr<timeshift_buffer>>	buffers;
+
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex);
+
+			auto buffer = buffers[source].lock();
+
+			if (buffer)
+				return buffer;
+		}
+
+		// Opening the source may take a while, so it is done unlocked. If two
+		// channels race, the first buffer registered is used.
+		auto buffer = factory();
+
+		if (!buffer)
+			return nullptr;
+
+		tbb::spin_mutex::scoped_lock lock(mutex);
+
+		auto& registered	= buffers[source];
+		auto existing		= registered.lock();
+
+		if (existing)
+			return existing;
+
+		registered = buffer;
+
+		return buffer;
+	}
+};
+
 std::shared_ptr<packetProducer> ffmpeg_producer::createProducer(const std::vector<std::wstring>& params)
 {
+	// PLAYLIST "a.mp4|b.mp4|udp://..." [LOOP] [PREROLL ms] [PREROLL_MB n], the
+	// remaining parameters apply to every item.
+	if (boost::iequals(params.at(0), L"PLAYLIST") && params.size() > 1)
+	{
+		std::vector<std::wstring> items;
+		boost::split(items, params.at(1), boost::is_any_of(L"|"), boost::token_compress_on);
+
+		std::vector<std::wstring> item_params;
+
+		for (size_t i = 2; i < params.size(); ++i)
+		{
+			if (!boost::iequals(params[i], L"LOOP"))
+				item_params.push_back(params[i]);
+		}
+
+		playlist_producer::settings settings;
+		settings.loop				= contains_param(L"LOOP", params);
+		settings.lead_time			= get_param(L"PREROLL", params, settings.lead_time / 1000) * 1000;
+		settings.max_preroll_bytes	= get_param(L"PREROLL_MB", params, settings.max_preroll_bytes / (1024 * 1024)) * 1024 * 1024;
+
+		return std::make_shared<playlist_producer>(items, [item_params](const std::wstring& item)
+		{
+			auto parameters = item_params;
+			parameters.insert(parameters.begin(), item);
+
+			return ffmpeg_producer().createProducer(parameters);
+		}, settings);
+	}
+
+	// FAILOVER primary_url backup_url [STALL ms] [WINDOW ms] [RECOVERY ms], the
+	// remaining parameters apply to both sources.
+	if (boost::iequals(params.at(0), L"FAILOVER") && params.size() > 2)
+	{
+		std::vector<std::wstring> source_params(params.begin() + 3, params.end());
+
+		failover_producer::settings settings;
+		settings.stall_timeout	= get_param(L"STALL", params, settings.stall_timeout / 1000) * 1000;
+		settings.window			= get_param(L"WINDOW", params, settings.window / 1000) * 1000;
+		settings.recovery		= get_param(L"RECOVERY", params, settings.recovery / 1000) * 1000;
+
+		return std::make_shared<failover_producer>(params.at(1), params.at(2), [source_params](const std::wstring& url)
+		{
+			auto parameters = source_params;
+			parameters.insert(parameters.begin(), url);
+
+			return ffmpeg_producer().createProducer(parameters);
+		}, settings);
+	}
+
+	// TIMESHIFT source [BEHIND ms | RESTART] [WINDOW s] [RAM s] [FILE path]
+	// [FILE_MB n], the remaining parameters apply to the source. BEHIND plays
+	// that far behind the live edge (default 0), RESTART from the oldest point
+	// of the window. The window settings only apply when the source is not
+	// already being buffered.
+	if (boost::iequals(params.at(0), L"TIMESHIFT") && params.size() > 1)
+	{
+		std::vector<std::wstring> source_params(params.begin() + 1, params.end());
+
+		timeshift_buffer::settings settings;
+		settings.window		= get_param(L"WINDOW", params, settings.window / AV_TIME_BASE) * AV_TIME_BASE;
+		settings.ram		= get_param(L"RAM", params, settings.ram / AV_TIME_BASE) * AV_TIME_BASE;
+		settings.file		= get_param(L"FILE", params);
+		settings.file_size	= get_param(L"FILE_MB", params, settings.file_size / (1024 * 1024)) * 1024 * 1024;
+
+		auto buffer = timeshift_producer::find_or_create(params.at(1), [&]() -> std::shared_ptr<timeshift_buffer>
+		{
+			auto source = ffmpeg_producer().createProducer(source_params);
+
+			if (!source)
+				return nullptr;
+
+			return std::make_shared<timeshift_buffer>(source, settings);
+		});
+
+		if (!buffer)
+			return nullptr;
+
+		auto view = contains_param(L"RESTART", params)
+			? buffer->open_at(buffer->window().first)
+			: buffer->open_behind(get_param(L"BEHIND", params, static_cast<int64_t>(0)) * 1000);
+
+		return std::make_shared<timeshift_producer>(buffer, view);
+	}
+
+	// SCHEDULE "start|clip[|in|out];..." [FILLER clip] [PREROLL ms] [LEAD ms], see
+	// parse_schedule_time() for start, the remaining parameters apply to every
+	// clip.
+	if (boost::iequals(params.at(0), L"SCHEDULE") && params.size() > 1)
+	{
+		std::vector<std::wstring> clip_params(params.begin() + 2, params.end());
+		std::vector<std::wstring> lines;
+		boost::split(lines, params.at(1), boost::is_any_of(L";"), boost::token_compress_on);
+
+		std::vector<playout_scheduler::entry> schedule;
+
+		for (auto& line : lines)
+		{
+			std::vector<std::wstring> fields;
+			boost::split(fields, line, boost::is_any_of(L"|"));
+
+			playout_scheduler::entry entry;
+
+			if (fields.size() < 2
+				|| (fields.size() > 2 && !boost::conversion::try_lexical_convert(fields[2], entry.in))
+				|| (fields.size() > 3 && !boost::conversion::try_lexical_convert(fields[3], entry.out)))
+			{
+				if (!boost::trim_copy(line).empty())
+					CASPAR_LOG(warning) << L"Ignoring invalid schedule entry " << line;
+
+				continue;
+			}
+
+			entry.start	= parse_schedule_time(fields[0]);
+			entry.clip	= fields[1];
+			schedule.push_back(entry);
+		}
+
+		playout_scheduler::settings settings;
+		settings.filler		= get_param(L"FILLER", params);
+		settings.preroll	= get_param(L"PREROLL", params, settings.preroll / 1000) * 1000;
+		settings.lead		= get_param(L"LEAD", params, settings.lead / 1000) * 1000;
+
+		return std::make_shared<playout_scheduler>(schedule, [clip_params](const playout_scheduler::entry& entry)
+		{
+			std::vector<std::wstring> parameters = { entry.clip, L"IN", std::to_wstring(entry.in) };
+
+			// Without OUT the clip plays to its end.
+			if (entry.out != std::numeric_limits<uint32_t>::max())
+			{
+				parameters.push_back(L"OUT");
+				parameters.push_back(std::to_wstring(entry.out));
+			}
+
+			if (entry.loop)
+				parameters.push_back(L"LOOP");
+
+			parameters.insert(parameters.end(), clip_params.begin(), clip_params.end());
+
+			return ffmpeg_producer().createProducer(parameters);
+		}, settings);
+	}
+
 	auto file_or_url = params.at(0);
 
 	if (!boost::contains(file_or_url, L"://"))
@@ -42,13 +285,54 @@ std::shared_ptr<packetProducer> ffmpeg_producer::createProducer(const std::vecto
 		out = uint32_max;
 	out = get_param(L"OUT", params, out);
 	ffmpeg_options vid_params;
-	auto producer = spl::make_shared<ffmpeg_producer_internal>(
+
+	// TIMEBASE 1/90000 puts all streams on one time base, DISCONTINUITY is the
+	// largest timestamp jump in milliseconds that is kept rather than removed.
+	timestamp_normalizer::settings timestamps;
+	auto time_base = get_param(L"TIMEBASE", params);
+
+	if (!time_base.empty())
+	{
+		std::vector<std::wstring> parts;
+		boost::split(parts, time_base, boost::is_any_of(L"/:"));
+
+		if (parts.size() == 1)
+			parts.insert(parts.begin(), L"1");
+
+		int num = 0;
+		int den = 0;
+
+		if (parts.size() == 2 && boost::conversion::try_lexical_convert(parts[0], num) && boost::conversion::try_lexical_convert(parts[1], den) && num > 0 && den > 0)
+			timestamps.time_base = AVRational{ num, den };
+		else
+			CASPAR_LOG(warning) << L"Ignoring invalid TIMEBASE " << time_base;
+	}
+
+	timestamps.discontinuity_threshold = get_param(L"DISCONTINUITY", params, timestamps.discontinuity_threshold / 1000) * 1000;
+
+	// TRICKPLAY 8 plays the key frames only, 8 times faster than real time.
+	auto trick_play = get_param(L"TRICKPLAY", params, 0);
+
+	return spl::make_shared<ffmpeg_producer_internal>(
 		file_or_url,
 		loop,
 		in,
 		out,
-		vid_params
+		vid_params,
+		timestamps,
+		trick_play
 		);
-
-	return producer;
 };
+
+input_pool::handle ffmpeg_producer::prepare(const std::vector<std::wstring>& params)
+{
+	return input_pool::instance().prepare(params.at(0), [params]
+	{
+		return ffmpeg_producer().createProducer(params);
+	});
+}
+
+std::shared_ptr<packetProducer> ffmpeg_producer::createProducer(const input_pool::handle& prepared)
+{
+	return input_pool::instance().take(prepared);
+}
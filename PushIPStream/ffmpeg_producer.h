@@ -1,5 +1,6 @@
 #pragma once
 #include "packetProducer.h"
+#include "ffmpeg/input_pool.h"
 
 #include <string>
 #include <vector>
@@ -11,6 +12,14 @@ public:
 	virtual ~ffmpeg_producer();        
 public:
 	std::shared_ptr<packetProducer> createProducer(const std::vector<std::wstring>& params);
+
+	// Opens params like createProducer() on a background pool, the returned
+	// handle becomes ready once the input is opened, probed, seeked to its IN
+	// point and buffered.
+	caspar::ffmpeg::input_pool::handle prepare(const std::vector<std::wstring>& params);
+	// The producer of a prepared input, without waiting when the handle is
+	// ready. Throws what opening it threw.
+	std::shared_ptr<packetProducer> createProducer(const caspar::ffmpeg::input_pool::handle& prepared);
 };
 
 
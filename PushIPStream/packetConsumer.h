@@ -0,0 +1,14 @@
+#pragma once
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <string>
+
+class packetConsumer
+{
+public:
+	virtual ~packetConsumer() {}
+
+	virtual std::wstring print() const = 0;
+	// Runtime statistics of the output (bitrate, queue depth, timing errors).
+	virtual boost::property_tree::wptree info() const = 0;
+};
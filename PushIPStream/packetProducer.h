@@ -1,11 +1,16 @@
 #pragma once
 #include <memory>
 struct AVPacket;
+struct AVFormatContext;
 
 class packetProducer
 {
 public:
+	virtual ~packetProducer() {}
+
 	virtual bool receive_v(std::shared_ptr<AVPacket>& packet) = 0;
 	virtual bool receive_a(std::shared_ptr<AVPacket>& packet, int& stream_index) = 0;
 	virtual bool receive_s(std::shared_ptr<AVPacket>& packet, int& stream_index) = 0;
+	// Stream layout (codec parameters and time bases) of the packets produced.
+	virtual std::shared_ptr<AVFormatContext> context() = 0;
 };
@@ -26,6 +26,10 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/noncopyable.hpp>
 
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
 namespace caspar {
 
 /**
@@ -44,7 +48,8 @@ namespace caspar {
  * Q::value_type elem;
  * q.try_pop(elem);
  *
- * It must also guarantee thread safety for those operations.
+ * It must also guarantee thread safety for those operations. Move-only
+ * element types are supported if Q also supports q.push(std::move(elem)).
  */
 template<class Q>
 class blocking_bounded_queue_adapter : boost::noncopyable
@@ -55,8 +60,8 @@ public:
 private:
 	mutable	boost::mutex	capacity_mutex_;
 	size_type				capacity_;
-	semaphore				space_available_		= capacity_;
-	semaphore				elements_available_		= 0;
+	semaphore				space_available_		{ capacity_ };
+	semaphore				elements_available_		{ 0u };
 	Q						queue_;
 public:
 	/**
@@ -80,6 +85,17 @@ public:
 		push_after_room_reserved(element);
 	}
 
+	/**
+	 * Push an element to the queue, block until room is available.
+	 *
+	 * @param element The element to move into the queue.
+	 */
+	void push(value_type&& element)
+	{
+		space_available_.acquire();
+		push_after_room_reserved(std::move(element));
+	}
+
 	/**
 	 * Try to push an element to the queue, returning immediately if room is not
 	 * available.
@@ -100,6 +116,66 @@ public:
 		return true;
 	}
 
+	/**
+	 * Try to push an element to the queue, returning immediately if room is not
+	 * available. The element is left untouched if there was no room.
+	 *
+	 * @param element The element to move into the queue.
+	 *
+	 * @return true if there was room for the element.
+	 */
+	bool try_push(value_type&& element)
+	{
+		bool room_available = space_available_.try_acquire();
+
+		if (!room_available)
+			return false;
+
+		push_after_room_reserved(std::move(element));
+
+		return true;
+	}
+
+	/**
+	 * Push a range of elements to the queue, blocking until room is available.
+	 * Room is reserved and elements are published in as few semaphore
+	 * operations as possible (one per run of free room). Use
+	 * std::make_move_iterator to move the elements into the queue.
+	 *
+	 * @param first The beginning of the range.
+	 * @param last  The end of the range.
+	 */
+	template<typename ForwardIterator>
+	void push_bulk(ForwardIterator first, ForwardIterator last)
+	{
+		while (first != last)
+		{
+			// Only the first permit is waited for, the chunk is whatever room is
+			// free then. Waiting for a whole chunk while holding part of it could
+			// deadlock bulk pushers that each hold some of the capacity.
+			space_available_.acquire();
+
+			auto chunk = 1 + space_available_.try_acquire_up_to(chunk_size(first, last) - 1);
+
+			size_type num_pushed = 0;
+
+			try
+			{
+				for (; num_pushed < chunk; ++num_pushed, ++first)
+					queue_.push(*first);
+			}
+			catch (...)
+			{
+				space_available_.release(chunk - num_pushed);
+				elements_available_.release(num_pushed);
+
+				throw;
+			}
+
+			elements_available_.release(chunk);
+		}
+	}
+
 	/**
 	 * Pop an element from the queue, will block until an element is available.
 	 *
@@ -131,6 +207,33 @@ public:
 		return true;
 	}
 
+	/**
+	 * Pop as many elements as currently available, up to a maximum, without
+	 * blocking. Uses one semaphore operation for the whole batch instead of
+	 * two per element.
+	 *
+	 * @param out          The output iterator to move the elements to.
+	 * @param max_elements The maximum number of elements to pop.
+	 *
+	 * @return the number of elements popped.
+	 */
+	template<typename OutputIterator>
+	size_type try_pop_bulk(OutputIterator out, size_type max_elements)
+	{
+		auto num_acquired = elements_available_.try_acquire_up_to(max_elements);
+
+		for (size_type i = 0; i < num_acquired; ++i)
+		{
+			value_type element;
+			queue_.try_pop(element);
+			*out++ = std::move(element);
+		}
+
+		space_available_.release(num_acquired);
+
+		return num_acquired;
+	}
+
 	/**
 	 * Modify the capacity of the queue. May block if reducing the capacity.
 	 *
@@ -176,11 +279,21 @@ public:
 		return elements_available_.permits();
 	}
 private:
-	void push_after_room_reserved(const value_type& element)
+	template<typename ForwardIterator>
+	size_type chunk_size(ForwardIterator first, ForwardIterator last) const
+	{
+		// A reservation larger than the capacity could never be satisfied.
+		auto remaining = static_cast<size_type>(std::distance(first, last));
+
+		return std::max(1u, std::min(remaining, capacity()));
+	}
+
+	template<typename V>
+	void push_after_room_reserved(V&& element)
 	{
 		try
 		{
-			queue_.push(element);
+			queue_.push(std::forward<V>(element));
 		}
 		catch (...)
 		{
@@ -20,9 +20,12 @@
 */
 #pragma once
 
+#include <algorithm>
 #include <stdexcept>
 #include <map>
 #include <initializer_list>
+#include <iterator>
+#include <utility>
 
 #include <tbb/concurrent_queue.h>
 
@@ -38,6 +41,8 @@ namespace caspar {
  *
  * Prio must have the < and > operators defined where a larger instance is of a
  * higher priority.
+ *
+ * T may be a move-only type.
  */
 template <class T, class Prio>
 class blocking_priority_queue
@@ -90,6 +95,20 @@ public:
 		push_acquired(priority, element, transaction);
 	}
 
+	/**
+	 * Push an element with a given priority to the queue. Blocks until room
+	 * is available.
+	 *
+	 * @param priority The priority of the element.
+	 * @param element  The element to move into the queue.
+	 */
+	void push(Prio priority, T&& element)
+	{
+		acquire_transaction transaction(space_available_);
+
+		push_acquired(priority, std::move(element), transaction);
+	}
+
 	/**
 	 * Attempt to push an element with a given priority to the queue. Will
 	 * immediately return even if there is no room in the queue.
@@ -111,6 +130,76 @@ public:
 		return true;
 	}
 
+	/**
+	 * Attempt to push an element with a given priority to the queue. Will
+	 * immediately return even if there is no room in the queue, in which case
+	 * the element is left untouched.
+	 *
+	 * @param priority The priority of the element.
+	 * @param element  The element to move into the queue.
+	 *
+	 * @return true if the element was pushed. false if there was no room.
+	 */
+	bool try_push(Prio priority, T&& element)
+	{
+		if (!space_available_.try_acquire())
+			return false;
+
+		acquire_transaction transaction(space_available_, true);
+
+		push_acquired(priority, std::move(element), transaction);
+
+		return true;
+	}
+
+	/**
+	 * Push a range of elements with the same priority to the queue. Blocks
+	 * until room is available. Room is reserved and elements are published in
+	 * as few semaphore operations as possible (one per run of free room).
+	 * Use std::make_move_iterator to move the elements into the queue.
+	 *
+	 * @param priority The priority of the elements.
+	 * @param first    The beginning of the range.
+	 * @param last     The end of the range.
+	 */
+	template<typename ForwardIterator>
+	void push_bulk(Prio priority, ForwardIterator first, ForwardIterator last)
+	{
+		auto queue = queues_by_priority_.find(priority);
+
+		if (queue == queues_by_priority_.end())
+			throw std::runtime_error("Priority not supported by queue");
+
+		while (first != last)
+		{
+			// Only the first permit is waited for, the chunk is whatever room is
+			// free then. Waiting for a whole chunk while holding part of it could
+			// deadlock bulk pushers that each hold some of the capacity.
+			auto remaining	= static_cast<size_type>(std::distance(first, last));
+
+			space_available_.acquire();
+
+			auto chunk		= 1 + space_available_.try_acquire_up_to(std::max(1u, std::min(remaining, capacity())) - 1);
+
+			size_type num_pushed = 0;
+
+			try
+			{
+				for (; num_pushed < chunk; ++num_pushed, ++first)
+					queue->second.push(*first);
+			}
+			catch (...)
+			{
+				space_available_.release(chunk - num_pushed);
+				elements_available_.release(num_pushed);
+
+				throw;
+			}
+
+			elements_available_.release(chunk);
+		}
+	}
+
 	/**
 	 * Pop the element with the highest priority (fifo for elements with the
 	 * same priority). Blocks until an element is available.
@@ -182,6 +271,47 @@ public:
 		return false;
 	}
 
+	/**
+	 * Pop as many elements as currently available, up to a maximum, without
+	 * blocking. Elements are delivered highest priority first (fifo for
+	 * elements with the same priority). Uses one semaphore operation for the
+	 * whole batch instead of two per element.
+	 *
+	 * @param out          The output iterator to move the elements to.
+	 * @param max_elements The maximum number of elements to pop.
+	 *
+	 * @return the number of elements popped.
+	 */
+	template<typename OutputIterator>
+	size_type try_pop_bulk(OutputIterator out, size_type max_elements)
+	{
+		auto num_acquired	= elements_available_.try_acquire_up_to(max_elements);
+		size_type num_popped	= 0;
+
+		for (auto& queue : queues_by_priority_)
+		{
+			T element;
+
+			while (num_popped < num_acquired && queue.second.try_pop(element))
+			{
+				*out++ = std::move(element);
+				++num_popped;
+			}
+		}
+
+		space_available_.release(num_popped);
+
+		if (num_popped != num_acquired)
+		{
+			elements_available_.release(num_acquired - num_popped);
+
+			throw std::logic_error(
+					"blocking_priority_queue should have contained more elements but didn't");
+		}
+
+		return num_popped;
+	}
+
 	/**
 	 * Modify the capacity of the queue. May block if reducing the capacity.
 	 *
@@ -234,11 +364,12 @@ public:
 		return space_available_.permits();
 	}
 private:
-	void push_acquired(Prio priority, const T& element, acquire_transaction& transaction)
+	template<typename U>
+	void push_acquired(Prio priority, U&& element, acquire_transaction& transaction)
 	{
 		try
 		{
-			queues_by_priority_.at(priority).push(element);
+			queues_by_priority_.at(priority).push(std::forward<U>(element));
 		}
 		catch (std::out_of_range&)
 		{
@@ -46,6 +46,9 @@
 #include <boost/log/sinks/text_ostream_backend.hpp>
 #include <boost/log/sinks/sync_frontend.hpp>
 #include <boost/log/sinks/async_frontend.hpp>
+#include <boost/log/sinks/bounded_fifo_queue.hpp>
+#include <boost/log/sinks/block_on_overflow.hpp>
+#include <boost/log/sinks/drop_on_overflow.hpp>
 #include <boost/log/core/record.hpp>
 #include <boost/log/attributes/attribute_value.hpp>
 #include <boost/log/attributes/function.hpp>
@@ -57,35 +60,105 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 #include <tbb/atomic.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <vector>
+
 namespace caspar { namespace log {
 
 using namespace boost;
 
-template<typename Stream>
-void append_timestamp(Stream& stream)
+// Formats "[YYYY-MM-DD hh:mm:ss.mmm] " without going through iostreams. The
+// result is cached per thread; the date and time part is only rebuilt when the
+// second changes and the milliseconds are patched in place once per
+// millisecond.
+class timestamp_cache
 {
-	auto timestamp = boost::posix_time::microsec_clock::local_time();
-	auto date = timestamp.date();
-	auto time = timestamp.time_of_day();
-	auto milliseconds = time.fractional_seconds() / 1000; // microseconds to milliseconds
-
-	std::wstringstream buffer;
-
-	buffer
-		<< std::setfill(L'0')
-		<< L"["
-		<< std::setw(4) << date.year() << L"-" << std::setw(2) << date.month().as_number() << "-" << std::setw(2) << date.day().as_number()
-		<< L" "
-		<< std::setw(2) << time.hours() << L":" << std::setw(2) << time.minutes() << L":" << std::setw(2) << time.seconds()
-		<< L"."
-		<< std::setw(3) << milliseconds
-		<< L"] ";
-
-	stream << buffer.str();
-}
+	static const int		length = 26;
+
+	wchar_t					buffer_[length + 1];
+	std::int64_t			cached_second_		= -1;
+	std::int64_t			cached_millisecond_	= -1;
+public:
+	const wchar_t* format(const boost::posix_time::ptime& timestamp)
+	{
+		static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+
+		auto since_epoch	= timestamp - epoch;
+		auto millisecond	= since_epoch.total_milliseconds();
+
+		if (millisecond == cached_millisecond_)
+			return buffer_;
+
+		auto second = since_epoch.total_seconds();
+
+		if (second != cached_second_)
+		{
+			auto date = timestamp.date();
+			auto time = timestamp.time_of_day();
+
+			buffer_[0] = L'[';
+			write_digits(buffer_ + 1, date.year(), 4);
+			buffer_[5] = L'-';
+			write_digits(buffer_ + 6, date.month().as_number(), 2);
+			buffer_[8] = L'-';
+			write_digits(buffer_ + 9, date.day().as_number(), 2);
+			buffer_[11] = L' ';
+			write_digits(buffer_ + 12, time.hours(), 2);
+			buffer_[14] = L':';
+			write_digits(buffer_ + 15, time.minutes(), 2);
+			buffer_[17] = L':';
+			write_digits(buffer_ + 18, time.seconds(), 2);
+			buffer_[20] = L'.';
+			buffer_[24] = L']';
+			buffer_[25] = L' ';
+			buffer_[26] = L'\0';
+
+			cached_second_ = second;
+		}
+
+		write_digits(buffer_ + 21, static_cast<int>(millisecond % 1000), 3);
+		cached_millisecond_ = millisecond;
+
+		return buffer_;
+	}
+
+	static int size()
+	{
+		return length;
+	}
+
+	static timestamp_cache& for_thread()
+	{
+		static boost::thread_specific_ptr<timestamp_cache> instance;
+
+		auto local = instance.get();
+
+		if (!local)
+		{
+			local = new timestamp_cache();
+			instance.reset(local);
+		}
+
+		return *local;
+	}
+private:
+	static void write_digits(wchar_t* out, int value, int num_digits)
+	{
+		for (int n = num_digits - 1; n >= 0; --n)
+		{
+			out[n] = static_cast<wchar_t>(L'0' + value % 10);
+			value /= 10;
+		}
+	}
+};
 
 class column_writer
 {
@@ -96,23 +169,73 @@ public:
 		column_width_ = initial_width;
 	}
 
-	template<typename Stream, typename Val>
-	void write(Stream& out, const Val& value)
+	template<typename Stream>
+	void write(Stream& out, std::int64_t value)
+	{
+		wchar_t digits[24];
+		int length = 0;
+		bool negative = value < 0;
+		std::uint64_t magnitude = negative ? 0 - static_cast<std::uint64_t>(value) : static_cast<std::uint64_t>(value);
+
+		do
+		{
+			digits[sizeof(digits) / sizeof(wchar_t) - 1 - length++] = static_cast<wchar_t>(L'0' + magnitude % 10);
+			magnitude /= 10;
+		} while (magnitude != 0);
+
+		if (negative)
+			digits[sizeof(digits) / sizeof(wchar_t) - 1 - length++] = L'-';
+
+		write(out, digits + sizeof(digits) / sizeof(wchar_t) - length, length);
+	}
+
+	template<typename Stream, typename Char>
+	void write(Stream& out, const Char* value, int length)
 	{
-		std::wstring to_string = boost::lexical_cast<std::wstring>(value);
-		int length = static_cast<int>(to_string.size());
+		static const wchar_t padding[] = L"                                ";
+		static const int max_padding = static_cast<int>(sizeof(padding) / sizeof(wchar_t)) - 1;
 		int read_width;
 
 		while ((read_width = column_width_) < length && column_width_.compare_and_swap(length, read_width) != read_width);
 		read_width = column_width_;
 
-		out << L"[" << to_string << L"] ";
+		out.write(L"[", 1);
+		out.write(value, length);
+		out.write(L"] ", 2);
 
-		for (int n = 0; n < read_width - length; ++n)
-			out << L" ";
+		for (int to_pad = read_width - length; to_pad > 0; to_pad -= max_padding)
+			out.write(padding, std::min(to_pad, max_padding));
 	}
 };
 
+inline bool is_printable(wchar_t c)
+{
+	return (c >= 0x20 && c < 0x7F) || c == L'\r' || c == L'\n';
+}
+
+template<typename Stream>
+void write_message_line(bool print_all_characters, const wchar_t* begin, const wchar_t* end, Stream& strm)
+{
+	if (print_all_characters)
+	{
+		strm.write(begin, end - begin);
+		return;
+	}
+
+	wchar_t chunk[256];
+
+	while (begin != end)
+	{
+		auto count = std::min<std::ptrdiff_t>(end - begin, sizeof(chunk) / sizeof(wchar_t));
+
+		for (std::ptrdiff_t n = 0; n < count; ++n)
+			chunk[n] = is_printable(begin[n]) ? begin[n] : L'?';
+
+		strm.write(chunk, count);
+		begin += count;
+	}
+}
+
 template<typename Stream>
 void my_formatter(bool print_all_characters, const boost::log::record_view& rec, Stream& strm)
 {
@@ -120,24 +243,49 @@ void my_formatter(bool print_all_characters, const boost::log::record_view& rec,
 	static column_writer severity_column(7);
 	namespace expr = boost::log::expressions;
 
-	std::wstringstream pre_message_stream;
-	append_timestamp(pre_message_stream);
-	thread_id_column.write(pre_message_stream, boost::log::extract<std::int64_t>("NativeThreadId", rec));
-	severity_column.write(pre_message_stream, boost::log::extract<boost::log::trivial::severity_level>("Severity", rec));
+	// Use the time of the log call rather than the time of formatting, which
+	// may happen later on an asynchronous sink's feeding thread.
+	auto timestamp_value	= boost::log::extract<boost::posix_time::ptime>("TimeStamp", rec);
+	auto timestamp			= timestamp_value ? timestamp_value.get() : boost::posix_time::microsec_clock::local_time();
+	auto thread_id			= boost::log::extract<std::int64_t>("NativeThreadId", rec);
+	auto severity			= boost::log::extract<boost::log::trivial::severity_level>("Severity", rec);
+	auto severity_name		= severity ? boost::log::trivial::to_string(severity.get()) : nullptr;
 
-	auto pre_message = pre_message_stream.str();
+	if (!severity_name)
+		severity_name = "";
 
-	strm << pre_message;
+	auto write_prefix = [&]
+	{
+		strm.write(timestamp_cache::for_thread().format(timestamp), timestamp_cache::size());
+		thread_id_column.write(strm, thread_id ? thread_id.get() : 0);
+		severity_column.write(strm, severity_name, static_cast<int>(std::strlen(severity_name)));
+	};
 
-	auto line_break_replacement = L"\n" + pre_message;
+	write_prefix();
 
-	if (print_all_characters)
-	{
-		strm << boost::replace_all_copy(rec[expr::message].get<std::wstring>(), "\n", line_break_replacement);
-	}
-	else
+	auto message = rec[expr::message];
+
+	if (!message)
+		return;
+
+	const std::wstring& text = message.get<std::wstring>();
+	auto begin = text.data();
+	auto end = begin + text.size();
+
+	while (true)
 	{
-		strm << boost::replace_all_copy(replace_nonprintable_copy(rec[expr::message].get<std::wstring>(), L'?'), L"\n", line_break_replacement);
+		auto line_end = std::find(begin, end, L'\n');
+
+		write_message_line(print_all_characters, begin, line_end, strm);
+
+		if (line_end == end)
+			break;
+
+		// Repeat the prefix on every line of a multi line message.
+		strm.write(L"\n", 1);
+		write_prefix();
+
+		begin = line_end + 1;
 	}
 }
 
@@ -175,29 +323,122 @@ std::string current_exception_diagnostic_information()
 
 }
 
-void add_file_sink(const std::wstring& file, const boost::log::filter& filter)
+// Stops the asynchronous file sinks, see shutdown().
+std::vector<std::function<void()>>& file_sink_stoppers()
+{
+	static std::vector<std::function<void()>> instance;
+
+	return instance;
+}
+
+boost::mutex& file_sink_mutex()
+{
+	static boost::mutex instance;
+
+	return instance;
+}
+
+std::terminate_handler previous_terminate_handler = nullptr;
+
+void shutdown_and_terminate()
 {
-	typedef boost::log::sinks::synchronous_sink<boost::log::sinks::text_file_backend> file_sink_type;
+	shutdown();
+
+	if (previous_terminate_handler)
+		previous_terminate_handler();
+
+	std::abort();
+}
+
+void add_file_sink_stopper(std::function<void()> stopper)
+{
+	// Records still queued when the process ends, the last exception before a
+	// crash among them, are only written if the sink is flushed on the way out.
+	static auto install = []
+	{
+		std::atexit(&shutdown);
+		previous_terminate_handler = std::set_terminate(&shutdown_and_terminate);
+		return 0;
+	}();
+
+	boost::lock_guard<boost::mutex> lock(file_sink_mutex());
+
+	file_sink_stoppers().push_back(std::move(stopper));
+}
+
+template<typename FileSink>
+void setup_file_sink(const std::wstring& file, const boost::log::filter& filter)
+{
+	auto backend = boost::make_shared<boost::log::sinks::text_file_backend>(
+		//boost::log::keywords::file_name = (file + L"_%Y-%m-%d.log"),
+		boost::log::keywords::file_name = (file + L"_%Y-%m-%d-%H-%M-%S.log"),
+		boost::log::keywords::rotation_size = 2 * 1024 * 1024,
+		boost::log::keywords::time_based_rotation = boost::log::sinks::file::rotation_at_time_point(0, 0, 0),
+		boost::log::keywords::auto_flush = true,
+		boost::log::keywords::open_mode = std::ios::app
+		);
+
+	auto file_sink = boost::make_shared<FileSink>(backend);
+
+	bool print_all_characters = true;
+
+	file_sink->set_formatter(boost::bind(&my_formatter<boost::log::formatting_ostream>, print_all_characters, _1, _2));
+	file_sink->set_filter(filter);
+	boost::log::core::get()->add_sink(file_sink);
+
+	add_file_sink_stopper([file_sink]
+	{
+		boost::log::core::get()->remove_sink(file_sink);
+		file_sink->stop();
+		file_sink->flush();
+	});
+}
+
+void shutdown()
+{
+	std::vector<std::function<void()>> stoppers;
+
+	{
+		boost::lock_guard<boost::mutex> lock(file_sink_mutex());
+		stoppers.swap(file_sink_stoppers());
+	}
+
+	for (auto& stop : stoppers)
+	{
+		try
+		{
+			stop();
+		}
+		catch (...)
+		{
+		}
+	}
+}
+
+void add_file_sink(const std::wstring& file, const boost::log::filter& filter, file_sink_overflow overflow)
+{
+	// Records are formatted and written on the sink's own thread. The queue is
+	// bounded so that a stalled disk cannot make the process grow without
+	// limit; the overflow policy decides whether the logging thread waits or
+	// the record is discarded when the queue is full.
+	static const std::size_t max_queued_records = 64 * 1024;
+
+	typedef boost::log::sinks::asynchronous_sink<
+			boost::log::sinks::text_file_backend,
+			boost::log::sinks::bounded_fifo_queue<max_queued_records, boost::log::sinks::block_on_overflow>> blocking_file_sink_type;
+	typedef boost::log::sinks::asynchronous_sink<
+			boost::log::sinks::text_file_backend,
+			boost::log::sinks::bounded_fifo_queue<max_queued_records, boost::log::sinks::drop_on_overflow>> dropping_file_sink_type;
 
 	try
 	{
 		if (!boost::filesystem::is_directory(boost::filesystem::path(file).parent_path()))
 			CASPAR_THROW_EXCEPTION(directory_not_found());
 
-		auto file_sink = boost::make_shared<file_sink_type>(
-			//boost::log::keywords::file_name = (file + L"_%Y-%m-%d.log"),
-			boost::log::keywords::file_name = (file + L"_%Y-%m-%d-%H-%M-%S.log"),
-			boost::log::keywords::rotation_size = 2 * 1024 * 1024,
-			boost::log::keywords::time_based_rotation = boost::log::sinks::file::rotation_at_time_point(0, 0, 0),
-			boost::log::keywords::auto_flush = true,
-			boost::log::keywords::open_mode = std::ios::app
-			);
-
-		bool print_all_characters = true;
-
-		file_sink->set_formatter(boost::bind(&my_formatter<boost::log::formatting_ostream>, print_all_characters, _1, _2));
-		file_sink->set_filter(filter);
-		boost::log::core::get()->add_sink(file_sink);
+		if (overflow == file_sink_overflow::drop)
+			setup_file_sink<dropping_file_sink_type>(file, filter);
+		else
+			setup_file_sink<blocking_file_sink_type>(file, filter);
 	}
 	catch (...)
 	{
@@ -252,9 +493,10 @@ boost::mutex& get_filter_mutex()
 	return instance;
 }
 
-boost::log::trivial::severity_level& get_level()
+// Read by get_log_level() on logging threads without the filter mutex.
+tbb::atomic<boost::log::trivial::severity_level>& get_level()
 {
-	static boost::log::trivial::severity_level instance;
+	static tbb::atomic<boost::log::trivial::severity_level> instance;
 
 	return instance;
 }
@@ -268,7 +510,7 @@ log_category& get_disabled_categories()
 
 void set_log_filter()
 {
-	auto severity_filter		= boost::log::trivial::severity >= get_level();
+	auto severity_filter		= boost::log::trivial::severity >= static_cast<boost::log::trivial::severity_level>(get_level());
 	auto disabled_categories	= get_disabled_categories();
 
 	boost::log::core::get()->set_filter([=](const boost::log::attribute_value_set& attributes)
@@ -298,6 +540,11 @@ void set_log_level(const std::wstring& lvl)
 	set_log_filter();
 }
 
+boost::log::trivial::severity_level get_log_level()
+{
+	return get_level();
+}
+
 void set_log_category(const std::wstring& cat, bool enabled)
 {
 	log_category category_to_set;
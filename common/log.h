@@ -68,7 +68,16 @@ inline std::basic_string<T> replace_nonprintable_copy(std::basic_string<T, std::
 	return str;
 }
 
-void add_file_sink(const std::wstring& file, const boost::log::filter& filter);
+enum class file_sink_overflow
+{
+	block,	// The logging thread waits for room in the sink's queue.
+	drop	// The record is discarded, logging never blocks the caller.
+};
+
+void add_file_sink(const std::wstring& file, const boost::log::filter& filter, file_sink_overflow overflow = file_sink_overflow::block);
+// Writes what the file sinks have queued and stops them. Runs at exit and on
+// std::terminate, call it earlier from a clean shutdown path if logging is done.
+void shutdown();
 std::shared_ptr<void> add_preformatted_line_sink(std::function<void(std::string line)> formatted_line_sink);
 
 enum class log_category
@@ -113,6 +122,7 @@ BOOST_LOG_INLINE_GLOBAL_LOGGER_INIT(logger, caspar_logger)
 	catch(...){}
 
 void set_log_level(const std::wstring& lvl);
+boost::log::trivial::severity_level get_log_level();
 void set_log_category(const std::wstring& cat, bool enabled);
 
 void print_child(
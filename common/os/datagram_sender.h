@@ -0,0 +1,84 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace caspar {
+
+/**
+ * Sends datagrams of a UDP socket in batches, with as few system calls as
+ * the platform allows: one sendmsg with UDP_SEGMENT (GSO) per batch of equal
+ * sized datagrams where the kernel supports it, otherwise sendmmsg on Linux
+ * and one send per datagram elsewhere.
+ *
+ * Datagrams are copied into the batch on add() and only sent on flush() or
+ * when the batch is full, so the caller controls the batching latency.
+ *
+ * tools/udp_send_bench compares the system calls and CPU time of the three
+ * ways on loopback.
+ */
+class datagram_sender : boost::noncopyable
+{
+public:
+	struct statistics
+	{
+		std::uint64_t	datagrams;
+		std::uint64_t	bytes;
+		std::uint64_t	syscalls;
+		std::uint64_t	errors;
+		bool			segmentation_offload;	// Whether GSO is currently in use.
+	};
+
+	/**
+	 * @param native_socket  A UDP socket (file descriptor or SOCKET), owned by
+	 *                       the caller.
+	 * @param address        Destination, a sockaddr_in or sockaddr_in6.
+	 * @param address_length Size of address.
+	 * @param max_batch      Maximum number of datagrams per batch.
+	 * @param max_datagram   Maximum size of a single datagram.
+	 * @param allow_offload  Whether to try segmentation offload.
+	 */
+	datagram_sender(std::intptr_t native_socket, const void* address, int address_length, std::size_t max_batch = 64, std::size_t max_datagram = 1500, bool allow_offload = true);
+	~datagram_sender();
+
+	/**
+	 * Adds a datagram to the batch, sending the batch first if it is full.
+	 * Datagrams larger than max_datagram are rejected with an exception.
+	 */
+	void		add(const std::uint8_t* data, std::size_t size);
+	/**
+	 * Sends all batched datagrams. Send errors are counted, not thrown, as a
+	 * lost datagram is no reason to stop a stream.
+	 */
+	void		flush();
+
+	std::size_t	pending() const;
+	statistics	stats() const;
+private:
+	struct impl;
+	std::unique_ptr<impl> impl_;
+};
+
+}
@@ -0,0 +1,79 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace caspar {
+
+/**
+ * A file written front to back in large blocks, for recordings that should
+ * not fill the page cache. Data bypasses the cache where the file system
+ * allows it (O_DIRECT, FILE_FLAG_NO_BUFFERING). Where it does not, written
+ * ranges are pushed to disk early and dropped from the cache, so a buffered
+ * file never holds more than a couple of blocks of dirty pages either.
+ *
+ * Unbuffered writes must start at a multiple of alignment, from memory aligned
+ * to it and with a size that is a multiple of it. The last block of a file is
+ * therefore written padded and cut to the real length by close().
+ */
+class direct_file : boost::noncopyable
+{
+public:
+	static const std::size_t alignment = 4096;
+
+	/**
+	 * Creates or truncates the file, throwing file_write_error on failure.
+	 *
+	 * @param path   The file to create.
+	 * @param direct Whether to try bypassing the page cache, a file system that
+	 *               does not support it silently gets a buffered file.
+	 */
+	explicit direct_file(const std::wstring& path, bool direct = true);
+	~direct_file();
+
+	/**
+	 * Appends data, throwing file_write_error on failure. Unbuffered files
+	 * require data, size and the current length to be aligned.
+	 */
+	void			write(const void* data, std::size_t size);
+	/**
+	 * Flushes the written data to disk (fdatasync, FlushFileBuffers).
+	 */
+	void			sync();
+	/**
+	 * Cuts the file to length, syncs and closes it. Nothing may be written
+	 * afterwards.
+	 */
+	void			close(std::uint64_t length);
+
+	bool			direct() const;
+	std::uint64_t	written() const;
+private:
+	struct impl;
+	std::unique_ptr<impl> impl_;
+};
+
+}
@@ -0,0 +1,282 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../datagram_sender.h"
+
+#include "../../except.h"
+
+#include <tbb/atomic.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstring>
+#include <vector>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT // Linux 4.18, not in older libc headers.
+#define UDP_SEGMENT 103
+#endif
+
+namespace caspar {
+
+static const std::size_t MAX_GSO_SEGMENTS	= 64;		// UDP_MAX_SEGMENTS
+static const std::size_t MAX_GSO_BYTES		= 65507;	// Still one UDP datagram until segmented.
+
+struct datagram_sender::impl : boost::noncopyable
+{
+	const int						fd_;
+	sockaddr_storage				address_;
+	const socklen_t					address_length_;
+	const std::size_t				max_batch_;
+	const std::size_t				max_datagram_;
+
+	std::vector<std::uint8_t>		buffer_;
+	std::vector<std::size_t>		offsets_;
+	std::vector<std::size_t>		sizes_;
+	std::size_t						used_			= 0;
+	std::vector<mmsghdr>			messages_;
+	std::vector<iovec>				iovecs_;
+
+	tbb::atomic<bool>				offload_;
+	tbb::atomic<std::uint64_t>		datagrams_;
+	tbb::atomic<std::uint64_t>		bytes_;
+	tbb::atomic<std::uint64_t>		syscalls_;
+	tbb::atomic<std::uint64_t>		errors_;
+
+	impl(std::intptr_t native_socket, const void* address, int address_length, std::size_t max_batch, std::size_t max_datagram, bool allow_offload)
+		: fd_(static_cast<int>(native_socket))
+		, address_length_(static_cast<socklen_t>(address_length))
+		, max_batch_(std::max<std::size_t>(max_batch, 1))
+		, max_datagram_(max_datagram)
+		, buffer_(max_batch_ * max_datagram)
+		, messages_(max_batch_)
+		, iovecs_(max_batch_)
+	{
+		if (address_length <= 0 || static_cast<std::size_t>(address_length) > sizeof(address_))
+			CASPAR_THROW_EXCEPTION(invalid_argument() << msg_info("Invalid destination address"));
+
+		std::memcpy(&address_, address, address_length);
+
+		offsets_.reserve(max_batch_);
+		sizes_.reserve(max_batch_);
+
+		offload_	= allow_offload;
+		datagrams_	= 0;
+		bytes_		= 0;
+		syscalls_	= 0;
+		errors_		= 0;
+	}
+
+	void add(const std::uint8_t* data, std::size_t size)
+	{
+		if (size > max_datagram_)
+			CASPAR_THROW_EXCEPTION(invalid_argument() << msg_info("Datagram larger than max_datagram"));
+
+		if (sizes_.size() == max_batch_)
+			flush();
+
+		std::memcpy(buffer_.data() + used_, data, size);
+		offsets_.push_back(used_);
+		sizes_.push_back(size);
+		used_ += size;
+	}
+
+	void flush()
+	{
+		std::size_t first = 0;
+
+		while (first < sizes_.size())
+		{
+			std::size_t sent = 0;
+
+			if (offload_)
+				sent = send_segmented(first);
+
+			if (sent == 0)
+				sent = send_multiple(first);
+
+			first += sent;
+		}
+
+		offsets_.clear();
+		sizes_.clear();
+		used_ = 0;
+	}
+
+	// One sendmsg for a run of equal sized datagrams (the last one may be
+	// shorter), segmented by the kernel or the NIC. Returns 0 if the run is
+	// not worth it or offload turned out to be unsupported.
+	std::size_t send_segmented(std::size_t first)
+	{
+		auto segment	= sizes_[first];
+		auto total		= std::size_t(0);
+		auto last		= first;
+
+		while (last < sizes_.size() && last - first < MAX_GSO_SEGMENTS && total + sizes_[last] <= MAX_GSO_BYTES)
+		{
+			if (sizes_[last] > segment)
+				break;
+
+			total += sizes_[last];
+
+			if (sizes_[last++] < segment)
+				break;
+		}
+
+		auto count = last - first;
+
+		if (count < 2)
+			return 0;
+
+		iovec iov;
+		iov.iov_base	= buffer_.data() + offsets_[first];
+		iov.iov_len		= total;
+
+		char control[CMSG_SPACE(sizeof(std::uint16_t))] = {};
+
+		msghdr msg			= {};
+		msg.msg_name		= &address_;
+		msg.msg_namelen		= address_length_;
+		msg.msg_iov			= &iov;
+		msg.msg_iovlen		= 1;
+		msg.msg_control		= control;
+		msg.msg_controllen	= sizeof(control);
+
+		auto cmsg			= CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level	= SOL_UDP;
+		cmsg->cmsg_type		= UDP_SEGMENT;
+		cmsg->cmsg_len		= CMSG_LEN(sizeof(std::uint16_t));
+		auto segment_size	= static_cast<std::uint16_t>(segment);
+		std::memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+		ssize_t result;
+
+		do
+		{
+			result = sendmsg(fd_, &msg, 0);
+			++syscalls_;
+		} while (result < 0 && errno == EINTR);
+
+		if (result < 0)
+		{
+			// Old kernels reject the option, NICs without checksum offload fail
+			// with EIO. Either way plain batching is all that is left.
+			if (errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP || errno == EIO)
+			{
+				offload_ = false;
+				return 0;
+			}
+
+			++errors_;
+			return count;
+		}
+
+		datagrams_	+= count;
+		bytes_		+= total;
+
+		return count;
+	}
+
+	std::size_t send_multiple(std::size_t first)
+	{
+		auto count = sizes_.size() - first;
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			iovecs_[i].iov_base	= buffer_.data() + offsets_[first + i];
+			iovecs_[i].iov_len	= sizes_[first + i];
+
+			auto& hdr			= messages_[i].msg_hdr;
+			hdr					= msghdr();
+			hdr.msg_name		= &address_;
+			hdr.msg_namelen		= address_length_;
+			hdr.msg_iov			= &iovecs_[i];
+			hdr.msg_iovlen		= 1;
+		}
+
+		int result;
+
+		do
+		{
+			result = sendmmsg(fd_, messages_.data(), static_cast<unsigned int>(count), 0);
+			++syscalls_;
+		} while (result < 0 && errno == EINTR);
+
+		if (result <= 0)
+		{
+			// The error belongs to the first datagram, skip it and carry on.
+			++errors_;
+			return 1;
+		}
+
+		for (int i = 0; i < result; ++i)
+			bytes_ += sizes_[first + i];
+
+		datagrams_ += result;
+
+		return static_cast<std::size_t>(result);
+	}
+};
+
+datagram_sender::datagram_sender(std::intptr_t native_socket, const void* address, int address_length, std::size_t max_batch, std::size_t max_datagram, bool allow_offload)
+	: impl_(new impl(native_socket, address, address_length, max_batch, max_datagram, allow_offload))
+{
+}
+
+datagram_sender::~datagram_sender()
+{
+}
+
+void datagram_sender::add(const std::uint8_t* data, std::size_t size)
+{
+	impl_->add(data, size);
+}
+
+void datagram_sender::flush()
+{
+	impl_->flush();
+}
+
+std::size_t datagram_sender::pending() const
+{
+	return impl_->sizes_.size();
+}
+
+datagram_sender::statistics datagram_sender::stats() const
+{
+	statistics s;
+	s.datagrams				= impl_->datagrams_;
+	s.bytes					= impl_->bytes_;
+	s.syscalls				= impl_->syscalls_;
+	s.errors				= impl_->errors_;
+	s.segmentation_offload	= impl_->offload_;
+
+	return s;
+}
+
+}
@@ -0,0 +1,186 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../direct_file.h"
+
+#include "../../except.h"
+#include "../../utf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace caspar {
+
+struct direct_file::impl : boost::noncopyable
+{
+	const std::wstring	path_;
+	int					fd_				= -1;
+	bool				direct_			= false;
+	std::uint64_t		written_		= 0;
+	std::uint64_t		flushed_		= 0;	// Buffered files: the range before this has left the page cache.
+
+	impl(const std::wstring& path, bool direct)
+		: path_(path)
+	{
+		auto name	= u8(path);
+		auto flags	= O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+		if (direct)
+		{
+			fd_ = ::open(name.c_str(), flags | O_DIRECT, 0644);
+			direct_ = fd_ >= 0;
+		}
+
+		// tmpfs and some network file systems refuse O_DIRECT with EINVAL.
+		if (fd_ < 0)
+			fd_ = ::open(name.c_str(), flags, 0644);
+
+		if (fd_ < 0)
+			fail("open");
+
+		if (!direct_)
+			posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	~impl()
+	{
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	void fail(const char* operation) const
+	{
+		CASPAR_THROW_EXCEPTION(file_write_error()
+				<< msg_info(std::string(operation) + " failed: " + std::strerror(errno))
+				<< file_name_info(path_));
+	}
+
+	void write(const void* data, std::size_t size)
+	{
+		auto bytes	= static_cast<const char*>(data);
+		auto offset	= written_;
+
+		while (size > 0)
+		{
+			auto result = ::write(fd_, bytes, size);
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				fail("write");
+			}
+
+			bytes		+= result;
+			size		-= result;
+			written_	+= result;
+		}
+
+		if (!direct_)
+			release(offset);
+	}
+
+	// Starts writeback of what was just written and waits for the block
+	// before it, which by now is usually on disk already, to drop it from the
+	// page cache. Keeps the dirty and cached pages of a buffered recording to
+	// about two blocks instead of letting them pile up until the kernel's
+	// dirty limits force a stall on every writer of the volume.
+	void release(std::uint64_t offset)
+	{
+		sync_file_range(fd_, offset, written_ - offset, SYNC_FILE_RANGE_WRITE);
+
+		if (offset > flushed_)
+		{
+			sync_file_range(fd_, flushed_, offset - flushed_, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(fd_, flushed_, offset - flushed_, POSIX_FADV_DONTNEED);
+			flushed_ = offset;
+		}
+	}
+
+	void sync()
+	{
+		if (fdatasync(fd_) != 0)
+			fail("fdatasync");
+
+		if (!direct_)
+		{
+			posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+			flushed_ = written_;
+		}
+	}
+
+	void close(std::uint64_t length)
+	{
+		if (length != written_ && ftruncate(fd_, length) != 0)
+			fail("ftruncate");
+
+		written_ = length;
+		sync();
+
+		auto fd = fd_;
+		fd_ = -1;
+
+		if (::close(fd) != 0)
+			fail("close");
+	}
+};
+
+direct_file::direct_file(const std::wstring& path, bool direct)
+	: impl_(new impl(path, direct))
+{
+}
+
+direct_file::~direct_file()
+{
+}
+
+void direct_file::write(const void* data, std::size_t size)
+{
+	impl_->write(data, size);
+}
+
+void direct_file::sync()
+{
+	impl_->sync();
+}
+
+void direct_file::close(std::uint64_t length)
+{
+	impl_->close(length);
+}
+
+bool direct_file::direct() const
+{
+	return impl_->direct_;
+}
+
+std::uint64_t direct_file::written() const
+{
+	return impl_->written_;
+}
+
+}
@@ -0,0 +1,150 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../mapped_file.h"
+
+#include "../../except.h"
+#include "../../utf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace caspar {
+
+struct mapped_file::impl : boost::noncopyable
+{
+	const std::wstring	path_;
+	const std::uint64_t	size_;
+	int					fd_		= -1;
+	void*				data_	= MAP_FAILED;
+
+	impl(const std::wstring& path, std::uint64_t size)
+		: path_(path)
+		, size_(size)
+	{
+		fd_ = ::open(u8(path).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+		if (fd_ < 0)
+			fail("open");
+
+		// The destructor does not run when the constructor throws.
+		try
+		{
+			// Not every file system can allocate, a sparse file is the fallback.
+			if (posix_fallocate(fd_, 0, static_cast<off_t>(size_)) != 0 && ftruncate(fd_, static_cast<off_t>(size_)) != 0)
+				fail("ftruncate");
+
+			data_ = mmap(nullptr, static_cast<std::size_t>(size_), PROT_READ, MAP_SHARED, fd_, 0);
+
+			if (data_ == MAP_FAILED)
+				fail("mmap");
+		}
+		catch (...)
+		{
+			close();
+			throw;
+		}
+	}
+
+	~impl()
+	{
+		close();
+	}
+
+	void close()
+	{
+		if (data_ != MAP_FAILED)
+			munmap(data_, static_cast<std::size_t>(size_));
+
+		if (fd_ >= 0)
+		{
+			::close(fd_);
+			::unlink(u8(path_).c_str());
+		}
+
+		data_	= MAP_FAILED;
+		fd_		= -1;
+	}
+
+	void fail(const char* operation) const
+	{
+		CASPAR_THROW_EXCEPTION(file_write_error()
+				<< msg_info(std::string(operation) + " failed: " + std::strerror(errno))
+				<< file_name_info(path_));
+	}
+
+	void write(std::uint64_t offset, const void* data, std::size_t size)
+	{
+		if (offset + size > size_)
+			CASPAR_THROW_EXCEPTION(file_write_error() << msg_info("Write beyond the end of the file.") << file_name_info(path_));
+
+		auto bytes = static_cast<const char*>(data);
+
+		while (size > 0)
+		{
+			auto result = ::pwrite(fd_, bytes, size, static_cast<off_t>(offset));
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				fail("pwrite");
+			}
+
+			bytes	+= result;
+			offset	+= result;
+			size	-= result;
+		}
+	}
+};
+
+mapped_file::mapped_file(const std::wstring& path, std::uint64_t size)
+	: impl_(new impl(path, size))
+{
+}
+
+mapped_file::~mapped_file()
+{
+}
+
+void mapped_file::write(std::uint64_t offset, const void* data, std::size_t size)
+{
+	impl_->write(offset, data, size);
+}
+
+const std::uint8_t* mapped_file::data() const
+{
+	return static_cast<const std::uint8_t*>(impl_->data_);
+}
+
+std::uint64_t mapped_file::size() const
+{
+	return impl_->size_;
+}
+
+}
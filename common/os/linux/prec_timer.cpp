@@ -22,15 +22,7 @@
 #include "../../stdafx.h"
 
 #include "../../prec_timer.h"
-
-#include <boost/thread.hpp>
-#include <boost/chrono/system_clocks.hpp>
-
-#include <time.h>
-
-#include <cmath>
-
-using namespace boost::chrono;
+#include "../precise_sleep.h"
 
 namespace caspar {
 	
@@ -41,45 +33,26 @@ prec_timer::prec_timer()
 
 void prec_timer::tick_millis(int64_t ticks_to_wait)
 {
-	ticks_to_wait *= 1000000;
-	auto t = duration_cast<nanoseconds>(high_resolution_clock::now().time_since_epoch()).count();
+	auto now = monotonic_now();
 
-	if (time_ != 0)
+	if (time_ == 0)
 	{
-		bool done = 0;
-		do
-		{
-			auto ticks_passed = t - time_;
-			auto ticks_left = ticks_to_wait - ticks_passed;
-
-			if (t < time_)    // time wrap
-				done = 1;
-			if (ticks_passed >= ticks_to_wait)
-				done = 1;
-
-			if (!done)
-			{
-				timespec spec;
-
-				if (ticks_left > 2000000)
-				{
-					spec.tv_sec = ticks_left / 1000000000;
-					spec.tv_nsec = 1000000;
-				}
-				else
-				{
-					spec.tv_sec = 0;
-					spec.tv_nsec = ticks_left / 100;
-				}
+		time_ = now;
+		return;
+	}
 
-				nanosleep(&spec, nullptr);
-			}
+	auto deadline = time_ + ticks_to_wait * 1000000;
 
-			t = duration_cast<nanoseconds>(high_resolution_clock::now().time_since_epoch()).count();
-		} while (!done);
+	// More than an interval late, start over from now rather than returning
+	// immediately until the lost ticks are made up.
+	if (now - deadline > ticks_to_wait * 1000000)
+	{
+		time_ = now;
+		return;
 	}
 
-	time_ = t;
+	sleep_until(deadline);
+	time_ = deadline;
 }
 
 }
@@ -0,0 +1,52 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../precise_sleep.h"
+
+#include <errno.h>
+#include <time.h>
+
+namespace caspar {
+
+std::int64_t monotonic_now()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return static_cast<std::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+void sleep_until(std::int64_t deadline)
+{
+	if (deadline <= 0)
+		return;
+
+	timespec target;
+	target.tv_sec	= static_cast<time_t>(deadline / 1000000000);
+	target.tv_nsec	= static_cast<long>(deadline % 1000000000);
+
+	// The target is absolute, so a sleep interrupted by a signal is simply
+	// restarted with the same one.
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, nullptr) == EINTR)
+		;
+}
+
+}
@@ -0,0 +1,54 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../socket_pacing.h"
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <limits>
+
+#ifndef SO_MAX_PACING_RATE // Linux 3.13, not in older libc headers.
+#define SO_MAX_PACING_RATE 47
+#endif
+
+namespace caspar {
+
+bool set_socket_pacing_rate(std::intptr_t native_socket, std::uint64_t bytes_per_second)
+{
+	auto fd = static_cast<int>(native_socket);
+
+	if (bytes_per_second == 0)
+		bytes_per_second = std::numeric_limits<std::uint64_t>::max();
+
+	// Kernels before 4.20 only take 32 bits, ~34 Gbit/s, newer ones take
+	// either size.
+	std::uint64_t rate = bytes_per_second;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0)
+		return true;
+
+	auto rate32 = static_cast<std::uint32_t>(std::min<std::uint64_t>(bytes_per_second, std::numeric_limits<std::uint32_t>::max()));
+
+	return setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, sizeof(rate32)) == 0;
+}
+
+}
@@ -0,0 +1,60 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../tcp_stats.h"
+
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+namespace caspar {
+
+bool read_tcp_stats(std::intptr_t native_socket, tcp_stats& stats)
+{
+	auto fd = static_cast<int>(native_socket);
+
+	struct tcp_info info;
+	socklen_t length = sizeof(info);
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) != 0)
+		return false;
+
+	stats.rtt_us			= info.tcpi_rtt;
+	stats.rtt_var_us		= info.tcpi_rttvar;
+	stats.retransmissions	= info.tcpi_total_retrans;
+
+	int queued = 0;
+	int unsent = 0;
+
+	// SIOCOUTQ counts everything not yet acknowledged, SIOCOUTQNSD only what
+	// has not been sent.
+	if (ioctl(fd, SIOCOUTQ, &queued) == 0 && ioctl(fd, SIOCOUTQNSD, &unsent) == 0)
+	{
+		stats.bytes_unsent		= unsent;
+		stats.bytes_in_flight	= queued - unsent;
+	}
+
+	return true;
+}
+
+}
@@ -0,0 +1,63 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace caspar {
+
+/**
+ * A scratch file of fixed size, preallocated on creation so writing it never
+ * runs out of space or fragments it, which is written with positioned writes
+ * and read through a read-only mapping of the whole file. Reads are plain
+ * memory accesses without system calls, so any number of readers are cheap.
+ *
+ * Writes and the mapping share the page cache, a write is visible to readers
+ * when it returns. The file is deleted when the object is destroyed.
+ */
+class mapped_file : boost::noncopyable
+{
+public:
+	/**
+	 * Creates or truncates the file and maps it, throwing file_write_error on
+	 * failure.
+	 */
+	mapped_file(const std::wstring& path, std::uint64_t size);
+	~mapped_file();
+
+	/**
+	 * Writes data at offset, which must lie within the file. Throws
+	 * file_write_error on failure.
+	 */
+	void					write(std::uint64_t offset, const void* data, std::size_t size);
+
+	const std::uint8_t*		data() const;
+	std::uint64_t			size() const;
+private:
+	struct impl;
+	std::unique_ptr<impl> impl_;
+};
+
+}
@@ -0,0 +1,48 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace caspar {
+
+/**
+ * Nanoseconds on the monotonic clock, the same clock boost::chrono and
+ * std::chrono steady_clock read (CLOCK_MONOTONIC, QueryPerformanceCounter),
+ * so values can be compared with theirs.
+ */
+std::int64_t monotonic_now();
+
+/**
+ * Sleeps until an absolute time on the monotonic_now() clock and returns
+ * immediately if it has passed. Sleeping to an absolute deadline, not for a
+ * duration computed from a clock read earlier, means time spent being
+ * preempted or interrupted before the call does not add up over a sequence
+ * of waits.
+ *
+ * On Linux this is clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME), restarted
+ * after signals, so the wake-up error is the timer slack plus scheduling
+ * latency. On Windows a high resolution waitable timer is used where
+ * available (Windows 10 1803), otherwise a waitable timer with the system
+ * timer granularity, so callers that need better should spin the remainder.
+ */
+void sleep_until(std::int64_t deadline);
+
+}
@@ -0,0 +1,40 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace caspar {
+
+/**
+ * Asks the kernel to pace a socket's transmissions to a rate
+ * (SO_MAX_PACING_RATE), so a stream leaves the host evenly spread instead
+ * of in the bursts it is written in. TCP sockets are paced by the stack
+ * itself, UDP sockets only when the interface uses the fq queueing
+ * discipline.
+ *
+ * @param native_socket     A socket (a file descriptor or a SOCKET).
+ * @param bytes_per_second  The rate, 0 removes the limit.
+ *
+ * @return false if the platform does not support pacing offload.
+ */
+bool set_socket_pacing_rate(std::intptr_t native_socket, std::uint64_t bytes_per_second);
+
+}
@@ -0,0 +1,48 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace caspar {
+
+/**
+ * Kernel side view of a connected TCP socket. Values the platform cannot
+ * provide are left at -1.
+ */
+struct tcp_stats
+{
+	std::int64_t	rtt_us				= -1;	// Smoothed round trip time.
+	std::int64_t	rtt_var_us			= -1;
+	std::int64_t	bytes_in_flight		= -1;	// Sent but not yet acknowledged by the peer.
+	std::int64_t	bytes_unsent		= -1;	// In the send buffer, not yet sent.
+	std::int64_t	retransmissions		= -1;	// Retransmitted segments (Linux) or bytes (Windows).
+};
+
+/**
+ * @param native_socket The native handle of a connected TCP socket (a file
+ *                      descriptor or a SOCKET).
+ * @param stats         Receives the values that could be read.
+ *
+ * @return false if the socket could not be queried at all.
+ */
+bool read_tcp_stats(std::intptr_t native_socket, tcp_stats& stats);
+
+}
@@ -0,0 +1,247 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "../../stdafx.h"
+
+#include "../datagram_sender.h"
+
+#include "../../except.h"
+
+#include <tbb/atomic.h>
+
+#include <cstring>
+#include <vector>
+
+namespace caspar {
+
+static const std::size_t MAX_USO_BYTES = 65507;
+
+struct datagram_sender::impl : boost::noncopyable
+{
+	const SOCKET					socket_;
+	sockaddr_storage				address_;
+	const int						address_length_;
+	const std::size_t				max_batch_;
+	const std::size_t				max_datagram_;
+
+	std::vector<std::uint8_t>		buffer_;
+	std::vector<std::size_t>		offsets_;
+	std::vector<std::size_t>		sizes_;
+	std::size_t						used_			= 0;
+	DWORD							segment_size_	= 0;	// Currently set UDP_SEND_MSG_SIZE, 0 for none.
+
+	tbb::atomic<bool>				offload_;
+	tbb::atomic<std::uint64_t>		datagrams_;
+	tbb::atomic<std::uint64_t>		bytes_;
+	tbb::atomic<std::uint64_t>		syscalls_;
+	tbb::atomic<std::uint64_t>		errors_;
+
+	impl(std::intptr_t native_socket, const void* address, int address_length, std::size_t max_batch, std::size_t max_datagram, bool allow_offload)
+		: socket_(static_cast<SOCKET>(native_socket))
+		, address_length_(address_length)
+		, max_batch_(std::max<std::size_t>(max_batch, 1))
+		, max_datagram_(max_datagram)
+		, buffer_(max_batch_ * max_datagram)
+	{
+		if (address_length <= 0 || static_cast<std::size_t>(address_length) > sizeof(address_))
+			CASPAR_THROW_EXCEPTION(invalid_argument() << msg_info("Invalid destination address"));
+
+		std::memcpy(&address_, address, address_length);
+
+		offsets_.reserve(max_batch_);
+		sizes_.reserve(max_batch_);
+
+#ifdef UDP_SEND_MSG_SIZE // Windows 10 2004 SDK and later.
+		offload_	= allow_offload;
+#else
+		offload_	= false;
+#endif
+		datagrams_	= 0;
+		bytes_		= 0;
+		syscalls_	= 0;
+		errors_		= 0;
+	}
+
+	void add(const std::uint8_t* data, std::size_t size)
+	{
+		if (size > max_datagram_)
+			CASPAR_THROW_EXCEPTION(invalid_argument() << msg_info("Datagram larger than max_datagram"));
+
+		if (sizes_.size() == max_batch_)
+			flush();
+
+		std::memcpy(buffer_.data() + used_, data, size);
+		offsets_.push_back(used_);
+		sizes_.push_back(size);
+		used_ += size;
+	}
+
+	void flush()
+	{
+		std::size_t first = 0;
+
+		while (first < sizes_.size())
+		{
+			std::size_t sent = 0;
+
+			if (offload_)
+				sent = send_segmented(first);
+
+			if (sent == 0)
+				sent = send_single(first);
+
+			first += sent;
+		}
+
+		offsets_.clear();
+		sizes_.clear();
+		used_ = 0;
+	}
+
+	// Same idea as UDP_SEGMENT on Linux: one sendto for a run of equal sized
+	// datagrams (the last one may be shorter), segmented by the stack.
+	std::size_t send_segmented(std::size_t first)
+	{
+#ifdef UDP_SEND_MSG_SIZE
+		auto segment	= sizes_[first];
+		auto total		= std::size_t(0);
+		auto last		= first;
+
+		while (last < sizes_.size() && total + sizes_[last] <= MAX_USO_BYTES)
+		{
+			if (sizes_[last] > segment)
+				break;
+
+			total += sizes_[last];
+
+			if (sizes_[last++] < segment)
+				break;
+		}
+
+		auto count = last - first;
+
+		if (count < 2)
+			return 0;
+
+		if (segment_size_ != segment)
+		{
+			DWORD value = static_cast<DWORD>(segment);
+
+			++syscalls_;
+
+			if (setsockopt(socket_, IPPROTO_UDP, UDP_SEND_MSG_SIZE, reinterpret_cast<const char*>(&value), sizeof(value)) != 0)
+			{
+				offload_ = false;
+				return 0;
+			}
+
+			segment_size_ = value;
+		}
+
+		++syscalls_;
+
+		if (sendto(socket_, reinterpret_cast<const char*>(buffer_.data() + offsets_[first]), static_cast<int>(total), 0, reinterpret_cast<const sockaddr*>(&address_), address_length_) == SOCKET_ERROR)
+		{
+			if (WSAGetLastError() == WSAEINVAL || WSAGetLastError() == WSAEOPNOTSUPP)
+			{
+				offload_ = false;
+				return 0;
+			}
+
+			++errors_;
+			return count;
+		}
+
+		datagrams_	+= count;
+		bytes_		+= total;
+
+		return count;
+#else
+		return 0;
+#endif
+	}
+
+	std::size_t send_single(std::size_t first)
+	{
+#ifdef UDP_SEND_MSG_SIZE
+		if (segment_size_ != 0)
+		{
+			DWORD value = 0;
+
+			++syscalls_;
+			setsockopt(socket_, IPPROTO_UDP, UDP_SEND_MSG_SIZE, reinterpret_cast<const char*>(&value), sizeof(value));
+			segment_size_ = 0;
+		}
+#endif
+
+		++syscalls_;
+
+		if (sendto(socket_, reinterpret_cast<const char*>(buffer_.data() + offsets_[first]), static_cast<int>(sizes_[first]), 0, reinterpret_cast<const sockaddr*>(&address_), address_length_) == SOCKET_ERROR)
+		{
+			++errors_;
+			return 1;
+		}
+
+		++datagrams_;
+		bytes_ += sizes_[first];
+
+		return 1;
+	}
+};
+
+datagram_sender::datagram_sender(std::intptr_t native_socket, const void* address, int address_length, std::size_t max_batch, std::size_t max_datagram, bool allow_offload)
+	: impl_(new impl(native_socket, address, address_length, max_batch, max_datagram, allow_offload))
+{
+}
+
+datagram_sender::~datagram_sender()
+{
+}
+
+void datagram_sender::add(const std::uint8_t* data, std::size_t size)
+{
+	impl_->add(data, size);
+}
+
+void datagram_sender::flush()
+{
+	impl_->flush();
+}
+
+std::size_t datagram_sender::pending() const
+{
+	return impl_->sizes_.size();
+}
+
+datagram_sender::statistics datagram_sender::stats() const
+{
+	statistics s;
+	s.datagrams				= impl_->datagrams_;
+	s.bytes					= impl_->bytes_;
+	s.syscalls				= impl_->syscalls_;
+	s.errors				= impl_->errors_;
+	s.segmentation_offload	= impl_->offload_;
+
+	return s;
+}
+
+}
@@ -0,0 +1,156 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../direct_file.h"
+
+#include "../../except.h"
+
+#include "windows.h"
+
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+
+namespace caspar {
+
+struct direct_file::impl : boost::noncopyable
+{
+	const std::wstring	path_;
+	HANDLE				file_		= INVALID_HANDLE_VALUE;
+	bool				direct_		= false;
+	std::uint64_t		written_	= 0;
+
+	impl(const std::wstring& path, bool direct)
+		: path_(path)
+	{
+		if (direct)
+		{
+			file_	= open(FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN);
+			direct_	= file_ != INVALID_HANDLE_VALUE;
+		}
+
+		if (file_ == INVALID_HANDLE_VALUE)
+			file_ = open(FILE_FLAG_SEQUENTIAL_SCAN);
+
+		if (file_ == INVALID_HANDLE_VALUE)
+			fail("CreateFile");
+	}
+
+	~impl()
+	{
+		if (file_ != INVALID_HANDLE_VALUE)
+			CloseHandle(file_);
+	}
+
+	HANDLE open(DWORD flags) const
+	{
+		return CreateFileW(path_.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | flags, nullptr);
+	}
+
+	void fail(const char* operation) const
+	{
+		CASPAR_THROW_EXCEPTION(file_write_error()
+				<< msg_info(std::string(operation) + " failed with error " + boost::lexical_cast<std::string>(GetLastError()))
+				<< file_name_info(path_));
+	}
+
+	void write(const void* data, std::size_t size)
+	{
+		auto bytes = static_cast<const char*>(data);
+
+		while (size > 0)
+		{
+			DWORD written = 0;
+
+			if (!WriteFile(file_, bytes, static_cast<DWORD>(std::min<std::size_t>(size, 1 << 30)), &written, nullptr))
+				fail("WriteFile");
+
+			bytes		+= written;
+			size		-= written;
+			written_	+= written;
+		}
+	}
+
+	void sync()
+	{
+		if (!FlushFileBuffers(file_))
+			fail("FlushFileBuffers");
+	}
+
+	void close(std::uint64_t length)
+	{
+		if (length != written_)
+		{
+			// The end of file may be set anywhere, only unbuffered I/O is
+			// restricted to sector boundaries.
+			FILE_END_OF_FILE_INFO end;
+			end.EndOfFile.QuadPart = static_cast<LONGLONG>(length);
+
+			if (!SetFileInformationByHandle(file_, FileEndOfFileInfo, &end, sizeof(end)))
+				fail("SetFileInformationByHandle");
+		}
+
+		written_ = length;
+		sync();
+
+		auto file = file_;
+		file_ = INVALID_HANDLE_VALUE;
+
+		if (!CloseHandle(file))
+			fail("CloseHandle");
+	}
+};
+
+direct_file::direct_file(const std::wstring& path, bool direct)
+	: impl_(new impl(path, direct))
+{
+}
+
+direct_file::~direct_file()
+{
+}
+
+void direct_file::write(const void* data, std::size_t size)
+{
+	impl_->write(data, size);
+}
+
+void direct_file::sync()
+{
+	impl_->sync();
+}
+
+void direct_file::close(std::uint64_t length)
+{
+	impl_->close(length);
+}
+
+bool direct_file::direct() const
+{
+	return impl_->direct_;
+}
+
+std::uint64_t direct_file::written() const
+{
+	return impl_->written_;
+}
+
+}
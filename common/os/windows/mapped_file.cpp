@@ -0,0 +1,162 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../mapped_file.h"
+
+#include "../../except.h"
+
+#include "windows.h"
+
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+
+namespace caspar {
+
+struct mapped_file::impl : boost::noncopyable
+{
+	const std::wstring	path_;
+	const std::uint64_t	size_;
+	HANDLE				file_		= INVALID_HANDLE_VALUE;
+	HANDLE				mapping_	= nullptr;
+	const void*			data_		= nullptr;
+
+	impl(const std::wstring& path, std::uint64_t size)
+		: path_(path)
+		, size_(size)
+	{
+		file_ = CreateFileW(path_.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+
+		if (file_ == INVALID_HANDLE_VALUE)
+			fail("CreateFile");
+
+		// The destructor does not run when the constructor throws. Closing the
+		// file deletes it (FILE_FLAG_DELETE_ON_CLOSE).
+		try
+		{
+			FILE_ALLOCATION_INFO allocation;
+			allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(size_);
+			SetFileInformationByHandle(file_, FileAllocationInfo, &allocation, sizeof(allocation)); // Best effort.
+
+			FILE_END_OF_FILE_INFO end;
+			end.EndOfFile.QuadPart = static_cast<LONGLONG>(size_);
+
+			if (!SetFileInformationByHandle(file_, FileEndOfFileInfo, &end, sizeof(end)))
+				fail("SetFileInformationByHandle");
+
+			mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+			if (!mapping_)
+				fail("CreateFileMapping");
+
+			data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+
+			if (!data_)
+				fail("MapViewOfFile");
+		}
+		catch (...)
+		{
+			close();
+			throw;
+		}
+	}
+
+	~impl()
+	{
+		close();
+	}
+
+	void close()
+	{
+		if (data_)
+			UnmapViewOfFile(data_);
+
+		if (mapping_)
+			CloseHandle(mapping_);
+
+		if (file_ != INVALID_HANDLE_VALUE)
+			CloseHandle(file_);
+
+		data_		= nullptr;
+		mapping_	= nullptr;
+		file_		= INVALID_HANDLE_VALUE;
+	}
+
+	void fail(const char* operation) const
+	{
+		CASPAR_THROW_EXCEPTION(file_write_error()
+				<< msg_info(std::string(operation) + " failed with error " + boost::lexical_cast<std::string>(GetLastError()))
+				<< file_name_info(path_));
+	}
+
+	void write(std::uint64_t offset, const void* data, std::size_t size)
+	{
+		if (offset + size > size_)
+			CASPAR_THROW_EXCEPTION(file_write_error() << msg_info("Write beyond the end of the file.") << file_name_info(path_));
+
+		auto bytes = static_cast<const char*>(data);
+
+		while (size > 0)
+		{
+			auto chunk = static_cast<DWORD>(std::min<std::size_t>(size, 1 << 30));
+
+			// Views of a local file are coherent with WriteFile to it.
+			OVERLAPPED position = {};
+			position.Offset		= static_cast<DWORD>(offset);
+			position.OffsetHigh	= static_cast<DWORD>(offset >> 32);
+
+			DWORD written = 0;
+
+			if (!WriteFile(file_, bytes, chunk, &written, &position))
+				fail("WriteFile");
+
+			bytes	+= written;
+			offset	+= written;
+			size	-= written;
+		}
+	}
+};
+
+mapped_file::mapped_file(const std::wstring& path, std::uint64_t size)
+	: impl_(new impl(path, size))
+{
+}
+
+mapped_file::~mapped_file()
+{
+}
+
+void mapped_file::write(std::uint64_t offset, const void* data, std::size_t size)
+{
+	impl_->write(offset, data, size);
+}
+
+const std::uint8_t* mapped_file::data() const
+{
+	return static_cast<const std::uint8_t*>(impl_->data_);
+}
+
+std::uint64_t mapped_file::size() const
+{
+	return impl_->size_;
+}
+
+}
@@ -0,0 +1,101 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "../precise_sleep.h"
+
+#include <windows.h>
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION // Windows 10 1803 SDK.
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+namespace caspar {
+
+namespace {
+
+std::int64_t performance_frequency()
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	return frequency.QuadPart;
+}
+
+// One timer per sleeping thread, created on its first sleep.
+struct thread_timer
+{
+	HANDLE handle;
+
+	thread_timer()
+		: handle(CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS))
+	{
+		if (!handle) // Older than Windows 10 1803.
+			handle = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+	}
+
+	~thread_timer()
+	{
+		if (handle)
+			CloseHandle(handle);
+	}
+};
+
+}
+
+std::int64_t monotonic_now()
+{
+	static const std::int64_t frequency = performance_frequency();
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+
+	// Split so the multiplication does not overflow after a few days of uptime.
+	return counter.QuadPart / frequency * 1000000000 + counter.QuadPart % frequency * 1000000000 / frequency;
+}
+
+void sleep_until(std::int64_t deadline)
+{
+	static thread_local thread_timer timer;
+
+	auto remaining = deadline - monotonic_now();
+
+	if (remaining <= 0)
+		return;
+
+	if (!timer.handle)
+	{
+		Sleep(static_cast<DWORD>((remaining + 999999) / 1000000));
+		return;
+	}
+
+	// Waitable timers take absolute times on the system clock only, which
+	// may be stepped, so the monotonic deadline is converted to a relative
+	// due time (negative, in 100 ns units) as late as possible.
+	LARGE_INTEGER due;
+	due.QuadPart = -((remaining + 99) / 100);
+
+	if (SetWaitableTimer(timer.handle, &due, 0, nullptr, nullptr, FALSE))
+		WaitForSingleObject(timer.handle, INFINITE);
+	else
+		Sleep(static_cast<DWORD>((remaining + 999999) / 1000000));
+}
+
+}
@@ -0,0 +1,50 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
+
+#include "../../stdafx.h"
+
+#include "../tcp_stats.h"
+
+namespace caspar {
+
+bool read_tcp_stats(std::intptr_t native_socket, tcp_stats& stats)
+{
+#ifdef SIO_TCP_INFO // Windows 10 1703 SDK and later.
+	DWORD version = 0;
+	TCP_INFO_v0 info;
+	DWORD returned = 0;
+
+	if (WSAIoctl(static_cast<SOCKET>(native_socket), SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &returned, nullptr, nullptr) != 0)
+		return false;
+
+	stats.rtt_us			= info.RttUs;
+	stats.bytes_in_flight	= info.BytesInFlight;
+	stats.retransmissions	= info.BytesRetrans;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+}
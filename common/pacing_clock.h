@@ -0,0 +1,269 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "os/precise_sleep.h"
+
+#include <tbb/atomic.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+namespace caspar {
+
+/**
+ * Releases output in real time, to absolute deadlines in nanoseconds on the
+ * monotonic_now() clock.
+ *
+ * Each wait sleeps to an absolute deadline (see sleep_until()) and, when a
+ * spin window is configured, stops sleeping that long before it and spins
+ * the rest, trading some cpu for wake-ups within microseconds of the
+ * deadline.
+ *
+ * wait_media() paces media time instead. The first time anchors the media
+ * timeline to the clock and every later deadline is computed from that
+ * anchor, never from the previous wake-up, so wake-up errors do not
+ * accumulate and output does not drift from media time. The anchor is only
+ * moved when the output falls behind by more than max_lag (the lost time is
+ * given up and counted as drift, instead of sending a burst to catch up) and
+ * a new timeline starts when media time jumps by more than max_gap.
+ *
+ * Wake-up errors, how late each wait that slept returned, are kept as a
+ * histogram that info() reports. Waiting is meant for one thread, stats()
+ * and info() may be called from any.
+ */
+class pacing_clock : boost::noncopyable
+{
+public:
+	static const int histogram_size = 10;
+
+	struct settings
+	{
+		std::int64_t	spin	= 0;			// ns before a deadline to stop sleeping and spin.
+		std::int64_t	lead	= 0;			// ns media is released ahead of its time.
+		std::int64_t	max_lag	= 100000000;	// ns behind the timeline before giving the time up.
+		std::int64_t	max_gap	= 1000000000;	// ns of media time jump that starts a new timeline.
+	};
+
+	struct statistics
+	{
+		std::uint64_t							waits;
+		std::uint64_t							late;		// Waits whose deadline had already passed, not in the histogram.
+		std::uint64_t							resyncs;	// Anchor moves and new timelines.
+		std::int64_t							drift;		// ns given up by falling behind.
+		std::int64_t							mean_error;
+		std::int64_t							max_error;
+		std::array<std::uint64_t, histogram_size>	histogram;	// Counts per histogram_bound().
+	};
+
+	pacing_clock()
+		: pacing_clock(settings())
+	{
+	}
+
+	explicit pacing_clock(const settings& settings)
+		: settings_(settings)
+	{
+		waits_		= 0;
+		late_		= 0;
+		resyncs_	= 0;
+		drift_		= 0;
+		error_sum_	= 0;
+		max_error_	= 0;
+
+		for (auto& count : histogram_)
+			count = 0;
+	}
+
+	static std::int64_t now()
+	{
+		return monotonic_now();
+	}
+
+	/**
+	 * Upper bound in ns of the wake-up errors counted in a histogram bucket,
+	 * the last bucket has none.
+	 */
+	static std::int64_t histogram_bound(int bucket)
+	{
+		static const std::int64_t bounds[histogram_size - 1] = { 10000, 50000, 100000, 250000, 500000, 1000000, 2000000, 5000000, 10000000 };
+
+		return bucket < histogram_size - 1 ? bounds[bucket] : -1;
+	}
+
+	/**
+	 * Waits until deadline and returns how late it woke up, or how late the
+	 * call already was, in ns.
+	 */
+	std::int64_t wait_until(std::int64_t deadline)
+	{
+		auto start = now();
+
+		++waits_;
+
+		if (start >= deadline)
+		{
+			++late_;
+			return start - deadline;
+		}
+
+		if (deadline - start > settings_.spin)
+			sleep_until(deadline - settings_.spin);
+
+		auto woke = now();
+
+		while (woke < deadline)
+			woke = now();
+
+		return record(woke - deadline);
+	}
+
+	/**
+	 * Waits until media_time (ns on the producer's timeline) is due, less the
+	 * lead, and returns how late it woke up in ns. Falling more than max_lag
+	 * behind media time moves the timeline along instead.
+	 */
+	std::int64_t wait_media(std::int64_t media_time)
+	{
+		auto result	= wait_until(deadline_of(media_time));
+		auto lag	= result - settings_.lead;
+
+		if (lag > settings_.max_lag)
+		{
+			anchor_wall_	+= lag;
+			drift_			+= lag;
+			++resyncs_;
+		}
+
+		return result;
+	}
+
+	/**
+	 * The deadline wait_media() would wait for, for outputs that schedule
+	 * their own waits. Anchors the timeline when needed.
+	 */
+	std::int64_t deadline_of(std::int64_t media_time)
+	{
+		if (!anchored_ || std::abs(media_time - last_media_) > settings_.max_gap)
+		{
+			if (anchored_)
+				++resyncs_;
+
+			anchored_		= true;
+			anchor_media_	= media_time;
+			anchor_wall_	= now();
+		}
+
+		last_media_ = media_time;
+
+		return anchor_wall_ + (media_time - anchor_media_) - settings_.lead;
+	}
+
+	/**
+	 * Starts a new timeline on the next wait_media(), e.g. after a seek.
+	 */
+	void reset()
+	{
+		anchored_ = false;
+	}
+
+	statistics stats() const
+	{
+		statistics result;
+		result.waits		= waits_;
+		result.late			= late_;
+		result.resyncs		= resyncs_;
+		result.drift		= drift_;
+		result.mean_error	= result.waits > result.late ? error_sum_ / static_cast<std::int64_t>(result.waits - result.late) : 0;
+		result.max_error	= max_error_;
+
+		for (int n = 0; n < histogram_size; ++n)
+			result.histogram[n] = histogram_[n];
+
+		return result;
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		auto stats = this->stats();
+
+		boost::property_tree::wptree info;
+		info.add(L"waits", stats.waits);
+		info.add(L"late", stats.late);
+		info.add(L"resyncs", stats.resyncs);
+		info.add(L"drift-ms", static_cast<double>(stats.drift) / 1000000.0);
+		info.add(L"mean-error-us", static_cast<double>(stats.mean_error) / 1000.0);
+		info.add(L"max-error-us", static_cast<double>(stats.max_error) / 1000.0);
+
+		boost::property_tree::wptree histogram;
+
+		for (int n = 0; n < histogram_size; ++n)
+		{
+			auto bound = histogram_bound(n);
+			histogram.add(bound < 0 ? L"over" : L"under-" + std::to_wstring(bound / 1000) + L"us", stats.histogram[n]);
+		}
+
+		info.add_child(L"error-histogram", histogram);
+
+		return info;
+	}
+private:
+	std::int64_t record(std::int64_t error)
+	{
+		int bucket = 0;
+
+		while (bucket < histogram_size - 1 && error >= histogram_bound(bucket))
+			++bucket;
+
+		++histogram_[bucket];
+		error_sum_ += error;
+
+		for (auto max = max_error_.load(); error > max; max = max_error_.load())
+		{
+			if (max_error_.compare_and_swap(error, max) == max)
+				break;
+		}
+
+		return error;
+	}
+
+	const settings									settings_;
+
+	bool											anchored_		= false;
+	std::int64_t									anchor_media_	= 0;
+	std::int64_t									anchor_wall_	= 0;
+	std::int64_t									last_media_		= 0;
+
+	tbb::atomic<std::uint64_t>						waits_;
+	tbb::atomic<std::uint64_t>						late_;
+	tbb::atomic<std::uint64_t>						resyncs_;
+	tbb::atomic<std::int64_t>						drift_;
+	tbb::atomic<std::int64_t>						error_sum_;
+	tbb::atomic<std::int64_t>						max_error_;
+	std::array<tbb::atomic<std::uint64_t>, histogram_size>	histogram_;
+};
+
+}
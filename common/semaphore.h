@@ -27,6 +27,8 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
 
+#include <tbb/atomic.h>
+
 #include <map>
 #include <queue>
 #include <functional>
@@ -35,11 +37,16 @@ namespace caspar {
 
 /**
  * Counting semaphore modelled after java.util.concurrent.Semaphore
+ *
+ * The permit count is kept in an atomic so that uncontended acquire/release
+ * never touches the mutex. The mutex and condition variable are only used
+ * when a thread has to block or when callback based acquires are pending.
  */
 class semaphore : boost::noncopyable
 {
 	mutable boost::mutex										mutex_;
-	unsigned int												permits_;
+	tbb::atomic<unsigned int>									permits_;
+	tbb::atomic<unsigned int>									waiters_; // Blocked threads + pending callbacks.
 	boost::condition_variable_any								permits_available_;
 	std::map<unsigned int, std::queue<std::function<void()>>>	callbacks_per_requested_permits_;
 public:
@@ -49,8 +56,9 @@ public:
 	 * @param permits The initial number of permits.
 	 */
 	explicit semaphore(unsigned int permits)
-		: permits_(permits)
 	{
+		permits_ = permits;
+		waiters_ = 0u;
 	}
 
 	/**
@@ -58,10 +66,15 @@ public:
 	 */
 	void release()
 	{
-		boost::unique_lock<boost::mutex> lock(mutex_);
-
 		++permits_;
 
+		// The increment above is a full fence, so a waiter that registered
+		// itself before failing to acquire is guaranteed to be seen here.
+		if (waiters_ == 0u)
+			return;
+
+		boost::unique_lock<boost::mutex> lock(mutex_);
+
 		perform_callback_based_acquire();
 		permits_available_.notify_one();
 	}
@@ -73,10 +86,13 @@ public:
 	 */
 	void release(unsigned int permits)
 	{
-		boost::unique_lock<boost::mutex> lock(mutex_);
-
 		permits_ += permits;
 
+		if (waiters_ == 0u)
+			return;
+
+		boost::unique_lock<boost::mutex> lock(mutex_);
+
 		perform_callback_based_acquire();
 		permits_available_.notify_all();
 	}
@@ -87,14 +103,18 @@ public:
 	 */
 	void acquire()
 	{
+		if (try_acquire())
+			return;
+
 		boost::unique_lock<boost::mutex> lock(mutex_);
+		++waiters_;
 
-		while (permits_ == 0u)
+		while (!try_acquire())
 		{
 			permits_available_.wait(lock);
 		}
 
-		--permits_;
+		--waiters_;
 	}
 
 	/**
@@ -105,22 +125,25 @@ public:
 	 */
 	void acquire(unsigned int permits)
 	{
+		auto num_acquired = drain(permits);
+
+		if (num_acquired == permits)
+			return;
+
 		boost::unique_lock<boost::mutex> lock(mutex_);
-		auto num_acquired = 0u;
+		++waiters_;
 
 		while (true)
 		{
-			auto num_wanted	= permits - num_acquired;
-			auto to_drain   = std::min(num_wanted, permits_);
-
-			permits_        -= to_drain;
-			num_acquired    += to_drain;
+			num_acquired += drain(permits - num_acquired);
 
 			if (num_acquired == permits)
 				break;
 
 			permits_available_.wait(lock);
 		}
+
+		--waiters_;
 	}
 
 	/**
@@ -133,10 +156,11 @@ public:
 	void acquire(unsigned int permits, std::function<void()> acquired_callback)
 	{
 		boost::unique_lock<boost::mutex> lock(mutex_);
+		++waiters_;
 
-		if (permits_ >= permits)
+		if (try_acquire_all(permits))
 		{
-			permits_ -= permits;
+			--waiters_;
 			lock.unlock();
 			acquired_callback();
 		}
@@ -157,28 +181,32 @@ public:
 	template <typename Rep, typename Period>
 	bool try_acquire(unsigned int permits, const boost::chrono::duration<Rep, Period>& timeout)
 	{
+		auto num_acquired = drain(permits);
+
+		if (num_acquired == permits)
+			return true;
+
 		boost::unique_lock<boost::mutex> lock(mutex_);
-		auto num_acquired = 0u;
+		++waiters_;
 
 		while (true)
 		{
-			auto num_wanted = permits - num_acquired;
-			auto to_drain   = std::min(num_wanted, permits_);
-
-			permits_        -= to_drain;
-			num_acquired    += to_drain;
+			num_acquired += drain(permits - num_acquired);
 
 			if (num_acquired == permits)
 				break;
 
 			if (permits_available_.wait_for(lock, timeout) == boost::cv_status::timeout)
 			{
+				--waiters_;
 				lock.unlock();
 				release(num_acquired);
 				return false;
 			}
 		}
 
+		--waiters_;
+
 		return true;
 	}
 
@@ -191,16 +219,20 @@ public:
 	 */
 	bool try_acquire()
 	{
-		boost::unique_lock<boost::mutex> lock(mutex_);
-
-		if (permits_ == 0u)
-			return false;
-		else
-		{
-			--permits_;
+		return try_acquire_all(1u);
+	}
 
-			return true;
-		}
+	/**
+	 * Acquire as many permits as currently available, up to a maximum. Does
+	 * not block.
+	 *
+	 * @param permits The maximum number of permits to acquire.
+	 *
+	 * @return the number of permits acquired (may be 0).
+	 */
+	unsigned int try_acquire_up_to(unsigned int permits)
+	{
+		return drain(permits);
 	}
 
 	/**
@@ -209,12 +241,53 @@ public:
 	 */
 	unsigned int permits() const
 	{
-		boost::unique_lock<boost::mutex> lock(mutex_);
-
 		return permits_;
 	}
 
 	private:
+		/**
+		 * Take all of the wanted permits or none of them.
+		 */
+		bool try_acquire_all(unsigned int wanted)
+		{
+			unsigned int current = permits_;
+
+			while (current >= wanted)
+			{
+				auto previous = permits_.compare_and_swap(current - wanted, current);
+
+				if (previous == current)
+					return true;
+
+				current = previous;
+			}
+
+			return false;
+		}
+
+		/**
+		 * Take as many of the wanted permits as currently available.
+		 *
+		 * @return the number of permits taken.
+		 */
+		unsigned int drain(unsigned int wanted)
+		{
+			unsigned int current = permits_;
+
+			while (current > 0u && wanted > 0u)
+			{
+				auto to_drain = std::min(wanted, current);
+				auto previous = permits_.compare_and_swap(current - to_drain, current);
+
+				if (previous == current)
+					return to_drain;
+
+				current = previous;
+			}
+
+			return 0u;
+		}
+
 		void perform_callback_based_acquire()
 		{
 			if (callbacks_per_requested_permits_.empty())
@@ -234,9 +307,17 @@ public:
 					continue;
 				}
 
-				auto& callback = callbacks.front();
+				// A lock free acquirer may have raced us for the permits.
+				if (!try_acquire_all(requested_permits))
+					break;
+
+				auto callback = std::move(callbacks.front());
+				callbacks.pop();
+				--waiters_;
+
+				if (callbacks.empty())
+					callbacks_per_requested_permits_.erase(requested_permits_and_callbacks);
 
-				permits_ -= requested_permits;
 				mutex_.unlock();
 
 				try
@@ -248,10 +329,6 @@ public:
 				}
 
 				mutex_.lock();
-				callbacks.pop();
-
-				if (callbacks.empty())
-					callbacks_per_requested_permits_.erase(requested_permits_and_callbacks);
 			}
 		}
 };
@@ -0,0 +1,382 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "executor.h"
+#include "semaphore.h"
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+namespace caspar {
+
+/**
+ * Work-stealing thread pool with one task deque per worker.
+ *
+ * Tasks are posted to a worker's own deque (the worker given by the affinity
+ * hint, the posting worker itself when posting from inside the pool, or round
+ * robin otherwise) and that worker is woken. A worker takes work from its own
+ * deque in fifo order and only when it is empty steals from the back of the
+ * other workers' deques. Each deque has one lane per task_priority, a higher
+ * priority lane is served before a lower priority one of the same deque.
+ *
+ * A worker with nothing to do sleeps on its own semaphore. Posting wakes the
+ * target worker, or a sleeping one when the target is busy.
+ */
+class thread_pool final : boost::noncopyable
+{
+public:
+	struct worker_stats
+	{
+		std::uint64_t	tasks_executed;
+		std::uint64_t	tasks_stolen;
+		std::uint64_t	busy_nanoseconds;
+		double			utilisation;	// Busy time / time since pool start.
+	};
+private:
+	static const int num_priorities = static_cast<int>(task_priority::higher_priority) + 1;
+
+	struct worker : boost::noncopyable
+	{
+		tbb::spin_mutex													mutex;
+		std::array<std::deque<std::function<void()>>, num_priorities>	lanes;
+		tbb::atomic<unsigned int>										size;		// Tasks in lanes, checked before stealing without the lock.
+		tbb::atomic<bool>												sleeping;
+		semaphore														wakeup		{ 0u };
+		boost::thread													thread;
+		tbb::atomic<std::uint64_t>										tasks_executed;
+		tbb::atomic<std::uint64_t>										tasks_stolen;
+		tbb::atomic<std::uint64_t>										busy_nanoseconds;
+
+		worker()
+		{
+			size				= 0;
+			sleeping			= false;
+			tasks_executed		= 0;
+			tasks_stolen		= 0;
+			busy_nanoseconds	= 0;
+		}
+	};
+
+	const std::wstring							name_;
+	std::vector<std::unique_ptr<worker>>		workers_;
+	tbb::atomic<unsigned int>					queued_;
+	tbb::atomic<bool>							is_running_;
+	tbb::atomic<unsigned int>					next_worker_;
+	boost::thread_specific_ptr<int>				current_worker_index_;
+	const boost::chrono::steady_clock::time_point	started_			= boost::chrono::steady_clock::now();
+public:
+	/**
+	 * Constructor.
+	 *
+	 * @param name        The name of the pool, used for thread names and logging.
+	 * @param num_workers The number of worker threads, defaults to one per core.
+	 */
+	explicit thread_pool(const std::wstring& name, unsigned int num_workers = boost::thread::hardware_concurrency())
+		: name_(name)
+	{
+		queued_			= 0;
+		is_running_		= true;
+		next_worker_	= 0;
+
+		for (unsigned int i = 0; i < std::max(num_workers, 1u); ++i)
+			workers_.push_back(std::unique_ptr<worker>(new worker()));
+
+		for (int i = 0; i < static_cast<int>(workers_.size()); ++i)
+			workers_[i]->thread = boost::thread([=] { run(i); });
+	}
+
+	~thread_pool()
+	{
+		CASPAR_LOG(debug) << L"Shutting down " << print();
+
+		is_running_ = false;
+
+		// Workers exit once the queued tasks have been drained.
+		for (auto& w : workers_)
+			w->wakeup.release();
+
+		for (auto& w : workers_)
+			w->thread.join();
+	}
+
+	/**
+	 * Queue a function for execution without creating a future. Exceptions
+	 * thrown by the function are logged.
+	 *
+	 * @param func     The function to execute.
+	 * @param priority The priority lane to queue the function in.
+	 * @param affinity Index of the preferred worker or -1 for no preference.
+	 *                 Only a hint, an idle worker may still steal the task.
+	 */
+	void post(std::function<void()> func, task_priority priority = task_priority::normal_priority, int affinity = -1)
+	{
+		if (!is_running_)
+			CASPAR_THROW_EXCEPTION(invalid_operation() << msg_info("thread_pool not running.") << source_info(name_));
+
+		auto& target = *workers_.at(select_worker(affinity));
+
+		{
+			tbb::spin_mutex::scoped_lock lock(target.mutex);
+			target.lanes.at(static_cast<int>(priority)).push_back(std::move(func));
+			++target.size;
+		}
+
+		++queued_;
+
+		if (wake(target))
+			return;
+
+		for (auto& w : workers_)
+		{
+			if (wake(*w))
+				return;
+		}
+	}
+
+	template<typename Func>
+	auto begin_invoke(Func&& func, task_priority priority = task_priority::normal_priority, int affinity = -1) -> std::future<decltype(func())>
+	{
+		typedef decltype(func())					result_type;
+		typedef std::packaged_task<result_type()>	task_type;
+
+		auto task	= std::make_shared<task_type>(std::forward<Func>(func));
+		auto future	= task->get_future();
+
+		post([task]
+		{
+			(*task)();
+		}, priority, affinity);
+
+		return future;
+	}
+
+	template<typename Func>
+	auto invoke(Func&& func, task_priority priority = task_priority::normal_priority, int affinity = -1) -> decltype(func())
+	{
+		if (is_current()) // Avoids potential deadlock when all workers wait on each other.
+			return func();
+
+		return begin_invoke(std::forward<Func>(func), priority, affinity).get();
+	}
+
+	/**
+	 * @return whether the calling thread is one of the pool's workers.
+	 */
+	bool is_current() const
+	{
+		return current_worker() != -1;
+	}
+
+	int size() const
+	{
+		return static_cast<int>(workers_.size());
+	}
+
+	/**
+	 * @return the number of queued tasks not yet picked up by a worker (may
+	 *         have changed at the time of returning).
+	 */
+	unsigned int queued() const
+	{
+		return queued_;
+	}
+
+	std::vector<worker_stats> stats() const
+	{
+		auto elapsed = boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::steady_clock::now() - started_).count();
+		std::vector<worker_stats> result;
+
+		for (auto& w : workers_)
+		{
+			worker_stats s;
+			s.tasks_executed	= w->tasks_executed;
+			s.tasks_stolen		= w->tasks_stolen;
+			s.busy_nanoseconds	= w->busy_nanoseconds;
+			s.utilisation		= elapsed > 0 ? static_cast<double>(s.busy_nanoseconds) / static_cast<double>(elapsed) : 0.0;
+			result.push_back(s);
+		}
+
+		return result;
+	}
+
+	std::wstring name() const
+	{
+		return name_;
+	}
+private:
+	std::wstring print() const
+	{
+		return L"thread_pool[" + name_ + L"]";
+	}
+
+	int current_worker() const
+	{
+		auto index = current_worker_index_.get();
+
+		return index ? *index : -1;
+	}
+
+	int select_worker(int affinity)
+	{
+		auto count = static_cast<int>(workers_.size());
+
+		if (affinity >= 0)
+			return affinity % count;
+
+		auto current = current_worker();
+
+		if (current != -1)
+			return current;
+
+		return static_cast<int>(next_worker_++ % static_cast<unsigned int>(count));
+	}
+
+	// Wakes w if it sleeps, true when it did.
+	static bool wake(worker& w)
+	{
+		if (!w.sleeping.fetch_and_store(false))
+			return false;
+
+		w.wakeup.release();
+
+		return true;
+	}
+
+	static bool try_pop(worker& w, bool front, std::function<void()>& task)
+	{
+		if (w.size == 0u)
+			return false;
+
+		tbb::spin_mutex::scoped_lock lock(w.mutex);
+
+		for (int priority = num_priorities - 1; priority >= 0; --priority)
+		{
+			auto& lane = w.lanes[priority];
+
+			if (lane.empty())
+				continue;
+
+			if (front)
+			{
+				task = std::move(lane.front());
+				lane.pop_front();
+			}
+			else
+			{
+				task = std::move(lane.back());
+				lane.pop_back();
+			}
+
+			--w.size;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	bool try_take(int self, std::function<void()>& task, bool& stolen)
+	{
+		auto count = static_cast<int>(workers_.size());
+
+		stolen = false;
+
+		if (try_pop(*workers_[self], true, task))
+			return true;
+
+		for (int n = 1; n < count; ++n)
+		{
+			if (try_pop(*workers_[(self + n) % count], false, task))
+			{
+				stolen = true;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void run(int index) // noexcept
+	{
+		ensure_gpf_handler_installed_for_thread(u8(name_ + L"-" + boost::lexical_cast<std::wstring>(index)).c_str());
+		current_worker_index_.reset(new int(index));
+
+		auto& self = *workers_[index];
+
+		while (true)
+		{
+			std::function<void()> task;
+			bool stolen = false;
+
+			if (!try_take(index, task, stolen))
+			{
+				if (!is_running_ && queued_ == 0u)
+					break;
+
+				// Announced before the last look, so a post either finds the flag
+				// set and wakes this worker or is seen by the look.
+				self.sleeping.fetch_and_store(true);
+
+				if (queued_ == 0u && is_running_)
+					self.wakeup.acquire();
+
+				self.sleeping = false;
+
+				continue;
+			}
+
+			--queued_;
+
+			auto start = boost::chrono::steady_clock::now();
+
+			try
+			{
+				task();
+			}
+			catch (...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+
+			self.busy_nanoseconds += boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::steady_clock::now() - start).count();
+			++self.tasks_executed;
+
+			if (stolen)
+				++self.tasks_stolen;
+		}
+	}
+};
+
+}
@@ -0,0 +1,108 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <tbb/spin_mutex.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace caspar {
+
+/**
+ * Token bucket rate limiter that schedules instead of dropping. reserve()
+ * takes the tokens for a send and returns the time, in ns on the clock the
+ * caller uses (e.g. pacing_clock::now()), at which the send conforms to the
+ * rate and burst; the caller then waits until it.
+ *
+ * Implemented as a virtual scheduling (GCRA) bucket, the next time the
+ * bucket is empty is all the state it keeps, so sends may be reserved ahead
+ * of time and buckets can be chained: reserving the returned time on a
+ * parent bucket shapes an aggregate, e.g. every output on an interface.
+ *
+ * Thread safe, a bucket may be shared by several outputs.
+ */
+class token_bucket : boost::noncopyable
+{
+public:
+	/**
+	 * @param rate  Bits per second, 0 for unlimited.
+	 * @param burst Bytes that may be sent at once after being idle.
+	 */
+	token_bucket(std::int64_t rate, std::int64_t burst)
+	{
+		set_rate(rate, burst);
+	}
+
+	void set_rate(std::int64_t rate, std::int64_t burst)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		rate_	= std::max<std::int64_t>(rate, 0);
+		burst_	= std::max<std::int64_t>(burst, 0);
+	}
+
+	/**
+	 * Takes bytes from the bucket and returns when they may be sent, never
+	 * before earliest.
+	 */
+	std::int64_t reserve(std::size_t bytes, std::int64_t earliest)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		if (rate_ == 0)
+			return earliest;
+
+		auto size	= duration(static_cast<std::int64_t>(bytes));
+		auto result	= std::max(earliest, empty_at_ + size - duration(burst_));
+
+		empty_at_ = std::max(empty_at_, result) + size;
+
+		return result;
+	}
+
+	std::int64_t rate() const
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		return rate_;
+	}
+
+	std::int64_t burst() const
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		return burst_;
+	}
+private:
+	std::int64_t duration(std::int64_t bytes) const
+	{
+		// Split so the multiplication does not overflow for large bursts.
+		return bytes * 8 / rate_ * 1000000000 + bytes * 8 % rate_ * 1000000000 / rate_;
+	}
+
+	mutable tbb::spin_mutex	mutex_;
+	std::int64_t			rate_		= 0;
+	std::int64_t			burst_		= 0;
+	std::int64_t			empty_at_	= 0;
+};
+
+}
@@ -0,0 +1,142 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks the segments of a record:// output against its index, for testing
+// segment cuts. Record a clip across a few segment boundaries, e.g. with
+// record://<directory>?segment=2, then run
+//
+//   recorder_check <directory> [name]
+//
+// Every segment listed in <name>.index (default segment.index) must exist
+// with exactly the length the index gives. TS segments must also be whole
+// TS packets with the sync byte in place up to the last one, which catches
+// a tail that was never written or was filled with zeros. Exits with 1 if
+// any segment fails.
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+const std::size_t TS_PACKET_SIZE = 188;
+
+struct index_entry
+{
+	std::string		name;
+	std::uint64_t	length;
+};
+
+std::vector<index_entry> read_index(const std::string& path)
+{
+	std::ifstream file(path);
+
+	if (!file)
+		throw std::runtime_error("Cannot open " + path);
+
+	std::vector<index_entry> entries;
+	std::string line;
+
+	while (std::getline(file, line))
+	{
+		std::vector<std::string> fields;
+		boost::split(fields, line, boost::is_any_of("\t"));
+
+		if (line.empty() || line[0] == '#' || fields.size() != 4)
+			continue;
+
+		entries.push_back(index_entry{ fields[0], boost::lexical_cast<std::uint64_t>(fields[3]) });
+	}
+
+	return entries;
+}
+
+// Returns an empty string when the segment is fine, otherwise what is wrong.
+std::string check(const std::string& path, const index_entry& entry)
+{
+	std::ifstream file(path, std::ios::binary);
+
+	if (!file)
+		return "missing";
+
+	std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	if (data.size() != entry.length)
+		return "size " + std::to_string(data.size()) + ", index says " + std::to_string(entry.length);
+
+	if (data.empty())
+		return "empty";
+
+	if (!boost::iends_with(entry.name, ".ts"))
+		return std::string();
+
+	if (data.size() % TS_PACKET_SIZE != 0)
+		return "not whole TS packets";
+
+	for (std::size_t offset = 0; offset < data.size(); offset += TS_PACKET_SIZE)
+	{
+		if (data[offset] != 0x47)
+			return "no sync byte at " + std::to_string(offset) + " of " + std::to_string(data.size());
+	}
+
+	return std::string();
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: recorder_check <directory> [name]" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		std::string directory	= argv[1];
+		std::string name		= argc > 2 ? argv[2] : "segment";
+		auto entries			= read_index(directory + "/" + name + ".index");
+		auto failed				= 0;
+
+		for (auto& entry : entries)
+		{
+			auto problem = check(directory + "/" + entry.name, entry);
+
+			std::cout << entry.name << ": " << (problem.empty() ? "ok" : problem) << std::endl;
+
+			if (!problem.empty())
+				++failed;
+		}
+
+		std::cout << entries.size() << " segments, " << failed << " failed." << std::endl;
+
+		return failed > 0 || entries.empty() ? 1 : 0;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+}
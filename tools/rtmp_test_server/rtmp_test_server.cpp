@@ -0,0 +1,750 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Minimal RTMP ingest for testing the rtmp:// output without a media server.
+// It accepts publishers, answers connect / createStream / publish and counts
+// what arrives. To exercise the send queue and the overflow policies it can
+// read slowly, so that the socket backs up the way it does towards a
+// congested server:
+//
+//   rtmp_test_server [--port 1935] [--read-kbps <kbit/s>]
+//                    [--stall <ms> <every seconds>] [--rcvbuf <bytes>]
+//
+// --read-kbps caps how fast the socket is read, --stall stops reading for
+// a while every few seconds and --rcvbuf shrinks the receive buffer so that
+// the client sees the back-pressure sooner. For example, with the output
+// publishing to rtmp://127.0.0.1/live/test:
+//
+//   rtmp_test_server --read-kbps 2000 --stall 3000 10
+
+#include <boost/asio.hpp>
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef boost::chrono::steady_clock clock_type;
+
+const std::size_t	HANDSHAKE_SIZE		= 1536;
+const std::uint32_t	OUT_CHUNK_SIZE		= 4096;
+const std::uint32_t	WINDOW_SIZE			= 2500000;
+const std::size_t	READ_SIZE			= 64 * 1024;
+// With --read-kbps the socket is read in slices of at most this long.
+const int			READ_SLICE_MS		= 20;
+
+enum
+{
+	CS_CONTROL				= 2,
+	CS_COMMAND				= 3,
+
+	MSG_SET_CHUNK_SIZE		= 1,
+	MSG_ABORT				= 2,
+	MSG_ACK					= 3,
+	MSG_USER_CONTROL		= 4,
+	MSG_WINDOW_ACK_SIZE		= 5,
+	MSG_SET_PEER_BANDWIDTH	= 6,
+	MSG_AUDIO				= 8,
+	MSG_VIDEO				= 9,
+	MSG_DATA_AMF0			= 18,
+	MSG_COMMAND_AMF0		= 20
+};
+
+struct options
+{
+	unsigned short	port			= 1935;
+	int				read_kbps		= 0;
+	int				stall_ms		= 0;
+	int				stall_every_s	= 0;
+	int				rcvbuf			= 0;
+};
+
+std::uint32_t get_be(const std::uint8_t* data, int size)
+{
+	std::uint32_t value = 0;
+
+	for (int i = 0; i < size; ++i)
+		value = (value << 8) | data[i];
+
+	return value;
+}
+
+void put_be(std::vector<std::uint8_t>& out, std::uint32_t value, int size)
+{
+	for (int i = size - 1; i >= 0; --i)
+		out.push_back(static_cast<std::uint8_t>(value >> (i * 8)));
+}
+
+namespace amf0 {
+
+void number(std::vector<std::uint8_t>& out, double value)
+{
+	std::uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+
+	out.push_back(0x00);
+
+	for (int i = 7; i >= 0; --i)
+		out.push_back(static_cast<std::uint8_t>(bits >> (i * 8)));
+}
+
+void key(std::vector<std::uint8_t>& out, const std::string& value)
+{
+	put_be(out, static_cast<std::uint32_t>(value.size()), 2);
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+void string(std::vector<std::uint8_t>& out, const std::string& value)
+{
+	out.push_back(0x02);
+	key(out, value);
+}
+
+void null(std::vector<std::uint8_t>& out)
+{
+	out.push_back(0x05);
+}
+
+void object_begin(std::vector<std::uint8_t>& out)
+{
+	out.push_back(0x03);
+}
+
+void object_end(std::vector<std::uint8_t>& out)
+{
+	out.push_back(0x00);
+	out.push_back(0x00);
+	out.push_back(0x09);
+}
+
+// Only the command name and the transaction id are needed, which are always
+// the first two values.
+bool read_command(const std::vector<std::uint8_t>& payload, std::string& name, double& transaction)
+{
+	if (payload.size() < 3 || payload[0] != 0x02)
+		return false;
+
+	auto length = get_be(&payload[1], 2);
+
+	if (payload.size() < 3 + length + 9 || payload[3 + length] != 0x00)
+		return false;
+
+	name.assign(payload.begin() + 3, payload.begin() + 3 + length);
+
+	std::uint64_t bits = 0;
+
+	for (int i = 0; i < 8; ++i)
+		bits = (bits << 8) | payload[4 + length + i];
+
+	std::memcpy(&transaction, &bits, sizeof(transaction));
+
+	return true;
+}
+
+}
+
+struct statistics
+{
+	std::uint64_t	bytes			= 0;
+	std::uint64_t	audio			= 0;
+	std::uint64_t	video			= 0;
+	std::uint64_t	key_frames		= 0;
+	std::uint64_t	data			= 0;
+	double			read_wait_ms	= 0.0;
+};
+
+void print(std::ostream& out, const std::string& label, const statistics& stats, double seconds)
+{
+	out << std::fixed << std::setprecision(1)
+		<< label
+		<< " kbit/s=" << (seconds > 0.0 ? stats.bytes * 8.0 / seconds / 1000.0 : 0.0)
+		<< " video=" << stats.video
+		<< " key-frames=" << stats.key_frames
+		<< " audio=" << stats.audio
+		<< " data=" << stats.data
+		<< " read-wait-ms=" << stats.read_wait_ms
+		<< std::endl;
+}
+
+class session : public std::enable_shared_from_this<session>
+{
+	struct chunk_stream
+	{
+		std::uint32_t				timestamp	= 0;
+		std::uint32_t				delta		= 0;
+		std::uint32_t				length		= 0;
+		std::uint8_t				type		= 0;
+		std::uint32_t				stream_id	= 0;
+		bool						extended	= false;
+		std::vector<std::uint8_t>	payload;
+	};
+
+	boost::asio::ip::tcp::socket			socket_;
+	boost::asio::deadline_timer				read_timer_;
+	boost::asio::deadline_timer				report_timer_;
+	const options							options_;
+	const std::string						name_;
+	std::vector<std::uint8_t>				handshake_	= std::vector<std::uint8_t>(1 + HANDSHAKE_SIZE);
+	std::vector<std::uint8_t>				buffer_		= std::vector<std::uint8_t>(READ_SIZE);
+	std::vector<std::uint8_t>				in_;
+	std::map<std::uint32_t, chunk_stream>	streams_;
+	std::uint32_t							in_chunk_size_	= 128;
+	std::uint32_t							ack_window_		= WINDOW_SIZE;
+	std::uint64_t							received_		= 0;
+	std::uint64_t							last_ack_		= 0;
+	std::deque<std::vector<std::uint8_t>>	out_;
+	bool									closed_			= false;
+	statistics								total_;
+	statistics								second_;
+	clock_type::time_point					started_		= clock_type::now();
+	clock_type::time_point					second_started_	= started_;
+	clock_type::time_point					next_read_		= started_;
+	clock_type::time_point					next_stall_		= started_ + boost::chrono::seconds(options_.stall_every_s);
+	int										elapsed_		= 0;
+public:
+	session(boost::asio::ip::tcp::socket socket, const options& options)
+		: socket_(std::move(socket))
+		, read_timer_(socket_.get_io_service())
+		, report_timer_(socket_.get_io_service())
+		, options_(options)
+		, name_(boost::lexical_cast<std::string>(socket_.remote_endpoint()))
+	{
+	}
+
+	void start()
+	{
+		std::cout << name_ << " connected" << std::endl;
+
+		auto self = shared_from_this();
+
+		boost::asio::async_read(socket_, boost::asio::buffer(handshake_), [this, self](const boost::system::error_code& error, std::size_t)
+		{
+			if (error)
+				return close(error);
+
+			if (handshake_[0] != 0x03)
+				return close(boost::asio::error::operation_not_supported);
+
+			// S0 + S1 (zero time, zero filled) + S2 (echo of C1).
+			std::vector<std::uint8_t> response(1 + 2 * HANDSHAKE_SIZE, 0);
+			response[0] = 0x03;
+			std::copy(handshake_.begin() + 1, handshake_.end(), response.begin() + 1 + HANDSHAKE_SIZE);
+			write(std::move(response));
+
+			boost::asio::async_read(socket_, boost::asio::buffer(handshake_.data(), HANDSHAKE_SIZE), [this, self](const boost::system::error_code& error, std::size_t)
+			{
+				if (error)
+					return close(error);
+
+				report();
+				read();
+			});
+		});
+	}
+private:
+	// Reading
+
+	void read()
+	{
+		auto self = shared_from_this();
+		auto size = buffer_.size();
+
+		if (options_.read_kbps > 0)
+			size = std::max<std::size_t>(1, std::min<std::size_t>(size, options_.read_kbps * 1000 / 8 * READ_SLICE_MS / 1000));
+
+		socket_.async_read_some(boost::asio::buffer(buffer_.data(), size), [this, self](const boost::system::error_code& error, std::size_t size)
+		{
+			if (error)
+				return close(error);
+
+			total_.bytes	+= size;
+			second_.bytes	+= size;
+			received_		+= size;
+
+			in_.insert(in_.end(), buffer_.begin(), buffer_.begin() + size);
+
+			if (!parse())
+				return close(boost::asio::error::invalid_argument);
+
+			acknowledge();
+			schedule_read(size);
+		});
+	}
+
+	// Decides when the socket is read next, which is what makes this a slow
+	// reader. The kernel buffers fill up meanwhile and the client's writes
+	// start to lag.
+	void schedule_read(std::size_t size)
+	{
+		auto now = clock_type::now();
+
+		if (options_.read_kbps > 0)
+		{
+			auto cost = boost::chrono::microseconds(static_cast<std::int64_t>(size * 8000.0 / options_.read_kbps));
+			next_read_ = std::max(next_read_, now) + cost;
+		}
+
+		if (options_.stall_ms > 0 && options_.stall_every_s > 0 && now >= next_stall_)
+		{
+			next_read_	= std::max(next_read_, now) + boost::chrono::milliseconds(options_.stall_ms);
+			next_stall_	= now + boost::chrono::seconds(options_.stall_every_s);
+
+			std::cout << name_ << " stalling for " << options_.stall_ms << " ms" << std::endl;
+		}
+
+		if (next_read_ <= now)
+			return read();
+
+		auto wait = boost::chrono::duration_cast<boost::chrono::microseconds>(next_read_ - now).count();
+
+		total_.read_wait_ms		+= wait / 1000.0;
+		second_.read_wait_ms	+= wait / 1000.0;
+
+		auto self = shared_from_this();
+
+		read_timer_.expires_from_now(boost::posix_time::microseconds(wait));
+		read_timer_.async_wait([this, self](const boost::system::error_code& error)
+		{
+			if (!error && !closed_)
+				read();
+		});
+	}
+
+	// Returns false on a malformed stream.
+	bool parse()
+	{
+		std::size_t offset = 0;
+
+		while (true)
+		{
+			auto available = in_.size() - offset;
+			auto p = in_.data() + offset;
+
+			if (available < 1)
+				break;
+
+			std::size_t header = 1;
+			auto fmt = p[0] >> 6;
+			std::uint32_t csid = p[0] & 0x3F;
+
+			if (csid == 0)
+				header = 2;
+			else if (csid == 1)
+				header = 3;
+
+			if (available < header)
+				break;
+
+			if (csid == 0)
+				csid = 64 + p[1];
+			else if (csid == 1)
+				csid = 64 + p[1] + p[2] * 256;
+
+			static const std::size_t MESSAGE_HEADER_SIZE[] = { 11, 7, 3, 0 };
+			auto message_header = MESSAGE_HEADER_SIZE[fmt];
+
+			if (available < header + message_header)
+				break;
+
+			auto& stream	= streams_[csid];
+			auto m			= p + header;
+			auto starts		= stream.payload.empty();
+			auto field		= fmt < 3 ? get_be(m, 3) : 0;
+			auto extended	= fmt < 3 ? field == 0xFFFFFF : stream.extended;
+			auto total		= header + message_header + (extended ? 4 : 0);
+
+			if (available < total)
+				break;
+
+			if (fmt == 3 && !starts)
+			{
+				// Continuation, its timestamp (if any) repeats the first chunk's.
+			}
+			else
+			{
+				auto value = extended ? get_be(m + message_header, 4) : field;
+
+				if (fmt <= 1)
+				{
+					stream.length	= get_be(m + 3, 3);
+					stream.type		= m[6];
+				}
+
+				if (fmt == 0)
+				{
+					stream.stream_id	= m[7] | (m[8] << 8) | (m[9] << 16) | (static_cast<std::uint32_t>(m[10]) << 24);
+					stream.timestamp	= value;
+					stream.delta		= 0;
+				}
+				else if (fmt < 3)
+				{
+					stream.delta		= value;
+					stream.timestamp	+= value;
+				}
+				else
+					stream.timestamp	+= stream.delta;
+
+				stream.extended = extended;
+			}
+
+			auto wanted = std::min<std::size_t>(in_chunk_size_, stream.length - stream.payload.size());
+
+			if (available < total + wanted)
+				break;
+
+			stream.payload.insert(stream.payload.end(), p + total, p + total + wanted);
+			offset += total + wanted;
+
+			if (stream.payload.size() >= stream.length)
+			{
+				std::vector<std::uint8_t> payload;
+				payload.swap(stream.payload);
+
+				if (!on_message(stream.type, payload))
+					return false;
+			}
+		}
+
+		in_.erase(in_.begin(), in_.begin() + offset);
+
+		return true;
+	}
+
+	bool on_message(std::uint8_t type, const std::vector<std::uint8_t>& payload)
+	{
+		switch (type)
+		{
+		case MSG_SET_CHUNK_SIZE:
+			if (payload.size() < 4)
+				return false;
+			in_chunk_size_ = std::max<std::uint32_t>(1, get_be(payload.data(), 4) & 0x7FFFFFFF);
+			break;
+		case MSG_ABORT:
+			if (payload.size() >= 4)
+				streams_[get_be(payload.data(), 4)].payload.clear();
+			break;
+		case MSG_WINDOW_ACK_SIZE:
+			if (payload.size() >= 4)
+				ack_window_ = get_be(payload.data(), 4);
+			break;
+		case MSG_AUDIO:
+			++total_.audio;
+			++second_.audio;
+			break;
+		case MSG_VIDEO:
+			++total_.video;
+			++second_.video;
+
+			// FLV video tag, frame type 1 in the upper nibble is a key frame.
+			if (!payload.empty() && (payload[0] >> 4) == 1)
+			{
+				++total_.key_frames;
+				++second_.key_frames;
+			}
+			break;
+		case MSG_DATA_AMF0:
+			++total_.data;
+			++second_.data;
+			break;
+		case MSG_COMMAND_AMF0:
+			on_command(payload);
+			break;
+		default:
+			break;
+		}
+
+		return true;
+	}
+
+	void on_command(const std::vector<std::uint8_t>& payload)
+	{
+		std::string name;
+		double transaction = 0;
+
+		if (!amf0::read_command(payload, name, transaction))
+			return;
+
+		std::cout << name_ << " " << name << std::endl;
+
+		if (name == "connect")
+		{
+			std::vector<std::uint8_t> window;
+			put_be(window, WINDOW_SIZE, 4);
+			send(CS_CONTROL, MSG_WINDOW_ACK_SIZE, 0, std::move(window));
+
+			std::vector<std::uint8_t> bandwidth;
+			put_be(bandwidth, WINDOW_SIZE, 4);
+			bandwidth.push_back(2); // Dynamic.
+			send(CS_CONTROL, MSG_SET_PEER_BANDWIDTH, 0, std::move(bandwidth));
+
+			std::vector<std::uint8_t> chunk_size;
+			put_be(chunk_size, OUT_CHUNK_SIZE, 4);
+			send(CS_CONTROL, MSG_SET_CHUNK_SIZE, 0, std::move(chunk_size));
+
+			std::vector<std::uint8_t> result;
+			amf0::string(result, "_result");
+			amf0::number(result, transaction);
+			amf0::object_begin(result);
+			amf0::key(result, "fmsVer");
+			amf0::string(result, "FMS/3,0,1,123");
+			amf0::key(result, "capabilities");
+			amf0::number(result, 31);
+			amf0::object_end(result);
+			amf0::object_begin(result);
+			amf0::key(result, "level");
+			amf0::string(result, "status");
+			amf0::key(result, "code");
+			amf0::string(result, "NetConnection.Connect.Success");
+			amf0::key(result, "description");
+			amf0::string(result, "Connection succeeded.");
+			amf0::object_end(result);
+			send(CS_COMMAND, MSG_COMMAND_AMF0, 0, std::move(result));
+		}
+		else if (name == "createStream")
+		{
+			std::vector<std::uint8_t> result;
+			amf0::string(result, "_result");
+			amf0::number(result, transaction);
+			amf0::null(result);
+			amf0::number(result, 1);
+			send(CS_COMMAND, MSG_COMMAND_AMF0, 0, std::move(result));
+		}
+		else if (name == "publish")
+		{
+			std::vector<std::uint8_t> status;
+			amf0::string(status, "onStatus");
+			amf0::number(status, 0);
+			amf0::null(status);
+			amf0::object_begin(status);
+			amf0::key(status, "level");
+			amf0::string(status, "status");
+			amf0::key(status, "code");
+			amf0::string(status, "NetStream.Publish.Start");
+			amf0::key(status, "description");
+			amf0::string(status, "Publishing.");
+			amf0::object_end(status);
+			send(CS_COMMAND, MSG_COMMAND_AMF0, 1, std::move(status));
+		}
+	}
+
+	void acknowledge()
+	{
+		if (ack_window_ == 0 || received_ - last_ack_ < ack_window_)
+			return;
+
+		std::vector<std::uint8_t> ack;
+		put_be(ack, static_cast<std::uint32_t>(received_), 4);
+		send(CS_CONTROL, MSG_ACK, 0, std::move(ack));
+
+		last_ack_ = received_;
+	}
+
+	// Writing
+
+	void send(std::uint32_t csid, std::uint8_t type, std::uint32_t stream_id, std::vector<std::uint8_t>&& payload)
+	{
+		std::vector<std::uint8_t> message;
+
+		message.push_back(static_cast<std::uint8_t>(csid));	// fmt 0, timestamp 0
+		put_be(message, 0, 3);
+		put_be(message, static_cast<std::uint32_t>(payload.size()), 3);
+		message.push_back(type);
+
+		for (int i = 0; i < 4; ++i)	// Little endian.
+			message.push_back(static_cast<std::uint8_t>(stream_id >> (i * 8)));
+
+		for (std::size_t offset = 0; offset < payload.size(); offset += OUT_CHUNK_SIZE)
+		{
+			if (offset > 0)
+				message.push_back(static_cast<std::uint8_t>(0xC0 | csid));	// fmt 3
+
+			auto end = std::min<std::size_t>(payload.size(), offset + OUT_CHUNK_SIZE);
+			message.insert(message.end(), payload.begin() + offset, payload.begin() + end);
+		}
+
+		write(std::move(message));
+	}
+
+	void write(std::vector<std::uint8_t>&& data)
+	{
+		out_.push_back(std::move(data));
+
+		if (out_.size() == 1)
+			start_write();
+	}
+
+	void start_write()
+	{
+		auto self = shared_from_this();
+
+		boost::asio::async_write(socket_, boost::asio::buffer(out_.front()), [this, self](const boost::system::error_code& error, std::size_t)
+		{
+			if (error)
+				return close(error);
+
+			out_.pop_front();
+
+			if (!out_.empty())
+				start_write();
+		});
+	}
+
+	// Reporting
+
+	void report()
+	{
+		auto self = shared_from_this();
+
+		report_timer_.expires_from_now(boost::posix_time::seconds(1));
+		report_timer_.async_wait([this, self](const boost::system::error_code& error)
+		{
+			if (error || closed_)
+				return;
+
+			auto now = clock_type::now();
+
+			print(std::cout, name_ + " " + std::to_string(++elapsed_) + "s", second_, boost::chrono::duration<double>(now - second_started_).count());
+
+			second_			= statistics();
+			second_started_	= now;
+
+			report();
+		});
+	}
+
+	void close(const boost::system::error_code& error)
+	{
+		if (closed_)
+			return;
+
+		closed_ = true;
+
+		boost::system::error_code ignored;
+
+		socket_.close(ignored);
+		read_timer_.cancel(ignored);
+		report_timer_.cancel(ignored);
+
+		std::cout << name_ << " closed: " << error.message() << std::endl;
+		print(std::cout, name_ + " total", total_, boost::chrono::duration<double>(clock_type::now() - started_).count());
+	}
+};
+
+class server
+{
+	boost::asio::ip::tcp::acceptor	acceptor_;
+	boost::asio::ip::tcp::socket	socket_;
+	boost::asio::signal_set			signals_;
+	const options					options_;
+public:
+	server(boost::asio::io_service& service, const options& options)
+		: acceptor_(service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), options.port))
+		, socket_(service)
+		, signals_(service, SIGINT, SIGTERM)
+		, options_(options)
+	{
+		signals_.async_wait([&service](const boost::system::error_code& error, int)
+		{
+			if (!error)
+				service.stop();
+		});
+
+		std::cout << "Listening on " << acceptor_.local_endpoint() << std::endl;
+
+		accept();
+	}
+private:
+	void accept()
+	{
+		acceptor_.async_accept(socket_, [this](const boost::system::error_code& error)
+		{
+			if (error == boost::asio::error::operation_aborted)
+				return;
+
+			if (!error)
+			{
+				boost::system::error_code ignored;
+
+				socket_.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+
+				if (options_.rcvbuf > 0)
+					socket_.set_option(boost::asio::socket_base::receive_buffer_size(options_.rcvbuf), ignored);
+
+				std::make_shared<session>(std::move(socket_), options_)->start();
+			}
+
+			accept();
+		});
+	}
+};
+
+}
+
+int main(int argc, char* argv[])
+{
+	options options;
+
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			auto has = [&](int count) { return i + count < argc; };
+
+			if (arg == "--port" && has(1))
+				options.port = boost::lexical_cast<unsigned short>(argv[++i]);
+			else if (arg == "--read-kbps" && has(1))
+				options.read_kbps = boost::lexical_cast<int>(argv[++i]);
+			else if (arg == "--stall" && has(2))
+			{
+				options.stall_ms		= boost::lexical_cast<int>(argv[++i]);
+				options.stall_every_s	= boost::lexical_cast<int>(argv[++i]);
+			}
+			else if (arg == "--rcvbuf" && has(1))
+				options.rcvbuf = boost::lexical_cast<int>(argv[++i]);
+			else
+			{
+				std::cerr << "usage: rtmp_test_server [--port 1935] [--read-kbps <kbit/s>] [--stall <ms> <every seconds>] [--rcvbuf <bytes>]" << std::endl;
+				return 1;
+			}
+		}
+
+		boost::asio::io_service service;
+		server server(service, options);
+
+		service.run();
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
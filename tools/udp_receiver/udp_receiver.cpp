@@ -0,0 +1,349 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Receiver for testing the udp:// output on loopback or a LAN. It measures
+// the inter-arrival time of the datagrams, which is what PCR pacing is meant
+// to keep smooth, and checks the MPEG-TS in them for sync and continuity
+// errors.
+//
+//   udp_receiver <port> [seconds] [multicast group]
+//
+// Prints a line per second and a summary at the end, after seconds or on
+// Ctrl-C. For example, with the output sending to udp://127.0.0.1:5000:
+//
+//   udp_receiver 5000 30
+
+#include <boost/asio.hpp>
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef boost::chrono::steady_clock clock_type;
+
+const std::size_t	TS_PACKET_SIZE		= 188;
+const std::size_t	MAX_DATAGRAM		= 65536;
+const int			RECEIVE_BUFFER		= 8 * 1024 * 1024;
+// Inter-arrival times are kept in a histogram of 10 us buckets up to 1 s.
+const int			BUCKET_US			= 10;
+const std::size_t	NUM_BUCKETS			= 100000;
+
+class interval_statistics
+{
+	std::uint64_t				count_		= 0;
+	double						sum_		= 0.0;
+	double						sum_sq_		= 0.0;
+	double						max_		= 0.0;
+	std::vector<std::uint64_t>	histogram_	= std::vector<std::uint64_t>(NUM_BUCKETS + 1, 0);
+public:
+	void add(double us)
+	{
+		++count_;
+		sum_	+= us;
+		sum_sq_	+= us * us;
+		max_	= std::max(max_, us);
+		++histogram_[std::min(static_cast<std::size_t>(us / BUCKET_US), NUM_BUCKETS)];
+	}
+
+	std::uint64_t count() const { return count_; }
+	double mean() const { return count_ > 0 ? sum_ / count_ : 0.0; }
+	double max() const { return max_; }
+
+	double stddev() const
+	{
+		if (count_ < 2)
+			return 0.0;
+
+		auto mean = this->mean();
+
+		return std::sqrt(std::max(0.0, sum_sq_ / count_ - mean * mean));
+	}
+
+	double percentile(double p) const
+	{
+		auto wanted	= static_cast<std::uint64_t>(std::ceil(count_ * p));
+		auto seen	= std::uint64_t(0);
+
+		for (std::size_t bucket = 0; bucket < histogram_.size(); ++bucket)
+		{
+			seen += histogram_[bucket];
+
+			if (seen >= wanted && seen > 0)
+				return static_cast<double>((bucket + 1) * BUCKET_US);
+		}
+
+		return max_;
+	}
+};
+
+struct statistics
+{
+	std::uint64_t		datagrams		= 0;
+	std::uint64_t		bytes			= 0;
+	std::uint64_t		ts_packets		= 0;
+	std::uint64_t		sync_errors		= 0;
+	std::uint64_t		cc_errors		= 0;
+	interval_statistics	intervals;
+};
+
+// Continuity counter check per PID, duplicates (the same counter twice) are
+// allowed as the standard does.
+class ts_checker
+{
+	std::array<int, 8192> last_cc_;
+public:
+	ts_checker()
+	{
+		last_cc_.fill(-1);
+	}
+
+	void check(const std::uint8_t* data, std::size_t size, statistics& stats)
+	{
+		for (std::size_t offset = 0; offset + TS_PACKET_SIZE <= size; offset += TS_PACKET_SIZE)
+		{
+			auto packet = data + offset;
+
+			++stats.ts_packets;
+
+			if (packet[0] != 0x47)
+			{
+				++stats.sync_errors;
+				continue;
+			}
+
+			auto pid			= ((packet[1] & 0x1F) << 8) | packet[2];
+			auto has_payload	= (packet[3] & 0x10) != 0;
+			auto cc				= packet[3] & 0x0F;
+			auto discontinuity	= (packet[3] & 0x20) && packet[4] > 0 && (packet[5] & 0x80);
+
+			if (pid == 0x1FFF || !has_payload)
+				continue;
+
+			auto& last = last_cc_[pid];
+
+			if (last != -1 && !discontinuity && cc != ((last + 1) & 0x0F) && cc != last)
+				++stats.cc_errors;
+
+			last = cc;
+		}
+
+		if (size % TS_PACKET_SIZE != 0)
+			++stats.sync_errors;
+	}
+};
+
+void print(std::ostream& out, const std::string& label, const statistics& stats, double seconds)
+{
+	auto& intervals = stats.intervals;
+
+	out << std::fixed << std::setprecision(1)
+		<< label
+		<< " datagrams=" << stats.datagrams
+		<< " mbit/s=" << (seconds > 0.0 ? stats.bytes * 8.0 / seconds / 1000000.0 : 0.0)
+		<< " interval-mean-us=" << intervals.mean()
+		<< " jitter-stddev-us=" << intervals.stddev()
+		<< " interval-p99-us=" << intervals.percentile(0.99)
+		<< " interval-max-us=" << intervals.max()
+		<< " sync-errors=" << stats.sync_errors
+		<< " cc-errors=" << stats.cc_errors
+		<< std::endl;
+}
+
+class receiver
+{
+	boost::asio::ip::udp::socket				socket_;
+	boost::asio::deadline_timer					timer_;
+	boost::asio::signal_set						signals_;
+	std::vector<std::uint8_t>					buffer_		= std::vector<std::uint8_t>(MAX_DATAGRAM);
+	boost::asio::ip::udp::endpoint				sender_;
+	const int									seconds_;
+	ts_checker									checker_;
+	statistics									total_;
+	statistics									second_;
+	clock_type::time_point						started_;
+	clock_type::time_point						second_started_;
+	clock_type::time_point						last_arrival_;
+	bool										receiving_	= false;
+	int											elapsed_	= 0;
+public:
+	receiver(boost::asio::io_service& service, unsigned short port, int seconds, const std::string& group)
+		: socket_(service)
+		, timer_(service)
+		, signals_(service, SIGINT, SIGTERM)
+		, seconds_(seconds)
+	{
+		using namespace boost::asio::ip;
+
+		auto multicast = group.empty() ? address() : address::from_string(group);
+		auto v6 = multicast.is_v6();
+
+		socket_.open(v6 ? udp::v6() : udp::v4());
+		socket_.set_option(udp::socket::reuse_address(true));
+		socket_.set_option(boost::asio::socket_base::receive_buffer_size(RECEIVE_BUFFER));
+		socket_.bind(udp::endpoint(v6 ? address(address_v6::any()) : address(address_v4::any()), port));
+
+		if (!group.empty())
+			socket_.set_option(multicast::join_group(multicast));
+
+		signals_.async_wait([this](const boost::system::error_code& error, int)
+		{
+			if (!error)
+				stop();
+		});
+
+		receive();
+		tick();
+	}
+private:
+	void receive()
+	{
+		socket_.async_receive_from(boost::asio::buffer(buffer_), sender_, [this](const boost::system::error_code& error, std::size_t size)
+		{
+			if (error == boost::asio::error::operation_aborted)
+				return;
+
+			if (!error)
+				on_datagram(size);
+
+			receive();
+		});
+	}
+
+	void on_datagram(std::size_t size)
+	{
+		auto now = clock_type::now();
+
+		if (!receiving_)
+		{
+			receiving_		= true;
+			started_		= now;
+			second_started_	= now;
+
+			std::cout << "Receiving from " << sender_ << std::endl;
+		}
+		else
+		{
+			auto us = boost::chrono::duration_cast<boost::chrono::nanoseconds>(now - last_arrival_).count() / 1000.0;
+
+			total_.intervals.add(us);
+			second_.intervals.add(us);
+		}
+
+		last_arrival_ = now;
+
+		for (auto stats : { &total_, &second_ })
+		{
+			++stats->datagrams;
+			stats->bytes += size;
+		}
+
+		statistics ts;
+		checker_.check(buffer_.data(), size, ts);
+
+		for (auto stats : { &total_, &second_ })
+		{
+			stats->ts_packets	+= ts.ts_packets;
+			stats->sync_errors	+= ts.sync_errors;
+			stats->cc_errors	+= ts.cc_errors;
+		}
+	}
+
+	void tick()
+	{
+		timer_.expires_from_now(boost::posix_time::seconds(1));
+		timer_.async_wait([this](const boost::system::error_code& error)
+		{
+			if (error)
+				return;
+
+			++elapsed_;
+
+			if (receiving_)
+			{
+				auto now = clock_type::now();
+
+				print(std::cout, std::to_string(elapsed_) + "s", second_, boost::chrono::duration<double>(now - second_started_).count());
+
+				second_			= statistics();
+				second_started_	= now;
+			}
+
+			if (seconds_ > 0 && elapsed_ >= seconds_)
+				stop();
+			else
+				tick();
+		});
+	}
+
+	void stop()
+	{
+		boost::system::error_code ignored;
+
+		socket_.close(ignored);
+		timer_.cancel(ignored);
+		signals_.cancel(ignored);
+
+		if (!receiving_)
+		{
+			std::cout << "Nothing received." << std::endl;
+			return;
+		}
+
+		print(std::cout, "total", total_, boost::chrono::duration<double>(last_arrival_ - started_).count());
+	}
+};
+
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: udp_receiver <port> [seconds] [multicast group]" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		auto port		= boost::lexical_cast<unsigned short>(argv[1]);
+		auto seconds	= argc > 2 ? boost::lexical_cast<int>(argv[2]) : 0;
+		auto group		= argc > 3 ? std::string(argv[3]) : std::string();
+
+		boost::asio::io_service service;
+		receiver receiver(service, port, seconds, group);
+
+		service.run();
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
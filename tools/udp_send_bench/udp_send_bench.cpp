@@ -0,0 +1,241 @@
+/*
+* Copyright (c) 2011 Sveriges Television AB <info@casparcg.com>
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Loopback benchmark for datagram_sender, the batching behind the udp://
+// output. The same stream is sent three ways:
+//
+//   single   one system call per datagram, as a plain sendto loop
+//   batch    64 datagrams per sendmmsg (one send each on Windows)
+//   offload  64 datagrams per sendmsg with UDP_SEGMENT (GSO), or
+//            UDP_SEND_MSG_SIZE on Windows, falling back to batch
+//
+// and each run reports the system calls per second and the CPU time of the
+// sending thread per Gbit sent:
+//
+//   udp_send_bench [seconds per mode] [datagram size] [mbit/s]
+//
+// Without a rate the sender runs flat out, which measures the ceiling; with
+// one (e.g. 200) it shows the cost at a realistic output bitrate. The
+// default datagram size is 7 TS packets, what the udp:// output sends.
+
+#include <common/os/datagram_sender.h>
+
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <tbb/atomic.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+const std::size_t	TS_PACKET_SIZE		= 188;
+const std::size_t	BATCH				= 64;
+const int			SOCKET_BUFFER		= 8 * 1024 * 1024;
+
+struct mode
+{
+	const char*	name;
+	std::size_t	batch;
+	bool		offload;
+};
+
+// CPU time (user + system) of the calling thread.
+double thread_cpu_seconds()
+{
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+
+	if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+		return 0.0;
+
+	auto to_100ns = [](const FILETIME& t) { return (static_cast<std::uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+
+	return (to_100ns(kernel) + to_100ns(user)) / 10000000.0;
+#else
+	timespec now;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) != 0)
+		return 0.0;
+
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+#endif
+}
+
+// Drains the loopback socket so that the sender measures sending, not a full
+// receive buffer. Datagrams of one byte end the run.
+class sink
+{
+	boost::asio::ip::udp::socket	socket_;
+	tbb::atomic<std::uint64_t>		received_;
+	tbb::atomic<bool>				done_;
+	std::thread						thread_;
+public:
+	sink(boost::asio::io_service& service, std::size_t max_datagram)
+		: socket_(service, boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+	{
+		received_	= 0;
+		done_		= false;
+
+		socket_.set_option(boost::asio::socket_base::receive_buffer_size(SOCKET_BUFFER));
+
+		thread_ = std::thread([this, max_datagram]
+		{
+			std::vector<std::uint8_t> buffer(max_datagram);
+			boost::system::error_code error;
+
+			while (true)
+			{
+				auto size = socket_.receive(boost::asio::buffer(buffer), 0, error);
+
+				if (error || size == 1)
+					break;
+
+				++received_;
+			}
+
+			done_ = true;
+		});
+	}
+
+	~sink()
+	{
+		thread_.join();
+	}
+
+	boost::asio::ip::udp::endpoint endpoint() const { return socket_.local_endpoint(); }
+	std::uint64_t received() const { return received_; }
+	bool done() const { return done_; }
+};
+
+void run(const mode& mode, double seconds, std::size_t size, double mbps)
+{
+	boost::asio::io_service service;
+	sink sink(service, size);
+
+	auto destination = sink.endpoint();
+
+	boost::asio::ip::udp::socket socket(service, boost::asio::ip::udp::v4());
+	socket.set_option(boost::asio::socket_base::send_buffer_size(SOCKET_BUFFER));
+
+	caspar::datagram_sender sender(socket.native_handle(), destination.data(), static_cast<int>(destination.size()), mode.batch, size, mode.offload);
+
+	std::vector<std::uint8_t> datagram(size, 0xFF);
+
+	for (std::size_t offset = 0; offset + TS_PACKET_SIZE <= size; offset += TS_PACKET_SIZE)
+		datagram[offset] = 0x47;
+
+	auto started		= clock_type::now();
+	auto deadline		= started + std::chrono::microseconds(static_cast<std::int64_t>(seconds * 1000000));
+	auto cpu_started	= thread_cpu_seconds();
+	auto queued			= std::uint64_t(0);
+
+	while (clock_type::now() < deadline)
+	{
+		for (std::size_t i = 0; i < mode.batch; ++i)
+			sender.add(datagram.data(), datagram.size());
+
+		sender.flush();
+		queued += mode.batch;
+
+		if (mbps > 0.0)
+		{
+			auto due = started + std::chrono::microseconds(static_cast<std::int64_t>(queued * size * 8 / mbps));
+			std::this_thread::sleep_until(due);
+		}
+	}
+
+	auto cpu		= thread_cpu_seconds() - cpu_started;
+	auto elapsed	= std::chrono::duration<double>(clock_type::now() - started).count();
+	auto stats		= sender.stats();
+
+	// The end markers may be dropped while the sink catches up, so keep
+	// sending them until it has seen one.
+	std::uint8_t marker = 0;
+
+	while (!sink.done())
+	{
+		socket.send_to(boost::asio::buffer(&marker, 1), destination);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	auto gbit = stats.bytes * 8.0 / 1000000000.0;
+
+	std::cout << std::fixed << std::setprecision(1)
+		<< std::left << std::setw(8) << mode.name << std::right
+		<< " mbit/s=" << stats.bytes * 8.0 / elapsed / 1000000.0
+		<< " datagrams=" << stats.datagrams
+		<< " received=" << sink.received()
+		<< " syscalls/s=" << stats.syscalls / elapsed
+		<< " datagrams/syscall=" << (stats.syscalls > 0 ? static_cast<double>(stats.datagrams) / stats.syscalls : 0.0)
+		<< " cpu-ms/gbit=" << (gbit > 0.0 ? cpu * 1000.0 / gbit : 0.0)
+		<< " cpu-%=" << cpu / elapsed * 100.0
+		<< " errors=" << stats.errors
+		<< " offload=" << (stats.segmentation_offload ? "on" : "off")
+		<< std::endl;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		auto seconds	= argc > 1 ? boost::lexical_cast<double>(argv[1]) : 3.0;
+		auto size		= argc > 2 ? boost::lexical_cast<std::size_t>(argv[2]) : 7 * TS_PACKET_SIZE;
+		auto mbps		= argc > 3 ? boost::lexical_cast<double>(argv[3]) : 0.0;
+
+		if (seconds <= 0.0 || size < 2 || size > 65507 || mbps < 0.0)
+		{
+			std::cerr << "usage: udp_send_bench [seconds per mode] [datagram size] [mbit/s]" << std::endl;
+			return 1;
+		}
+
+		const mode modes[] =
+		{
+			{ "single",		1,		false },
+			{ "batch",		BATCH,	false },
+			{ "offload",	BATCH,	true },
+		};
+
+		for (auto& mode : modes)
+			run(mode, seconds, size, mbps);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}